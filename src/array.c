@@ -0,0 +1,230 @@
+#include "array.h"
+
+// The kernels work on 16 bytes at a time through the compiler's vector
+// extensions, which lower to SSE2 or NEON, with a scalar loop for the tail.
+// Lanes are unsigned so wrapping arithmetic is defined.
+#define LANES 4
+
+typedef uint32_t IntLanes __attribute__((vector_size(16)));
+typedef int32_t MaskLanes __attribute__((vector_size(16)));
+typedef uint8_t ByteLanes __attribute__((vector_size(LANES)));
+
+static inline IntLanes load_lanes(const int32_t* p) {
+  IntLanes lanes;
+  memcpy(&lanes, p, sizeof(lanes));
+  return lanes;
+}
+
+static inline void store_lanes(int32_t* p, IntLanes lanes) {
+  memcpy(p, &lanes, sizeof(lanes));
+}
+
+// Narrows a lane mask of all ones or all zeros to LANES bools.
+static inline void store_mask(bool* p, MaskLanes mask) {
+  ByteLanes bytes = __builtin_convertvector(mask & 1, ByteLanes);
+  memcpy(p, &bytes, sizeof(bytes));
+}
+
+ObjArray* new_array(Heap* heap, int element_size, int length) {
+  // Rounded up to the heap alignment, which vectors never straddle.
+  size_t size;
+  if (__builtin_mul_overflow((size_t)element_size, (size_t)length, &size) ||
+      size > SIZE_MAX - HEAP_ALIGN) {
+    return NULL;
+  }
+
+  size = (size + HEAP_ALIGN - 1) / HEAP_ALIGN * HEAP_ALIGN;
+  if (size == 0) size = HEAP_ALIGN;
+
+  ObjArray* array =
+      (ObjArray*)allocate_object(heap, OBJ_ARRAY, sizeof(ObjArray));
+
+  array->length = length;
+  array->element_size = element_size;
+  array->size = size;
+  array->data = heap_alloc(heap, size);
+  account_bytes(heap, size);
+
+  return array;
+}
+
+#define MAP_LOOP(vector_op, scalar_op)                            \
+  do {                                                            \
+    for (; i + LANES <= length; i += LANES) {                     \
+      IntLanes x = load_lanes(&a[i]);                             \
+      IntLanes y = b != NULL ? load_lanes(&b[i]) : splat;         \
+      vector_op;                                                  \
+    }                                                             \
+                                                                  \
+    for (; i < length; i++) {                                     \
+      uint32_t x = (uint32_t)a[i];                                \
+      uint32_t y = b != NULL ? (uint32_t)b[i] : (uint32_t)scalar; \
+      scalar_op;                                                  \
+    }                                                             \
+  } while (false)
+
+void map_ints(Kernel kernel, void* out, const int32_t* a, const int32_t* b,
+              int32_t scalar, int length) {
+  IntLanes splat = {0};
+  splat += (uint32_t)scalar;
+
+  int32_t* ints = (int32_t*)out;
+  bool* bools = (bool*)out;
+  int i = 0;
+
+  switch (kernel) {
+    case KERNEL_ADD:
+      MAP_LOOP(store_lanes(&ints[i], x + y), ints[i] = (int32_t)(x + y));
+      break;
+    case KERNEL_SUBTRACT:
+      MAP_LOOP(store_lanes(&ints[i], x - y), ints[i] = (int32_t)(x - y));
+      break;
+    case KERNEL_MULTIPLY:
+      MAP_LOOP(store_lanes(&ints[i], x * y), ints[i] = (int32_t)(x * y));
+      break;
+    case KERNEL_EQUAL:
+      MAP_LOOP(store_mask(&bools[i], x == y), bools[i] = x == y);
+      break;
+    case KERNEL_LESS:
+      MAP_LOOP(store_mask(&bools[i], (MaskLanes)x < (MaskLanes)y),
+               bools[i] = (int32_t)x < (int32_t)y);
+      break;
+    case KERNEL_GREATER:
+      MAP_LOOP(store_mask(&bools[i], (MaskLanes)x > (MaskLanes)y),
+               bools[i] = (int32_t)x > (int32_t)y);
+      break;
+  }
+}
+
+#undef MAP_LOOP
+
+void negate_ints(int32_t* out, const int32_t* a, int length) {
+  int i = 0;
+
+  for (; i + LANES <= length; i += LANES) {
+    store_lanes(&out[i], -load_lanes(&a[i]));
+  }
+
+  for (; i < length; i++) out[i] = (int32_t)(0u - (uint32_t)a[i]);
+}
+
+// Bools are 0 or 1 bytes, so eight of them flip with one xor.
+void not_bools(bool* out, const bool* a, int length) {
+  int i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, &a[i], sizeof(word));
+    word ^= 0x0101010101010101ull;
+    memcpy(&out[i], &word, sizeof(word));
+  }
+
+  for (; i < length; i++) out[i] = !a[i];
+}
+
+int32_t sum_ints(const int32_t* a, int length) {
+  IntLanes total = {0};
+  int i = 0;
+
+  for (; i + LANES <= length; i += LANES) total += load_lanes(&a[i]);
+
+  uint32_t sum = 0;
+  for (int lane = 0; lane < LANES; lane++) sum += total[lane];
+  for (; i < length; i++) sum += (uint32_t)a[i];
+
+  return (int32_t)sum;
+}
+
+// Keeps the larger or the smaller of each pair of lanes. C has no vector
+// select, so the pick goes through the compare mask.
+static inline MaskLanes pick_lanes(MaskLanes x, MaskLanes y, bool max) {
+  MaskLanes keep = max ? x > y : x < y;
+  return (x & keep) | (y & ~keep);
+}
+
+static inline int32_t reduce_ints(const int32_t* a, int length, bool max) {
+  int32_t best = a[0];
+  int i = 1;
+
+  if (length >= LANES) {
+    MaskLanes acc = (MaskLanes)load_lanes(a);
+
+    for (i = LANES; i + LANES <= length; i += LANES) {
+      acc = pick_lanes(acc, (MaskLanes)load_lanes(&a[i]), max);
+    }
+
+    best = acc[0];
+    for (int lane = 1; lane < LANES; lane++) {
+      if (max ? acc[lane] > best : acc[lane] < best) best = acc[lane];
+    }
+  }
+
+  for (; i < length; i++) {
+    if (max ? a[i] > best : a[i] < best) best = a[i];
+  }
+
+  return best;
+}
+
+// Callers make sure the array is not empty.
+int32_t min_ints(const int32_t* a, int length) {
+  return reduce_ints(a, length, false);
+}
+
+int32_t max_ints(const int32_t* a, int length) {
+  return reduce_ints(a, length, true);
+}
+
+// Adds up eight 0 or 1 bytes at a time, the multiply gathers their sum in
+// the top byte.
+int32_t count_bools(const bool* a, int length) {
+  int32_t count = 0;
+  int i = 0;
+
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, &a[i], sizeof(word));
+    count += (int32_t)((word * 0x0101010101010101ull) >> 56);
+  }
+
+  for (; i < length; i++) count += a[i];
+
+  return count;
+}
+
+// Every element is written and the cursor only advances past the kept
+// ones, so the loop has no branch on the mask.
+int filter_elements(void* out, const void* a, const bool* mask,
+                    int element_size, int length) {
+  int count = 0;
+
+  if (element_size == sizeof(int32_t)) {
+    int32_t* to = (int32_t*)out;
+    const int32_t* from = (const int32_t*)a;
+
+    for (int i = 0; i < length; i++) {
+      to[count] = from[i];
+      count += mask[i];
+    }
+  } else if (element_size == sizeof(bool)) {
+    uint8_t* to = (uint8_t*)out;
+    const uint8_t* from = (const uint8_t*)a;
+
+    for (int i = 0; i < length; i++) {
+      to[count] = from[i];
+      count += mask[i];
+    }
+  } else {
+    // Structs.
+    uint8_t* to = (uint8_t*)out;
+    const uint8_t* from = (const uint8_t*)a;
+
+    for (int i = 0; i < length; i++) {
+      memcpy(to + count * element_size, from + i * element_size,
+             element_size);
+      count += mask[i];
+    }
+  }
+
+  return count;
+}
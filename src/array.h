@@ -0,0 +1,55 @@
+#ifndef nol_array_h
+#define nol_array_h
+
+#include "common.h"
+#include "heap.h"
+
+typedef struct ObjArray ObjArray;
+
+// A fixed length array of int32_t, bool or struct elements. The element
+// type is known to the compiler, so the array itself only records its size.
+// The elements start on HEAP_ALIGN.
+struct ObjArray {
+  Obj obj;
+  int length;
+  int element_size;
+  // Bytes allocated for data, which may be more than length elements.
+  size_t size;
+  void* data;
+};
+
+// Returns an array of length elements of element_size bytes each. The
+// elements are not initialized, every caller writes all of them. NULL if
+// the array's bytes don't fit in a size_t, which only a length the script
+// chose can cause.
+ObjArray* new_array(Heap* heap, int element_size, int length);
+
+typedef enum {
+  KERNEL_ADD,
+  KERNEL_SUBTRACT,
+  KERNEL_MULTIPLY,
+  KERNEL_EQUAL,
+  KERNEL_LESS,
+  KERNEL_GREATER
+} Kernel;
+
+// Elementwise out = a op b over int arrays. b is NULL when the right
+// operand is the scalar broadcast to every element. Comparison kernels
+// write bools to out instead of ints.
+void map_ints(Kernel kernel, void* out, const int32_t* a, const int32_t* b,
+              int32_t scalar, int length);
+void negate_ints(int32_t* out, const int32_t* a, int length);
+void not_bools(bool* out, const bool* a, int length);
+
+int32_t sum_ints(const int32_t* a, int length);
+int32_t min_ints(const int32_t* a, int length);
+int32_t max_ints(const int32_t* a, int length);
+// Number of true elements.
+int32_t count_bools(const bool* a, int length);
+
+// Copies the elements whose mask is set to the front of out, in order, and
+// returns how many there were.
+int filter_elements(void* out, const void* a, const bool* mask,
+                    int element_size, int length);
+
+#endif
@@ -0,0 +1,282 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "memory.h"
+#include "metrics.h"
+#include "module.h"
+#include "pool.h"
+#include "vm.h"
+
+typedef struct {
+  char* path;
+
+  FILE* out;
+  char* output;
+  size_t output_size;
+
+  Program program;
+  double start;
+  double seconds;
+  bool ok;
+} Job;
+
+typedef struct {
+  Job* jobs;
+  int count;
+  int capacity;
+} JobList;
+
+void add_job(JobList* list, char* path) {
+  if (list->capacity < list->count + 1) {
+    int old_capacity = list->capacity;
+
+    list->capacity = GROW_CAPACITY(old_capacity);
+    list->jobs = GROW_ARRAY(Job, list->jobs, old_capacity, list->capacity);
+  }
+
+  Job* job = &list->jobs[list->count];
+  job->path = path;
+  job->out = NULL;
+  job->output = NULL;
+  job->output_size = 0;
+  job->seconds = 0;
+  job->ok = false;
+
+  list->count++;
+}
+
+int compare_jobs(const void* a, const void* b) {
+  return strcmp(((Job*)a)->path, ((Job*)b)->path);
+}
+
+bool has_extension(const char* path, const char* extension) {
+  size_t length = strlen(path);
+  size_t extension_length = strlen(extension);
+
+  return length > extension_length &&
+         strcmp(path + length - extension_length, extension) == 0;
+}
+
+// Adds every .nol file under dir. The entries of a directory are sorted, so
+// the run order does not depend on the file system.
+void add_directory(JobList* list, const char* dir) {
+  DIR* handle = opendir(dir);
+  if (handle == NULL) return;
+
+  int first = list->count;
+  struct dirent* entry;
+
+  while ((entry = readdir(handle)) != NULL) {
+    if (entry->d_name[0] == '.') continue;
+
+    char* path = malloc(strlen(dir) + strlen(entry->d_name) + 2);
+    sprintf(path, "%s/%s", dir, entry->d_name);
+
+    struct stat info;
+
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+      add_directory(list, path);
+      free(path);
+    } else if (has_extension(path, ".nol")) {
+      add_job(list, path);
+    } else {
+      free(path);
+    }
+  }
+
+  closedir(handle);
+
+  if (list->count > first) {
+    qsort(&list->jobs[first], list->count - first, sizeof(Job), compare_jobs);
+  }
+}
+
+// Fibers a worker time slices at most, and the instructions each of them
+// runs before the worker takes on another script next to them. Scripts
+// shorter than that run one after the other, a longer one shares the worker
+// with the scripts queued behind it.
+#define MAX_WORKER_FIBERS 4
+#define TURN_INSTRUCTIONS ((uint64_t)FIBER_SLICE * 1000)
+
+// The pool the batch runs on, which workers take more scripts from.
+Pool* batch_pool;
+
+// The scripts a worker is running, and whether one of its tasks is running
+// them, taking on any scripts started meanwhile.
+_Thread_local Scheduler worker_fibers;
+_Thread_local int worker_fiber_count;
+_Thread_local bool worker_running;
+
+void finish_job(Job* job) {
+  job->seconds = now_seconds() - job->start;
+  fclose(job->out);
+}
+
+// Reports how the script's fiber ended on the script's own output.
+void fiber_finished(void* owner, FiberState state, const char* fault) {
+  Job* job = (Job*)owner;
+
+  set_error_stream(job->out);
+  if (state == FIBER_ERROR) fprintf(job->out, "%s\n", fault);
+  report_stop(state);
+  set_error_stream(NULL);
+
+  count_metric(METRIC_RUNS, 1);
+  job->ok = state == FIBER_DONE;
+  free_program(&job->program);
+  finish_job(job);
+
+  worker_fiber_count--;
+}
+
+// Compiles the script and adds its fiber to the worker's.
+void start_job(Job* job) {
+  job->start = now_seconds();
+  job->out = open_memstream(&job->output, &job->output_size);
+
+  set_error_stream(job->out);
+  bool loaded = load_program(&job->program, job->path);
+  set_error_stream(NULL);
+
+  if (!loaded) {
+    finish_job(job);
+    return;
+  }
+
+  Fiber* fiber = new_fiber(&job->program);
+  fiber->out = job->out;
+  fiber->owner = job;
+  fiber->hold_fault = true;
+  apply_run_limits(fiber);
+
+  spawn_fiber(&worker_fibers, fiber);
+  worker_fiber_count++;
+}
+
+// Whether the worker has room for another script, which it has once every
+// fiber it runs has had its turn.
+bool can_take_job() {
+  if (worker_fiber_count >= MAX_WORKER_FIBERS) return false;
+
+  for (Fiber* fiber = worker_fibers.head; fiber != NULL; fiber = fiber->next) {
+    if (fiber->instructions < TURN_INSTRUCTIONS) return false;
+  }
+
+  return true;
+}
+
+// One pool task per script. The first task a worker runs time slices the
+// worker's fibers until they are all done, taking queued scripts from the
+// pool whenever there is room for them. Those tasks only start their
+// script.
+void run_job(void* arg) {
+  Job* job = (Job*)arg;
+  bool running = worker_running;
+
+  if (!running) {
+    init_scheduler(&worker_fibers, FIBER_SLICE, fiber_finished);
+    worker_fiber_count = 0;
+    worker_running = true;
+  }
+
+  start_job(job);
+  if (running) return;
+
+  do {
+    while (can_take_job() && pool_run_next(batch_pool)) {
+    }
+  } while (step_scheduler(&worker_fibers));
+
+  worker_running = false;
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+double percentile(double* sorted, int count, double p) {
+  int index = (int)(p * (count - 1) + 0.5);
+  return sorted[index];
+}
+
+void report(JobList* list, double seconds, int jobs) {
+  double* latencies = ALLOCATE(double, list->count);
+  int failed = 0;
+
+  for (int i = 0; i < list->count; i++) {
+    latencies[i] = list->jobs[i].seconds * 1000;
+    if (!list->jobs[i].ok) failed++;
+  }
+
+  qsort(latencies, list->count, sizeof(double), compare_doubles);
+
+  fprintf(stderr, "%d scripts, %d failed, %d jobs, %.3fs, %.1f scripts/sec\n",
+          list->count, failed, jobs, seconds, list->count / seconds);
+  fprintf(stderr, "latency ms: p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+          percentile(latencies, list->count, 0.50),
+          percentile(latencies, list->count, 0.90),
+          percentile(latencies, list->count, 0.99),
+          latencies[list->count - 1]);
+
+  FREE_ARRAY(double, latencies, list->count);
+}
+
+bool run_batch(char** paths, int path_count, int jobs) {
+  JobList list = {NULL, 0, 0};
+
+  for (int i = 0; i < path_count; i++) {
+    struct stat info;
+
+    if (stat(paths[i], &info) == 0 && S_ISDIR(info.st_mode)) {
+      add_directory(&list, paths[i]);
+    } else {
+      add_job(&list, strdup(paths[i]));
+    }
+  }
+
+  if (list.count == 0) {
+    fprintf(stderr, "No scripts to run.\n");
+    return false;
+  }
+
+  // The scripts already run in parallel, each one compiles on its worker.
+  set_compile_threads(1);
+
+  double start = now_seconds();
+  batch_pool = new_pool(jobs);
+
+  for (int i = 0; i < list.count; i++) {
+    pool_submit(batch_pool, run_job, &list.jobs[i]);
+  }
+
+  pool_wait(batch_pool);
+  free_pool(batch_pool);
+  batch_pool = NULL;
+
+  double seconds = now_seconds() - start;
+  bool ok = true;
+
+  for (int i = 0; i < list.count; i++) {
+    Job* job = &list.jobs[i];
+
+    printf("==> %s <==\n", job->path);
+    fwrite(job->output, 1, job->output_size, stdout);
+
+    if (!job->ok) ok = false;
+
+    free(job->output);
+    free(job->path);
+  }
+
+  fflush(stdout);
+  report(&list, seconds, jobs);
+
+  FREE_ARRAY(Job, list.jobs, list.capacity);
+  return ok;
+}
@@ -0,0 +1,14 @@
+#ifndef nol_batch_h
+#define nol_batch_h
+
+#include "common.h"
+
+// Runs every script in paths, directories included recursively, on jobs
+// worker threads. A worker time slices a script that runs long with the
+// scripts queued behind it, so those need not wait for it to finish. Each
+// script's output is captured and written in path order once all of them
+// are done, followed by throughput and latency numbers on stderr. Returns
+// false when any script failed.
+bool run_batch(char** paths, int path_count, int jobs);
+
+#endif
@@ -1,46 +1,351 @@
 #include "bytecode.h"
 
 #include "memory.h"
+#include "value.h"
 
-uint8_t* code;
-int count;
-int capacity;
+#define OPCODE_INFO(name, operand) {#name, operand},
 
-void init_code() {
-  code = NULL;
-  count = 0;
-  capacity = 0;
-}
+const OpInfo op_info[OP_COUNT] = {OPCODES(OPCODE_INFO)};
+
+#undef OPCODE_INFO
+
+void init_code(Code* code) {
+  code->code = NULL;
+  code->count = 0;
+  code->capacity = 0;
 
-void free_code() {
-  FREE_ARRAY(uint8_t, code, capacity);
+  code->constants = NULL;
+  code->constant_count = 0;
+  code->constant_capacity = 0;
 
-  init_code();
+  code->max_stack = 0;
+
+  code->constant_lookup = NULL;
+  code->lookup_capacity = 0;
 }
 
-uint8_t* get_code() { return code; }
-int get_code_size() { return count; }
+void free_code(Code* code) {
+  FREE_ARRAY(uint8_t, code->code, code->capacity);
+  FREE_ARRAY(Constant, code->constants, code->constant_capacity);
+  FREE_ARRAY(int, code->constant_lookup, code->lookup_capacity);
+
+  init_code(code);
+}
 
 // ensure the required size is available
-void reserve_code(int size) {
-  while (capacity < count + size) {
-    int old_capacity = capacity;
+void reserve_code(Code* code, int size) {
+  while (code->capacity < code->count + size) {
+    int old_capacity = code->capacity;
+
+    code->capacity = GROW_CAPACITY(old_capacity);
+    code->code = GROW_ARRAY(uint8_t, code->code, old_capacity, code->capacity);
+  }
+}
+
+void write_code(Code* code, uint8_t byte) {
+  reserve_code(code, 1);
+
+  code->code[code->count] = byte;
+  code->count++;
+}
+
+void write_value(Code* code, void* src, int size) {
+  reserve_code(code, size);
+
+  memcpy(&code->code[code->count], src, size);
+  code->count += size;
+}
+
+void write_leb128(Code* code, uint32_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+
+    if (value != 0) byte |= 0x80;
 
-    capacity = GROW_CAPACITY(old_capacity);
-    code = GROW_ARRAY(uint8_t, code, old_capacity, capacity);
+    write_code(code, byte);
+  } while (value != 0);
+}
+
+uint32_t hash_constant(Constant value) {
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdull;
+  value ^= value >> 33;
+
+  return (uint32_t)value;
+}
+
+// Returns the lookup slot holding value, or the empty slot where it belongs.
+int* find_constant(Code* code, Constant value) {
+  uint32_t mask = code->lookup_capacity - 1;
+  uint32_t index = hash_constant(value) & mask;
+
+  while (true) {
+    int* slot = &code->constant_lookup[index];
+
+    if (*slot == 0 || code->constants[*slot - 1] == value) return slot;
+
+    index = (index + 1) & mask;
   }
 }
 
-void write_code(uint8_t byte) {
-  reserve_code(1);
+void grow_constant_lookup(Code* code) {
+  int old_capacity = code->lookup_capacity;
+
+  FREE_ARRAY(int, code->constant_lookup, old_capacity);
 
-  code[count] = byte;
-  count++;
+  code->lookup_capacity = GROW_CAPACITY(old_capacity);
+  code->constant_lookup = ALLOCATE(int, code->lookup_capacity);
+  memset(code->constant_lookup, 0, sizeof(int) * code->lookup_capacity);
+
+  for (int i = 0; i < code->constant_count; i++) {
+    *find_constant(code, code->constants[i]) = i + 1;
+  }
 }
 
-void write_value(void* src, int size) {
-  reserve_code(size);
+// Adds a constant to the pool and returns its index. A constant already in
+// the pool is not added again, its existing index is returned instead.
+int add_constant(Code* code, void* src, int size) {
+  Constant value = 0;
+  memcpy(&value, src, size);
+
+  if ((code->constant_count + 1) * 4 > code->lookup_capacity * 3) {
+    grow_constant_lookup(code);
+  }
+
+  int* slot = find_constant(code, value);
+  if (*slot != 0) return *slot - 1;
+
+  if (code->constant_capacity < code->constant_count + 1) {
+    int old_capacity = code->constant_capacity;
+
+    code->constant_capacity = GROW_CAPACITY(old_capacity);
+    code->constants = GROW_ARRAY(Constant, code->constants, old_capacity,
+                                 code->constant_capacity);
+  }
+
+  code->constants[code->constant_count] = value;
+  code->constant_count++;
+
+  *slot = code->constant_count;
+  return code->constant_count - 1;
+}
+
+// Emits the shortest instruction that pushes the given integer.
+void write_int_constant(Code* code, int32_t value) {
+  if (value == 0) {
+    write_code(code, OP_ZERO);
+  } else if (value == 1) {
+    write_code(code, OP_ONE);
+  } else if (value >= INT8_MIN && value <= INT8_MAX) {
+    write_code(code, OP_CONST_SMALL);
+    write_code(code, (uint8_t)(int8_t)value);
+  } else {
+    write_code(code, OP_CONSTANT);
+    write_leb128(code, add_constant(code, &value, sizeof(value)));
+  }
+}
+
+bool read_int_constant(Code* code, uint8_t op, int32_t operand,
+                       int32_t* value) {
+  switch (op) {
+    case OP_ZERO:
+      *value = 0;
+      return true;
+    case OP_ONE:
+      *value = 1;
+      return true;
+    case OP_CONST_SMALL:
+      *value = operand;
+      return true;
+    case OP_CONSTANT:
+      memcpy(value, &code->constants[operand], sizeof(int32_t));
+      return true;
+    default:
+      return false;
+  }
+}
+
+void decode_instruction(uint8_t* code, int offset, Instruction* out) {
+  uint8_t* ip = &code[offset];
+
+  out->op = *ip;
+  ip++;
+
+  out->type = VAL_VOID;
+  out->operand = 0;
+  out->immediate = 0;
+  out->cost = 0;
+
+  switch (out->op < OP_COUNT ? op_info[out->op].operand : OPERAND_NONE) {
+    case OPERAND_NONE:
+      break;
+    case OPERAND_TYPE:
+      out->type = *ip;
+      ip++;
+      break;
+    case OPERAND_SMALL:
+      out->operand = (int8_t)*ip;
+      ip++;
+      break;
+    case OPERAND_INDEX:
+      out->operand = (int32_t)read_leb128(&ip);
+      break;
+    case OPERAND_TYPE_INDEX:
+      out->type = *ip;
+      ip++;
+      out->operand = (int32_t)read_leb128(&ip);
+      break;
+    case OPERAND_TYPE_COST:
+      out->type = *ip;
+      ip++;
+      out->cost = (int32_t)read_leb128(&ip);
+      break;
+    case OPERAND_INDEX_COST:
+      out->operand = (int32_t)read_leb128(&ip);
+      out->cost = (int32_t)read_leb128(&ip);
+      break;
+    case OPERAND_JUMP:
+      out->operand = read_u16(&ip);
+      out->cost = (int32_t)read_leb128(&ip);
+      break;
+    case OPERAND_JUMP_INDEX:
+      out->operand = read_u16(&ip);
+      out->cost = (int32_t)read_leb128(&ip);
+      out->immediate = (int32_t)read_leb128(&ip);
+      break;
+    case OPERAND_INDEX_SMALL:
+      out->operand = (int32_t)read_leb128(&ip);
+      out->immediate = (int8_t)*ip;
+      ip++;
+      break;
+    case OPERAND_TABLE:
+      out->type = *ip;
+      ip++;
+      out->cost = (int32_t)read_leb128(&ip);
+      memcpy(&out->immediate, ip, sizeof(int32_t));
+      ip += sizeof(int32_t);
+      out->operand = (int32_t)read_leb128(&ip);
+      ip += 2 * (out->operand + 1);
+      break;
+    case OPERAND_LOOKUP:
+      out->type = *ip;
+      ip++;
+      out->cost = (int32_t)read_leb128(&ip);
+      out->operand = (int32_t)read_leb128(&ip);
+      ip += 2 + (sizeof(int32_t) + 2) * out->operand;
+      break;
+  }
+
+  out->length = ip - &code[offset];
+}
+
+int leb128_length(uint32_t value) {
+  int length = 1;
+
+  while (value >= 0x80) {
+    value >>= 7;
+    length++;
+  }
+
+  return length;
+}
+
+int instruction_length(Instruction* instruction) {
+  switch (op_info[instruction->op].operand) {
+    case OPERAND_NONE:
+      return 1;
+    case OPERAND_TYPE:
+    case OPERAND_SMALL:
+      return 2;
+    case OPERAND_INDEX:
+      return 1 + leb128_length(instruction->operand);
+    case OPERAND_TYPE_INDEX:
+      return 2 + leb128_length(instruction->operand);
+    case OPERAND_TYPE_COST:
+      return 2 + leb128_length(instruction->cost);
+    case OPERAND_INDEX_COST:
+      return 1 + leb128_length(instruction->operand) +
+             leb128_length(instruction->cost);
+    case OPERAND_JUMP:
+      return 3 + leb128_length(instruction->cost);
+    case OPERAND_JUMP_INDEX:
+      return 3 + leb128_length(instruction->cost) +
+             leb128_length(instruction->immediate);
+    case OPERAND_INDEX_SMALL:
+      return 2 + leb128_length(instruction->operand);
+    case OPERAND_TABLE:
+      return 2 + leb128_length(instruction->cost) + sizeof(int32_t) +
+             leb128_length(instruction->operand) +
+             2 * (instruction->operand + 1);
+    case OPERAND_LOOKUP:
+      return 2 + leb128_length(instruction->cost) +
+             leb128_length(instruction->operand) + 2 +
+             (sizeof(int32_t) + 2) * instruction->operand;
+  }
+
+  return 1;
+}
+
+void write_instruction(Code* code, Instruction* instruction) {
+  write_code(code, instruction->op);
+
+  switch (op_info[instruction->op].operand) {
+    case OPERAND_NONE:
+      break;
+    case OPERAND_TYPE:
+      write_code(code, instruction->type);
+      break;
+    case OPERAND_SMALL:
+      write_code(code, (uint8_t)(int8_t)instruction->operand);
+      break;
+    case OPERAND_INDEX:
+      write_leb128(code, instruction->operand);
+      break;
+    case OPERAND_TYPE_INDEX:
+      write_code(code, instruction->type);
+      write_leb128(code, instruction->operand);
+      break;
+    case OPERAND_TYPE_COST:
+      write_code(code, instruction->type);
+      write_leb128(code, instruction->cost);
+      break;
+    case OPERAND_INDEX_COST:
+      write_leb128(code, instruction->operand);
+      write_leb128(code, instruction->cost);
+      break;
+    case OPERAND_JUMP:
+      write_code(code, (instruction->operand >> 8) & 0xff);
+      write_code(code, instruction->operand & 0xff);
+      write_leb128(code, instruction->cost);
+      break;
+    case OPERAND_JUMP_INDEX:
+      write_code(code, (instruction->operand >> 8) & 0xff);
+      write_code(code, instruction->operand & 0xff);
+      write_leb128(code, instruction->cost);
+      write_leb128(code, instruction->immediate);
+      break;
+    case OPERAND_INDEX_SMALL:
+      write_leb128(code, instruction->operand);
+      write_code(code, (uint8_t)(int8_t)instruction->immediate);
+      break;
+    case OPERAND_TABLE:
+    case OPERAND_LOOKUP:
+      // Switches carry their tables, only the compiler writes them.
+      break;
+  }
+}
+
+int count_instructions(Code* code, int from, int to) {
+  int count = 0;
+
+  while (from < to) {
+    Instruction instruction;
+    decode_instruction(code->code, from, &instruction);
+
+    from += instruction.length;
+    count++;
+  }
 
-  memcpy(&code[count], src, size);
-  count += size;
+  return count;
 }
@@ -3,28 +3,217 @@
 
 #include "common.h"
 
+// How the bytes following an opcode are encoded.
 typedef enum {
-  OP_RETURN,
-  OP_CONSTANT,
-  OP_NEGATE,
-  OP_ADD,
-  OP_SUBTRACT,
-  OP_MULTIPLY,
-  OP_DIVIDE,
-  OP_TRUE,
-  OP_FALSE,
-  OP_NOT,
-  OP_EQUAL,
-  OP_GREATER,
-  OP_LESS
-} OP;
-
-void init_code();
-void free_code();
-uint8_t* get_code();
-int get_code_size();
-void reserve_code(int size);
-void write_code(uint8_t byte);
-void write_value(void* src, int size);
-
-#endif
\ No newline at end of file
+  OPERAND_NONE,
+  OPERAND_TYPE,       // 1 byte ValueType
+  OPERAND_SMALL,      // 1 byte signed immediate
+  OPERAND_INDEX,      // LEB128 unsigned index
+  OPERAND_TYPE_INDEX, // 1 byte ValueType followed by a LEB128 index
+  OPERAND_TYPE_COST,  // 1 byte ValueType followed by a LEB128 block cost
+  OPERAND_INDEX_COST, // LEB128 index followed by a LEB128 block cost
+  OPERAND_JUMP,       // 2 byte offset followed by a LEB128 block cost
+  OPERAND_INDEX_SMALL, // LEB128 index followed by a 1 byte signed immediate
+  // 1 byte ValueType, LEB128 block cost, 4 byte lowest value, LEB128 count,
+  // then 2 byte signed offsets for the default and each value in order.
+  OPERAND_TABLE,
+  // 1 byte ValueType, LEB128 block cost, LEB128 count, 2 byte signed
+  // default offset, then count sorted 4 byte values each with an offset.
+  OPERAND_LOOKUP,
+  // 2 byte offset followed by a LEB128 block cost and a LEB128 index.
+  OPERAND_JUMP_INDEX
+} OperandKind;
+
+// The single opcode description table. Every opcode is listed once with its
+// operand encoding, and the enum, the decoder and the disassembler are all
+// generated from it.
+#define OPCODES(X)                            \
+  X(OP_END, OPERAND_NONE)                     \
+  X(OP_CONSTANT, OPERAND_INDEX)               \
+  X(OP_CONST_SMALL, OPERAND_SMALL)            \
+  X(OP_ZERO, OPERAND_NONE)                    \
+  X(OP_ONE, OPERAND_NONE)                     \
+  X(OP_NEGATE, OPERAND_NONE)                  \
+  X(OP_ADD, OPERAND_NONE)                     \
+  X(OP_SUBTRACT, OPERAND_NONE)                \
+  X(OP_MULTIPLY, OPERAND_NONE)                \
+  X(OP_DIVIDE, OPERAND_NONE)                  \
+  X(OP_MODULO, OPERAND_NONE)                  \
+  X(OP_DIVIDE_POW2, OPERAND_SMALL)            \
+  X(OP_MODULO_POW2, OPERAND_SMALL)            \
+  X(OP_DIVIDE_MAGIC, OPERAND_INDEX_SMALL)     \
+  X(OP_MODULO_MAGIC, OPERAND_INDEX_SMALL)     \
+  X(OP_BIT_AND, OPERAND_NONE)                 \
+  X(OP_BIT_OR, OPERAND_NONE)                  \
+  X(OP_BIT_XOR, OPERAND_NONE)                 \
+  X(OP_BIT_NOT, OPERAND_NONE)                 \
+  X(OP_SHIFT_LEFT, OPERAND_NONE)              \
+  X(OP_SHIFT_RIGHT, OPERAND_NONE)             \
+  X(OP_SHIFT_RIGHT_UNSIGNED, OPERAND_NONE)    \
+  X(OP_TRUE, OPERAND_NONE)                    \
+  X(OP_FALSE, OPERAND_NONE)                   \
+  X(OP_NOT, OPERAND_NONE)                     \
+  X(OP_EQUAL, OPERAND_TYPE)                   \
+  X(OP_GREATER, OPERAND_NONE)                 \
+  X(OP_LESS, OPERAND_NONE)                    \
+  X(OP_AND, OPERAND_NONE)                     \
+  X(OP_OR, OPERAND_NONE)                      \
+  X(OP_POP, OPERAND_TYPE)                     \
+  X(OP_DROP, OPERAND_INDEX)                   \
+  X(OP_SLIDE, OPERAND_TYPE_INDEX)             \
+  X(OP_PRINT, OPERAND_TYPE)                   \
+  X(OP_RESULT, OPERAND_TYPE)                  \
+  X(OP_FIELD, OPERAND_INDEX)                  \
+  X(OP_STRING, OPERAND_INDEX)                 \
+  X(OP_CONCAT, OPERAND_NONE)                  \
+  X(OP_LENGTH, OPERAND_TYPE)                  \
+  X(OP_ARRAY, OPERAND_TYPE_INDEX)             \
+  X(OP_GET_ELEMENT, OPERAND_TYPE)             \
+  X(OP_SET_ELEMENT, OPERAND_TYPE)             \
+  X(OP_GET_ELEMENT_UNCHECKED, OPERAND_TYPE)   \
+  X(OP_SET_ELEMENT_UNCHECKED, OPERAND_TYPE)   \
+  X(OP_GET_MEMBER, OPERAND_TYPE_INDEX)        \
+  X(OP_SET_MEMBER, OPERAND_TYPE_INDEX)        \
+  X(OP_GET_COLUMN, OPERAND_TYPE_INDEX)        \
+  X(OP_SET_COLUMN, OPERAND_TYPE_INDEX)        \
+  X(OP_COPY_COLUMN, OPERAND_TYPE_INDEX)       \
+  X(OP_ARRAY_ADD, OPERAND_TYPE)               \
+  X(OP_ARRAY_SUBTRACT, OPERAND_TYPE)          \
+  X(OP_ARRAY_MULTIPLY, OPERAND_TYPE)          \
+  X(OP_ARRAY_EQUAL, OPERAND_TYPE)             \
+  X(OP_ARRAY_LESS, OPERAND_TYPE)              \
+  X(OP_ARRAY_GREATER, OPERAND_TYPE)           \
+  X(OP_ARRAY_NEGATE, OPERAND_NONE)            \
+  X(OP_ARRAY_NOT, OPERAND_NONE)               \
+  X(OP_RANGE, OPERAND_NONE)                   \
+  X(OP_FILL, OPERAND_TYPE)                    \
+  X(OP_FILL_COLUMNS, OPERAND_INDEX)           \
+  X(OP_SUM, OPERAND_TYPE)                     \
+  X(OP_MIN, OPERAND_NONE)                     \
+  X(OP_MAX, OPERAND_NONE)                     \
+  X(OP_FILTER, OPERAND_TYPE)                  \
+  X(OP_ABS, OPERAND_NONE)                     \
+  X(OP_MIN_INT, OPERAND_NONE)                 \
+  X(OP_MAX_INT, OPERAND_NONE)                 \
+  X(OP_CLAMP, OPERAND_NONE)                   \
+  X(OP_SQRT, OPERAND_NONE)                    \
+  X(OP_GET_GLOBAL, OPERAND_TYPE_INDEX)        \
+  X(OP_SET_GLOBAL, OPERAND_TYPE_INDEX)        \
+  X(OP_GET_LOCAL, OPERAND_TYPE_INDEX)         \
+  X(OP_SET_LOCAL, OPERAND_TYPE_INDEX)         \
+  X(OP_INCREMENT_GLOBAL, OPERAND_INDEX_SMALL) \
+  X(OP_INCREMENT_LOCAL, OPERAND_INDEX_SMALL)  \
+  X(OP_CALL, OPERAND_INDEX)                   \
+  X(OP_CALL_NATIVE, OPERAND_INDEX_COST)       \
+  X(OP_TAIL_CALL, OPERAND_INDEX_COST)         \
+  X(OP_RETURN, OPERAND_TYPE_COST)             \
+  X(OP_JUMP, OPERAND_JUMP)                    \
+  X(OP_JUMP_IF_FALSE, OPERAND_JUMP)           \
+  X(OP_JUMP_IF_NOT_LESS, OPERAND_JUMP)        \
+  X(OP_JUMP_IF_NOT_GREATER, OPERAND_JUMP)     \
+  X(OP_JUMP_IF_NOT_EQUAL, OPERAND_JUMP)       \
+  X(OP_LOOP, OPERAND_JUMP)                    \
+  X(OP_TABLESWITCH, OPERAND_TABLE)            \
+  X(OP_LOOKUPSWITCH, OPERAND_LOOKUP)          \
+  X(OP_PARALLEL, OPERAND_JUMP_INDEX)          \
+  X(OP_PARALLEL_END, OPERAND_JUMP_INDEX)      \
+  X(OP_FUEL, OPERAND_INDEX)                   \
+  X(OP_PROFILE_BLOCK, OPERAND_INDEX)
+
+#define OPCODE_ENUM(name, operand) name,
+
+typedef enum { OPCODES(OPCODE_ENUM) OP_COUNT } OP;
+
+#undef OPCODE_ENUM
+
+typedef struct {
+  const char* name;
+  OperandKind operand;
+} OpInfo;
+
+// How a parallel for combines what its chunks computed. The index of
+// OP_PARALLEL has two bits for each reduction, first one lowest.
+typedef enum { REDUCE_SUM = 1, REDUCE_MIN, REDUCE_MAX } Reduction;
+
+#define MAX_REDUCTIONS 8
+
+extern const OpInfo op_info[OP_COUNT];
+
+// A constant pool slot. Values are stored as raw bytes zero extended to 64
+// bits, so equal bit patterns share one slot regardless of their type.
+// String literals are stored as a pointer to their interned object.
+typedef uint64_t Constant;
+
+typedef struct {
+  uint8_t* code;
+  int count;
+  int capacity;
+
+  Constant* constants;
+  int constant_count;
+  int constant_capacity;
+
+  // Deepest the operand stack gets while running this code, in bytes.
+  int max_stack;
+
+  // Open addressing index over the pool, used to deduplicate constants.
+  // Each slot holds a constant index plus one, 0 means empty.
+  int* constant_lookup;
+  int lookup_capacity;
+} Code;
+
+typedef struct {
+  uint8_t op;
+  uint8_t type;
+  int32_t operand;
+  // The signed byte after the index of OPERAND_INDEX_SMALL, the lowest
+  // value of OPERAND_TABLE, the index of OPERAND_JUMP_INDEX. Switches have
+  // their value count as operand.
+  int32_t immediate;
+  // Instruction cost of the basic block a jump, call or return ends.
+  int32_t cost;
+  int length;
+} Instruction;
+
+void init_code(Code* code);
+void free_code(Code* code);
+void reserve_code(Code* code, int size);
+void write_code(Code* code, uint8_t byte);
+void write_value(Code* code, void* src, int size);
+void write_leb128(Code* code, uint32_t value);
+int add_constant(Code* code, void* src, int size);
+void write_int_constant(Code* code, int32_t value);
+// The value pushed by an instruction write_int_constant emits, false for any
+// other instruction.
+bool read_int_constant(Code* code, uint8_t op, int32_t operand,
+                       int32_t* value);
+
+void decode_instruction(uint8_t* code, int offset, Instruction* out);
+// Encodes an instruction as decode_instruction reads it. For jumps operand
+// is the offset. Switches are not written, their tables are not decoded.
+void write_instruction(Code* code, Instruction* instruction);
+int instruction_length(Instruction* instruction);
+int count_instructions(Code* code, int from, int to);
+
+static inline uint32_t read_leb128(uint8_t** ip) {
+  uint8_t* p = *ip;
+  uint32_t result = *p & 0x7f;
+  int shift = 7;
+
+  while (*p & 0x80) {
+    p++;
+    result |= (uint32_t)(*p & 0x7f) << shift;
+    shift += 7;
+  }
+
+  *ip = p + 1;
+  return result;
+}
+
+static inline uint16_t read_u16(uint8_t** ip) {
+  uint16_t value = (uint16_t)((*ip)[0] << 8 | (*ip)[1]);
+  *ip += 2;
+  return value;
+}
+
+#endif
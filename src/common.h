@@ -8,4 +8,7 @@
 #include <stdio.h>
 #include <string.h>
 
+// Uncomment to log every instruction and the stack while the VM runs.
+// #define DEBUG_TRACE_EXECUTION
+
 #endif
\ No newline at end of file
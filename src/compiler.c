@@ -6,7 +6,15 @@
 #include "bytecode.h"
 #include "common.h"
 #include "debug.h"
+#include "hash.h"
+#include "memory.h"
+#include "metrics.h"
+#include "module.h"
+#include "native.h"
+#include "optimizer.h"
+#include "rules.h"
 #include "scanner.h"
+#include "str.h"
 #include "value.h"
 
 typedef enum {
@@ -16,8 +24,12 @@ typedef enum {
   PREC_AND,         // and
   PREC_EQUALITY,    // == !=
   PREC_COMPARISON,  // < > <= >=
+  PREC_BIT_OR,      // |
+  PREC_BIT_XOR,     // ^
+  PREC_BIT_AND,     // &
+  PREC_SHIFT,       // << >> >>>
   PREC_TERM,        // + -
-  PREC_FACTOR,      // * /
+  PREC_FACTOR,      // * / %
   PREC_UNARY,       // ! -
   PREC_CALL,        // . ()
   PREC_PRIMARY
@@ -39,34 +51,178 @@ typedef struct {
   int line;
 } ParseInfo;
 
+#define MAX_LOCALS 256
+#define MAX_STRUCTS 64
+#define MAX_FIELDS 16
+// Heap values one statement may have on the operand stack at once.
+#define MAX_HEAP_OPERANDS 256
+// Arrays a parallel for can write, and read at other indexes, each.
+#define MAX_PARALLEL_ARRAYS 16
+
+// Functions whose inlined body is longer than this many bytes are called.
+#define INLINE_LIMIT 64
+
+typedef struct {
+  const char* name;
+  int length;
+  ValueType type;
+
+  // Byte offset from the start of the frame.
+  int offset;
+  int depth;
+
+  // Where the initializer ends if it is an int constant, -1 otherwise.
+  int constant_end;
+  int32_t constant;
+} Local;
+
+typedef struct {
+  const char* name;
+  int length;
+  ValueType type;
+
+  // Byte offset inside the struct.
+  int offset;
+} StructField;
+
+// Structs belong to the module declaring them. The bits of their type above
+// the code byte are the index plus one.
+typedef struct {
+  const char* name;
+  int length;
+  ValueType type;
+
+  StructField fields[MAX_FIELDS];
+  int field_count;
+
+  // Whether arrays of the struct keep each field in a column of its own,
+  // instead of one struct after the other.
+  bool columns;
+} StructInfo;
+
+// An array by the variable holding it. get is OP_END for one that can't be
+// told apart from any other, such as what a local of the body holds or a
+// function reads.
+typedef struct {
+  OP get;
+  int operand;
+} ArrayRef;
+
+// The parallel for whose body is being compiled. The body may assign its
+// own locals, update the reductions and write array elements at the loop
+// index, nothing else, so its iterations can run in any order.
+typedef struct {
+  // Frame offset of the loop variable.
+  int index_offset;
+  // Locals from first_reduction on are the reductions, in order.
+  int first_reduction;
+  Reduction kinds[MAX_REDUCTIONS];
+  int reduction_count;
+  // Locals at or above this frame offset are the body's own.
+  int body_offset;
+
+  // Arrays the body writes elements of, and those it reads elements of at
+  // other indexes than the loop variable. None can be in both, or an
+  // iteration could read what another one writes.
+  ArrayRef written[MAX_PARALLEL_ARRAYS];
+  int written_count;
+  ArrayRef shifted[MAX_PARALLEL_ARRAYS];
+  int shifted_count;
+} Parallel;
+
 typedef struct {
   ParseInfo current;
   ParseInfo previous;
 
   bool had_error;
   bool panic_mode;
+
+  // Whether the expression being parsed may be an assignment target.
+  bool can_assign;
+
+  // Bytes currently on the operand stack at this point of the code.
+  int stack_depth;
+  // The operands that are heap values, offsets counting from the first
+  // operand, for the stack maps.
+  HeapSlot heap_operands[MAX_HEAP_OPERANDS];
+  int heap_operand_count;
+
+  // Offset where the current basic block starts.
+  int block_start;
+
+  // The function being compiled, NULL at the top level.
+  Function* function;
+  // The parallel for being compiled, NULL outside of one.
+  Parallel* parallel;
+  // Where the left operand of the infix operator being compiled starts.
+  int operand_start;
+
+  Local locals[MAX_LOCALS];
+  int local_count;
+  int scope_depth;
+  // Bytes taken by parameters and locals, the operands sit right above.
+  int locals_size;
+
+  // Offset of the last OP_CALL emitted. Returning its result right away
+  // turns it into a tail call.
+  int last_call;
+  // Code of the expression of the last return statement.
+  int return_start;
+  int return_end;
+  // Whether the statement just compiled returns on every path.
+  bool returned;
+
+  int token_count;
+
+  // Whether the module is a rule set, whose && and || evaluate both sides
+  // so the rules become straight line code that can be merged.
+  bool rules;
+
+  StructInfo structs[MAX_STRUCTS];
+  int struct_count;
+
+  // The last compile of the same file, NULL if there is none.
+  Module* previous_module;
+  // The dependencies of the declaration being compiled start here.
+  int first_dependency;
 } Parser;
 
-Parser parser;
+// Modules are compiled concurrently, so each thread has its own parser.
+_Thread_local Parser parser;
+_Thread_local Module* compiling_module;
+
+bool loop_optimization = true;
+
+void set_loop_optimization(bool enabled) { loop_optimization = enabled; }
+
+Code* current_code() { return &compiling_module->code; }
+
+void emit(uint8_t byte) { write_code(current_code(), byte); }
 
-static ParseRule* get_rule(Token type);
+static const ParseRule* get_rule(Token type);
+ValueType expression();
 
 void error_at(ParseInfo* info, const char* message) {
   if (parser.panic_mode) return;
 
   parser.panic_mode = true;
-  fprintf(stderr, "[line %d] Error", info->line);
+  count_metric(METRIC_COMPILE_ERRORS, 1);
+
+  if (compiling_module->path != NULL) {
+    fprintf(error_stream(), "%s: ", compiling_module->path);
+  }
+  fprintf(error_stream(), "[line %d] Error", info->line);
 
   if (info->token == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(error_stream(), " at end");
   } else if (info->token == TOKEN_ERROR) {
     // Nothing.
   } else {
     int len = info->end - info->start;
-    fprintf(stderr, " at '%.*s'", len, info->start);
+    fprintf(error_stream(), " at '%.*s'", len, info->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
+  fprintf(error_stream(), ": %s\n", message);
   parser.had_error = true;
 }
 
@@ -76,6 +232,167 @@ void error_at_current(const char* message) {
 
 void error(const char* message) { error_at(&parser.previous, message); }
 
+void set_stack_depth(int depth) {
+  parser.stack_depth = depth;
+
+  // In a function the operands sit above the parameters and locals, and the
+  // deepest point sets the frame size.
+  int size = parser.locals_size + depth;
+
+  if (parser.function != NULL) {
+    if (size > parser.function->frame_size) parser.function->frame_size = size;
+  } else if (size > current_code()->max_stack) {
+    current_code()->max_stack = size;
+  }
+}
+
+// Records the value an expression leaves at offset base, in place of the
+// operands from mark on that it consumed.
+void set_operand(int base, int mark, ValueType type) {
+  set_stack_depth(base + value_size(type));
+  parser.heap_operand_count = mark;
+
+  if (!is_heap_type(type)) return;
+
+  if (parser.heap_operand_count == MAX_HEAP_OPERANDS) {
+    error("Too many strings and arrays in one expression.");
+    return;
+  }
+
+  HeapSlot* slot = &parser.heap_operands[parser.heap_operand_count++];
+  slot->offset = base;
+  slot->type = type;
+}
+
+// Tells the collector which locals and operands below depth hold heap
+// values while the instruction just emitted is a safepoint.
+void emit_stack_map(int depth) {
+  HeapSlot slots[MAX_LOCALS + MAX_HEAP_OPERANDS];
+  int count = 0;
+
+  for (int i = 0; i < parser.local_count; i++) {
+    Local* local = &parser.locals[i];
+
+    if (is_heap_type(local->type)) {
+      slots[count].offset = local->offset;
+      slots[count].type = local->type;
+      count++;
+    }
+  }
+
+  for (int i = 0; i < parser.heap_operand_count; i++) {
+    HeapSlot* operand = &parser.heap_operands[i];
+
+    if (operand->offset < depth) {
+      slots[count].offset = parser.locals_size + operand->offset;
+      slots[count].type = operand->type;
+      count++;
+    }
+  }
+
+  if (count > 0) {
+    add_stack_map(compiling_module, current_code()->count, slots, count);
+  }
+}
+
+// Execution is metered per basic block, and a block is charged where it
+// ends: a jump carries the instruction count of the block it closes, and a
+// block that falls through into a jump target gets an OP_FUEL instead. Most
+// blocks end in a jump, so metering rarely costs an extra dispatch.
+int block_cost() {
+  Code* code = current_code();
+  // +1 for the instruction that ends the block.
+  return count_instructions(code, parser.block_start, code->count) + 1;
+}
+
+// Ends the current block if it has code and returns where the next one
+// starts, the place jumps into it must target.
+int begin_block() {
+  Code* code = current_code();
+
+  if (parser.block_start < code->count) {
+    int cost = block_cost();
+
+    emit(OP_FUEL);
+    write_leb128(code, cost);
+  }
+
+  parser.block_start = code->count;
+  return parser.block_start;
+}
+
+// Emits a jump ending the current block and returns where to patch its
+// offset.
+int emit_jump(OP op) {
+  Code* code = current_code();
+  int cost = block_cost();
+
+  emit(op);
+  int offset = code->count;
+  emit(0xff);
+  emit(0xff);
+  write_leb128(code, cost);
+
+  parser.block_start = code->count;
+  return offset;
+}
+
+void patch_jump(int offset) {
+  Code* code = current_code();
+  int target = begin_block();
+
+  // Offsets count from the end of the jump instruction.
+  Instruction instruction;
+  decode_instruction(code->code, offset - 1, &instruction);
+
+  int jump = target - (offset - 1 + instruction.length);
+
+  if (jump > UINT16_MAX) {
+    error("Too much code to jump over.");
+  }
+
+  code->code[offset] = (jump >> 8) & 0xff;
+  code->code[offset + 1] = jump & 0xff;
+}
+
+// loop_start must come from begin_block.
+void emit_loop(int loop_start) {
+  Code* code = current_code();
+  int cost = block_cost();
+
+  emit(OP_LOOP);
+  int offset = code->count;
+  emit(0);
+  emit(0);
+  write_leb128(code, cost);
+
+  int jump = code->count - loop_start;
+
+  if (jump > UINT16_MAX) {
+    error("Loop body too large.");
+  }
+
+  code->code[offset] = (jump >> 8) & 0xff;
+  code->code[offset + 1] = jump & 0xff;
+
+  // Loops are where the collector may run. Statements leave no operands.
+  emit_stack_map(0);
+
+  parser.block_start = code->count;
+}
+
+// Returns from the function, ending the current block.
+void emit_return(ValueType type) {
+  Code* code = current_code();
+  int cost = block_cost();
+
+  emit(OP_RETURN);
+  emit(type);
+  write_leb128(code, cost);
+
+  parser.block_start = code->count;
+}
+
 void advance() {
   parser.previous = parser.current;
 
@@ -84,6 +401,7 @@ void advance() {
     parser.current.start = get_scanner_start();
     parser.current.end = get_scanner_current();
     parser.current.line = get_scanner_line();
+    parser.token_count++;
 
     if (parser.current.token != TOKEN_ERROR) break;
 
@@ -100,6 +418,15 @@ void consume(Token token, const char* message) {
   error_at_current(message);
 }
 
+bool check(Token token) { return parser.current.token == token; }
+
+bool match_token(Token token) {
+  if (!check(token)) return false;
+
+  advance();
+  return true;
+}
+
 ValueType number() {
   int len = parser.previous.end - parser.previous.start;
 
@@ -112,204 +439,2990 @@ ValueType number() {
 
   free(substr);
 
-  write_code(OP_CONSTANT);
-  write_value(&value, sizeof(value));
+  write_int_constant(current_code(), value);
+
+  return VAL_INT;
+}
+
+// $N reads field N of the current record as an int, straight from the
+// input. Outside stream mode there is no record and every field is 0.
+ValueType field() {
+  int index = atoi(parser.previous.start + 1);
+
+  if (index < 1) {
+    error("Field numbers start at 1.");
+    return VAL_INT;
+  }
+
+  if (index > compiling_module->field_count) {
+    compiling_module->field_count = index;
+  }
+
+  emit(OP_FIELD);
+  write_leb128(current_code(), index - 1);
 
   return VAL_INT;
 }
 
+// Literals are interned, so every use of the same text shares one object
+// and one constant slot.
+ValueType string() {
+  const char* start = parser.previous.start + 1;
+  int length = parser.previous.end - parser.previous.start - 2;
+
+  ObjString* object = intern_string(start, length);
+
+  emit(OP_STRING);
+  write_leb128(current_code(),
+               add_constant(current_code(), &object, sizeof(object)));
+
+  return VAL_STRING;
+}
+
 ValueType literal() {
   switch (parser.previous.token) {
     case TOKEN_FALSE:
-      write_code(OP_FALSE);
+      emit(OP_FALSE);
       return VAL_BOOL;
     case TOKEN_TRUE:
-      write_code(OP_TRUE);
+      emit(OP_TRUE);
       return VAL_BOOL;
     default:
       return VAL_VOID;  // Unreachable.
   }
 }
 
-ValueType parse_prec(Prec precedence) {
-  advance();
-  ParseFn prefixRule = get_rule(parser.previous.token)->prefix;
+int find_struct(const char* name, int length) {
+  for (int i = 0; i < parser.struct_count; i++) {
+    StructInfo* info = &parser.structs[i];
 
-  if (prefixRule == NULL) {
-    error("Expect expression.");
-    return VAL_VOID;
+    if (info->length == length && memcmp(info->name, name, length) == 0) {
+      return i;
+    }
   }
 
-  ValueType prefix_type = prefixRule(VAL_VOID);
+  return -1;
+}
 
-  while (precedence <= get_rule(parser.current.token)->precedence) {
-    advance();
+StructInfo* struct_info(ValueType type) {
+  return &parser.structs[(int)(type >> 8) - 1];
+}
 
-    ParseFn infixRule = get_rule(parser.previous.token)->infix;
-    prefix_type = infixRule(prefix_type);
+// Types only the declaring module knows.
+bool uses_struct(ValueType type) {
+  return is_struct_type(type) || is_struct_array_type(type);
+}
+
+// A struct's type and the layout of its fields.
+uint64_t struct_signature(StructInfo* info) {
+  uint64_t signature = hash_combine(info->type, info->columns);
+
+  for (int i = 0; i < info->field_count; i++) {
+    StructField* field = &info->fields[i];
+
+    signature = hash_combine(signature, hash_bytes(field->name, field->length));
+    signature = hash_combine(signature, field->type);
+    signature = hash_combine(signature, field->offset);
   }
 
-  return prefix_type;
+  return signature;
 }
 
-ValueType expression() { return parse_prec(PREC_ASSIGNMENT); }
+// Struct types of this module stand for their layout as well, which the
+// code reading their fields depends on.
+uint64_t type_signature(ValueType type) {
+  ValueType element = is_struct_array_type(type) ? element_type(type) : type;
+  if (!is_struct_type(element)) return type;
 
-ValueType grouping() {
-  ValueType value_type = expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
-  return value_type;
+  return hash_combine(type, struct_signature(struct_info(element)));
 }
 
-bool is_number_type(ValueType val_type) { return val_type <= VAL_FLOAT; }
+// The function a module level name calls from this module: its own, then
+// those of its imports, then what earlier REPL entries declared.
+int resolve_function(const char* name, int length, Module** owner) {
+  *owner = compiling_module;
+  int index = find_function(*owner, name, length);
 
-ValueType binary(ValueType left_type) {
-  Token op = parser.previous.token;
-  ParseRule* rule = get_rule(op);
-  ValueType right_type = parse_prec((Prec)(rule->precedence + 1));
+  for (int i = 0; index == -1 && i < compiling_module->import_count; i++) {
+    *owner = compiling_module->imports[i];
+    index = find_function(*owner, name, length);
+  }
 
-  switch (op) {
-    case TOKEN_PLUS:
-    case TOKEN_MINUS:
-    case TOKEN_STAR:
-    case TOKEN_SLASH:
-    case TOKEN_GREATER:
-    case TOKEN_GREATER_EQUAL:
-    case TOKEN_LESS:
-    case TOKEN_LESS_EQUAL:
-      if (!is_number_type(left_type) || !is_number_type(right_type)) {
-        error("Expect a number.");
-      } else if (left_type != right_type) {
-        error("Expect operands to be of the same type.");
-      }
-      break;
-    case TOKEN_BANG_EQUAL:
-    case TOKEN_EQUAL_EQUAL:
-      if (left_type != right_type) {
-        error("Expect a matching type for equality comparison.");
-      }
-      break;
-    default:
-      break;
+  if (index == -1 && compiling_module->scope != NULL) {
+    index = scope_function(compiling_module->scope, name, length, owner);
   }
 
-  switch (op) {
-    case TOKEN_PLUS:
-      write_code(OP_ADD);
-      return VAL_INT;
-    case TOKEN_MINUS:
-      write_code(OP_SUBTRACT);
-      return VAL_INT;
-    case TOKEN_STAR:
-      write_code(OP_MULTIPLY);
-      return VAL_INT;
-    case TOKEN_SLASH:
-      write_code(OP_DIVIDE);
-      return VAL_INT;
-    case TOKEN_BANG_EQUAL:
-      write_code(OP_EQUAL);
-      write_code(left_type);
-      write_code(OP_NOT);
-      return VAL_BOOL;
-    case TOKEN_EQUAL_EQUAL:
-      write_code(OP_EQUAL);
-      write_code(left_type);
-      return VAL_BOOL;
-    case TOKEN_GREATER:
-      write_code(OP_GREATER);
-      return VAL_BOOL;
-    case TOKEN_GREATER_EQUAL:
-      write_code(OP_LESS);
-      write_code(OP_NOT);
-      return VAL_BOOL;
-    case TOKEN_LESS:
-      write_code(OP_LESS);
-      return VAL_BOOL;
-    case TOKEN_LESS_EQUAL:
-      write_code(OP_GREATER);
-      write_code(OP_NOT);
-      return VAL_BOOL;
-    default:
-      return VAL_VOID;  // Unreachable.
+  return index;
+}
+
+// Same as resolve_function, for a global.
+int resolve_symbol(const char* name, int length, Module** owner) {
+  *owner = compiling_module;
+  int index = find_symbol(*owner, name, length);
+
+  for (int i = 0; index == -1 && i < compiling_module->import_count; i++) {
+    *owner = compiling_module->imports[i];
+    index = find_symbol(*owner, name, length);
+  }
+
+  if (index == -1 && compiling_module->scope != NULL) {
+    index = scope_symbol(compiling_module->scope, name, length, owner);
   }
+
+  return index;
 }
 
-ValueType unary() {
-  Token op = parser.previous.token;
+// Everything a module level name may stand for at this point of the
+// module, looked up as variable() and parse_type() do. Code using the name
+// stays valid as long as this does not change.
+uint64_t name_signature(const char* name, int length) {
+  uint64_t signature = 0;
 
-  // Compile the operand.
-  ValueType val_type = parse_prec(PREC_UNARY);
+  int index = find_struct(name, length);
+  if (index != -1) {
+    signature = hash_combine(1, struct_signature(&parser.structs[index]));
+  }
 
-  // Emit the operator instruction.
-  switch (op) {
-    case TOKEN_MINUS:
-      if (!is_number_type(val_type)) {
-        error("Expect a number.");
-      }
-      write_code(OP_NEGATE);
-      break;
-    case TOKEN_BANG:
-      if (val_type != VAL_BOOL) {
-        error("Expect a boolean.");
-      }
-      write_code(OP_NOT);
-      break;
-    default:
-      break;  // Unreachable.
+  Module* owner;
+  index = resolve_function(name, length, &owner);
+
+  if (index != -1) {
+    Function* function = &owner->functions[index];
+    signature = hash_combine(signature, hash_combine(2, function->signature));
+
+    // Inlined code comes from the other module.
+    if (owner != compiling_module && function->inline_start >= 0) {
+      signature = hash_combine(signature, owner->key);
+    }
   }
 
-  return val_type;
+  index = resolve_symbol(name, length, &owner);
+
+  if (index != -1) {
+    ValueType type = owner->symbols[index].type;
+    if (owner == compiling_module) type = type_signature(type);
+
+    signature = hash_combine(signature, hash_combine(3, type));
+  }
+
+  return signature;
 }
 
-ParseRule rules[TOKEN_EOF + 1] = {
-    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
-    [TOKEN_MINUS] = {unary, binary, PREC_TERM},
-    [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
-    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
-    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
-    [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
-    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
-    [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
-    [TOKEN_BANG] = {unary, NULL, PREC_NONE},
-    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
-    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON}};
+// Records that the declaration being compiled uses a module level name.
+void note_dependency(const char* name, int length) {
+  Module* module = compiling_module;
+  if (parser.rules) return;
+
+  for (int i = parser.first_dependency; i < module->dependency_count; i++) {
+    Dependency* dependency = &module->dependencies[i];
 
-void init_rules() {
-  for (int i = 0; i < TOKEN_EOF + 1; i++) {
-    if (i == TOKEN_LEFT_PAREN || i == TOKEN_MINUS || i == TOKEN_PLUS ||
-        i == TOKEN_SLASH || i == TOKEN_STAR || i == TOKEN_NUMBER ||
-        i == TOKEN_TRUE || i == TOKEN_FALSE || i == TOKEN_BANG ||
-        i == TOKEN_BANG_EQUAL || i == TOKEN_EQUAL_EQUAL || i == TOKEN_GREATER ||
-        i == TOKEN_GREATER_EQUAL || i == TOKEN_LESS || i == TOKEN_LESS_EQUAL) {
-      continue;
+    if (dependency->length == length &&
+        memcmp(dependency->name, name, length) == 0) {
+      return;
     }
+  }
+
+  add_dependency(module, name, length, name_signature(name, length));
+}
+
+// The field of a struct the previous token names, NULL if it has none.
+StructField* find_field(ValueType type) {
+  StructInfo* info = struct_info(type);
+  int length = parser.previous.end - parser.previous.start;
 
-    rules[i].prefix = NULL;
-    rules[i].infix = NULL;
-    rules[i].precedence = PREC_NONE;
+  for (int i = 0; i < info->field_count; i++) {
+    StructField* field = &info->fields[i];
+
+    if (field->length == length &&
+        memcmp(field->name, parser.previous.start, length) == 0) {
+      return field;
+    }
   }
+
+  error("Unknown field.");
+  return NULL;
 }
 
-ParseRule* get_rule(Token type) { return &rules[type]; }
+// Consumes the name after '.' and returns that field of the struct.
+StructField* consume_field(ValueType type) {
+  consume(TOKEN_IDENTIFIER, "Expect field name after '.'.");
+  return find_field(type);
+}
 
-void compile(const char* source) {
-  init_scanner(source);
-  init_rules();
+ValueType named_value(ValueType type, OP get, OP set, int operand);
 
-  parser.had_error = false;
-  parser.panic_mode = false;
+// p.f on a struct variable reads or writes only the field, which sits at a
+// fixed offset in the variable.
+ValueType variable_field(ValueType type, OP get, OP set, int operand) {
+  StructField* field = consume_field(type);
+  if (field == NULL) return VAL_VOID;
 
-  free_code();
+  if (get == OP_GET_LOCAL) {
+    operand += field->offset;
+  } else {
+    GlobalRef* ref = &compiling_module->refs[operand];
+    operand = add_ref(compiling_module, ref->owner, ref->symbol,
+                      ref->offset + field->offset);
+  }
 
-  advance();
-  ValueType val_type = expression();
-  consume(TOKEN_EOF, "Expect end of expression.");
+  return named_value(field->type, get, set, operand);
+}
+
+// Emits a read of a named value, or a write when it is assigned to.
+ValueType named_value(ValueType type, OP get, OP set, int operand) {
+  if (is_struct_type(type) && match_token(TOKEN_DOT)) {
+    return variable_field(type, get, set, operand);
+  }
+
+  if (parser.can_assign && match_token(TOKEN_EQUAL)) {
+    if (parser.parallel != NULL &&
+        (set != OP_SET_LOCAL || operand < parser.parallel->body_offset)) {
+      error("A parallel for can only assign variables declared in it.");
+    }
 
-  write_code(OP_RETURN);
-  write_code(val_type);
+    if (expression() != type) {
+      error("Expect assigned value to match the variable type.");
+    }
+
+    emit(set);
+    emit(type);
+    write_leb128(current_code(), operand);
+
+    // Assignment is a statement level expression, it leaves no value.
+    return VAL_VOID;
+  }
+
+  emit(get);
+  emit(type);
+  write_leb128(current_code(), operand);
+
+  return type;
+}
 
-  // log_code();
-}
\ No newline at end of file
+int resolve_local(const char* name, int length) {
+  for (int i = parser.local_count - 1; i >= 0; i--) {
+    Local* local = &parser.locals[i];
+
+    if (local->length == length && memcmp(local->name, name, length) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// Whether the code between start and end may be copied into a caller. It
+// has to run straight through and only touch its own frame and globals.
+bool can_inline(Code* code, int start, int end) {
+  if (end - start > INLINE_LIMIT) return false;
+
+  while (start < end) {
+    Instruction instruction;
+    decode_instruction(code->code, start, &instruction);
+
+    switch (instruction.op) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_LOOP:
+      case OP_FUEL:
+      case OP_CALL:
+      case OP_CALL_NATIVE:
+      case OP_TAIL_CALL:
+      case OP_RETURN:
+      case OP_END:
+      case OP_PRINT:
+      case OP_RESULT:
+      case OP_PARALLEL:
+        return false;
+      default:
+        break;
+    }
+
+    start += instruction.length;
+  }
+
+  return true;
+}
+
+// When a body starts by reading each parameter in order and never touches
+// them again, the pushed arguments already are those operands. Returns the
+// offset after the reads in that case, and -1 otherwise.
+int in_place_start(Code* code, Function* function) {
+  int offset = function->inline_start;
+  int param_offset = 0;
+
+  for (int i = 0; i < function->arity; i++) {
+    Instruction instruction;
+    decode_instruction(code->code, offset, &instruction);
+
+    if (instruction.op != OP_GET_LOCAL || instruction.operand != param_offset) {
+      return -1;
+    }
+
+    offset += instruction.length;
+    param_offset += value_size(function->params[i]);
+  }
+
+  for (int rest = offset; rest < function->inline_end;) {
+    Instruction instruction;
+    decode_instruction(code->code, rest, &instruction);
+
+    if (instruction.op == OP_GET_LOCAL || instruction.op == OP_SET_LOCAL) {
+      return -1;
+    }
+
+    rest += instruction.length;
+  }
+
+  return offset;
+}
+
+// Copies the body of a small function in place of a call to it. The
+// arguments already sit where its parameters would, base bytes into the
+// caller's frame, so only local offsets, global refs and constants have to
+// be moved over. The arguments are dropped from under the result after,
+// unless the body consumed them in place.
+void inline_call(Module* owner, Function* function, int base) {
+  Code* from = &owner->code;
+  Code* code = current_code();
+
+  set_stack_depth(base - parser.locals_size + function->frame_size);
+
+  int start = in_place_start(from, function);
+  bool in_place = start >= 0;
+  if (!in_place) start = function->inline_start;
+
+  for (int offset = start; offset < function->inline_end;) {
+    Instruction instruction;
+    decode_instruction(from->code, offset, &instruction);
+
+    switch (instruction.op) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+        emit(instruction.op);
+        emit(instruction.type);
+        write_leb128(code, base + instruction.operand);
+        break;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL: {
+        GlobalRef* ref = &owner->refs[instruction.operand];
+
+        emit(instruction.op);
+        emit(instruction.type);
+        write_leb128(code, add_ref(compiling_module, ref->owner, ref->symbol,
+                                  ref->offset));
+        break;
+      }
+      case OP_CONSTANT:
+      case OP_STRING:
+        emit(instruction.op);
+        write_leb128(code, add_constant(code,
+                                        &from->constants[instruction.operand],
+                                        sizeof(Constant)));
+        break;
+      default: {
+        // from may be this very code, which can move as it grows.
+        uint8_t bytes[16];
+        memcpy(bytes, from->code + offset, instruction.length);
+        write_value(code, bytes, instruction.length);
+        break;
+      }
+    }
+
+    offset += instruction.length;
+  }
+
+  if (!in_place && function->params_size > 0) {
+    emit(OP_SLIDE);
+    emit(function->return_type);
+    write_leb128(code, function->params_size);
+  }
+}
+
+// The array the left operand of a subscript reads, from the code between
+// parser.operand_start and end.
+ArrayRef indexed_array(int end) {
+  ArrayRef array = {OP_END, 0};
+  if (parser.operand_start >= end) return array;
+
+  Instruction instruction;
+  decode_instruction(current_code()->code, parser.operand_start,
+                     &instruction);
+
+  // Only a variable read as is names the array. A local of the body may
+  // hold any array.
+  if (parser.operand_start + instruction.length != end) return array;
+
+  if (instruction.op == OP_GET_GLOBAL ||
+      (instruction.op == OP_GET_LOCAL &&
+       instruction.operand < parser.parallel->body_offset)) {
+    array.get = instruction.op;
+    array.operand = instruction.operand;
+  }
+
+  return array;
+}
+
+bool same_array(ArrayRef a, ArrayRef b) {
+  return a.get == OP_END || b.get == OP_END ||
+         (a.get == b.get && a.operand == b.operand);
+}
+
+// Adds the array to the ones the parallel for writes, or to the ones it
+// reads at other indexes, unless the other list has it.
+void use_array(ArrayRef array, bool write) {
+  Parallel* parallel = parser.parallel;
+  ArrayRef* others = write ? parallel->shifted : parallel->written;
+  int other_count = write ? parallel->shifted_count : parallel->written_count;
+
+  for (int i = 0; i < other_count; i++) {
+    if (same_array(others[i], array)) {
+      error("A parallel for can't read elements other iterations write.");
+      return;
+    }
+  }
+
+  ArrayRef* arrays = write ? parallel->written : parallel->shifted;
+  int* count = write ? &parallel->written_count : &parallel->shifted_count;
+
+  for (int i = 0; i < *count; i++) {
+    if (arrays[i].get == array.get && arrays[i].operand == array.operand) {
+      return;
+    }
+  }
+
+  if (*count == MAX_PARALLEL_ARRAYS) {
+    error("Too many arrays in a parallel for.");
+    return;
+  }
+
+  arrays[(*count)++] = array;
+}
+
+// Iterations of a parallel for only write the elements at their own index,
+// so no two of them write the same element.
+void check_parallel_write(ArrayRef array, bool at_index) {
+  if (parser.parallel == NULL) return;
+
+  if (!at_index) {
+    error("A parallel for can only write elements at its loop index.");
+    return;
+  }
+
+  use_array(array, true);
+}
+
+// An element read at another index than the loop variable may be one that
+// another iteration writes.
+void check_parallel_read(ArrayRef array, bool at_index) {
+  if (parser.parallel != NULL && !at_index) use_array(array, false);
+}
+
+// Array operators, the built in functions taking an array and functions
+// that read elements may read any element of any array.
+void check_parallel_array_read() {
+  ArrayRef any = {OP_END, 0};
+  check_parallel_read(any, false);
+}
+
+// Arguments are pushed where the callee's frame starts, so calling takes no
+// copying. Small functions are inlined instead.
+// Compiles the arguments of a call, checking them against the parameters.
+void arguments(const ValueType* params, int arity) {
+  int arg_count = 0;
+
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      ValueType type = expression();
+
+      if (arg_count < arity && type != params[arg_count]) {
+        error("Expect argument to match the parameter type.");
+      }
+
+      arg_count++;
+    } while (match_token(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+
+  if (arg_count != arity) {
+    error("Expect as many arguments as the function has parameters.");
+  }
+}
+
+ValueType call(Module* owner, int index) {
+  Function* function = &owner->functions[index];
+
+  if (parser.rules) error("Rules can't call functions.");
+
+  if (owner != compiling_module) {
+    bool structs = uses_struct(function->return_type);
+    for (int i = 0; i < function->arity; i++) {
+      if (uses_struct(function->params[i])) structs = true;
+    }
+
+    if (structs) error("Structs can't be shared between modules.");
+  }
+
+  int args_depth = parser.stack_depth;
+
+  arguments(function->params, function->arity);
+
+  if (function->inline_start >= 0) {
+    inline_call(owner, function, parser.locals_size + args_depth);
+  } else {
+    parser.last_call = current_code()->count;
+
+    emit(OP_CALL);
+    write_leb128(current_code(), add_call(compiling_module, owner, index));
+
+    // The arguments become the callee's, the frame keeps what is below.
+    emit_stack_map(args_depth);
+  }
+
+  return function->return_type;
+}
+
+// A host function gets a pointer to the arguments where they were pushed,
+// the operand is its index in the table of natives. The call ends the block,
+// so a fiber whose time is up yields right after it.
+ValueType call_native(int index) {
+  Native* native = &natives[index];
+
+  arguments(native->params, native->arity);
+
+  Code* code = current_code();
+  int cost = block_cost();
+
+  emit(OP_CALL_NATIVE);
+  write_leb128(code, index);
+  write_leb128(code, cost);
+
+  parser.block_start = code->count;
+  return native->return_type;
+}
+
+ValueType struct_array(ValueType type) {
+  return (ValueType)(type << 8 | VAL_STRUCT_ARRAY);
+}
+
+// The fill of an array of column structs copies each field down its
+// column. The VM is told the layout: the field count in the low 5 bits and
+// a bit per field above them, set for bools.
+void fill_structs(ValueType type) {
+  StructInfo* info = struct_info(type);
+
+  if (!info->columns) {
+    emit(OP_FILL);
+    emit(type);
+    return;
+  }
+
+  uint32_t layout = info->field_count;
+
+  for (int i = 0; i < info->field_count; i++) {
+    if (info->fields[i].type == VAL_BOOL) layout |= 1u << (5 + i);
+  }
+
+  emit(OP_FILL_COLUMNS);
+  write_leb128(current_code(), layout);
+}
+
+bool is_named(const char* name, int length, const char* expected) {
+  return (int)strlen(expected) == length && memcmp(name, expected, length) == 0;
+}
+
+// The built in functions, which compile to their own instructions instead
+// of calls. They are only looked for when no function of that name is in
+// scope, so scripts may define their own.
+bool intrinsic(const char* name, int length, ValueType* result) {
+  OP op;
+
+  if (is_named(name, length, "range")) {
+    op = OP_RANGE;
+  } else if (is_named(name, length, "fill")) {
+    op = OP_FILL;
+  } else if (is_named(name, length, "sum")) {
+    op = OP_SUM;
+  } else if (is_named(name, length, "min")) {
+    op = OP_MIN;
+  } else if (is_named(name, length, "max")) {
+    op = OP_MAX;
+  } else if (is_named(name, length, "filter")) {
+    op = OP_FILTER;
+  } else if (is_named(name, length, "abs")) {
+    op = OP_ABS;
+  } else if (is_named(name, length, "clamp")) {
+    op = OP_CLAMP;
+  } else if (is_named(name, length, "sqrt")) {
+    op = OP_SQRT;
+  } else {
+    return false;
+  }
+
+  ValueType args[3] = {VAL_VOID, VAL_VOID, VAL_VOID};
+  int arg_count = 0;
+
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      ValueType type = expression();
+      if (arg_count < 3) args[arg_count] = type;
+      arg_count++;
+    } while (match_token(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+
+  // min and max of two ints are not the ones of an array.
+  if (arg_count == 2 && op == OP_MIN) op = OP_MIN_INT;
+  if (arg_count == 2 && op == OP_MAX) op = OP_MAX_INT;
+
+  int arity = 1;
+  if (op == OP_FILL || op == OP_FILTER || op == OP_MIN_INT ||
+      op == OP_MAX_INT) {
+    arity = 2;
+  } else if (op == OP_CLAMP) {
+    arity = 3;
+  }
+
+  if (arg_count != arity) {
+    error("Expect as many arguments as the function has parameters.");
+    *result = VAL_VOID;
+    return true;
+  }
+
+  switch (op) {
+    case OP_RANGE:
+      if (args[0] != VAL_INT) error("Expect an int length.");
+
+      emit(OP_RANGE);
+      *result = VAL_INT_ARRAY;
+      break;
+    case OP_FILL:
+      if (args[0] != VAL_INT) error("Expect an int length.");
+
+      if (is_struct_type(args[1])) {
+        fill_structs(args[1]);
+        *result = struct_array(args[1]);
+        break;
+      }
+
+      if (args[1] != VAL_INT && args[1] != VAL_BOOL) {
+        error("Expect an int, bool or struct element.");
+      }
+
+      emit(OP_FILL);
+      emit(args[1]);
+      *result = args[1] == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+      break;
+    case OP_SUM:
+      // The sum of a mask counts its true elements.
+      if (!is_array_type(args[0])) error("Expect an array.");
+      check_parallel_array_read();
+
+      emit(OP_SUM);
+      emit(args[0]);
+      *result = VAL_INT;
+      break;
+    case OP_MIN:
+    case OP_MAX:
+      if (args[0] != VAL_INT_ARRAY) error("Expect an int[].");
+      check_parallel_array_read();
+
+      emit(op);
+      *result = VAL_INT;
+      break;
+    case OP_FILTER:
+      if (is_struct_array_type(args[0])) {
+        if (struct_info(element_type(args[0]))->columns) {
+          error("Can't filter an array of column structs.");
+        }
+      } else if (!is_array_type(args[0])) {
+        error("Expect an array to filter.");
+      }
+      if (args[1] != VAL_BOOL_ARRAY) error("Expect a bool[] mask.");
+      check_parallel_array_read();
+
+      emit(OP_FILTER);
+      emit(element_type(args[0]));
+      *result = args[0];
+      break;
+    default:
+      for (int i = 0; i < arity; i++) {
+        if (args[i] != VAL_INT) error("Expect an int.");
+      }
+
+      emit(op);
+      *result = VAL_INT;
+      break;
+  }
+
+  return true;
+}
+
+// Point(1, true) makes a struct of its fields in order. The arguments are
+// already laid out as the struct, so it takes no code.
+ValueType construct(StructInfo* info) {
+  ValueType params[MAX_FIELDS];
+
+  for (int i = 0; i < info->field_count; i++) {
+    params[i] = info->fields[i].type;
+  }
+
+  arguments(params, info->field_count);
+  return info->type;
+}
+
+ValueType parse_prec(Prec precedence);
+
+// Whether the identifier just consumed is the given local.
+bool is_local(Local* local) {
+  return parser.previous.token == TOKEN_IDENTIFIER &&
+         parser.previous.end - parser.previous.start == local->length &&
+         memcmp(parser.previous.start, local->name, local->length) == 0;
+}
+
+// In a parallel for, a reduction is only updated, as r = r + x - y,
+// r = min(r, x) or r = max(r, x). Every chunk starts it over and the chunks
+// are combined after the loop, so nothing else would give the same result.
+ValueType update_reduction(int index) {
+  Parallel* parallel = parser.parallel;
+  Local* local = &parser.locals[index];
+  Reduction kind = parallel->kinds[index - parallel->first_reduction];
+  const char* message =
+      "Expect a reduction to be updated as r = r + x, min(r, x) or max(r, x).";
+
+  if (!parser.can_assign || !match_token(TOKEN_EQUAL)) {
+    error(message);
+    return VAL_VOID;
+  }
+
+  int base = parser.stack_depth;
+
+  emit(OP_GET_LOCAL);
+  emit(VAL_INT);
+  write_leb128(current_code(), local->offset);
+  set_stack_depth(base + sizeof(int32_t));
+
+  if (kind == REDUCE_SUM) {
+    consume(TOKEN_IDENTIFIER, message);
+    if (!is_local(local) || (!check(TOKEN_PLUS) && !check(TOKEN_MINUS))) {
+      error(message);
+    }
+
+    while (match_token(TOKEN_PLUS) || match_token(TOKEN_MINUS)) {
+      OP op = parser.previous.token == TOKEN_PLUS ? OP_ADD : OP_SUBTRACT;
+
+      if (parse_prec(PREC_FACTOR) != VAL_INT) error("Expect an int.");
+      emit(op);
+      set_stack_depth(base + sizeof(int32_t));
+    }
+  } else {
+    consume(TOKEN_IDENTIFIER, message);
+    if (!is_named(parser.previous.start,
+                  parser.previous.end - parser.previous.start,
+                  kind == REDUCE_MIN ? "min" : "max")) {
+      error(message);
+    }
+
+    consume(TOKEN_LEFT_PAREN, message);
+    consume(TOKEN_IDENTIFIER, message);
+    if (!is_local(local)) error(message);
+    consume(TOKEN_COMMA, message);
+
+    if (expression() != VAL_INT) error("Expect an int.");
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+
+    emit(kind == REDUCE_MIN ? OP_MIN_INT : OP_MAX_INT);
+    set_stack_depth(base + sizeof(int32_t));
+  }
+
+  emit(OP_SET_LOCAL);
+  emit(VAL_INT);
+  write_leb128(current_code(), local->offset);
+
+  return VAL_VOID;
+}
+
+ValueType variable() {
+  const char* name = parser.previous.start;
+  int length = parser.previous.end - parser.previous.start;
+
+  if (match_token(TOKEN_LEFT_PAREN)) {
+    note_dependency(name, length);
+
+    int index = find_struct(name, length);
+    if (index != -1) return construct(&parser.structs[index]);
+
+    Module* owner;
+    int function = resolve_function(name, length, &owner);
+
+    int native = function == -1 ? find_native(name, length) : -1;
+    if (native != -1) return call_native(native);
+
+    ValueType result;
+    if (function == -1 && intrinsic(name, length, &result)) return result;
+
+    if (function == -1) {
+      error("Undefined function.");
+      return VAL_VOID;
+    }
+
+    if (parser.parallel != NULL && owner->functions[function].has_effects) {
+      error("A parallel for can't call a function with effects.");
+    }
+    if (owner->functions[function].reads_arrays) check_parallel_array_read();
+
+    return call(owner, function);
+  }
+
+  int local = resolve_local(name, length);
+  Parallel* parallel = parser.parallel;
+
+  if (parallel != NULL && local >= parallel->first_reduction &&
+      local < parallel->first_reduction + parallel->reduction_count) {
+    return update_reduction(local);
+  }
+
+  if (local != -1) {
+    Local* slot = &parser.locals[local];
+    return named_value(slot->type, OP_GET_LOCAL, OP_SET_LOCAL, slot->offset);
+  }
+
+  note_dependency(name, length);
+
+  Module* owner;
+  int symbol = resolve_symbol(name, length, &owner);
+
+  if (symbol == -1) {
+    error("Undefined variable.");
+    return VAL_VOID;
+  }
+
+  if (owner != compiling_module && uses_struct(owner->symbols[symbol].type)) {
+    error("Structs can't be shared between modules.");
+    return VAL_VOID;
+  }
+
+  return named_value(owner->symbols[symbol].type, OP_GET_GLOBAL,
+                     OP_SET_GLOBAL, add_ref(compiling_module, owner, symbol, 0));
+}
+
+ValueType parse_prec(Prec precedence) {
+  advance();
+  ParseFn prefixRule = get_rule(parser.previous.token)->prefix;
+
+  if (prefixRule == NULL) {
+    error("Expect expression.");
+    return VAL_VOID;
+  }
+
+  // Operands of this expression are pushed on top of what is already there.
+  int base = parser.stack_depth;
+  int mark = parser.heap_operand_count;
+
+  bool can_assign = precedence <= PREC_ASSIGNMENT;
+  parser.can_assign = can_assign;
+
+  int start = current_code()->count;
+  ValueType prefix_type = prefixRule(VAL_VOID);
+  set_operand(base, mark, prefix_type);
+
+  while (precedence <= get_rule(parser.current.token)->precedence) {
+    advance();
+
+    ParseFn infixRule = get_rule(parser.previous.token)->infix;
+    parser.can_assign = can_assign;
+    parser.operand_start = start;
+    prefix_type = infixRule(prefix_type);
+    set_operand(base, mark, prefix_type);
+  }
+
+  if (can_assign && match_token(TOKEN_EQUAL)) {
+    error("Invalid assignment target.");
+  }
+
+  return prefix_type;
+}
+
+ValueType expression() { return parse_prec(PREC_ASSIGNMENT); }
+
+ValueType grouping() {
+  ValueType value_type = expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+  return value_type;
+}
+
+bool is_number_type(ValueType val_type) { return val_type <= VAL_FLOAT; }
+
+// Arithmetic and comparisons on int arrays work elementwise, the right
+// operand being another array of the same length or an int applied to
+// every element. Comparisons give a bool[] mask.
+ValueType array_binary(Token op, ValueType left_type, ValueType right_type) {
+  if (left_type != VAL_INT_ARRAY) {
+    error("Expect an int[] on the left of an array operation.");
+    return VAL_VOID;
+  }
+
+  if (right_type != VAL_INT_ARRAY && right_type != VAL_INT) {
+    error("Expect an int[] or an int on the right.");
+    return VAL_VOID;
+  }
+
+  check_parallel_array_read();
+
+  switch (op) {
+    case TOKEN_PLUS:
+      emit(OP_ARRAY_ADD);
+      emit(right_type);
+      return VAL_INT_ARRAY;
+    case TOKEN_MINUS:
+      emit(OP_ARRAY_SUBTRACT);
+      emit(right_type);
+      return VAL_INT_ARRAY;
+    case TOKEN_STAR:
+      emit(OP_ARRAY_MULTIPLY);
+      emit(right_type);
+      return VAL_INT_ARRAY;
+    case TOKEN_EQUAL_EQUAL:
+      emit(OP_ARRAY_EQUAL);
+      emit(right_type);
+      return VAL_BOOL_ARRAY;
+    case TOKEN_BANG_EQUAL:
+      emit(OP_ARRAY_EQUAL);
+      emit(right_type);
+      emit(OP_ARRAY_NOT);
+      return VAL_BOOL_ARRAY;
+    case TOKEN_GREATER:
+      emit(OP_ARRAY_GREATER);
+      emit(right_type);
+      return VAL_BOOL_ARRAY;
+    case TOKEN_GREATER_EQUAL:
+      emit(OP_ARRAY_LESS);
+      emit(right_type);
+      emit(OP_ARRAY_NOT);
+      return VAL_BOOL_ARRAY;
+    case TOKEN_LESS:
+      emit(OP_ARRAY_LESS);
+      emit(right_type);
+      return VAL_BOOL_ARRAY;
+    case TOKEN_LESS_EQUAL:
+      emit(OP_ARRAY_GREATER);
+      emit(right_type);
+      emit(OP_ARRAY_NOT);
+      return VAL_BOOL_ARRAY;
+    default:
+      error("Unsupported array operation.");
+      return VAL_VOID;
+  }
+}
+
+// Multiplier and shift that divide by d as a multiplication, from Hacker's
+// Delight 10-1, for 2 <= d. The multiplier is taken as unsigned, which adds
+// the dividend in when its top bit is set as the book says to.
+uint32_t divisor_magic(int32_t d, int* shift) {
+  const uint32_t two31 = 0x80000000u;
+  uint32_t ad = (uint32_t)d;
+  uint32_t anc = two31 - 1 - two31 % ad;
+
+  uint32_t q1 = two31 / anc;
+  uint32_t r1 = two31 - q1 * anc;
+  uint32_t q2 = two31 / ad;
+  uint32_t r2 = two31 - q2 * ad;
+  uint32_t delta;
+  int p = 31;
+
+  do {
+    p++;
+    q1 *= 2;
+    r1 *= 2;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 *= 2;
+    r2 *= 2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  *shift = p;
+  return q2 + 1;
+}
+
+// Division and remainder by an int constant d >= 2 become a shift and a
+// mask for powers of two and a multiplication otherwise, with the constant
+// folded into the instruction. Neither can fail, so no checks are left
+// either. right_start is where the right operand's code starts.
+bool divide_by_constant(bool remainder, int right_start) {
+  Code* code = current_code();
+
+  Instruction instruction;
+  decode_instruction(code->code, right_start, &instruction);
+
+  int32_t d;
+  if (right_start + instruction.length != code->count ||
+      !read_int_constant(code, instruction.op, instruction.operand, &d) ||
+      d < 2) {
+    return false;
+  }
+
+  code->count = right_start;
+
+  if ((d & (d - 1)) == 0) {
+    int k = 0;
+    while ((1 << k) != d) k++;
+
+    emit(remainder ? OP_MODULO_POW2 : OP_DIVIDE_POW2);
+    emit(k);
+    return true;
+  }
+
+  // The multiplier and the divisor share a constant, the shift goes in
+  // the instruction.
+  int shift;
+  uint64_t magic = divisor_magic(d, &shift) | (uint64_t)d << 32;
+
+  emit(remainder ? OP_MODULO_MAGIC : OP_DIVIDE_MAGIC);
+  write_leb128(code, add_constant(code, &magic, sizeof(magic)));
+  emit(shift);
+  return true;
+}
+
+ValueType binary(ValueType left_type) {
+  Token op = parser.previous.token;
+  const ParseRule* rule = get_rule(op);
+  int right_start = current_code()->count;
+  ValueType right_type = parse_prec((Prec)(rule->precedence + 1));
+
+  if (is_array_type(left_type) || is_array_type(right_type)) {
+    return array_binary(op, left_type, right_type);
+  }
+
+  // & | ^ on booleans evaluate both sides.
+  if (op == TOKEN_AMP || op == TOKEN_PIPE || op == TOKEN_CARET) {
+    if (left_type != right_type ||
+        (left_type != VAL_INT && left_type != VAL_BOOL)) {
+      error("Expect two ints or two booleans.");
+      return VAL_VOID;
+    }
+
+    if (left_type == VAL_BOOL) {
+      if (op == TOKEN_AMP) {
+        emit(OP_AND);
+      } else if (op == TOKEN_PIPE) {
+        emit(OP_OR);
+      } else {
+        emit(OP_EQUAL);
+        emit(VAL_BOOL);
+        emit(OP_NOT);
+      }
+      return VAL_BOOL;
+    }
+
+    emit(op == TOKEN_AMP ? OP_BIT_AND : op == TOKEN_PIPE ? OP_BIT_OR
+                                                          : OP_BIT_XOR);
+    return VAL_INT;
+  }
+
+  if (op == TOKEN_PLUS && left_type == VAL_STRING) {
+    if (right_type != VAL_STRING) error("Expect a string.");
+
+    emit(OP_CONCAT);
+    return VAL_STRING;
+  }
+
+  switch (op) {
+    case TOKEN_PLUS:
+    case TOKEN_MINUS:
+    case TOKEN_STAR:
+    case TOKEN_SLASH:
+    case TOKEN_PERCENT:
+    case TOKEN_LESS_LESS:
+    case TOKEN_GREATER_GREATER:
+    case TOKEN_GREATER_GREATER_GREATER:
+    case TOKEN_GREATER:
+    case TOKEN_GREATER_EQUAL:
+    case TOKEN_LESS:
+    case TOKEN_LESS_EQUAL:
+      if (!is_number_type(left_type) || !is_number_type(right_type)) {
+        error("Expect a number.");
+      } else if (left_type != right_type) {
+        error("Expect operands to be of the same type.");
+      }
+      break;
+    case TOKEN_BANG_EQUAL:
+    case TOKEN_EQUAL_EQUAL:
+      if (left_type != right_type) {
+        error("Expect a matching type for equality comparison.");
+      } else if (is_struct_array_type(left_type)) {
+        error("Can't compare arrays of structs.");
+      }
+      break;
+    default:
+      break;
+  }
+
+  switch (op) {
+    case TOKEN_PLUS:
+      emit(OP_ADD);
+      return VAL_INT;
+    case TOKEN_MINUS:
+      emit(OP_SUBTRACT);
+      return VAL_INT;
+    case TOKEN_STAR:
+      emit(OP_MULTIPLY);
+      return VAL_INT;
+    case TOKEN_SLASH:
+      if (!divide_by_constant(false, right_start)) emit(OP_DIVIDE);
+      return VAL_INT;
+    case TOKEN_PERCENT:
+      if (!divide_by_constant(true, right_start)) emit(OP_MODULO);
+      return VAL_INT;
+    case TOKEN_LESS_LESS:
+      emit(OP_SHIFT_LEFT);
+      return VAL_INT;
+    case TOKEN_GREATER_GREATER:
+      emit(OP_SHIFT_RIGHT);
+      return VAL_INT;
+    case TOKEN_GREATER_GREATER_GREATER:
+      emit(OP_SHIFT_RIGHT_UNSIGNED);
+      return VAL_INT;
+    case TOKEN_BANG_EQUAL:
+      emit(OP_EQUAL);
+      emit(left_type);
+      emit(OP_NOT);
+      return VAL_BOOL;
+    case TOKEN_EQUAL_EQUAL:
+      emit(OP_EQUAL);
+      emit(left_type);
+      return VAL_BOOL;
+    case TOKEN_GREATER:
+      emit(OP_GREATER);
+      return VAL_BOOL;
+    case TOKEN_GREATER_EQUAL:
+      emit(OP_LESS);
+      emit(OP_NOT);
+      return VAL_BOOL;
+    case TOKEN_LESS:
+      emit(OP_LESS);
+      return VAL_BOOL;
+    case TOKEN_LESS_EQUAL:
+      emit(OP_GREATER);
+      emit(OP_NOT);
+      return VAL_BOOL;
+    default:
+      return VAL_VOID;  // Unreachable.
+  }
+}
+
+// A field of a struct computed whole, such as a call's result. The fields
+// above it are dropped and the ones below slid over.
+ValueType struct_field(ValueType type) {
+  StructField* field = consume_field(type);
+  if (field == NULL) return VAL_VOID;
+
+  int above = value_size(type) - field->offset - value_size(field->type);
+
+  if (above > 0) {
+    emit(OP_DROP);
+    write_leb128(current_code(), above);
+  }
+
+  if (field->offset > 0) {
+    emit(OP_SLIDE);
+    emit(field->type);
+    write_leb128(current_code(), field->offset);
+  }
+
+  return field->type;
+}
+
+// a.f on an array of column structs is the field of every element as an
+// int[] or bool[], a copy of its column the array operators work on. element
+// is the struct type of the array's elements.
+ValueType column_array(ValueType element) {
+  StructInfo* info = struct_info(element);
+  if (!info->columns) {
+    error("Only arrays of column structs have field arrays.");
+    return VAL_VOID;
+  }
+
+  StructField* field = find_field(element);
+  if (field == NULL) return VAL_VOID;
+
+  check_parallel_array_read();
+  emit(OP_COPY_COLUMN);
+  emit(field->type);
+  write_leb128(current_code(), field->offset);
+
+  return field->type == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+}
+
+// Fields of structs, and the length of a string or an array.
+ValueType dot(ValueType left_type) {
+  if (is_struct_type(left_type)) return struct_field(left_type);
+
+  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+
+  int length = parser.previous.end - parser.previous.start;
+
+  if (is_struct_array_type(left_type) &&
+      !is_named(parser.previous.start, length, "length")) {
+    return column_array(element_type(left_type));
+  }
+
+  bool has_length = left_type == VAL_STRING || is_array_type(left_type) ||
+                    is_struct_array_type(left_type);
+
+  if (!has_length || length != 6 ||
+      memcmp(parser.previous.start, "length", 6) != 0) {
+    error("Unknown property.");
+    return VAL_VOID;
+  }
+
+  emit(OP_LENGTH);
+  emit(left_type);
+  return VAL_INT;
+}
+
+// [a, b, ...] makes an array of the elements, which all have the type of
+// the first one.
+ValueType array_literal() {
+  ValueType element = VAL_VOID;
+  int count = 0;
+
+  if (!check(TOKEN_RIGHT_BRACKET)) {
+    do {
+      ValueType type = expression();
+
+      if (count == 0) {
+        element = type;
+      } else if (type != element) {
+        error("Expect array elements to be of the same type.");
+      }
+
+      count++;
+    } while (match_token(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+
+  bool structs = is_struct_type(element) && !struct_info(element)->columns;
+
+  if (element != VAL_INT && element != VAL_BOOL && !structs) {
+    error("Expect int, bool or struct elements, use fill() for an empty "
+          "array.");
+    return VAL_VOID;
+  }
+
+  emit(OP_ARRAY);
+  emit(element);
+  write_leb128(current_code(), count);
+
+  if (structs) return struct_array(element);
+  return element == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+}
+
+// a[i].f reads or writes only the field of the struct element.
+ValueType element_field(ValueType type, bool can_assign, ArrayRef array,
+                        bool at_index) {
+  StructField* field = consume_field(type);
+  if (field == NULL) return VAL_VOID;
+
+  bool columns = struct_info(type)->columns;
+
+  if (can_assign && match_token(TOKEN_EQUAL)) {
+    check_parallel_write(array, at_index);
+
+    if (expression() != field->type) {
+      error("Expect assigned value to match the field type.");
+    }
+
+    emit(columns ? OP_SET_COLUMN : OP_SET_MEMBER);
+    emit(field->type);
+    write_leb128(current_code(), field->offset);
+    return VAL_VOID;
+  }
+
+  check_parallel_read(array, at_index);
+
+  emit(columns ? OP_GET_COLUMN : OP_GET_MEMBER);
+  emit(field->type);
+  write_leb128(current_code(), field->offset);
+  return field->type;
+}
+
+// a[i] reads an element, a[i] = v writes one. Indexes are checked when the
+// code runs.
+ValueType subscript(ValueType left_type) {
+  bool can_assign = parser.can_assign;
+
+  if (!is_array_type(left_type) && !is_struct_array_type(left_type)) {
+    error("Only arrays can be indexed.");
+  }
+
+  Code* code = current_code();
+  int index_start = code->count;
+
+  ArrayRef array = {OP_END, 0};
+  if (parser.parallel != NULL) array = indexed_array(index_start);
+
+  if (expression() != VAL_INT) error("Expect an int index.");
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  // Whether the index is the loop variable of the parallel for, as is.
+  bool at_index = false;
+
+  if (parser.parallel != NULL && index_start < code->count) {
+    Instruction instruction;
+    decode_instruction(code->code, index_start, &instruction);
+
+    at_index = index_start + instruction.length == code->count &&
+               instruction.op == OP_GET_LOCAL &&
+               instruction.operand == parser.parallel->index_offset;
+  }
+
+  ValueType element = element_type(left_type);
+
+  if (is_struct_array_type(left_type)) {
+    if (match_token(TOKEN_DOT)) {
+      return element_field(element, can_assign, array, at_index);
+    }
+
+    if (struct_info(element)->columns) {
+      error("Column structs in an array are read and written by field.");
+    }
+  }
+
+  if (can_assign && match_token(TOKEN_EQUAL)) {
+    check_parallel_write(array, at_index);
+
+    if (expression() != element) {
+      error("Expect assigned value to match the element type.");
+    }
+
+    emit(OP_SET_ELEMENT);
+    emit(element);
+    return VAL_VOID;
+  }
+
+  check_parallel_read(array, at_index);
+
+  emit(OP_GET_ELEMENT);
+  emit(element);
+  return element;
+}
+
+ValueType and_(ValueType left_type) {
+  if (left_type != VAL_BOOL) error("Expect a boolean.");
+
+  if (parser.rules) {
+    if (parse_prec(PREC_AND) != VAL_BOOL) error("Expect a boolean.");
+    emit(OP_AND);
+    return VAL_BOOL;
+  }
+
+  int else_jump = emit_jump(OP_JUMP_IF_FALSE);
+  parser.stack_depth -= value_size(VAL_BOOL);
+
+  if (parse_prec(PREC_AND) != VAL_BOOL) error("Expect a boolean.");
+
+  int end_jump = emit_jump(OP_JUMP);
+
+  patch_jump(else_jump);
+  emit(OP_FALSE);
+
+  patch_jump(end_jump);
+
+  return VAL_BOOL;
+}
+
+ValueType or_(ValueType left_type) {
+  if (left_type != VAL_BOOL) error("Expect a boolean.");
+
+  if (parser.rules) {
+    if (parse_prec(PREC_OR) != VAL_BOOL) error("Expect a boolean.");
+    emit(OP_OR);
+    return VAL_BOOL;
+  }
+
+  int else_jump = emit_jump(OP_JUMP_IF_FALSE);
+  parser.stack_depth -= value_size(VAL_BOOL);
+
+  emit(OP_TRUE);
+  int end_jump = emit_jump(OP_JUMP);
+
+  patch_jump(else_jump);
+  if (parse_prec(PREC_OR) != VAL_BOOL) error("Expect a boolean.");
+
+  patch_jump(end_jump);
+
+  return VAL_BOOL;
+}
+
+ValueType unary() {
+  Token op = parser.previous.token;
+
+  // Compile the operand.
+  ValueType val_type = parse_prec(PREC_UNARY);
+
+  // Emit the operator instruction.
+  switch (op) {
+    case TOKEN_MINUS:
+      if (val_type == VAL_INT_ARRAY) {
+        check_parallel_array_read();
+        emit(OP_ARRAY_NEGATE);
+      } else if (!is_number_type(val_type)) {
+        error("Expect a number.");
+      } else {
+        emit(OP_NEGATE);
+      }
+      break;
+    case TOKEN_TILDE:
+      if (val_type != VAL_INT) {
+        error("Expect an int.");
+      } else {
+        emit(OP_BIT_NOT);
+      }
+      break;
+    case TOKEN_BANG:
+      if (val_type == VAL_BOOL_ARRAY) {
+        emit(OP_ARRAY_NOT);
+      } else if (val_type != VAL_BOOL) {
+        error("Expect a boolean.");
+      } else {
+        emit(OP_NOT);
+      }
+      break;
+    default:
+      break;  // Unreachable.
+  }
+
+  return val_type;
+}
+
+// Tokens without an entry are zero initialized to no prefix, no infix and
+// PREC_NONE. The table is never written, so compiling threads share it.
+const ParseRule rules[TOKEN_EOF + 1] = {
+    [TOKEN_LEFT_PAREN] = {grouping, NULL, PREC_NONE},
+    [TOKEN_LEFT_BRACKET] = {array_literal, subscript, PREC_CALL},
+    [TOKEN_DOT] = {NULL, dot, PREC_CALL},
+    [TOKEN_MINUS] = {unary, binary, PREC_TERM},
+    [TOKEN_PLUS] = {NULL, binary, PREC_TERM},
+    [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_PERCENT] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_AMP] = {NULL, binary, PREC_BIT_AND},
+    [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
+    [TOKEN_PIPE] = {NULL, binary, PREC_BIT_OR},
+    [TOKEN_TILDE] = {unary, NULL, PREC_NONE},
+    [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
+    [TOKEN_STRING] = {string, NULL, PREC_NONE},
+    [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
+    [TOKEN_FIELD] = {field, NULL, PREC_NONE},
+    [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+    [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
+    [TOKEN_BANG] = {unary, NULL, PREC_NONE},
+    [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_EQUAL_EQUAL] = {NULL, binary, PREC_EQUALITY},
+    [TOKEN_GREATER] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_AMP_AMP] = {NULL, and_, PREC_AND},
+    [TOKEN_PIPE_PIPE] = {NULL, or_, PREC_OR}};
+
+const ParseRule* get_rule(Token type) { return &rules[type]; }
+
+void synchronize() {
+  parser.panic_mode = false;
+
+  while (parser.current.token != TOKEN_EOF) {
+    if (parser.previous.token == TOKEN_SEMICOLON) return;
+
+    switch (parser.current.token) {
+      case TOKEN_INT:
+      case TOKEN_BOOL:
+      case TOKEN_STRING_TYPE:
+      case TOKEN_VOID:
+      case TOKEN_PRINT:
+      case TOKEN_IF:
+      case TOKEN_WHILE:
+      case TOKEN_MATCH:
+      case TOKEN_PARALLEL:
+      case TOKEN_RETURN:
+      case TOKEN_STRUCT:
+        return;
+      default:;  // Do nothing.
+    }
+
+    advance();
+  }
+}
+
+bool is_type_token(Token token) {
+  switch (token) {
+    case TOKEN_INT:
+    case TOKEN_FLOAT:
+    case TOKEN_BOOL:
+    case TOKEN_CHAR:
+    case TOKEN_STRING_TYPE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Whether a declaration starts at the current token, with a type keyword
+// or the name of a struct.
+bool is_type_start() {
+  if (is_type_token(parser.current.token)) return true;
+
+  return check(TOKEN_IDENTIFIER) &&
+         find_struct(parser.current.start,
+                     parser.current.end - parser.current.start) != -1;
+}
+
+// int[], bool[] and Point[] are arrays of the element type.
+ValueType array_suffix(ValueType element) {
+  if (!match_token(TOKEN_LEFT_BRACKET)) return element;
+
+  consume(TOKEN_RIGHT_BRACKET, "Expect ']' after '['.");
+
+  if (is_struct_type(element)) return struct_array(element);
+  return element == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+}
+
+ValueType parse_type() {
+  switch (parser.previous.token) {
+    case TOKEN_INT:
+      return array_suffix(VAL_INT);
+    case TOKEN_BOOL:
+      return array_suffix(VAL_BOOL);
+    case TOKEN_STRING_TYPE:
+      return VAL_STRING;
+    case TOKEN_VOID:
+      return VAL_VOID;
+    case TOKEN_IDENTIFIER: {
+      note_dependency(parser.previous.start,
+                      parser.previous.end - parser.previous.start);
+
+      int index = find_struct(parser.previous.start,
+                              parser.previous.end - parser.previous.start);
+      if (index != -1) return array_suffix(parser.structs[index].type);
+
+      error("Unknown type.");
+      return VAL_VOID;
+    }
+    default:
+      error("Unsupported type.");
+      return VAL_VOID;
+  }
+}
+
+void var_declaration(ValueType type, const char* name, int length) {
+  if (type == VAL_VOID) error("Variables can't be void.");
+
+  consume(TOKEN_EQUAL, "Expect '=' after variable name.");
+  ValueType value_type = expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  if (value_type != type) {
+    error("Expect initializer to match the variable type.");
+  }
+
+  // The symbol is added after the initializer so it cannot refer to itself.
+  int symbol = add_symbol(compiling_module, name, length, type);
+
+  emit(OP_SET_GLOBAL);
+  emit(type);
+  write_leb128(current_code(), add_ref(compiling_module, compiling_module,
+                                       symbol, 0));
+}
+
+void add_local(const char* name, int length, ValueType type) {
+  if (parser.local_count == MAX_LOCALS) {
+    error("Too many local variables in function.");
+    return;
+  }
+
+  Local* local = &parser.locals[parser.local_count];
+  local->name = name;
+  local->length = length;
+  local->type = type;
+  local->offset = parser.locals_size;
+  local->depth = parser.scope_depth;
+  local->constant_end = -1;
+
+  parser.local_count++;
+  parser.locals_size += value_size(type);
+}
+
+void local_declaration() {
+  advance();
+  ValueType type = parse_type();
+
+  consume(TOKEN_IDENTIFIER, "Expect variable name.");
+
+  const char* name = parser.previous.start;
+  int length = parser.previous.end - parser.previous.start;
+
+  for (int i = parser.local_count - 1; i >= 0; i--) {
+    Local* local = &parser.locals[i];
+    if (local->depth < parser.scope_depth) break;
+
+    if (local->length == length && memcmp(local->name, name, length) == 0) {
+      error("Already a variable with this name in this scope.");
+    }
+  }
+
+  consume(TOKEN_EQUAL, "Expect '=' after variable name.");
+
+  Code* code = current_code();
+  int start = code->count;
+
+  parser.stack_depth = 0;
+  parser.heap_operand_count = 0;
+  ValueType value_type = expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+  if (type == VAL_VOID) {
+    error("Variables can't be void.");
+  } else if (value_type != type) {
+    error("Expect initializer to match the variable type.");
+  }
+
+  // The initializer is left where it was computed, right above the other
+  // locals, and becomes the new local.
+  add_local(name, length, type);
+
+  Instruction instruction;
+  int32_t value;
+
+  if (type == VAL_INT && !parser.had_error && start < code->count) {
+    decode_instruction(code->code, start, &instruction);
+
+    if (start + instruction.length == code->count &&
+        read_int_constant(code, instruction.op, instruction.operand,
+                          &value)) {
+      Local* local = &parser.locals[parser.local_count - 1];
+      local->constant_end = code->count;
+      local->constant = value;
+    }
+  }
+}
+
+void begin_scope() { parser.scope_depth++; }
+
+void end_scope() {
+  parser.scope_depth--;
+
+  int size = 0;
+
+  while (parser.local_count > 0 &&
+         parser.locals[parser.local_count - 1].depth > parser.scope_depth) {
+    size += value_size(parser.locals[parser.local_count - 1].type);
+    parser.local_count--;
+  }
+
+  if (size > 0) {
+    emit(OP_DROP);
+    write_leb128(current_code(), size);
+    parser.locals_size -= size;
+  }
+}
+
+void print_statement() {
+  if (parser.parallel != NULL) {
+    error("Can't print in a parallel for, its iterations run in any order.");
+  }
+
+  ValueType type = expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
+
+  if (type == VAL_VOID) error("Expect a value.");
+  if (uses_struct(type)) error("Can't print a struct, print its fields.");
+
+  emit(OP_PRINT);
+  emit(type);
+}
+
+// An expression statement ends with ';'. Without one, the expression must be
+// the last thing in the module and becomes its result, which is printed.
+// This keeps single expression programs, the REPL and stream filters
+// working.
+void expression_statement() {
+  ValueType type = expression();
+
+  if (check(TOKEN_EOF)) {
+    if (uses_struct(type)) error("Can't print a struct, print its fields.");
+
+    if (type != VAL_VOID) {
+      emit(OP_RESULT);
+      emit(type);
+    }
+    return;
+  }
+
+  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+
+  if (type != VAL_VOID) {
+    emit(OP_POP);
+    emit(type);
+  }
+}
+
+void condition() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' before condition.");
+  if (expression() != VAL_BOOL) error("Expect a boolean condition.");
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+}
+
+void statement();
+
+void if_statement() {
+  condition();
+
+  int then_jump = emit_jump(OP_JUMP_IF_FALSE);
+  statement();
+  bool then_returns = parser.returned;
+
+  if (match_token(TOKEN_ELSE)) {
+    int else_jump = emit_jump(OP_JUMP);
+
+    patch_jump(then_jump);
+    statement();
+    patch_jump(else_jump);
+
+    parser.returned = then_returns && parser.returned;
+  } else {
+    patch_jump(then_jump);
+    parser.returned = false;
+  }
+}
+
+void set_loop_entry(LoopInfo* loop, OP set, int operand, int32_t value) {
+  for (int i = 0; i < loop->entry_count; i++) {
+    LoopEntry* entry = &loop->entries[i];
+
+    if (entry->set == set && entry->operand == operand) {
+      entry->value = value;
+      return;
+    }
+  }
+
+  if (loop->entry_count == MAX_LOOP_ENTRIES) return;
+
+  LoopEntry* entry = &loop->entries[loop->entry_count++];
+  entry->set = set;
+  entry->operand = operand;
+  entry->value = value;
+}
+
+// Whether writing size bytes to the variable overwrites the entry's. A
+// global ref is to a whole symbol or to a field of a struct, so refs to
+// one symbol are taken to overlap.
+bool overlaps_entry(LoopEntry* entry, OP set, int operand, int size) {
+  if (entry->set != set) return false;
+  if (operand == -1) return true;
+
+  if (set == OP_SET_LOCAL) {
+    return entry->operand < operand + size &&
+           operand < entry->operand + (int)sizeof(int32_t);
+  }
+
+  GlobalRef* a = &compiling_module->refs[entry->operand];
+  GlobalRef* b = &compiling_module->refs[operand];
+  return a->owner == b->owner && a->symbol == b->symbol;
+}
+
+// Forgets the variables a write of size bytes overwrites, or all variables
+// of the kind for operand -1.
+void clear_loop_entries(LoopInfo* loop, OP set, int operand, int size) {
+  for (int i = 0; i < loop->entry_count;) {
+    LoopEntry* entry = &loop->entries[i];
+
+    if (overlaps_entry(entry, set, operand, size)) {
+      *entry = loop->entries[--loop->entry_count];
+    } else {
+      i++;
+    }
+  }
+}
+
+// Collects the int constants the current block leaves in variables. A loop
+// starting right after it has its counters start at those.
+void find_loop_entries(LoopInfo* loop) {
+  Code* code = current_code();
+  Instruction previous = {OP_END, VAL_VOID, 0, 0, 0, 0};
+
+  loop->entry_count = 0;
+
+  for (int offset = parser.block_start; offset < code->count;) {
+    Instruction instruction;
+    decode_instruction(code->code, offset, &instruction);
+    offset += instruction.length;
+
+    int32_t value;
+
+    switch (instruction.op) {
+      case OP_SET_LOCAL:
+      case OP_SET_GLOBAL:
+        clear_loop_entries(loop, instruction.op, instruction.operand,
+                           value_size(instruction.type));
+
+        if (instruction.type == VAL_INT &&
+            read_int_constant(code, previous.op, previous.operand, &value)) {
+          set_loop_entry(loop, instruction.op, instruction.operand, value);
+        }
+        break;
+      case OP_CALL:
+      case OP_CALL_NATIVE:
+        clear_loop_entries(loop, OP_SET_GLOBAL, -1, 0);
+        break;
+      case OP_DROP:
+        // Later locals reuse the offsets.
+        clear_loop_entries(loop, OP_SET_LOCAL, -1, 0);
+        break;
+      default:
+        break;
+    }
+
+    for (int i = 0; i < parser.local_count; i++) {
+      Local* local = &parser.locals[i];
+
+      if (local->constant_end == offset) {
+        set_loop_entry(loop, OP_SET_LOCAL, local->offset, local->constant);
+      }
+    }
+
+    previous = instruction;
+  }
+}
+
+// Lets the optimizer rewrite the loop just compiled, and carries on after
+// the code it wrote.
+void optimize_while(LoopInfo* loop, int loop_start) {
+  loop->module = compiling_module;
+  loop->start = loop_start;
+  loop->locals_size = parser.locals_size;
+
+  if (!optimize_loop(loop)) return;
+
+  parser.block_start = loop->exit;
+  parser.last_call = -1;
+
+  // The hidden locals sit below everything the loop pushes.
+  if (parser.function != NULL) {
+    parser.function->frame_size += loop->hidden_size;
+  } else {
+    current_code()->max_stack += loop->hidden_size;
+  }
+}
+
+void while_statement() {
+  LoopInfo loop;
+  loop.source_offset = parser.previous.start - compiling_module->source;
+  find_loop_entries(&loop);
+
+  int loop_start = begin_block();
+
+  condition();
+
+  int exit_jump = emit_jump(OP_JUMP_IF_FALSE);
+  statement();
+  emit_loop(loop_start);
+
+  patch_jump(exit_jump);
+  parser.returned = false;
+
+  if (loop_optimization && !parser.had_error) {
+    optimize_while(&loop, loop_start);
+  }
+}
+
+typedef struct {
+  int32_t value;
+  // Start of the arm's code.
+  int target;
+} MatchCase;
+
+int compare_cases(const void* a, const void* b) {
+  int32_t x = ((const MatchCase*)a)->value;
+  int32_t y = ((const MatchCase*)b)->value;
+  return (x > y) - (x < y);
+}
+
+int32_t match_value(ValueType type) {
+  if (type == VAL_BOOL) {
+    if (match_token(TOKEN_TRUE)) return 1;
+    consume(TOKEN_FALSE, "Expect true or false.");
+    return 0;
+  }
+
+  bool negative = match_token(TOKEN_MINUS);
+  consume(TOKEN_NUMBER, "Expect an int.");
+
+  uint32_t value = (uint32_t)strtoul(parser.previous.start, NULL, 10);
+  return (int32_t)(negative ? 0u - value : value);
+}
+
+void emit_switch_offset(int end, int target) {
+  // Values without an arm and without an else go right past the match.
+  int offset = target == -1 ? 0 : target - end;
+
+  if (offset < INT16_MIN) error("Too much code to jump over.");
+
+  emit((offset >> 8) & 0xff);
+  emit(offset & 0xff);
+}
+
+// Values in a range at most twice as wide as their count index a table,
+// others are looked up by binary search. Either way the dispatch is one
+// instruction, however many arms there are.
+void emit_switch(ValueType type, MatchCase* cases, int count,
+                 int default_target) {
+  Code* code = current_code();
+  if (count > 0) qsort(cases, count, sizeof(MatchCase), compare_cases);
+
+  int64_t range = count == 0 ? 0
+                             : (int64_t)cases[count - 1].value -
+                                   cases[0].value + 1;
+
+  Instruction instruction;
+  instruction.op = range <= 2 * count ? OP_TABLESWITCH : OP_LOOKUPSWITCH;
+  instruction.type = type;
+  instruction.operand = instruction.op == OP_TABLESWITCH ? range : count;
+  instruction.immediate = count == 0 ? 0 : cases[0].value;
+  instruction.cost = block_cost();
+
+  int end = code->count + instruction_length(&instruction);
+
+  emit(instruction.op);
+  emit(type);
+  write_leb128(code, instruction.cost);
+
+  if (instruction.op == OP_TABLESWITCH) {
+    write_value(code, &instruction.immediate, sizeof(int32_t));
+    write_leb128(code, range);
+    emit_switch_offset(end, default_target);
+
+    for (int i = 0, value = 0; value < range; value++) {
+      if (cases[i].value - instruction.immediate == value) {
+        emit_switch_offset(end, cases[i++].target);
+      } else {
+        emit_switch_offset(end, default_target);
+      }
+    }
+  } else {
+    write_leb128(code, count);
+    emit_switch_offset(end, default_target);
+
+    for (int i = 0; i < count; i++) {
+      write_value(code, &cases[i].value, sizeof(int32_t));
+      emit_switch_offset(end, cases[i].target);
+    }
+  }
+
+  parser.block_start = code->count;
+}
+
+// The arms are compiled first and the dispatch after them, once all of
+// their values are known. Each arm jumps past the dispatch when it is done.
+void match_statement() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'match'.");
+  ValueType type = expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after match value.");
+
+  if (type != VAL_INT && type != VAL_BOOL) {
+    error("Can only match ints and booleans.");
+  }
+
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before match arms.");
+
+  // The dispatch pops the value.
+  int dispatch_jump = emit_jump(OP_JUMP);
+
+  MatchCase* cases = NULL;
+  int count = 0;
+  int capacity = 0;
+  int* end_jumps = NULL;
+  int arm_count = 0;
+  int arm_capacity = 0;
+  int default_target = -1;
+  bool returns = true;
+
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    int target = current_code()->count;
+
+    if (match_token(TOKEN_ELSE)) {
+      if (default_target != -1) error("Already an else arm in this match.");
+      default_target = target;
+    } else {
+      do {
+        int32_t value = match_value(type);
+
+        for (int i = 0; i < count; i++) {
+          if (cases[i].value == value) error("Already an arm for this value.");
+        }
+
+        if (capacity < count + 1) {
+          int old_capacity = capacity;
+
+          capacity = GROW_CAPACITY(old_capacity);
+          cases = GROW_ARRAY(MatchCase, cases, old_capacity, capacity);
+        }
+
+        cases[count].value = value;
+        cases[count].target = target;
+        count++;
+      } while (match_token(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_ARROW, "Expect '=>' after match values.");
+    statement();
+    returns = returns && parser.returned;
+
+    if (arm_capacity < arm_count + 1) {
+      int old_capacity = arm_capacity;
+
+      arm_capacity = GROW_CAPACITY(old_capacity);
+      end_jumps = GROW_ARRAY(int, end_jumps, old_capacity, arm_capacity);
+    }
+
+    end_jumps[arm_count++] = emit_jump(OP_JUMP);
+
+    if (parser.panic_mode) synchronize();
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after match arms.");
+
+  patch_jump(dispatch_jump);
+  emit_switch(type, cases, count, default_target);
+
+  for (int i = 0; i < arm_count; i++) patch_jump(end_jumps[i]);
+
+  parser.returned = returns && default_target != -1;
+
+  FREE_ARRAY(MatchCase, cases, capacity);
+  FREE_ARRAY(int, end_jumps, arm_capacity);
+}
+
+// The int variable before a parallel for that a reduction goes into, and
+// the accumulator standing in for it in the body, which starts out as the
+// identity of the reduction.
+typedef struct {
+  OP get;
+  OP set;
+  int operand;
+  int accumulator;
+} ReductionTarget;
+
+void reduction(Parallel* parallel, ReductionTarget* target) {
+  consume(TOKEN_IDENTIFIER, "Expect sum, min or max.");
+
+  const char* kind = parser.previous.start;
+  int kind_length = parser.previous.end - parser.previous.start;
+  Reduction reduction = REDUCE_SUM;
+  int32_t identity = 0;
+
+  if (is_named(kind, kind_length, "min")) {
+    reduction = REDUCE_MIN;
+    identity = INT32_MAX;
+  } else if (is_named(kind, kind_length, "max")) {
+    reduction = REDUCE_MAX;
+    identity = INT32_MIN;
+  } else if (!is_named(kind, kind_length, "sum")) {
+    error("Expect sum, min or max.");
+  }
+
+  consume(TOKEN_IDENTIFIER, "Expect a variable to reduce into.");
+
+  const char* name = parser.previous.start;
+  int length = parser.previous.end - parser.previous.start;
+  ValueType type = VAL_VOID;
+
+  // Only variables from before the loop, not the loop variable.
+  int local = resolve_local(name, length);
+
+  if (local != -1 && local < parallel->first_reduction - 2) {
+    target->get = OP_GET_LOCAL;
+    target->set = OP_SET_LOCAL;
+    target->operand = parser.locals[local].offset;
+    type = parser.locals[local].type;
+  } else if (local == -1) {
+    note_dependency(name, length);
+
+    Module* owner;
+    int symbol = resolve_symbol(name, length, &owner);
+
+    if (symbol != -1) {
+      target->get = OP_GET_GLOBAL;
+      target->set = OP_SET_GLOBAL;
+      target->operand = add_ref(compiling_module, owner, symbol, 0);
+      type = owner->symbols[symbol].type;
+    }
+  }
+
+  if (type != VAL_INT) {
+    error("Expect an int variable declared before the loop.");
+  }
+
+  for (int i = parallel->first_reduction; i < parser.local_count; i++) {
+    if (is_local(&parser.locals[i])) error("Already reduced.");
+  }
+
+  if (parallel->reduction_count == MAX_REDUCTIONS) {
+    error("Can't have more than 8 reductions.");
+    return;
+  }
+
+  write_int_constant(current_code(), identity);
+  set_stack_depth(sizeof(int32_t));
+
+  target->accumulator = parser.locals_size;
+  add_local(name, length, VAL_INT);
+  parser.stack_depth = 0;
+
+  parallel->kinds[parallel->reduction_count++] = reduction;
+}
+
+// parallel for (int i = low; i < high) reduce (sum total, max best) body
+//
+// runs the body once for each i from low up to high, in chunks spread over
+// the threads of the pool. The loop variable, the end and the accumulators
+// of the reductions are locals of the frame, which every chunk gets a copy
+// of. The accumulators are combined chunk by chunk, in order, and then
+// folded into their variables.
+void parallel_statement() {
+  if (parser.parallel != NULL) error("Parallel for loops can't be nested.");
+
+  consume(TOKEN_FOR, "Expect 'for' after 'parallel'.");
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  consume(TOKEN_INT, "Expect an int loop variable.");
+  consume(TOKEN_IDENTIFIER, "Expect loop variable name.");
+
+  const char* name = parser.previous.start;
+  int length = parser.previous.end - parser.previous.start;
+
+  consume(TOKEN_EQUAL, "Expect '=' after loop variable name.");
+  begin_scope();
+
+  Parallel parallel;
+  parallel.index_offset = parser.locals_size;
+  parallel.reduction_count = 0;
+  parallel.written_count = 0;
+  parallel.shifted_count = 0;
+
+  if (expression() != VAL_INT) error("Expect an int start.");
+  add_local(name, length, VAL_INT);
+  parser.stack_depth = 0;
+  parser.heap_operand_count = 0;
+
+  consume(TOKEN_SEMICOLON, "Expect ';' after the start.");
+  consume(TOKEN_IDENTIFIER, "Expect the loop variable.");
+  if (!is_local(&parser.locals[parser.local_count - 1])) {
+    error("Expect the loop variable.");
+  }
+  consume(TOKEN_LESS, "Expect '<' after the loop variable.");
+
+  // The end has no name, the body can't see it.
+  if (expression() != VAL_INT) error("Expect an int end.");
+  add_local("", 0, VAL_INT);
+  parser.stack_depth = 0;
+  parser.heap_operand_count = 0;
+
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after the range.");
+
+  parallel.first_reduction = parser.local_count;
+  ReductionTarget targets[MAX_REDUCTIONS];
+
+  if (check(TOKEN_IDENTIFIER) &&
+      is_named(parser.current.start, parser.current.end - parser.current.start,
+               "reduce")) {
+    advance();
+    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'reduce'.");
+
+    do {
+      reduction(&parallel, &targets[parallel.reduction_count]);
+    } while (match_token(TOKEN_COMMA));
+
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after reductions.");
+  }
+
+  uint32_t kinds = 0;
+  for (int i = 0; i < parallel.reduction_count; i++) {
+    kinds |= (uint32_t)parallel.kinds[i] << (2 * i);
+  }
+
+  Code* code = current_code();
+  int cost = block_cost();
+
+  emit(OP_PARALLEL);
+  int exit = code->count;
+  emit(0xff);
+  emit(0xff);
+  write_leb128(code, cost);
+  write_leb128(code, kinds);
+
+  // Chunks read the strings the frame holds, which are readied first.
+  emit_stack_map(0);
+
+  int body_start = code->count;
+  parser.block_start = body_start;
+
+  parallel.body_offset = parser.locals_size;
+  parser.parallel = &parallel;
+  statement();
+  parser.parallel = NULL;
+
+  cost = block_cost();
+
+  emit(OP_PARALLEL_END);
+  int offset = code->count;
+  emit(0);
+  emit(0);
+  write_leb128(code, cost);
+  write_leb128(code, parallel.index_offset);
+
+  int jump = code->count - body_start;
+  if (jump > UINT16_MAX) error("Loop body too large.");
+
+  code->code[offset] = (jump >> 8) & 0xff;
+  code->code[offset + 1] = jump & 0xff;
+
+  parser.block_start = code->count;
+  patch_jump(exit);
+
+  for (int i = 0; i < parallel.reduction_count; i++) {
+    ReductionTarget* target = &targets[i];
+    Reduction kind = parallel.kinds[i];
+
+    emit(target->get);
+    emit(VAL_INT);
+    write_leb128(code, target->operand);
+    emit(OP_GET_LOCAL);
+    emit(VAL_INT);
+    write_leb128(code, target->accumulator);
+    set_stack_depth(2 * sizeof(int32_t));
+
+    emit(kind == REDUCE_SUM   ? OP_ADD
+         : kind == REDUCE_MIN ? OP_MIN_INT
+                              : OP_MAX_INT);
+    emit(target->set);
+    emit(VAL_INT);
+    write_leb128(code, target->operand);
+  }
+
+  end_scope();
+  parser.returned = false;
+}
+
+void return_statement() {
+  Code* code = current_code();
+  int start = code->count;
+
+  ValueType type = VAL_VOID;
+  if (!check(TOKEN_SEMICOLON)) type = expression();
+
+  consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+  parser.returned = true;
+
+  if (parser.function == NULL) {
+    error("Can't return from top-level code.");
+    return;
+  }
+
+  if (parser.parallel != NULL) {
+    error("Can't return from a parallel for.");
+    return;
+  }
+
+  if (type != parser.function->return_type) {
+    error("Expect the return value to match the function's return type.");
+  }
+
+  Instruction call;
+  if (parser.last_call >= start) {
+    decode_instruction(code->code, parser.last_call, &call);
+  }
+
+  // Returning the result of a call right away reuses the frame.
+  if (parser.last_call >= start &&
+      parser.last_call + call.length == code->count) {
+    code->count = parser.last_call;
+    drop_stack_maps(compiling_module, code->count);
+    int cost = block_cost();
+
+    emit(OP_TAIL_CALL);
+    write_leb128(code, call.operand);
+    write_leb128(code, cost);
+
+    parser.block_start = code->count;
+    return;
+  }
+
+  parser.return_start = start;
+  parser.return_end = code->count;
+
+  emit_return(type);
+}
+
+void block() {
+  bool returns = false;
+
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    parser.returned = false;
+
+    if (!is_type_start()) {
+      statement();
+    } else if (parser.function != NULL || parser.parallel != NULL) {
+      local_declaration();
+    } else {
+      error_at_current("Variables can only be declared at the top level.");
+      statement();
+    }
+
+    if (parser.returned) returns = true;
+    if (parser.panic_mode) synchronize();
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  parser.returned = returns;
+}
+
+void statement() {
+  // Every statement starts and ends with an empty operand stack.
+  parser.stack_depth = 0;
+  parser.heap_operand_count = 0;
+  parser.returned = false;
+
+  if (match_token(TOKEN_PRINT)) {
+    print_statement();
+  } else if (match_token(TOKEN_IF)) {
+    if_statement();
+  } else if (match_token(TOKEN_WHILE)) {
+    while_statement();
+  } else if (match_token(TOKEN_MATCH)) {
+    match_statement();
+  } else if (match_token(TOKEN_PARALLEL)) {
+    parallel_statement();
+  } else if (match_token(TOKEN_RETURN)) {
+    return_statement();
+  } else if (match_token(TOKEN_LEFT_BRACE)) {
+    begin_scope();
+    block();
+    end_scope();
+  } else {
+    expression_statement();
+  }
+
+  parser.stack_depth = 0;
+  parser.heap_operand_count = 0;
+}
+
+void import_declaration() {
+  // The imported modules were resolved from these declarations before
+  // compilation, see scan_imports.
+  consume(TOKEN_STRING, "Expect module path string.");
+  consume(TOKEN_SEMICOLON, "Expect ';' after import.");
+}
+
+// The parameter and return types and, for a body its callers copy, the
+// declaration and everything it depends on.
+uint64_t function_signature(Function* function) {
+  uint64_t signature = type_signature(function->return_type);
+
+  for (int i = 0; i < function->arity; i++) {
+    signature = hash_combine(signature, type_signature(function->params[i]));
+  }
+
+  signature = hash_combine(signature, function->has_effects);
+  signature = hash_combine(signature, function->reads_arrays);
+  if (function->inline_start < 0) return signature;
+
+  signature = hash_combine(
+      signature, hash_bytes(compiling_module->source + function->source_start,
+                            function->source_length));
+
+  for (int i = 0; i < function->dependency_count; i++) {
+    Dependency* dependency =
+        &compiling_module->dependencies[function->first_dependency + i];
+    signature = hash_combine(signature, dependency->signature);
+  }
+
+  return signature;
+}
+
+// The global a ref of the previous compile names, as this module sees it
+// now, or -1 when it is gone.
+int move_ref(Module* previous, int index) {
+  GlobalRef* ref = &previous->refs[index];
+  Symbol* symbol = &ref->owner->symbols[ref->symbol];
+
+  Module* owner;
+  int found = resolve_symbol(symbol->name, symbol->length, &owner);
+
+  if (found == -1) return -1;
+  return add_ref(compiling_module, owner, found, ref->offset);
+}
+
+// Same as move_ref, for a call.
+int move_call(Module* previous, int index) {
+  CallRef* call = &previous->calls[index];
+  Function* function = &call->owner->functions[call->function];
+
+  Module* owner;
+  int found = resolve_function(function->name, function->length, &owner);
+
+  if (found == -1) return -1;
+  return add_call(compiling_module, owner, found);
+}
+
+// Appends the body of a function of the previous compile, with its
+// constants, globals and calls moved over to this module. Jumps are
+// relative, so the body is only taken when no instruction changes length.
+bool copy_body(Module* previous, Function* old) {
+  Code* from = &previous->code;
+  Code* code = current_code();
+  int start = code->count;
+
+  for (int offset = old->entry; offset < old->code_end;) {
+    Instruction instruction;
+    decode_instruction(from->code, offset, &instruction);
+
+    int operand = instruction.operand;
+
+    switch (instruction.op) {
+      case OP_CONSTANT:
+      case OP_STRING:
+      case OP_DIVIDE_MAGIC:
+      case OP_MODULO_MAGIC:
+        operand = add_constant(code, &from->constants[operand],
+                               sizeof(Constant));
+        break;
+      case OP_PROFILE_BLOCK:
+        // The counters are the previous module's.
+        code->count = start;
+        return false;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+      case OP_INCREMENT_GLOBAL:
+        operand = move_ref(previous, operand);
+        break;
+      case OP_CALL:
+      case OP_TAIL_CALL:
+        operand = move_call(previous, operand);
+        break;
+      case OP_FIELD:
+        if (operand + 1 > compiling_module->field_count) {
+          compiling_module->field_count = operand + 1;
+        }
+        break;
+      default:
+        break;
+    }
+
+    if (operand == instruction.operand) {
+      write_value(code, from->code + offset, instruction.length);
+    } else {
+      instruction.operand = operand;
+
+      if (operand < 0 ||
+          instruction_length(&instruction) != instruction.length) {
+        code->count = start;
+        return false;
+      }
+
+      write_instruction(code, &instruction);
+    }
+
+    offset += instruction.length;
+  }
+
+  // The safepoints of the body, which end after its entry.
+  int low = 0;
+  int high = previous->map_count;
+
+  while (low < high) {
+    int middle = (low + high) / 2;
+
+    if (previous->maps[middle].code_offset <= old->entry) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  for (int i = low; i < previous->map_count; i++) {
+    StackMap* map = &previous->maps[i];
+    if (map->code_offset > old->code_end) break;
+
+    add_stack_map(compiling_module, start + map->code_offset - old->entry,
+                  &previous->map_slots[map->first_slot], map->slot_count);
+  }
+
+  return true;
+}
+
+// Takes the function from the previous compile of the module when its
+// declaration reads the same from start on and every name it uses still
+// stands for the same thing. The scanner then continues after its body.
+bool reuse_function(Function* function, ParseInfo* start) {
+  Module* previous = parser.previous_module;
+  if (previous == NULL) return false;
+
+  int index = find_function(previous, function->name, function->length);
+  if (index == -1) return false;
+
+  Function* old = &previous->functions[index];
+  const char* text = previous->source + old->source_start;
+
+  if (old->return_type != function->return_type ||
+      strncmp(text, start->start, old->source_length) != 0) {
+    return false;
+  }
+
+  for (int i = 0; i < old->dependency_count; i++) {
+    Dependency* dependency = &previous->dependencies[old->first_dependency + i];
+
+    if (name_signature(dependency->name, dependency->length) !=
+        dependency->signature) {
+      return false;
+    }
+  }
+
+  if (!copy_body(previous, old)) return false;
+
+  // The names are in the same place of the same text here.
+  for (int i = 0; i < old->dependency_count; i++) {
+    Dependency* dependency = &previous->dependencies[old->first_dependency + i];
+
+    add_dependency(compiling_module, start->start + (dependency->name - text),
+                   dependency->length, dependency->signature);
+  }
+
+  int shift = function->entry - old->entry;
+
+  memcpy(function->params, old->params, sizeof(old->params));
+  function->arity = old->arity;
+  function->params_size = old->params_size;
+  function->frame_size = old->frame_size;
+  function->code_end = old->code_end + shift;
+  function->source_length = old->source_length;
+  function->source_lines = old->source_lines;
+  function->dependency_count = old->dependency_count;
+  function->has_effects = old->has_effects;
+  function->reads_arrays = old->reads_arrays;
+
+  if (old->inline_start >= 0) {
+    function->inline_start = old->inline_start + shift;
+    function->inline_end = old->inline_end + shift;
+  }
+
+  function->signature = function_signature(function);
+
+  skip_scanner(start->start + old->source_length,
+               start->line + old->source_lines);
+  advance();
+
+  parser.block_start = current_code()->count;
+  count_metric(METRIC_FUNCTIONS_REUSED, 1);
+  return true;
+}
+
+// Whether the code from start to end writes globals or array elements,
+// prints or calls a function that does.
+bool has_effects(Code* code, int start, int end) {
+  while (start < end) {
+    Instruction instruction;
+    decode_instruction(code->code, start, &instruction);
+    start += instruction.length;
+
+    switch (instruction.op) {
+      case OP_SET_GLOBAL:
+      case OP_INCREMENT_GLOBAL:
+      case OP_SET_ELEMENT:
+      case OP_SET_ELEMENT_UNCHECKED:
+      case OP_SET_MEMBER:
+      case OP_SET_COLUMN:
+      case OP_PRINT:
+      case OP_RESULT:
+      case OP_PARALLEL:
+        return true;
+      case OP_CALL:
+      case OP_TAIL_CALL: {
+        CallRef* call = &compiling_module->calls[instruction.operand];
+        if (call->owner->functions[call->function].has_effects) return true;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  return false;
+}
+
+// Whether the code from start to end reads array elements, or calls a
+// function that does.
+bool reads_arrays(Code* code, int start, int end) {
+  while (start < end) {
+    Instruction instruction;
+    decode_instruction(code->code, start, &instruction);
+    start += instruction.length;
+
+    switch (instruction.op) {
+      case OP_GET_ELEMENT:
+      case OP_GET_ELEMENT_UNCHECKED:
+      case OP_GET_MEMBER:
+      case OP_GET_COLUMN:
+      case OP_COPY_COLUMN:
+      case OP_ARRAY_ADD:
+      case OP_ARRAY_SUBTRACT:
+      case OP_ARRAY_MULTIPLY:
+      case OP_ARRAY_EQUAL:
+      case OP_ARRAY_LESS:
+      case OP_ARRAY_GREATER:
+      case OP_ARRAY_NEGATE:
+      case OP_ARRAY_NOT:
+      case OP_SUM:
+      case OP_MIN:
+      case OP_MAX:
+      case OP_FILTER:
+        return true;
+      case OP_CALL:
+      case OP_TAIL_CALL: {
+        CallRef* call = &compiling_module->calls[instruction.operand];
+        if (call->owner->functions[call->function].reads_arrays) return true;
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  return false;
+}
+
+// The body is compiled in line with the top level code, which jumps over
+// it. Parameters are the first locals of the frame. start is the first
+// token of the declaration.
+void function_declaration(ValueType return_type, const char* name,
+                          int length, ParseInfo* start) {
+  int index = add_function(compiling_module, name, length, return_type);
+  Function* function = &compiling_module->functions[index];
+
+  int skip = emit_jump(OP_JUMP);
+  function->entry = current_code()->count;
+  function->source_start = start->start - compiling_module->source;
+  function->first_dependency = parser.first_dependency;
+
+  if (reuse_function(function, start)) {
+    patch_jump(skip);
+    return;
+  }
+
+  parser.function = function;
+  parser.local_count = 0;
+  parser.scope_depth = 1;
+  parser.locals_size = 0;
+  parser.last_call = -1;
+  parser.return_start = -1;
+
+  if (!check(TOKEN_RIGHT_PAREN)) {
+    do {
+      advance();
+      ValueType type = parse_type();
+
+      if (type == VAL_VOID) error("Parameters can't be void.");
+      consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+
+      if (function->arity == MAX_PARAMS) {
+        error("Can't have more than 16 parameters.");
+      } else {
+        function->params[function->arity] = type;
+        function->arity++;
+      }
+
+      function->params_size += value_size(type);
+      add_local(parser.previous.start,
+                parser.previous.end - parser.previous.start, type);
+    } while (match_token(TOKEN_COMMA));
+  }
+
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+
+  if (function->params_size > function->frame_size) {
+    function->frame_size = function->params_size;
+  }
+
+  block();
+
+  if (!parser.returned) {
+    if (return_type != VAL_VOID) error("Expect the function to return.");
+    emit_return(VAL_VOID);
+  }
+
+  // A body that is a single short return is inlined at its call sites.
+  Code* code = current_code();
+  int return_length = code->count - parser.return_end;
+
+  if (parser.return_start == function->entry && return_length <= 3 &&
+      can_inline(code, parser.return_start, parser.return_end)) {
+    function->inline_start = parser.return_start;
+    function->inline_end = parser.return_end;
+  }
+
+  function->code_end = code->count;
+  function->has_effects = has_effects(code, function->entry, code->count);
+  function->reads_arrays = reads_arrays(code, function->entry, code->count);
+  function->source_length = parser.previous.end - start->start;
+  function->source_lines = parser.previous.line - start->line;
+  function->dependency_count =
+      compiling_module->dependency_count - function->first_dependency;
+  function->signature = function_signature(function);
+
+  parser.function = NULL;
+  parser.local_count = 0;
+  parser.scope_depth = 0;
+  parser.locals_size = 0;
+
+  patch_jump(skip);
+}
+
+// struct Name { int a; bool b; } declares a value type made of the fields
+// back to back, which lives inline in variables, arguments and arrays.
+// `struct Name columns { ... }` makes arrays of it keep each field in a
+// column of its own, so a scan over one field reads contiguous memory.
+void struct_declaration() {
+  consume(TOKEN_IDENTIFIER, "Expect struct name.");
+
+  const char* name = parser.previous.start;
+  int length = parser.previous.end - parser.previous.start;
+
+  if (find_struct(name, length) != -1 ||
+      find_symbol(compiling_module, name, length) != -1 ||
+      find_function(compiling_module, name, length) != -1) {
+    error("Already a struct, variable or function with this name.");
+  }
+
+  if (parser.struct_count == MAX_STRUCTS) {
+    error("Too many structs in one module.");
+    return;
+  }
+
+  StructInfo* info = &parser.structs[parser.struct_count];
+  info->name = name;
+  info->length = length;
+  info->field_count = 0;
+  info->columns = false;
+
+  if (match_token(TOKEN_IDENTIFIER)) {
+    if (!is_named(parser.previous.start,
+                  parser.previous.end - parser.previous.start, "columns")) {
+      error("Expect '{' before struct fields.");
+    }
+
+    info->columns = true;
+  }
+
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before struct fields.");
+
+  int size = 0;
+
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    advance();
+    ValueType type = parse_type();
+
+    if (type != VAL_INT && type != VAL_BOOL) {
+      error("Struct fields must be int or bool.");
+    }
+
+    consume(TOKEN_IDENTIFIER, "Expect field name.");
+
+    for (int i = 0; i < info->field_count; i++) {
+      StructField* field = &info->fields[i];
+
+      if (field->length == parser.previous.end - parser.previous.start &&
+          memcmp(field->name, parser.previous.start, field->length) == 0) {
+        error("Already a field with this name.");
+      }
+    }
+
+    if (info->field_count == MAX_FIELDS) {
+      error("Can't have more than 16 fields.");
+    } else {
+      StructField* field = &info->fields[info->field_count++];
+      field->name = parser.previous.start;
+      field->length = parser.previous.end - parser.previous.start;
+      field->type = type;
+      field->offset = size;
+    }
+
+    size += value_size(type);
+    consume(TOKEN_SEMICOLON, "Expect ';' after field.");
+  }
+
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after struct fields.");
+
+  if (info->field_count == 0) error("Expect a field.");
+  if (size > MAX_STRUCT_SIZE) error("Struct too large.");
+
+  info->type = (ValueType)((parser.struct_count + 1) << 8 | VAL_STRUCT |
+                           (size & MAX_STRUCT_SIZE));
+  parser.struct_count++;
+}
+
+void declaration() {
+  // Only functions keep what they depend on, the rest is compiled anew
+  // every time.
+  int functions = compiling_module->function_count;
+  parser.first_dependency = compiling_module->dependency_count;
+
+  if (match_token(TOKEN_STRUCT)) {
+    struct_declaration();
+  } else if (is_type_start() || check(TOKEN_VOID)) {
+    ParseInfo start = parser.current;
+    advance();
+    parser.stack_depth = 0;
+    parser.heap_operand_count = 0;
+
+    ValueType type = parse_type();
+    consume(TOKEN_IDENTIFIER, "Expect a name after the type.");
+
+    const char* name = parser.previous.start;
+    int length = parser.previous.end - parser.previous.start;
+
+    if (find_symbol(compiling_module, name, length) != -1 ||
+        find_function(compiling_module, name, length) != -1 ||
+        find_struct(name, length) != -1) {
+      error("Already a variable or function with this name in this module.");
+    }
+
+    if (match_token(TOKEN_LEFT_PAREN)) {
+      function_declaration(type, name, length, &start);
+    } else {
+      var_declaration(type, name, length);
+    }
+  } else if (match_token(TOKEN_IMPORT)) {
+    error("Imports must come before other declarations.");
+    import_declaration();
+  } else {
+    statement();
+  }
+
+  if (compiling_module->function_count == functions) {
+    compiling_module->dependency_count = parser.first_dependency;
+  }
+
+  if (parser.panic_mode) synchronize();
+}
+
+void begin_compile(Module* module, bool rules) {
+  init_scanner(module->source);
+
+  compiling_module = module;
+  parser.had_error = false;
+  parser.panic_mode = false;
+  parser.stack_depth = 0;
+  parser.heap_operand_count = 0;
+  parser.block_start = current_code()->count;
+  parser.function = NULL;
+  parser.parallel = NULL;
+  parser.local_count = 0;
+  parser.scope_depth = 0;
+  parser.locals_size = 0;
+  parser.last_call = -1;
+  parser.token_count = 0;
+  parser.rules = rules;
+  parser.struct_count = 0;
+  parser.previous_module = NULL;
+  parser.first_dependency = 0;
+
+  advance();
+
+  while (match_token(TOKEN_IMPORT)) import_declaration();
+}
+
+bool end_compile() {
+  // log_code(current_code());
+
+  count_metric(METRIC_MODULES_COMPILED, 1);
+  count_metric(METRIC_TOKENS_SCANNED, parser.token_count);
+  count_metric(METRIC_CODE_BYTES, current_code()->count);
+
+  return !parser.had_error;
+}
+
+bool compile(Module* module, Module* previous) {
+  begin_compile(module, false);
+  parser.previous_module = previous;
+
+  while (!match_token(TOKEN_EOF)) declaration();
+
+  begin_block();
+  emit(OP_END);
+
+  return end_compile();
+}
+
+// Each rule is compiled on its own first, then merge_rules rebuilds all of
+// them as one piece of code.
+bool compile_rules(Module* module) {
+  begin_compile(module, true);
+
+  RuleCode* rules = NULL;
+  int count = 0;
+  int capacity = 0;
+  ValueType type = VAL_VOID;
+
+  while (!match_token(TOKEN_EOF)) {
+    if (capacity < count + 1) {
+      int old_capacity = capacity;
+
+      capacity = GROW_CAPACITY(old_capacity);
+      rules = GROW_ARRAY(RuleCode, rules, old_capacity, capacity);
+    }
+
+    RuleCode* rule = &rules[count++];
+    rule->start = current_code()->count;
+
+    parser.stack_depth = 0;
+    parser.heap_operand_count = 0;
+
+    ValueType rule_type = expression();
+    rule->end = current_code()->count;
+
+    if (rule_type != VAL_INT && rule_type != VAL_BOOL) {
+      error("Rules must be int or bool.");
+    } else if (type == VAL_VOID) {
+      type = rule_type;
+    } else if (rule_type != type) {
+      error("Rules must all have the same type.");
+    }
+
+    consume(TOKEN_SEMICOLON, "Expect ';' after rule.");
+
+    if (parser.panic_mode) synchronize();
+  }
+
+  if (count == 0) error("Expect a rule.");
+
+  if (!parser.had_error && !merge_rules(module, rules, count, type)) {
+    parser.had_error = true;
+  }
+
+  FREE_ARRAY(RuleCode, rules, capacity);
+
+  return end_compile();
+}
@@ -1,6 +1,17 @@
 #ifndef nol_compiler_h
 #define nol_compiler_h
 
-void compile(const char* source);
+#include "module.h"
 
-#endif
\ No newline at end of file
+// previous is an earlier compile of the same file, or NULL. Functions whose
+// declaration and the names it uses are unchanged get their code copied from
+// it instead of compiled again.
+bool compile(Module* module, Module* previous);
+// Compiles a rule set: `;` separated int or bool expressions over the
+// record's fields and imported globals, all run at once by merge_rules.
+bool compile_rules(Module* module);
+
+// Loops are optimized unless turned off, to compare against.
+void set_loop_optimization(bool enabled);
+
+#endif
@@ -2,69 +2,121 @@
 
 #include <stdio.h>
 
-#include "bytecode.h"
+#include "value.h"
 
-void log_code() {
-  uint8_t* code = get_code();
-  int size = get_code_size();
+void log_code(Code* code) {
   int offset = 0;
 
-  while (offset < size) {
+  while (offset < code->count) {
     log_instruction(code, &offset);
   }
 }
 
-void log_simple(const char* name, int* offset) {
-  printf("%s\n", name);
+// One line for the switch, then one for each value and its target.
+void log_switch(Code* code, int offset, Instruction* instruction) {
+  const OpInfo* info = &op_info[instruction->op];
+  int end = offset + instruction->length;
 
-  *offset += 1;
-}
+  printf("%-16s %s cost %d\n", info->name, type_name(instruction->type),
+         instruction->cost);
+
+  // The default offset comes right after the header.
+  bool table = instruction->op == OP_TABLESWITCH;
+  int count = instruction->operand;
+  int entry_size = table ? 2 : sizeof(int32_t) + 2;
+  uint8_t* ip = code->code + end - entry_size * count - 2;
 
-void log_constant(const char* name, uint8_t* code, int* offset) {
-  int32_t value;
+  printf("%4s | %11s -> %d\n", "", "default", end + (int16_t)read_u16(&ip));
 
-  memcpy(&value, &code[*offset + 1], sizeof(int32_t));
+  for (int i = 0; i < count; i++) {
+    int32_t value = instruction->immediate + i;
 
-  printf("%-16s %d\n", name, value);
+    if (!table) {
+      memcpy(&value, ip, sizeof(value));
+      ip += sizeof(value);
+    }
 
-  *offset += 5;
+    printf("%4s | %11d -> %d\n", "", value, end + (int16_t)read_u16(&ip));
+  }
 }
 
-void log_instruction(uint8_t* code, int* offset) {
+void log_instruction(Code* code, int* offset) {
   printf("%04d ", *offset);
 
-  uint8_t instruction = code[*offset];
-
-  switch (instruction) {
-    case OP_CONSTANT:
-      return log_constant("OP_CONSTANT", code, offset);
-    case OP_ADD:
-      return log_simple("OP_ADD", offset);
-    case OP_SUBTRACT:
-      return log_simple("OP_SUBTRACT", offset);
-    case OP_MULTIPLY:
-      return log_simple("OP_MULTIPLY", offset);
-    case OP_DIVIDE:
-      return log_simple("OP_DIVIDE", offset);
-    case OP_NEGATE:
-      return log_simple("OP_NEGATE", offset);
-    case OP_TRUE:
-      return log_simple("OP_TRUE", offset);
-    case OP_FALSE:
-      return log_simple("OP_FALSE", offset);
-    case OP_NOT:
-      return log_simple("OP_NOT", offset);
-    case OP_EQUAL:
-      return log_simple("OP_EQUAL", offset);
-    case OP_GREATER:
-      return log_simple("OP_GREATER", offset);
-    case OP_LESS:
-      return log_simple("OP_LESS", offset);
-    case OP_RETURN:
-      return log_simple("OP_RETURN", offset);
-    default:
-      printf("Unknown opcode %d\n", instruction);
-      *offset += 1;
-      return;
+  Instruction instruction;
+  decode_instruction(code->code, *offset, &instruction);
+
+  if (instruction.op >= OP_COUNT) {
+    printf("Unknown opcode %d\n", instruction.op);
+    *offset += 1;
+    return;
   }
-}
\ No newline at end of file
+
+  const OpInfo* info = &op_info[instruction.op];
+
+  switch (info->operand) {
+    case OPERAND_NONE:
+      printf("%s\n", info->name);
+      break;
+    case OPERAND_TYPE:
+      printf("%-16s %s\n", info->name, type_name(instruction.type));
+      break;
+    case OPERAND_SMALL:
+      printf("%-16s %d\n", info->name, instruction.operand);
+      break;
+    case OPERAND_INDEX: {
+      printf("%-16s %4d", info->name, instruction.operand);
+
+      if (instruction.op == OP_CONSTANT) {
+        int32_t value;
+        memcpy(&value, &code->constants[instruction.operand], sizeof(value));
+        printf(" '%d'", value);
+      } else if (instruction.op == OP_STRING) {
+        ObjString* object;
+        memcpy(&object, &code->constants[instruction.operand], sizeof(object));
+        printf(" \"%.*s\"", object->length, object->chars);
+      }
+
+      printf("\n");
+      break;
+    }
+    case OPERAND_JUMP: {
+      int sign = instruction.op == OP_LOOP ? -1 : 1;
+
+      printf("%-16s %4d -> %d cost %d\n", info->name, *offset,
+             *offset + instruction.length + sign * instruction.operand,
+             instruction.cost);
+      break;
+    }
+    case OPERAND_JUMP_INDEX: {
+      int sign = instruction.op == OP_PARALLEL_END ? -1 : 1;
+
+      printf("%-16s %4d -> %d cost %d index %d\n", info->name, *offset,
+             *offset + instruction.length + sign * instruction.operand,
+             instruction.cost, instruction.immediate);
+      break;
+    }
+    case OPERAND_TYPE_INDEX:
+      printf("%-16s %4d %s\n", info->name, instruction.operand,
+             type_name(instruction.type));
+      break;
+    case OPERAND_TYPE_COST:
+      printf("%-16s %s cost %d\n", info->name, type_name(instruction.type),
+             instruction.cost);
+      break;
+    case OPERAND_INDEX_COST:
+      printf("%-16s %4d cost %d\n", info->name, instruction.operand,
+             instruction.cost);
+      break;
+    case OPERAND_INDEX_SMALL:
+      printf("%-16s %4d %+d\n", info->name, instruction.operand,
+             instruction.immediate);
+      break;
+    case OPERAND_TABLE:
+    case OPERAND_LOOKUP:
+      log_switch(code, *offset, &instruction);
+      break;
+  }
+
+  *offset += instruction.length;
+}
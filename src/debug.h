@@ -1,9 +1,10 @@
 #ifndef nol_debug_h
 #define nol_debug_h
 
+#include "bytecode.h"
 #include "common.h"
 
-void log_code();
-void log_instruction(uint8_t* code, int* offset);
+void log_code(Code* code);
+void log_instruction(Code* code, int* offset);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,39 @@
+#include "hash.h"
+
+uint64_t mix_word(uint64_t hash, uint64_t word) {
+  hash = (hash ^ word) * 0x9fb21c651e98df25ull;
+  return hash ^ (hash >> 29);
+}
+
+// Hashes 8 bytes per step instead of one, so hashing a script is cheap next
+// to compiling it. The result is only used as a cache key and table hash.
+uint64_t hash_bytes(const void* bytes, size_t length) {
+  const uint8_t* p = (const uint8_t*)bytes;
+  uint64_t hash = 0x9e3779b97f4a7c15ull ^ length;
+
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+
+    hash = mix_word(hash, word);
+    p += 8;
+    length -= 8;
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, p, length);
+  hash = mix_word(hash, tail);
+
+  // splitmix64 finalizer, spreads every input bit over the whole result.
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+
+  return hash;
+}
+
+uint64_t hash_combine(uint64_t seed, uint64_t value) {
+  return seed ^ (value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2));
+}
@@ -0,0 +1,9 @@
+#ifndef nol_hash_h
+#define nol_hash_h
+
+#include "common.h"
+
+uint64_t hash_bytes(const void* bytes, size_t length);
+uint64_t hash_combine(uint64_t seed, uint64_t value);
+
+#endif
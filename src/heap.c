@@ -0,0 +1,303 @@
+#include "heap.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "array.h"
+#include "memory.h"
+#include "str.h"
+
+struct Slab {
+  Slab* next;
+};
+
+// Cells start past the slab header, on the heap alignment.
+#define SLAB_HEADER HEAP_ALIGN
+
+static const int class_sizes[SIZE_CLASS_COUNT] = {16, 32, 64, 128, 256};
+
+GcStats total_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_heap(Heap* heap) {
+  for (int i = 0; i < SIZE_CLASS_COUNT; i++) {
+    heap->classes[i].free = NULL;
+    heap->classes[i].bump = NULL;
+    heap->classes[i].end = NULL;
+  }
+
+  heap->slabs = NULL;
+  heap->objects = NULL;
+  heap->sweep = NULL;
+
+  heap->gray = NULL;
+  heap->gray_count = 0;
+  heap->gray_capacity = 0;
+
+  heap->bytes = 0;
+  heap->live_bytes = 0;
+  heap->next_collection = MIN_COLLECTION_BYTES;
+  heap->pending = false;
+
+  memset(&heap->stats, 0, sizeof(heap->stats));
+}
+
+int size_class(size_t size) {
+  int index = 0;
+  while (class_sizes[index] < (int)size) index++;
+  return index;
+}
+
+void* system_alloc(size_t size) {
+  size = (size + HEAP_ALIGN - 1) / HEAP_ALIGN * HEAP_ALIGN;
+
+  void* pointer = aligned_alloc(HEAP_ALIGN, size);
+  if (pointer == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+  }
+
+  return pointer;
+}
+
+// Small sizes reuse a freed cell of their class, or bump the next one out
+// of the class's newest slab.
+void* heap_alloc(Heap* heap, size_t size) {
+  if (size > MAX_SMALL_SIZE) return system_alloc(size);
+
+  SizeClass* class = &heap->classes[size_class(size)];
+  int cell = class_sizes[class - heap->classes];
+
+  if (class->free != NULL) {
+    void* pointer = class->free;
+    memcpy(&class->free, pointer, sizeof(void*));
+    return pointer;
+  }
+
+  if (class->bump == NULL || class->bump + cell > class->end) {
+    Slab* slab = (Slab*)system_alloc(SLAB_SIZE);
+
+    slab->next = heap->slabs;
+    heap->slabs = slab;
+
+    class->bump = (uint8_t*)slab + SLAB_HEADER;
+    class->end = (uint8_t*)slab + SLAB_SIZE;
+  }
+
+  void* pointer = class->bump;
+  class->bump += cell;
+  return pointer;
+}
+
+void heap_free(Heap* heap, void* pointer, size_t size) {
+  if (size > MAX_SMALL_SIZE) {
+    free(pointer);
+    return;
+  }
+
+  SizeClass* class = &heap->classes[size_class(size)];
+
+  memcpy(pointer, &class->free, sizeof(void*));
+  class->free = pointer;
+}
+
+size_t object_size(Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+      return sizeof(ObjString) +
+             (string->chars != NULL ? string->length + 1 : 0);
+    }
+    case OBJ_ARRAY:
+      return sizeof(ObjArray) + ((ObjArray*)object)->size;
+  }
+
+  return 0;
+}
+
+void free_object(Heap* heap, Obj* object) {
+  switch (object->type) {
+    case OBJ_STRING: {
+      ObjString* string = (ObjString*)object;
+
+      if (string->chars != NULL) {
+        heap_free(heap, string->chars, string->length + 1);
+      }
+      heap_free(heap, string, sizeof(ObjString));
+      break;
+    }
+    case OBJ_ARRAY: {
+      ObjArray* array = (ObjArray*)object;
+
+      heap_free(heap, array->data, array->size);
+      heap_free(heap, array, sizeof(ObjArray));
+      break;
+    }
+  }
+}
+
+// Frees up to limit unmarked objects past the sweep cursor and clears the
+// marks of the rest. A negative limit sweeps to the end.
+void sweep(Heap* heap, int limit) {
+  Obj** link = heap->sweep;
+
+  while (link != NULL && *link != NULL && limit-- != 0) {
+    Obj* object = *link;
+
+    if (object->marked) {
+      object->marked = false;
+      link = &object->next;
+      continue;
+    }
+
+    *link = object->next;
+
+    size_t size = object_size(object);
+    heap->bytes -= size;
+    heap->stats.freed_bytes += size;
+
+    free_object(heap, object);
+  }
+
+  heap->sweep = link != NULL && *link != NULL ? link : NULL;
+}
+
+Obj* allocate_object(Heap* heap, ObjType type, size_t size) {
+  if (heap->sweep != NULL) sweep(heap, SWEEP_STEP);
+
+  Obj* object = (Obj*)heap_alloc(heap, size);
+
+  object->type = type;
+  object->marked = false;
+  object->pinned = false;
+
+  // Objects go in front of the list, behind the sweep. A sweep that has not
+  // moved off the head yet moves past the new object, which is unmarked
+  // like everything it already went by.
+  object->next = heap->objects;
+  heap->objects = object;
+  if (heap->sweep == &heap->objects) heap->sweep = &object->next;
+
+  heap->stats.allocated_objects++;
+  account_bytes(heap, size);
+
+  return object;
+}
+
+// What is counted has to add up to object_size, which the sweep takes off.
+void account_bytes(Heap* heap, size_t size) {
+  heap->bytes += size;
+  heap->stats.allocated_bytes += size;
+
+  if (heap->bytes > heap->stats.peak_bytes) {
+    heap->stats.peak_bytes = heap->bytes;
+  }
+
+  if (heap->bytes > heap->next_collection) heap->pending = true;
+}
+
+void mark_object(Heap* heap, Obj* object) {
+  if (object == NULL || object->pinned || object->marked) return;
+
+  object->marked = true;
+  heap->live_bytes += object_size(object);
+
+  // Only ropes refer to other objects.
+  if (object->type != OBJ_STRING) return;
+
+  if (heap->gray_capacity < heap->gray_count + 1) {
+    int old_capacity = heap->gray_capacity;
+
+    heap->gray_capacity = GROW_CAPACITY(old_capacity);
+    heap->gray =
+        GROW_ARRAY(Obj*, heap->gray, old_capacity, heap->gray_capacity);
+  }
+
+  heap->gray[heap->gray_count++] = object;
+}
+
+double pause_clock() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void finish_sweep(Heap* heap) { sweep(heap, -1); }
+
+void collect_garbage(Heap* heap, MarkRootsFn mark_roots, void* arg) {
+  double start = pause_clock();
+
+  // A sweep still going on would free objects marked by this collection.
+  sweep(heap, -1);
+
+  heap->live_bytes = 0;
+  mark_roots(heap, arg);
+
+  while (heap->gray_count > 0) {
+    ObjString* string = (ObjString*)heap->gray[--heap->gray_count];
+
+    mark_object(heap, (Obj*)string->left);
+    mark_object(heap, (Obj*)string->right);
+  }
+
+  heap->sweep = &heap->objects;
+  heap->pending = false;
+
+  heap->next_collection = heap->live_bytes * 2;
+  if (heap->next_collection < MIN_COLLECTION_BYTES) {
+    heap->next_collection = MIN_COLLECTION_BYTES;
+  }
+
+  double pause = pause_clock() - start;
+
+  heap->stats.collections++;
+  heap->stats.total_pause += pause;
+  if (pause > heap->stats.max_pause) heap->stats.max_pause = pause;
+}
+
+void free_heap(Heap* heap) {
+  // Slab cells go with their slabs, only large blocks are freed one by one.
+  for (Obj* object = heap->objects; object != NULL;) {
+    Obj* next = object->next;
+    free_object(heap, object);
+    object = next;
+  }
+
+  while (heap->slabs != NULL) {
+    Slab* next = heap->slabs->next;
+    free(heap->slabs);
+    heap->slabs = next;
+  }
+
+  FREE_ARRAY(Obj*, heap->gray, heap->gray_capacity);
+  init_heap(heap);
+}
+
+void add_gc_stats(GcStats* stats) {
+  pthread_mutex_lock(&stats_lock);
+
+  total_stats.collections += stats->collections;
+  total_stats.allocated_bytes += stats->allocated_bytes;
+  total_stats.allocated_objects += stats->allocated_objects;
+  total_stats.freed_bytes += stats->freed_bytes;
+  total_stats.total_pause += stats->total_pause;
+
+  if (stats->peak_bytes > total_stats.peak_bytes) {
+    total_stats.peak_bytes = stats->peak_bytes;
+  }
+  if (stats->max_pause > total_stats.max_pause) {
+    total_stats.max_pause = stats->max_pause;
+  }
+
+  pthread_mutex_unlock(&stats_lock);
+}
+
+GcStats gc_stats() {
+  pthread_mutex_lock(&stats_lock);
+  GcStats stats = total_stats;
+  pthread_mutex_unlock(&stats_lock);
+
+  return stats;
+}
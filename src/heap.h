@@ -0,0 +1,103 @@
+#ifndef nol_heap_h
+#define nol_heap_h
+
+#include "common.h"
+
+// Small allocations come from slabs carved into cells of one size class,
+// 16 to 256 bytes. Larger ones go straight to the system allocator.
+#define SIZE_CLASS_COUNT 5
+#define MAX_SMALL_SIZE 256
+#define SLAB_SIZE (64 * 1024)
+
+// Every cell and large block starts on this boundary.
+#define HEAP_ALIGN 32
+
+// A heap never collects before it holds this many bytes.
+#define MIN_COLLECTION_BYTES (1024 * 1024)
+
+// Objects the lazy sweep looks at per allocation.
+#define SWEEP_STEP 64
+
+typedef enum { OBJ_STRING, OBJ_ARRAY } ObjType;
+
+// Header of every heap object.
+typedef struct Obj {
+  uint8_t type;
+  bool marked;
+  // Shared between heaps and never collected, like interned strings.
+  bool pinned;
+
+  struct Obj* next;
+} Obj;
+
+typedef struct Slab Slab;
+
+typedef struct {
+  void* free;
+  uint8_t* bump;
+  uint8_t* end;
+} SizeClass;
+
+typedef struct {
+  uint64_t collections;
+  uint64_t allocated_bytes;
+  uint64_t allocated_objects;
+  uint64_t freed_bytes;
+  size_t peak_bytes;
+
+  double total_pause;
+  double max_pause;
+} GcStats;
+
+// The objects of one fiber. Collection is a precise mark from roots the VM
+// reports, followed by a sweep spread over the next allocations, so a pause
+// only costs as much as the live object graph. Objects never move.
+typedef struct {
+  SizeClass classes[SIZE_CLASS_COUNT];
+  Slab* slabs;
+
+  // Every object, newest first.
+  Obj* objects;
+  // Link the lazy sweep continues from, NULL when it is done.
+  Obj** sweep;
+
+  // Marked objects whose references still have to be marked.
+  Obj** gray;
+  int gray_count;
+  int gray_capacity;
+
+  size_t bytes;
+  size_t live_bytes;
+  size_t next_collection;
+  // Set once the heap has grown enough, the VM collects at its next
+  // safepoint.
+  bool pending;
+
+  GcStats stats;
+} Heap;
+
+void init_heap(Heap* heap);
+void free_heap(Heap* heap);
+
+void* heap_alloc(Heap* heap, size_t size);
+void heap_free(Heap* heap, void* pointer, size_t size);
+
+// Allocates an object of size bytes with its header filled in. Payloads
+// attached to it later are counted with account_bytes.
+Obj* allocate_object(Heap* heap, ObjType type, size_t size);
+void account_bytes(Heap* heap, size_t size);
+
+typedef void (*MarkRootsFn)(Heap* heap, void* arg);
+
+void mark_object(Heap* heap, Obj* object);
+// Marks from the roots mark_roots reports, then starts sweeping.
+void collect_garbage(Heap* heap, MarkRootsFn mark_roots, void* arg);
+// Sweeps what the last collection left to sweep, which allocations
+// otherwise do a little at a time.
+void finish_sweep(Heap* heap);
+
+// Totals over every heap freed so far.
+void add_gc_stats(GcStats* stats);
+GcStats gc_stats();
+
+#endif
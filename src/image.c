@@ -0,0 +1,435 @@
+#include "image.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "array.h"
+#include "memory.h"
+#include "str.h"
+#include "value.h"
+
+#define IMAGE_MAGIC "nolimage"
+#define IMAGE_VERSION 9
+
+// Start of an image file. Until the image is loaded every pointer in it,
+// those in program included, holds an offset from the start of the file.
+// relocations is where the table of the offsets of those pointers starts.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // Images of a build with other opcodes are refused.
+  uint32_t op_count;
+  uint64_t size;
+  uint64_t relocations;
+  uint64_t relocation_count;
+
+  Program program;
+} ImageHeader;
+
+typedef struct {
+  uint8_t* bytes;
+  size_t count;
+  size_t capacity;
+
+  uint64_t* relocations;
+  size_t relocation_count;
+  size_t relocation_capacity;
+
+  // Heap objects written so far, so shared ones are written once.
+  void** objects;
+  uint64_t* object_offsets;
+  int object_count;
+  int object_capacity;
+} ImageWriter;
+
+// Appends size bytes at the next multiple of align and returns their
+// offset. Without src the bytes are zero.
+uint64_t put(ImageWriter* writer, const void* src, size_t size, size_t align) {
+  size_t at = (writer->count + align - 1) & ~(align - 1);
+
+  while (writer->capacity < at + size) {
+    size_t old_capacity = writer->capacity;
+
+    writer->capacity = GROW_CAPACITY(old_capacity);
+    writer->bytes =
+        GROW_ARRAY(uint8_t, writer->bytes, old_capacity, writer->capacity);
+  }
+
+  memset(&writer->bytes[writer->count], 0, at + size - writer->count);
+  if (src != NULL && size > 0) memcpy(&writer->bytes[at], src, size);
+
+  writer->count = at + size;
+  return at;
+}
+
+// Stores the offset target as the pointer at offset at.
+void put_pointer(ImageWriter* writer, uint64_t at, uint64_t target) {
+  memcpy(&writer->bytes[at], &target, sizeof(target));
+
+  if (writer->relocation_capacity < writer->relocation_count + 1) {
+    size_t old_capacity = writer->relocation_capacity;
+
+    writer->relocation_capacity = GROW_CAPACITY(old_capacity);
+    writer->relocations = GROW_ARRAY(uint64_t, writer->relocations,
+                                     old_capacity, writer->relocation_capacity);
+  }
+
+  writer->relocations[writer->relocation_count++] = at;
+}
+
+uint64_t find_written(ImageWriter* writer, void* object) {
+  for (int i = 0; i < writer->object_count; i++) {
+    if (writer->objects[i] == object) return writer->object_offsets[i];
+  }
+
+  return 0;
+}
+
+void add_written(ImageWriter* writer, void* object, uint64_t at) {
+  if (writer->object_capacity < writer->object_count + 1) {
+    int old_capacity = writer->object_capacity;
+
+    writer->object_capacity = GROW_CAPACITY(old_capacity);
+    writer->objects = GROW_ARRAY(void*, writer->objects, old_capacity,
+                                 writer->object_capacity);
+    writer->object_offsets =
+        GROW_ARRAY(uint64_t, writer->object_offsets, old_capacity,
+                   writer->object_capacity);
+  }
+
+  writer->objects[writer->object_count] = object;
+  writer->object_offsets[writer->object_count] = at;
+  writer->object_count++;
+}
+
+// Objects in the image are pinned, the collector never frees them.
+uint64_t write_string(ImageWriter* writer, ObjString* object) {
+  uint64_t at = find_written(writer, object);
+  if (at != 0) return at;
+
+  ObjString copy = *object;
+  copy.obj.marked = false;
+  copy.obj.pinned = true;
+  copy.obj.next = NULL;
+  copy.chars = NULL;
+  copy.left = NULL;
+  copy.right = NULL;
+
+  at = put(writer, &copy, sizeof(copy), HEAP_ALIGN);
+  put_pointer(writer, at + offsetof(ObjString, chars),
+              put(writer, object->chars, object->length, 1));
+
+  add_written(writer, object, at);
+  return at;
+}
+
+uint64_t write_array(ImageWriter* writer, ObjArray* array, int element_size) {
+  uint64_t at = find_written(writer, array);
+  if (at != 0) return at;
+
+  ObjArray copy = *array;
+  copy.obj.marked = false;
+  copy.obj.pinned = true;
+  copy.obj.next = NULL;
+  copy.data = NULL;
+
+  at = put(writer, &copy, sizeof(copy), HEAP_ALIGN);
+
+  // Only the elements are copied, the rest of the block stays zero.
+  uint64_t data = put(writer, NULL, array->size, HEAP_ALIGN);
+  memcpy(&writer->bytes[data], array->data,
+         (size_t)array->length * element_size);
+  put_pointer(writer, at + offsetof(ObjArray, data), data);
+
+  add_written(writer, array, at);
+  return at;
+}
+
+// Writes the parts of a module the VM runs and returns the offset of its
+// Module. code_at gets the offset of its code.
+uint64_t write_module(ImageWriter* writer, Module* module, uint64_t* code_at) {
+  Code* code = &module->code;
+
+  *code_at = put(writer, code->code, code->count, 1);
+  uint64_t constants =
+      put(writer, code->constants, sizeof(Constant) * code->constant_count,
+          sizeof(Constant));
+
+  // String literals are pointers to interned objects, which are written
+  // along. Several literals may share a pool slot.
+  bool* patched = ALLOCATE(bool, code->constant_count);
+  memset(patched, 0, code->constant_count);
+
+  for (int offset = 0; offset < code->count;) {
+    Instruction instruction;
+    decode_instruction(code->code, offset, &instruction);
+    offset += instruction.length;
+
+    if (instruction.op != OP_STRING || patched[instruction.operand]) continue;
+    patched[instruction.operand] = true;
+
+    ObjString* object;
+    memcpy(&object, &code->constants[instruction.operand], sizeof(object));
+
+    put_pointer(writer, constants + sizeof(Constant) * instruction.operand,
+                write_string(writer, object));
+  }
+
+  FREE_ARRAY(bool, patched, code->constant_count);
+
+  uint64_t maps = put(writer, module->maps,
+                      sizeof(StackMap) * module->map_count, sizeof(int));
+  uint64_t map_slots =
+      put(writer, module->map_slots, sizeof(HeapSlot) * module->map_slot_count,
+          sizeof(int));
+
+  Module copy;
+  memset(&copy, 0, sizeof(copy));
+
+  copy.code.count = code->count;
+  copy.code.capacity = code->count;
+  copy.code.constant_count = code->constant_count;
+  copy.code.constant_capacity = code->constant_count;
+  copy.code.max_stack = code->max_stack;
+  copy.ref_count = module->ref_count;
+  copy.call_count = module->call_count;
+  copy.map_count = module->map_count;
+  copy.map_capacity = module->map_count;
+  copy.map_slot_count = module->map_slot_count;
+  copy.map_slot_capacity = module->map_slot_count;
+  copy.field_count = module->field_count;
+  atomic_init(&copy.users, 1);
+
+  uint64_t at = put(writer, &copy, sizeof(copy), sizeof(void*));
+
+  put_pointer(writer, at + offsetof(Module, code.code), *code_at);
+  put_pointer(writer, at + offsetof(Module, code.constants), constants);
+  put_pointer(writer, at + offsetof(Module, maps), maps);
+  put_pointer(writer, at + offsetof(Module, map_slots), map_slots);
+
+  return at;
+}
+
+// Where a pointer into the code of one of the program's modules ends up.
+uint64_t code_offset(Program* program, uint64_t* code_at, int module,
+                     uint8_t* pointer) {
+  return code_at[module] + (pointer - program->modules[module]->code.code);
+}
+
+#define PROGRAM_FIELD(field) \
+  (offsetof(ImageHeader, program) + offsetof(Program, field))
+
+bool write_image(Program* program, Fiber* fiber, const char* path) {
+  ImageWriter writer = {0};
+  put(&writer, NULL, sizeof(ImageHeader), sizeof(void*));
+
+  int count = program->count;
+  uint64_t* code_at = ALLOCATE(uint64_t, count);
+  uint64_t* module_at = ALLOCATE(uint64_t, count);
+
+  for (int i = 0; i < count; i++) {
+    module_at[i] = write_module(&writer, program->modules[i], &code_at[i]);
+  }
+
+  uint64_t modules = put(&writer, NULL, sizeof(Module*) * count, 8);
+  uint64_t links = put(&writer, NULL, sizeof(int*) * count, 8);
+  uint64_t callees = put(&writer, NULL, sizeof(Callee*) * count, 8);
+
+  for (int i = 0; i < count; i++) {
+    Module* module = program->modules[i];
+
+    put_pointer(&writer, modules + 8 * i, module_at[i]);
+    put_pointer(&writer, links + 8 * i,
+                put(&writer, program->links[i],
+                    sizeof(int) * module->ref_count, sizeof(int)));
+
+    uint64_t at = put(&writer, program->callees[i],
+                      sizeof(Callee) * module->call_count, sizeof(void*));
+    put_pointer(&writer, callees + 8 * i, at);
+
+    for (int j = 0; j < module->call_count; j++) {
+      Callee* callee = &program->callees[i][j];
+
+      put_pointer(&writer, at + sizeof(Callee) * j + offsetof(Callee, entry),
+                  code_offset(program, code_at, callee->module,
+                              callee->entry));
+    }
+  }
+
+  uint64_t roots = put(&writer, program->roots,
+                       sizeof(HeapSlot) * program->root_count, sizeof(int));
+
+  // The globals as the top level code left them, with the heap values they
+  // reference.
+  uint64_t globals =
+      put(&writer, fiber->globals, program->globals_size, HEAP_ALIGN);
+
+  for (int i = 0; i < program->root_count; i++) {
+    HeapSlot* root = &program->roots[i];
+    uint8_t* slot = fiber->globals + root->offset;
+
+    if (root->type == VAL_STRING) {
+      String string;
+      memcpy(&string, slot, sizeof(string));
+
+      ObjString* object = string_object(&string);
+      if (object == NULL) continue;
+
+      string_chars(&fiber->heap, &string);
+      put_pointer(&writer, globals + root->offset,
+                  write_string(&writer, object));
+    } else {
+      ObjArray* array;
+      memcpy(&array, slot, sizeof(array));
+      if (array == NULL) continue;
+
+      put_pointer(&writer, globals + root->offset,
+                  write_array(&writer, array,
+                              value_size(element_type(root->type))));
+    }
+  }
+
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+
+  memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+  header.version = IMAGE_VERSION;
+  header.op_count = OP_COUNT;
+  header.program = *program;
+  header.program.image = NULL;
+  header.program.image_size = 0;
+  // Only needed while a program is still being extended.
+  header.program.bases = NULL;
+  header.program.capacity = program->count;
+  header.program.root_capacity = program->root_count;
+  memcpy(writer.bytes, &header, sizeof(header));
+
+  put_pointer(&writer, PROGRAM_FIELD(modules), modules);
+  put_pointer(&writer, PROGRAM_FIELD(links), links);
+  put_pointer(&writer, PROGRAM_FIELD(callees), callees);
+  put_pointer(&writer, PROGRAM_FIELD(roots), roots);
+  put_pointer(&writer, PROGRAM_FIELD(initial_globals), globals);
+
+  if (program->has_main) {
+    put_pointer(&writer, PROGRAM_FIELD(main.entry),
+                code_offset(program, code_at, program->main.module,
+                            program->main.entry));
+  }
+
+  header.relocation_count = writer.relocation_count;
+  header.relocations = put(&writer, writer.relocations,
+                           sizeof(uint64_t) * writer.relocation_count, 8);
+  header.size = writer.count;
+
+  memcpy(&writer.bytes[offsetof(ImageHeader, size)], &header.size,
+         sizeof(uint64_t) * 3);
+
+  FILE* file = fopen(path, "wb");
+  bool written = file != NULL &&
+                 fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+  if (file != NULL && fclose(file) != 0) written = false;
+
+  if (!written) fprintf(error_stream(), "Could not write \"%s\".\n", path);
+
+  FREE_ARRAY(uint64_t, code_at, count);
+  FREE_ARRAY(uint64_t, module_at, count);
+  FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+  FREE_ARRAY(uint64_t, writer.relocations, writer.relocation_capacity);
+  FREE_ARRAY(void*, writer.objects, writer.object_capacity);
+  FREE_ARRAY(uint64_t, writer.object_offsets, writer.object_capacity);
+
+  return written;
+}
+
+#undef PROGRAM_FIELD
+
+bool is_image(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+
+  char magic[8];
+  bool found = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+               memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+
+  fclose(file);
+  return found;
+}
+
+// Checks what the header says about the image against its size, so a
+// truncated or foreign image is refused before any pointer is touched.
+bool valid_image(ImageHeader* header, size_t size) {
+  if (header->version != IMAGE_VERSION || header->op_count != OP_COUNT ||
+      header->size != size || header->relocations > size ||
+      header->relocation_count > (size - header->relocations) / 8) {
+    return false;
+  }
+
+  uint8_t* image = (uint8_t*)header;
+
+  for (uint64_t i = 0; i < header->relocation_count; i++) {
+    uint64_t at;
+    memcpy(&at, &image[header->relocations + 8 * i], sizeof(at));
+    if (at > size - 8) return false;
+
+    uint64_t target;
+    memcpy(&target, &image[at], sizeof(target));
+    if (target >= size) return false;
+  }
+
+  return true;
+}
+
+bool load_image(Program* program, const char* path) {
+  int file = open(path, O_RDONLY);
+  struct stat info;
+
+  if (file < 0 || fstat(file, &info) != 0) {
+    if (file >= 0) close(file);
+    report_read_error("Could not open file \"%s\".\n", path);
+    return false;
+  }
+
+  size_t size = info.st_size;
+  uint8_t* image = size >= sizeof(ImageHeader)
+                       ? mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE, file, 0)
+                       : MAP_FAILED;
+  close(file);
+
+  if (image == MAP_FAILED || !valid_image((ImageHeader*)image, size)) {
+    if (image != MAP_FAILED) munmap(image, size);
+    fprintf(error_stream(), "\"%s\" is not an image of this build.\n", path);
+    return false;
+  }
+
+  // Pages are private, only the ones holding pointers get copied.
+  ImageHeader* header = (ImageHeader*)image;
+
+  for (uint64_t i = 0; i < header->relocation_count; i++) {
+    uint64_t at;
+    memcpy(&at, &image[header->relocations + 8 * i], sizeof(at));
+
+    uint64_t target;
+    memcpy(&target, &image[at], sizeof(target));
+
+    uint8_t* pointer = image + target;
+    memcpy(&image[at], &pointer, sizeof(pointer));
+  }
+
+  *program = header->program;
+  program->image = image;
+  program->image_size = size;
+
+  return true;
+}
+
+void unmap_image(Program* program) {
+  munmap(program->image, program->image_size);
+
+  program->image = NULL;
+  program->modules = NULL;
+  program->count = 0;
+}
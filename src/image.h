@@ -0,0 +1,20 @@
+#ifndef nol_image_h
+#define nol_image_h
+
+#include "common.h"
+#include "module.h"
+#include "vm.h"
+
+// Writes the program together with the globals of a fiber that ran its top
+// level code, so later runs can start right at main. The image holds the
+// code, constants, linked tables, the string literals the code uses and the
+// heap values the globals reference.
+bool write_image(Program* program, Fiber* fiber, const char* path);
+
+bool is_image(const char* path);
+// Maps an image and relocates its pointers. The program lives in the mapping
+// until unmap_image.
+bool load_image(Program* program, const char* path);
+void unmap_image(Program* program);
+
+#endif
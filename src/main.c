@@ -1,15 +1,72 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
-#include "bytecode.h"
+#include "batch.h"
 #include "common.h"
 #include "compiler.h"
+#include "heap.h"
+#include "metrics.h"
+#include "image.h"
+#include "memory.h"
+#include "module.h"
+#include "native.h"
+#include "pool.h"
+#include "profile.h"
+#include "str.h"
+#include "stream.h"
 #include "vm.h"
 
+// string env(string name): the environment variable, "" if it is not set.
+// A name with a NUL byte in it names no variable.
+void env_native(Fiber* fiber, uint8_t* args) {
+  String name;
+  memcpy(&name, args, sizeof(name));
+
+  int length = string_length(&name);
+  char* key = ALLOCATE(char, length + 1);
+
+  memcpy(key, string_chars(&fiber->heap, &name), length);
+  key[length] = '\0';
+
+  const char* value = memchr(key, '\0', length) == NULL ? getenv(key) : NULL;
+  FREE_ARRAY(char, key, length + 1);
+
+  String result = make_string(&fiber->heap, value != NULL ? value : "",
+                              value != NULL ? (int)strlen(value) : 0);
+  memcpy(args, &result, sizeof(result));
+}
+
+// int clock_ms(): milliseconds since an arbitrary point, for timing.
+void clock_native(Fiber* fiber, uint8_t* args) {
+  (void)fiber;
+
+  int32_t ms = (int32_t)(int64_t)(now_seconds() * 1000);
+  memcpy(args, &ms, sizeof(ms));
+}
+
+void define_host_natives() {
+  ValueType string_param[] = {VAL_STRING};
+
+  define_native("env", VAL_STRING, string_param, 1, env_native);
+  define_native("clock_ms", VAL_INT, NULL, 0, clock_native);
+}
+
+// One program for the whole session, each line is compiled as one more
+// module of it. Globals, functions and the heap live on from line to line,
+// and a line that fails to compile leaves the session as it was.
 void repl() {
   char line[1024];
 
+  Program program;
+  Scope scope;
+  init_program(&program);
+  init_scope(&scope);
+
+  Fiber* fiber = new_fiber(&program);
+
   while (true) {
     printf("> ");
 
@@ -18,62 +75,321 @@ void repl() {
       break;
     }
 
-    compile(line);
-    run_code(get_code());
+    int first = extend_program(&program, &scope, line);
+    if (first == -1) continue;
+
+    fiber = grow_fiber(fiber);
+    fiber->out = stdout;
+    run_modules(fiber, first);
+  }
+
+  free_fiber(fiber);
+  free_program(&program);
+  free_scope(&scope);
+}
+
+int exit_status(FiberState state) {
+  switch (state) {
+    case FIBER_DONE:
+      return 0;
+    case FIBER_OUT_OF_FUEL:
+      return 75;
+    case FIBER_DEADLINE:
+      return 124;
+    default:
+      return 70;
   }
 }
 
-char* read_file(const char* path) {
-  FILE* file = fopen(path, "rb");
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);
+// A file that can't be read is an I/O error, one that doesn't compile is
+// bad input.
+int load_failure() { return read_failed() ? 74 : 65; }
+
+// With a profile path the counters of the loops are written to it on exit,
+// however the script ended.
+int run_file(const char* path, const char* profile) {
+  Program program;
+
+  if (!load_program(&program, path)) return load_failure();
+
+  FiberState state = run_program(&program, stdout);
+  bool written = profile == NULL || write_profile(&program, profile);
+  free_program(&program);
+
+  if (!written) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", profile);
+    return 74;
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t size = ftell(file);
-  rewind(file);
+  return exit_status(state);
+}
+
+// Runs the script again every time the file changes, until interrupted.
+// Each reload only compiles the functions that changed since the last one.
+int watch(const char* path) {
+  struct timespec last = {0, 0};
+  struct timespec poll = {0, 100 * 1000 * 1000};
+
+  while (true) {
+    struct stat info;
+
+    if (stat(path, &info) == 0 && (info.st_mtim.tv_sec != last.tv_sec ||
+                                   info.st_mtim.tv_nsec != last.tv_nsec)) {
+      last = info.st_mtim;
 
-  char* buffer = (char*)malloc(size + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
+      Program program;
+      if (load_program(&program, path)) run_program(&program, stdout);
+      free_program(&program);
+
+      fflush(stdout);
+    }
+
+    nanosleep(&poll, NULL);
   }
+}
 
-  size_t bytes_read = fread(buffer, sizeof(char), size, file);
-  if (bytes_read < size) {
-    fprintf(stderr, "Could not read file \"%s\".\n", path);
-    exit(74);
+// Runs the top level code of the script and writes the initialized program
+// to an image, whose runs start right at main.
+int snapshot(const char* path, const char* image) {
+  Program program;
+
+  if (!load_program(&program, path)) return load_failure();
+
+  Fiber* fiber = new_fiber(&program);
+  fiber->initialize_only = true;
+  apply_run_limits(fiber);
+
+  while (resume_fiber(fiber, FIBER_SLICE) == FIBER_READY) {
   }
 
-  buffer[bytes_read] = '\0';
+  FiberState state = fiber->state;
+  bool written = state == FIBER_DONE && write_image(&program, fiber, image);
+
+  free_fiber(fiber);
+  free_program(&program);
+
+  report_stop(state);
+  return state == FIBER_DONE && !written ? 74 : exit_status(state);
+}
+
+// Runs the source of -e or the rule set of --rules, once or, when
+// streaming, for every input record.
+int run_expression(const char* source, const char* rules, bool stream,
+                   char** inputs, int input_count, char delimiter) {
+  Program program;
+
+  bool loaded = rules != NULL ? load_rules(&program, rules)
+                              : load_program_source(&program, source);
+  if (!loaded) return load_failure();
 
-  fclose(file);
-  return buffer;
+  FiberState state =
+      stream ? run_stream(&program, inputs, input_count, delimiter)
+             : run_program(&program, stdout);
+  free_program(&program);
+
+  return exit_status(state);
+}
+
+void usage() {
+  fprintf(stderr, "Usage: nol [options] [path]\n");
+  fprintf(stderr, "       nol [options] [--jobs N] path...\n");
+  fprintf(stderr, "       nol [options] -e source [--stream] [input...]\n");
+  fprintf(stderr, "       nol [options] --rules file [--stream] [input...]\n");
+  fprintf(stderr, "       nol [options] --snapshot image path\n");
+  fprintf(stderr, "       nol [options] --watch path\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --stream        run -e for every line of the input,\n");
+  fprintf(stderr, "                  reading fields as $1, $2, ...\n");
+  fprintf(stderr, "  --delimiter C   split fields at C, not at blanks\n");
+  fprintf(stderr, "  --rules F       run the `;` separated rules in F at\n");
+  fprintf(stderr, "                  once, printing an array of results\n");
+  fprintf(stderr, "  --snapshot F    initialize the script and save it to\n");
+  fprintf(stderr, "                  the image F, which runs main()\n");
+  fprintf(stderr, "  --watch         run the script again whenever it\n");
+  fprintf(stderr, "                  changes, recompiling what changed\n");
+  fprintf(stderr, "  --fuel N        stop scripts after N instructions\n");
+  fprintf(stderr, "  --timeout MS    stop scripts after MS milliseconds\n");
+  fprintf(stderr, "  --threads N     run parallel for loops on N threads,\n");
+  fprintf(stderr, "                  one per core by default\n");
+  fprintf(stderr, "  --cache-size N  keep up to N compiled modules\n");
+  fprintf(stderr, "  --cache-stats   print compile cache counters on exit\n");
+  fprintf(stderr, "  --gc-stats      print collector counters on exit\n");
+  fprintf(stderr, "  --metrics=json  print all runtime metrics on exit\n");
+  fprintf(stderr, "  --no-loop-opt   compile loops as they are written\n");
+  fprintf(stderr, "  --record-profile F\n");
+  fprintf(stderr, "                  run the script with counters in its\n");
+  fprintf(stderr, "                  innermost loops and save them to F\n");
+  fprintf(stderr, "  --use-profile F recompile innermost loops for what\n");
+  fprintf(stderr, "                  the profile F saw them do\n");
+  exit(64);
 }
 
-void run_file(const char* path) {
-  char* source = read_file(path);
+// Returns the numeric value of the option at argv[*index] and moves past it.
+long option_value(int argc, char** argv, int* index) {
+  if (*index + 1 >= argc) usage();
 
-  compile(source);
-  run_code(get_code());
+  char* end;
+  long value = strtol(argv[*index + 1], &end, 10);
+  if (*end != '\0' || value < 1) usage();
 
-  free(source);
+  *index += 2;
+  return value;
 }
 
 int main(int argc, char** argv) {
-  init_code();
   init_vm();
+  define_host_natives();
+
+  int jobs = 0;
+  int64_t fuel = FUEL_UNLIMITED;
+  double timeout = 0;
+  bool cache_stats = false;
+  bool gc_stats_wanted = false;
+  bool metrics_wanted = false;
+  const char* source = NULL;
+  const char* rules = NULL;
+  const char* image = NULL;
+  const char* profile = NULL;
+  const char* recorded_profile = NULL;
+  bool stream = false;
+  bool watching = false;
+  char delimiter = '\0';
+  int first = 1;
+
+  while (first < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-e") == 0) {
+      if (first + 1 >= argc || rules != NULL) usage();
+      source = argv[first + 1];
+      first += 2;
+    } else if (strcmp(argv[first], "--rules") == 0) {
+      if (first + 1 >= argc || source != NULL) usage();
+      rules = argv[first + 1];
+      first += 2;
+    } else if (strcmp(argv[first], "--snapshot") == 0) {
+      if (first + 1 >= argc) usage();
+      image = argv[first + 1];
+      first += 2;
+    } else if (strcmp(argv[first], "--watch") == 0) {
+      watching = true;
+      first++;
+    } else if (strcmp(argv[first], "--stream") == 0) {
+      stream = true;
+      first++;
+    } else if (strcmp(argv[first], "--delimiter") == 0) {
+      if (first + 1 >= argc || strlen(argv[first + 1]) != 1) usage();
+      delimiter = argv[first + 1][0];
+      first += 2;
+    } else if (strcmp(argv[first], "--jobs") == 0) {
+      jobs = option_value(argc, argv, &first);
+    } else if (strcmp(argv[first], "--fuel") == 0) {
+      fuel = option_value(argc, argv, &first);
+    } else if (strcmp(argv[first], "--timeout") == 0) {
+      timeout = option_value(argc, argv, &first) / 1000.0;
+    } else if (strcmp(argv[first], "--threads") == 0) {
+      set_parallel_threads(option_value(argc, argv, &first));
+    } else if (strcmp(argv[first], "--cache-size") == 0) {
+      set_module_cache_limit(option_value(argc, argv, &first));
+    } else if (strcmp(argv[first], "--cache-stats") == 0) {
+      cache_stats = true;
+      first++;
+    } else if (strcmp(argv[first], "--gc-stats") == 0) {
+      gc_stats_wanted = true;
+      first++;
+    } else if (strcmp(argv[first], "--metrics=json") == 0) {
+      metrics_wanted = true;
+      first++;
+    } else if (strcmp(argv[first], "--no-loop-opt") == 0) {
+      set_loop_optimization(false);
+      first++;
+    } else if (strcmp(argv[first], "--record-profile") == 0) {
+      if (first + 1 >= argc || profile != NULL) usage();
+      recorded_profile = argv[first + 1];
+      set_profile_recording(true);
+      first += 2;
+    } else if (strcmp(argv[first], "--use-profile") == 0) {
+      if (first + 1 >= argc || recorded_profile != NULL) usage();
+      profile = argv[first + 1];
+      first += 2;
+    } else {
+      usage();
+    }
+  }
+
+  set_run_limits(fuel, timeout);
 
-  if (argc == 1) {
+  int path_count = argc - first;
+  int status = 0;
+
+  if (stream && source == NULL && rules == NULL) usage();
+
+  // Recording only follows the single run of one script.
+  if (recorded_profile != NULL &&
+      (watching || image != NULL || source != NULL || rules != NULL ||
+       jobs != 0 || path_count != 1)) {
+    usage();
+  }
+
+  if (profile != NULL && !load_profile(profile)) {
+    fprintf(stderr, "Could not read profile \"%s\".\n", profile);
+    exit(66);
+  }
+
+  if (watching) {
+    if (image != NULL || source != NULL || rules != NULL || jobs != 0 ||
+        path_count != 1) {
+      usage();
+    }
+    status = watch(argv[first]);
+  } else if (image != NULL) {
+    if (source != NULL || rules != NULL || jobs != 0 || path_count != 1) {
+      usage();
+    }
+    status = snapshot(argv[first], image);
+  } else if (source != NULL || rules != NULL) {
+    if (jobs != 0 || (!stream && path_count > 0)) usage();
+    status = run_expression(source, rules, stream, &argv[first], path_count,
+                            delimiter);
+  } else if (path_count == 0 && jobs == 0) {
     repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  } else if (path_count == 1 && jobs == 0) {
+    status = run_file(argv[first], recorded_profile);
+  } else if (path_count > 0) {
+    int workers = jobs > 0 ? jobs : cpu_count();
+    if (!run_batch(&argv[first], path_count, workers)) status = 65;
   } else {
-    fprintf(stderr, "Usage: nol [path]\n");
-    exit(64);
+    usage();
   }
 
+  if (cache_stats) {
+    CacheStats stats = module_cache_stats();
+
+    fprintf(stderr,
+            "cache: %llu hits, %llu misses, %llu evictions, %d/%d modules\n",
+            (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+            (unsigned long long)stats.evictions, stats.count, stats.limit);
+  }
+
+  if (gc_stats_wanted) {
+    GcStats stats = gc_stats();
+
+    fprintf(stderr,
+            "gc: %llu collections, pauses %.3f ms total, %.3f ms max\n",
+            (unsigned long long)stats.collections, stats.total_pause * 1e3,
+            stats.max_pause * 1e3);
+    fprintf(stderr,
+            "gc: %llu objects, %llu bytes allocated, %llu freed, "
+            "%zu peak\n",
+            (unsigned long long)stats.allocated_objects,
+            (unsigned long long)stats.allocated_bytes,
+            (unsigned long long)stats.freed_bytes, stats.peak_bytes);
+  }
+
+  if (metrics_wanted) print_metrics_json(stderr);
+
   free_vm();
-  free_code();
+  free_module_cache();
+  free_profile();
+  free_interned_strings();
+
+  return status;
 }
@@ -12,7 +12,7 @@ void init_map(Map* map) {
 
 void free_map(Map* map) {
   FREE_ARRAY(Entry, map->entries, map->capacity);
-  initTable(map);
+  init_map(map);
 }
 
 uint32_t hash_string(const char* key) {
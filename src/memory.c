@@ -2,12 +2,18 @@
 
 #include <stdlib.h>
 
+#include "metrics.h"
+
 void* reallocate(void* pointer, size_t old_size, size_t new_size) {
   if (new_size == 0) {
     free(pointer);
     return NULL;
   }
 
+  if (new_size > old_size) {
+    count_metric(METRIC_ALLOCATED_BYTES, new_size - old_size);
+  }
+
   void* result = realloc(pointer, new_size);
 
   if (result == NULL) exit(1);
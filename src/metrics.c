@@ -0,0 +1,113 @@
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "heap.h"
+#include "module.h"
+
+_Thread_local MetricBlock* thread_metrics = NULL;
+
+_Atomic(MetricBlock*) metric_blocks = NULL;
+
+pthread_key_t metric_key;
+pthread_once_t metric_key_once = PTHREAD_ONCE_INIT;
+
+// Runs when a thread that counted exits.
+void release_metric_block(void* block) {
+  atomic_store(&((MetricBlock*)block)->in_use, false);
+}
+
+void create_metric_key() {
+  pthread_key_create(&metric_key, release_metric_block);
+}
+
+// First count of a thread. Blocks are never freed, so readers can walk the
+// list while threads come and go.
+MetricBlock* claim_metric_block() {
+  MetricBlock* block = atomic_load(&metric_blocks);
+
+  for (; block != NULL; block = block->next) {
+    bool idle = false;
+    if (atomic_compare_exchange_strong(&block->in_use, &idle, true)) break;
+  }
+
+  if (block == NULL) {
+    // Not reallocate, which counts into this very block.
+    block = (MetricBlock*)calloc(1, sizeof(MetricBlock));
+    if (block == NULL) exit(1);
+
+    atomic_init(&block->in_use, true);
+    block->next = atomic_load(&metric_blocks);
+
+    while (!atomic_compare_exchange_weak(&metric_blocks, &block->next,
+                                         block)) {
+    }
+  }
+
+  pthread_once(&metric_key_once, create_metric_key);
+  pthread_setspecific(metric_key, block);
+
+  thread_metrics = block;
+  return block;
+}
+
+uint64_t metric_clock() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return (uint64_t)time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+void read_metrics(uint64_t totals[METRIC_COUNT]) {
+  memset(totals, 0, sizeof(uint64_t) * METRIC_COUNT);
+
+  MetricBlock* block = atomic_load(&metric_blocks);
+
+  for (; block != NULL; block = block->next) {
+    for (int i = 0; i < METRIC_COUNT; i++) {
+      totals[i] +=
+          atomic_load_explicit(&block->counters[i], memory_order_relaxed);
+    }
+  }
+}
+
+#define METRIC_NAME(metric, name) name,
+
+static const char* metric_names[METRIC_COUNT] = {METRICS(METRIC_NAME)};
+
+#undef METRIC_NAME
+
+void print_metrics_json(FILE* out) {
+  uint64_t totals[METRIC_COUNT];
+  read_metrics(totals);
+
+  fprintf(out, "{");
+
+  for (int i = 0; i < METRIC_COUNT; i++) {
+    fprintf(out, "\"%s\": %llu, ", metric_names[i],
+            (unsigned long long)totals[i]);
+  }
+
+  CacheStats cache = module_cache_stats();
+  uint64_t lookups = cache.hits + cache.misses;
+
+  fprintf(out,
+          "\"cache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": "
+          "%llu, \"hit_rate\": %.4f, \"modules\": %d}, ",
+          (unsigned long long)cache.hits, (unsigned long long)cache.misses,
+          (unsigned long long)cache.evictions,
+          lookups > 0 ? (double)cache.hits / lookups : 0.0, cache.count);
+
+  GcStats gc = gc_stats();
+
+  fprintf(out,
+          "\"gc\": {\"collections\": %llu, \"allocated_bytes\": %llu, "
+          "\"freed_bytes\": %llu, \"peak_bytes\": %zu, \"total_pause_ns\": "
+          "%.0f, \"max_pause_ns\": %.0f}}\n",
+          (unsigned long long)gc.collections,
+          (unsigned long long)gc.allocated_bytes,
+          (unsigned long long)gc.freed_bytes, gc.peak_bytes,
+          gc.total_pause * 1e9, gc.max_pause * 1e9);
+}
@@ -0,0 +1,66 @@
+#ifndef nol_metrics_h
+#define nol_metrics_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+
+// Every counter, with the name the JSON dump gives it. Times are in
+// nanoseconds.
+#define METRICS(X)                                   \
+  X(METRIC_MODULES_COMPILED, "modules_compiled")     \
+  X(METRIC_TOKENS_SCANNED, "tokens_scanned")         \
+  X(METRIC_FUNCTIONS_REUSED, "functions_reused")     \
+  X(METRIC_CODE_BYTES, "code_bytes")                 \
+  X(METRIC_COMPILE_ERRORS, "compile_errors")         \
+  X(METRIC_READ_NS, "read_ns")                       \
+  X(METRIC_COMPILE_NS, "compile_ns")                 \
+  X(METRIC_LINK_NS, "link_ns")                       \
+  X(METRIC_RUNS, "runs")                             \
+  X(METRIC_INSTRUCTIONS, "instructions")             \
+  X(METRIC_RUN_NS, "run_ns")                         \
+  X(METRIC_RUNTIME_ERRORS, "runtime_errors")         \
+  X(METRIC_OUT_OF_FUEL, "out_of_fuel")               \
+  X(METRIC_DEADLINES_EXCEEDED, "deadlines_exceeded") \
+  X(METRIC_PARALLEL_CHUNKS, "parallel_chunks")       \
+  X(METRIC_ALLOCATED_BYTES, "allocated_bytes")
+
+#define METRIC_ENUM(metric, name) metric,
+
+typedef enum { METRICS(METRIC_ENUM) METRIC_COUNT } Metric;
+
+#undef METRIC_ENUM
+
+// One thread's counters. Only the owning thread writes them, so counting is
+// a plain load and store with no lock and no locked instruction. Readers sum
+// the blocks of all threads. The block of a thread that exits is taken over
+// by the next new thread and keeps counting from where it was.
+typedef struct MetricBlock {
+  atomic_uint_fast64_t counters[METRIC_COUNT];
+  atomic_bool in_use;
+  struct MetricBlock* next;
+} MetricBlock;
+
+extern _Thread_local MetricBlock* thread_metrics;
+
+MetricBlock* claim_metric_block();
+
+static inline void count_metric(Metric metric, uint64_t amount) {
+  MetricBlock* block = thread_metrics;
+  if (block == NULL) block = claim_metric_block();
+
+  atomic_uint_fast64_t* counter = &block->counters[metric];
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+      memory_order_relaxed);
+}
+
+// CLOCK_MONOTONIC in nanoseconds, for the time metrics.
+uint64_t metric_clock();
+
+// Totals over every thread that ever counted.
+void read_metrics(uint64_t totals[METRIC_COUNT]);
+// The totals, the module cache and the collector as one JSON object.
+void print_metrics_json(FILE* out);
+
+#endif
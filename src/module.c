@@ -0,0 +1,1308 @@
+#include "module.h"
+
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "compiler.h"
+#include "hash.h"
+#include "image.h"
+#include "memory.h"
+#include "metrics.h"
+#include "pool.h"
+#include "scanner.h"
+
+NameSlot* find_slot(NameSlot* slots, int capacity, const char* name,
+                    int length) {
+  uint32_t index = (uint32_t)hash_bytes(name, length) & (capacity - 1);
+
+  while (slots[index].name != NULL &&
+         (slots[index].length != length ||
+          memcmp(slots[index].name, name, length) != 0)) {
+    index = (index + 1) & (capacity - 1);
+  }
+
+  return &slots[index];
+}
+
+int find_name(NameIndex* names, const char* name, int length) {
+  if (names->count == 0) return -1;
+
+  NameSlot* slot = find_slot(names->slots, names->capacity, name, length);
+  return slot->name != NULL ? slot->index : -1;
+}
+
+// The slot of name, empty if it is not there yet.
+NameSlot* name_slot(NameIndex* names, const char* name, int length) {
+  if ((names->count + 1) * 2 > names->capacity) {
+    int capacity = names->capacity < 8 ? 8 : names->capacity * 2;
+    NameSlot* slots = ALLOCATE(NameSlot, capacity);
+    memset(slots, 0, sizeof(NameSlot) * capacity);
+
+    for (int i = 0; i < names->capacity; i++) {
+      NameSlot* slot = &names->slots[i];
+      if (slot->name != NULL) {
+        *find_slot(slots, capacity, slot->name, slot->length) = *slot;
+      }
+    }
+
+    FREE_ARRAY(NameSlot, names->slots, names->capacity);
+    names->slots = slots;
+    names->capacity = capacity;
+  }
+
+  return find_slot(names->slots, names->capacity, name, length);
+}
+
+// Sets the index of name, unless it already has one.
+void add_name(NameIndex* names, const char* name, int length, int index) {
+  NameSlot* slot = name_slot(names, name, length);
+  if (slot->name != NULL) return;
+
+  slot->name = name;
+  slot->length = length;
+  slot->index = index;
+  names->count++;
+}
+
+// Sets the index of name, replacing the one it had.
+void set_name(NameIndex* names, const char* name, int length, int index) {
+  NameSlot* slot = name_slot(names, name, length);
+  if (slot->name == NULL) names->count++;
+
+  slot->name = name;
+  slot->length = length;
+  slot->index = index;
+}
+
+void init_names(NameIndex* names) {
+  names->slots = NULL;
+  names->count = 0;
+  names->capacity = 0;
+}
+
+void free_names(NameIndex* names) {
+  FREE_ARRAY(NameSlot, names->slots, names->capacity);
+}
+
+int find_symbol(Module* module, const char* name, int length) {
+  return find_name(&module->symbol_names, name, length);
+}
+
+void init_scope(Scope* scope) {
+  init_names(&scope->symbols);
+  init_names(&scope->functions);
+  scope->names = NULL;
+  scope->count = 0;
+  scope->capacity = 0;
+}
+
+void free_scope(Scope* scope) {
+  free_names(&scope->symbols);
+  free_names(&scope->functions);
+  FREE_ARRAY(ScopeName, scope->names, scope->capacity);
+  init_scope(scope);
+}
+
+void scope_name(Scope* scope, NameIndex* names, Module* owner, int index,
+                const char* name, int length) {
+  if (scope->capacity < scope->count + 1) {
+    int old_capacity = scope->capacity;
+
+    scope->capacity = GROW_CAPACITY(old_capacity);
+    scope->names = GROW_ARRAY(ScopeName, scope->names, old_capacity,
+                              scope->capacity);
+  }
+
+  scope->names[scope->count].owner = owner;
+  scope->names[scope->count].index = index;
+  set_name(names, name, length, scope->count);
+  scope->count++;
+}
+
+// Makes what module declares visible through scope.
+void add_to_scope(Scope* scope, Module* module) {
+  for (int i = 0; i < module->symbol_count; i++) {
+    Symbol* symbol = &module->symbols[i];
+    scope_name(scope, &scope->symbols, module, i, symbol->name,
+               symbol->length);
+  }
+
+  for (int i = 0; i < module->function_count; i++) {
+    Function* function = &module->functions[i];
+    scope_name(scope, &scope->functions, module, i, function->name,
+               function->length);
+  }
+}
+
+int find_scoped(Scope* scope, NameIndex* names, const char* name, int length,
+                Module** owner) {
+  int position = find_name(names, name, length);
+  if (position == -1) return -1;
+
+  *owner = scope->names[position].owner;
+  return scope->names[position].index;
+}
+
+int scope_symbol(Scope* scope, const char* name, int length, Module** owner) {
+  return find_scoped(scope, &scope->symbols, name, length, owner);
+}
+
+int scope_function(Scope* scope, const char* name, int length,
+                   Module** owner) {
+  return find_scoped(scope, &scope->functions, name, length, owner);
+}
+
+int add_symbol(Module* module, const char* name, int length, ValueType type) {
+  if (module->symbol_capacity < module->symbol_count + 1) {
+    int old_capacity = module->symbol_capacity;
+
+    module->symbol_capacity = GROW_CAPACITY(old_capacity);
+    module->symbols = GROW_ARRAY(Symbol, module->symbols, old_capacity,
+                                 module->symbol_capacity);
+  }
+
+  Symbol* symbol = &module->symbols[module->symbol_count];
+  symbol->name = name;
+  symbol->length = length;
+  symbol->type = type;
+  symbol->offset = module->globals_size;
+
+  module->globals_size += value_size(type);
+  add_name(&module->symbol_names, name, length, module->symbol_count);
+
+  return module->symbol_count++;
+}
+
+int add_ref(Module* module, Module* owner, int symbol, int offset) {
+  for (int i = 0; i < module->ref_count; i++) {
+    GlobalRef* ref = &module->refs[i];
+
+    if (ref->owner == owner && ref->symbol == symbol &&
+        ref->offset == offset) {
+      return i;
+    }
+  }
+
+  if (module->ref_capacity < module->ref_count + 1) {
+    int old_capacity = module->ref_capacity;
+
+    module->ref_capacity = GROW_CAPACITY(old_capacity);
+    module->refs = GROW_ARRAY(GlobalRef, module->refs, old_capacity,
+                              module->ref_capacity);
+  }
+
+  module->refs[module->ref_count].owner = owner;
+  module->refs[module->ref_count].symbol = symbol;
+  module->refs[module->ref_count].offset = offset;
+
+  return module->ref_count++;
+}
+
+int find_function(Module* module, const char* name, int length) {
+  return find_name(&module->function_names, name, length);
+}
+
+int add_function(Module* module, const char* name, int length,
+                 ValueType return_type) {
+  if (module->function_capacity < module->function_count + 1) {
+    int old_capacity = module->function_capacity;
+
+    module->function_capacity = GROW_CAPACITY(old_capacity);
+    module->functions = GROW_ARRAY(Function, module->functions, old_capacity,
+                                   module->function_capacity);
+  }
+
+  Function* function = &module->functions[module->function_count];
+  function->name = name;
+  function->length = length;
+  function->return_type = return_type;
+  function->arity = 0;
+  function->params_size = 0;
+  function->entry = 0;
+  function->frame_size = 0;
+  function->inline_start = -1;
+  function->inline_end = -1;
+  function->source_start = 0;
+  function->source_length = 0;
+  function->source_lines = 0;
+  function->code_end = 0;
+  function->first_dependency = 0;
+  function->dependency_count = 0;
+  function->signature = 0;
+  function->has_effects = false;
+  function->reads_arrays = false;
+
+  add_name(&module->function_names, name, length, module->function_count);
+
+  return module->function_count++;
+}
+
+int add_call(Module* module, Module* owner, int function) {
+  for (int i = 0; i < module->call_count; i++) {
+    CallRef* call = &module->calls[i];
+    if (call->owner == owner && call->function == function) return i;
+  }
+
+  if (module->call_capacity < module->call_count + 1) {
+    int old_capacity = module->call_capacity;
+
+    module->call_capacity = GROW_CAPACITY(old_capacity);
+    module->calls = GROW_ARRAY(CallRef, module->calls, old_capacity,
+                               module->call_capacity);
+  }
+
+  module->calls[module->call_count].owner = owner;
+  module->calls[module->call_count].function = function;
+
+  return module->call_count++;
+}
+
+void add_dependency(Module* module, const char* name, int length,
+                    uint64_t signature) {
+  if (module->dependency_capacity < module->dependency_count + 1) {
+    int old_capacity = module->dependency_capacity;
+
+    module->dependency_capacity = GROW_CAPACITY(old_capacity);
+    module->dependencies =
+        GROW_ARRAY(Dependency, module->dependencies, old_capacity,
+                   module->dependency_capacity);
+  }
+
+  Dependency* dependency = &module->dependencies[module->dependency_count];
+  dependency->name = name;
+  dependency->length = length;
+  dependency->signature = signature;
+
+  module->dependency_count++;
+}
+
+void add_stack_map(Module* module, int code_offset, HeapSlot* slots,
+                   int count) {
+  if (module->map_capacity < module->map_count + 1) {
+    int old_capacity = module->map_capacity;
+
+    module->map_capacity = GROW_CAPACITY(old_capacity);
+    module->maps = GROW_ARRAY(StackMap, module->maps, old_capacity,
+                              module->map_capacity);
+  }
+
+  while (module->map_slot_capacity < module->map_slot_count + count) {
+    int old_capacity = module->map_slot_capacity;
+
+    module->map_slot_capacity = GROW_CAPACITY(old_capacity);
+    module->map_slots = GROW_ARRAY(HeapSlot, module->map_slots, old_capacity,
+                                   module->map_slot_capacity);
+  }
+
+  StackMap* map = &module->maps[module->map_count];
+  map->code_offset = code_offset;
+  map->first_slot = module->map_slot_count;
+  map->slot_count = count;
+
+  memcpy(&module->map_slots[module->map_slot_count], slots,
+         sizeof(HeapSlot) * count);
+
+  module->map_count++;
+  module->map_slot_count += count;
+}
+
+void drop_stack_maps(Module* module, int code_offset) {
+  while (module->map_count > 0 &&
+         module->maps[module->map_count - 1].code_offset > code_offset) {
+    module->map_count--;
+    module->map_slot_count = module->maps[module->map_count].first_slot;
+  }
+}
+
+// Code is emitted in order, so the maps are sorted.
+StackMap* find_stack_map(Module* module, int code_offset) {
+  int low = 0;
+  int high = module->map_count - 1;
+
+  while (low <= high) {
+    int middle = (low + high) / 2;
+    StackMap* map = &module->maps[middle];
+
+    if (map->code_offset == code_offset) return map;
+
+    if (map->code_offset < code_offset) {
+      low = middle + 1;
+    } else {
+      high = middle - 1;
+    }
+  }
+
+  return NULL;
+}
+
+_Thread_local FILE* thread_error_stream;
+int compile_threads;
+
+FILE* error_stream() {
+  return thread_error_stream != NULL ? thread_error_stream : stderr;
+}
+
+void set_error_stream(FILE* stream) { thread_error_stream = stream; }
+
+void set_compile_threads(int threads) { compile_threads = threads; }
+
+// Whether the last load of the thread failed on a file it could not read.
+_Thread_local bool thread_read_failed;
+
+bool read_failed() { return thread_read_failed; }
+
+void report_read_error(const char* message, const char* path) {
+  fprintf(error_stream(), message, path);
+  thread_read_failed = true;
+}
+
+char* read_file(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    report_read_error("Could not open file \"%s\".\n", path);
+    return NULL;
+  }
+
+  struct stat info;
+  if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)) {
+    report_read_error("\"%s\" is not a file.\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  long size = -1;
+  if (fseek(file, 0L, SEEK_END) == 0) size = ftell(file);
+  rewind(file);
+
+  if (size < 0) {
+    report_read_error("Could not read file \"%s\".\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  char* buffer = (char*)malloc((size_t)size + 1);
+  if (buffer == NULL) {
+    report_read_error("Not enough memory to read \"%s\".\n", path);
+    fclose(file);
+    return NULL;
+  }
+
+  size_t bytes_read = fread(buffer, sizeof(char), (size_t)size, file);
+  fclose(file);
+
+  if (bytes_read < (size_t)size) {
+    report_read_error("Could not read file \"%s\".\n", path);
+    free(buffer);
+    return NULL;
+  }
+
+  buffer[bytes_read] = '\0';
+  return buffer;
+}
+
+Module* new_module(char* path, char* source, uint64_t key) {
+  Module* module = ALLOCATE(Module, 1);
+
+  module->path = path;
+  module->source = source;
+  module->key = key;
+
+  init_code(&module->code);
+
+  module->imports = NULL;
+  module->import_count = 0;
+  module->scope = NULL;
+
+  module->symbols = NULL;
+  module->symbol_count = 0;
+  module->symbol_capacity = 0;
+  module->globals_size = 0;
+  init_names(&module->symbol_names);
+
+  module->refs = NULL;
+  module->ref_count = 0;
+  module->ref_capacity = 0;
+
+  module->functions = NULL;
+  module->function_count = 0;
+  module->function_capacity = 0;
+  init_names(&module->function_names);
+
+  module->calls = NULL;
+  module->call_count = 0;
+  module->call_capacity = 0;
+
+  module->dependencies = NULL;
+  module->dependency_count = 0;
+  module->dependency_capacity = 0;
+
+  module->maps = NULL;
+  module->map_count = 0;
+  module->map_capacity = 0;
+
+  module->map_slots = NULL;
+  module->map_slot_count = 0;
+  module->map_slot_capacity = 0;
+
+  module->field_count = 0;
+
+  module->recorded_loops = NULL;
+  module->recorded_loop_count = 0;
+  module->recorded_loop_capacity = 0;
+
+  module->profile_sites = NULL;
+  module->profile_site_count = 0;
+  module->profile_site_capacity = 0;
+
+  module->profile_counters = NULL;
+  module->profile_counter_count = 0;
+  module->profile_counter_capacity = 0;
+
+  atomic_init(&module->users, 1);
+  module->older = NULL;
+  module->newer = NULL;
+
+  return module;
+}
+
+void release_module(Module* module);
+
+void free_module(Module* module) {
+  free(module->path);
+  free(module->source);
+
+  free_code(&module->code);
+
+  for (int i = 0; i < module->import_count; i++) {
+    release_module(module->imports[i]);
+  }
+
+  FREE_ARRAY(Module*, module->imports, module->import_count);
+  FREE_ARRAY(Symbol, module->symbols, module->symbol_capacity);
+  free_names(&module->symbol_names);
+  FREE_ARRAY(GlobalRef, module->refs, module->ref_capacity);
+  FREE_ARRAY(Function, module->functions, module->function_capacity);
+  free_names(&module->function_names);
+  FREE_ARRAY(CallRef, module->calls, module->call_capacity);
+  FREE_ARRAY(Dependency, module->dependencies, module->dependency_capacity);
+  FREE_ARRAY(StackMap, module->maps, module->map_capacity);
+  FREE_ARRAY(HeapSlot, module->map_slots, module->map_slot_capacity);
+
+  for (int i = 0; i < module->recorded_loop_count; i++) {
+    RecordedLoop* loop = &module->recorded_loops[i];
+    FREE_ARRAY(uint8_t, loop->ops, loop->node_count);
+  }
+
+  FREE_ARRAY(RecordedLoop, module->recorded_loops,
+             module->recorded_loop_capacity);
+  FREE_ARRAY(ProfileSite, module->profile_sites,
+             module->profile_site_capacity);
+  FREE_ARRAY(atomic_uint_fast64_t, module->profile_counters,
+             module->profile_counter_capacity);
+  FREE_ARRAY(Module, module, 1);
+}
+
+void retain_module(Module* module) { atomic_fetch_add(&module->users, 1); }
+
+void release_module(Module* module) {
+  if (atomic_fetch_sub(&module->users, 1) == 1) free_module(module);
+}
+
+#define DEFAULT_MODULE_CACHE_LIMIT 1024
+
+// Compiled modules keyed by Module.key, with a recency list from the least
+// to the most recently used one.
+pthread_mutex_t module_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+Module** module_cache;
+int module_cache_capacity;
+Module* oldest_module;
+Module* newest_module;
+CacheStats cache_stats = {0, 0, 0, 0, DEFAULT_MODULE_CACHE_LIMIT};
+
+// The source is compared as well, so a colliding key can never hand out the
+// wrong program.
+Module** find_cached(Module** entries, int capacity, uint64_t key,
+                     const char* source) {
+  uint32_t index = (uint32_t)key & (capacity - 1);
+
+  while (entries[index] != NULL &&
+         (entries[index]->key != key ||
+          strcmp(entries[index]->source, source) != 0)) {
+    index = (index + 1) & (capacity - 1);
+  }
+
+  return &entries[index];
+}
+
+// Removes module from the table, shifting back the entries after it so no
+// probe sequence is broken.
+void remove_cached(Module* module) {
+  uint32_t mask = module_cache_capacity - 1;
+  uint32_t hole = (uint32_t)module->key & mask;
+
+  while (module_cache[hole] != module) hole = (hole + 1) & mask;
+
+  for (uint32_t index = (hole + 1) & mask; module_cache[index] != NULL;
+       index = (index + 1) & mask) {
+    uint32_t home = (uint32_t)module_cache[index]->key & mask;
+
+    // The entry may fill the hole if its home slot does not lie after it.
+    if (((index - home) & mask) >= ((index - hole) & mask)) {
+      module_cache[hole] = module_cache[index];
+      hole = index;
+    }
+  }
+
+  module_cache[hole] = NULL;
+}
+
+void unlink_recent(Module* module) {
+  if (module->older != NULL) {
+    module->older->newer = module->newer;
+  } else {
+    oldest_module = module->newer;
+  }
+
+  if (module->newer != NULL) {
+    module->newer->older = module->older;
+  } else {
+    newest_module = module->older;
+  }
+
+  module->older = NULL;
+  module->newer = NULL;
+}
+
+void link_newest(Module* module) {
+  module->older = newest_module;
+  module->newer = NULL;
+
+  if (newest_module != NULL) {
+    newest_module->newer = module;
+  } else {
+    oldest_module = module;
+  }
+
+  newest_module = module;
+}
+
+// Evicts the least recently used modules held only by the cache until the
+// cache is within its limit again. Anything still imported by a cached
+// module or used by a program stays, so it can be found again.
+void evict_modules() {
+  Module* module = oldest_module;
+
+  while (cache_stats.count > cache_stats.limit && module != NULL) {
+    Module* newer = module->newer;
+
+    if (atomic_load(&module->users) == 1) {
+      remove_cached(module);
+      unlink_recent(module);
+      cache_stats.count--;
+      cache_stats.evictions++;
+
+      release_module(module);
+    }
+
+    module = newer;
+  }
+}
+
+// Returns the module compiled from source with the given key, held for the
+// caller, or NULL when it has to be compiled.
+Module* module_cache_get(uint64_t key, const char* source) {
+  Module* module = NULL;
+
+  pthread_mutex_lock(&module_cache_lock);
+
+  if (cache_stats.count > 0) {
+    module = *find_cached(module_cache, module_cache_capacity, key, source);
+  }
+
+  if (module != NULL) {
+    retain_module(module);
+    unlink_recent(module);
+    link_newest(module);
+    cache_stats.hits++;
+  } else {
+    cache_stats.misses++;
+  }
+
+  pthread_mutex_unlock(&module_cache_lock);
+
+  return module;
+}
+
+// Caches module and returns the cached module for its key, held for the
+// caller like module was. When another build already cached an identical
+// module, that one wins and module is released.
+Module* module_cache_put(Module* module) {
+  pthread_mutex_lock(&module_cache_lock);
+
+  if ((cache_stats.count + 1) * 4 > module_cache_capacity * 3) {
+    int capacity = GROW_CAPACITY(module_cache_capacity);
+    Module** entries = ALLOCATE(Module*, capacity);
+    memset(entries, 0, sizeof(Module*) * capacity);
+
+    for (int i = 0; i < module_cache_capacity; i++) {
+      Module* entry = module_cache[i];
+
+      if (entry != NULL) {
+        *find_cached(entries, capacity, entry->key, entry->source) = entry;
+      }
+    }
+
+    FREE_ARRAY(Module*, module_cache, module_cache_capacity);
+    module_cache = entries;
+    module_cache_capacity = capacity;
+  }
+
+  Module** slot = find_cached(module_cache, module_cache_capacity, module->key,
+                              module->source);
+
+  if (*slot == NULL) {
+    *slot = module;
+    retain_module(module);
+    link_newest(module);
+    cache_stats.count++;
+
+    evict_modules();
+  } else {
+    release_module(module);
+    module = *slot;
+    retain_module(module);
+  }
+
+  pthread_mutex_unlock(&module_cache_lock);
+  return module;
+}
+
+// The most recently used module compiled from the file at path, held for
+// the caller, or NULL. Compiling the file again starts from it.
+Module* module_cache_latest(const char* path) {
+  pthread_mutex_lock(&module_cache_lock);
+
+  Module* module = newest_module;
+
+  while (module != NULL &&
+         (module->path == NULL || strcmp(module->path, path) != 0)) {
+    module = module->older;
+  }
+
+  if (module != NULL) retain_module(module);
+
+  pthread_mutex_unlock(&module_cache_lock);
+  return module;
+}
+
+void set_module_cache_limit(int limit) {
+  pthread_mutex_lock(&module_cache_lock);
+  cache_stats.limit = limit;
+  evict_modules();
+  pthread_mutex_unlock(&module_cache_lock);
+}
+
+CacheStats module_cache_stats() {
+  pthread_mutex_lock(&module_cache_lock);
+  CacheStats stats = cache_stats;
+  pthread_mutex_unlock(&module_cache_lock);
+
+  return stats;
+}
+
+void free_module_cache() {
+  pthread_mutex_lock(&module_cache_lock);
+
+  for (int i = 0; i < module_cache_capacity; i++) {
+    if (module_cache[i] != NULL) release_module(module_cache[i]);
+  }
+
+  FREE_ARRAY(Module*, module_cache, module_cache_capacity);
+
+  module_cache = NULL;
+  module_cache_capacity = 0;
+  oldest_module = NULL;
+  newest_module = NULL;
+  cache_stats.count = 0;
+
+  pthread_mutex_unlock(&module_cache_lock);
+}
+
+// Mixed into the key of a rule set's module.
+#define RULES_KEY 0x72756c6573ull
+
+typedef struct BuildNode BuildNode;
+typedef struct Build Build;
+
+struct BuildNode {
+  Build* build;
+
+  char* path;
+  char* source;
+  uint64_t key;
+
+  // Set once compiled, or right away when the module is cached.
+  Module* module;
+
+  BuildNode** imports;
+  int import_count;
+
+  BuildNode** dependents;
+  int dependent_count;
+  int dependent_capacity;
+
+  // Imports that still have to be compiled before this node can be.
+  atomic_int pending;
+  atomic_bool failed;
+
+  bool visiting;
+  // Compiled with compile_rules instead of compile.
+  bool rules;
+  // Set for a REPL entry, which is compiled against it and never cached.
+  Scope* scope;
+};
+
+struct Build {
+  // Every node, in discovery order.
+  BuildNode** nodes;
+  int count;
+  int capacity;
+
+  // Nodes after all of their imports.
+  BuildNode** order;
+  int order_count;
+  int order_capacity;
+
+  Pool* pool;
+};
+
+void append_node(BuildNode*** nodes, int* count, int* capacity,
+                 BuildNode* node) {
+  if (*capacity < *count + 1) {
+    int old_capacity = *capacity;
+
+    *capacity = GROW_CAPACITY(old_capacity);
+    *nodes = GROW_ARRAY(BuildNode*, *nodes, old_capacity, *capacity);
+  }
+
+  (*nodes)[*count] = node;
+  (*count)++;
+}
+
+// Collects the paths of the import declarations at the top of source.
+int scan_imports(const char* source, char*** paths) {
+  int count = 0;
+  int capacity = 0;
+
+  *paths = NULL;
+  init_scanner(source);
+
+  while (scan_token() == TOKEN_IMPORT) {
+    if (scan_token() != TOKEN_STRING) break;
+
+    // Strip the quotes.
+    const char* path = get_scanner_start() + 1;
+    int length = get_scanner_current() - path - 1;
+
+    if (capacity < count + 1) {
+      int old_capacity = capacity;
+
+      capacity = GROW_CAPACITY(old_capacity);
+      *paths = GROW_ARRAY(char*, *paths, old_capacity, capacity);
+    }
+
+    (*paths)[count] = strndup(path, length);
+    count++;
+
+    if (scan_token() != TOKEN_SEMICOLON) break;
+  }
+
+  return count;
+}
+
+char* resolve_import(const char* importer, const char* path) {
+  if (path[0] == '/' || importer == NULL) return strdup(path);
+
+  char* copy = strdup(importer);
+  const char* dir = dirname(copy);
+
+  char* resolved = malloc(strlen(dir) + strlen(path) + 2);
+  sprintf(resolved, "%s/%s", dir, path);
+
+  free(copy);
+  return resolved;
+}
+
+BuildNode* load_node(Build* build, const char* path, const char* source);
+
+bool load_imports(Build* build, BuildNode* node) {
+  char** paths;
+  int count = scan_imports(node->source, &paths);
+  bool loaded = true;
+
+  node->imports = ALLOCATE(BuildNode*, count);
+  node->import_count = 0;
+
+  for (int i = 0; i < count; i++) {
+    char* resolved = resolve_import(node->path, paths[i]);
+    BuildNode* import = load_node(build, resolved, NULL);
+
+    free(resolved);
+    free(paths[i]);
+
+    if (import == NULL) {
+      loaded = false;
+      continue;
+    }
+
+    node->imports[node->import_count] = import;
+    node->import_count++;
+
+    node->key = hash_combine(node->key, import->key);
+
+    append_node(&import->dependents, &import->dependent_count,
+                &import->dependent_capacity, node);
+  }
+
+  FREE_ARRAY(char*, paths, count);
+  return loaded;
+}
+
+// Loads a module and, depth first, everything it imports. source is NULL
+// for files, which are read from path.
+BuildNode* load_node(Build* build, const char* path, const char* source) {
+  char* canonical = NULL;
+
+  if (source == NULL) {
+    canonical = realpath(path, NULL);
+
+    if (canonical == NULL) {
+      report_read_error("Could not open file \"%s\".\n", path);
+      return NULL;
+    }
+
+    for (int i = 0; i < build->count; i++) {
+      BuildNode* node = build->nodes[i];
+      if (node->path == NULL || strcmp(node->path, canonical) != 0) continue;
+
+      free(canonical);
+
+      if (node->visiting) {
+        fprintf(error_stream(), "Import cycle through \"%s\".\n", node->path);
+        return NULL;
+      }
+
+      return node;
+    }
+  }
+
+  uint64_t start = metric_clock();
+  char* text = source == NULL ? read_file(canonical) : strdup(source);
+  count_metric(METRIC_READ_NS, metric_clock() - start);
+
+  if (text == NULL) {
+    free(canonical);
+    return NULL;
+  }
+
+  BuildNode* node = ALLOCATE(BuildNode, 1);
+
+  node->build = build;
+  node->path = canonical;
+  node->source = text;
+  node->key = hash_bytes(node->source, strlen(node->source));
+  node->module = NULL;
+  node->dependents = NULL;
+  node->dependent_count = 0;
+  node->dependent_capacity = 0;
+  atomic_init(&node->failed, false);
+  node->visiting = true;
+  node->rules = false;
+  node->scope = NULL;
+
+  append_node(&build->nodes, &build->count, &build->capacity, node);
+
+  bool loaded = load_imports(build, node);
+  node->visiting = false;
+
+  if (!loaded) return NULL;
+
+  append_node(&build->order, &build->order_count, &build->order_capacity,
+              node);
+
+  return node;
+}
+
+void compile_node(BuildNode* node) {
+  for (int i = 0; i < node->import_count; i++) {
+    if (atomic_load(&node->imports[i]->failed)) atomic_store(&node->failed, true);
+  }
+
+  if (atomic_load(&node->failed)) return;
+
+  // An edited file reuses what did not change from its last compile.
+  Module* previous =
+      node->path != NULL && !node->rules ? module_cache_latest(node->path)
+                                         : NULL;
+
+  Module* module = new_module(node->path, node->source, node->key);
+  node->path = NULL;
+  node->source = NULL;
+
+  module->scope = node->scope;
+  module->import_count = node->import_count;
+  module->imports = ALLOCATE(Module*, node->import_count);
+  for (int i = 0; i < node->import_count; i++) {
+    module->imports[i] = node->imports[i]->module;
+    retain_module(module->imports[i]);
+  }
+
+  uint64_t start = metric_clock();
+  bool compiled =
+      node->rules ? compile_rules(module) : compile(module, previous);
+  count_metric(METRIC_COMPILE_NS, metric_clock() - start);
+
+  if (previous != NULL) release_module(previous);
+
+  if (compiled) {
+    node->module = node->scope != NULL ? module : module_cache_put(module);
+  } else {
+    release_module(module);
+    atomic_store(&node->failed, true);
+  }
+}
+
+void compile_task(void* arg) {
+  BuildNode* node = (BuildNode*)arg;
+
+  compile_node(node);
+
+  // A dependent becomes ready once the last of its imports is done, failed
+  // or not. A failed import makes it fail without compiling.
+  for (int i = 0; i < node->dependent_count; i++) {
+    BuildNode* dependent = node->dependents[i];
+
+    if (atomic_fetch_sub(&dependent->pending, 1) == 1 &&
+        dependent->module == NULL) {
+      pool_submit(node->build->pool, compile_task, dependent);
+    }
+  }
+}
+
+bool compile_build(Build* build) {
+  int to_compile = 0;
+
+  for (int i = 0; i < build->order_count; i++) {
+    BuildNode* node = build->order[i];
+    node->module =
+        node->scope == NULL ? module_cache_get(node->key, node->source) : NULL;
+
+    int pending = 0;
+    for (int j = 0; j < node->import_count; j++) {
+      if (node->imports[j]->module == NULL) pending++;
+    }
+    atomic_init(&node->pending, pending);
+
+    if (node->module == NULL) to_compile++;
+  }
+
+  int threads = compile_threads > 0 ? compile_threads : cpu_count();
+  if (threads > to_compile) threads = to_compile;
+
+  if (threads <= 1) {
+    for (int i = 0; i < build->order_count; i++) {
+      if (build->order[i]->module == NULL) compile_node(build->order[i]);
+    }
+  } else {
+    build->pool = new_pool(threads);
+
+    for (int i = 0; i < build->order_count; i++) {
+      BuildNode* node = build->order[i];
+
+      if (node->module == NULL && atomic_load(&node->pending) == 0) {
+        pool_submit(build->pool, compile_task, node);
+      }
+    }
+
+    pool_wait(build->pool);
+    free_pool(build->pool);
+  }
+
+  bool compiled = true;
+
+  for (int i = 0; i < build->order_count; i++) {
+    if (build->order[i]->module == NULL) compiled = false;
+  }
+
+  return compiled;
+}
+
+int program_index(Program* program, Module* module) {
+  int index = 0;
+  while (program->modules[index] != module) index++;
+
+  return index;
+}
+
+void init_program(Program* program) {
+  program->modules = NULL;
+  program->count = 0;
+  program->capacity = 0;
+  program->bases = NULL;
+  program->links = NULL;
+  program->callees = NULL;
+  program->globals_size = 0;
+  program->max_stack = 0;
+  program->has_calls = false;
+  program->field_count = 0;
+  program->roots = NULL;
+  program->root_count = 0;
+  program->root_capacity = 0;
+  program->has_main = false;
+  program->initial_globals = NULL;
+  program->image = NULL;
+  program->image_size = 0;
+}
+
+// Adds module to the program unless it has it already.
+void add_module(Program* program, Module* module) {
+  for (int i = 0; i < program->count; i++) {
+    if (program->modules[i] == module) return;
+  }
+
+  if (program->capacity < program->count + 1) {
+    int old_capacity = program->capacity;
+
+    program->capacity = GROW_CAPACITY(old_capacity);
+    program->modules = GROW_ARRAY(Module*, program->modules, old_capacity,
+                                  program->capacity);
+    program->bases =
+        GROW_ARRAY(int, program->bases, old_capacity, program->capacity);
+    program->links =
+        GROW_ARRAY(int*, program->links, old_capacity, program->capacity);
+    program->callees = GROW_ARRAY(Callee*, program->callees, old_capacity,
+                                  program->capacity);
+  }
+
+  retain_module(module);
+  program->modules[program->count++] = module;
+}
+
+// Links the modules from first on, which were just added. Their globals go
+// after those of the modules before them, which stay where they are.
+void link_modules(Program* program, int first) {
+  for (int i = first; i < program->count; i++) {
+    program->bases[i] = program->globals_size;
+    program->globals_size += program->modules[i]->globals_size;
+  }
+
+  for (int i = first; i < program->count; i++) {
+    Module* module = program->modules[i];
+    program->links[i] = ALLOCATE(int, module->ref_count);
+
+    for (int j = 0; j < module->ref_count; j++) {
+      GlobalRef* ref = &module->refs[j];
+      int owner = program_index(program, ref->owner);
+      Symbol* symbol = &ref->owner->symbols[ref->symbol];
+
+      program->links[i][j] =
+          program->bases[owner] + symbol->offset + ref->offset;
+    }
+
+    program->callees[i] = ALLOCATE(Callee, module->call_count);
+    if (module->call_count > 0) program->has_calls = true;
+
+    for (int j = 0; j < module->call_count; j++) {
+      CallRef* call = &module->calls[j];
+      Function* function = &call->owner->functions[call->function];
+      Callee* callee = &program->callees[i][j];
+
+      callee->module = program_index(program, call->owner);
+      callee->entry = call->owner->code.code + function->entry;
+      callee->params_size = function->params_size;
+      callee->frame_size = function->frame_size;
+    }
+
+    for (int j = 0; j < module->symbol_count; j++) {
+      Symbol* symbol = &module->symbols[j];
+      if (!is_heap_type(symbol->type)) continue;
+
+      if (program->root_capacity < program->root_count + 1) {
+        int old_capacity = program->root_capacity;
+
+        program->root_capacity = GROW_CAPACITY(old_capacity);
+        program->roots = GROW_ARRAY(HeapSlot, program->roots, old_capacity,
+                                    program->root_capacity);
+      }
+
+      HeapSlot* root = &program->roots[program->root_count++];
+      root->offset = program->bases[i] + symbol->offset;
+      root->type = symbol->type;
+    }
+
+    if (module->code.max_stack > program->max_stack) {
+      program->max_stack = module->code.max_stack;
+    }
+
+    if (module->field_count > program->field_count) {
+      program->field_count = module->field_count;
+    }
+  }
+}
+
+void link_program(Program* program, Build* build) {
+  // Files with identical contents share one module.
+  for (int i = 0; i < build->order_count; i++) {
+    add_module(program, build->order[i]->module);
+  }
+
+  link_modules(program, 0);
+
+  Module* entry = program->modules[program->count - 1];
+  int index = find_function(entry, "main", 4);
+  Function* function = index != -1 ? &entry->functions[index] : NULL;
+
+  program->has_main = function != NULL && function->arity == 0 &&
+                      function->return_type == VAL_VOID;
+
+  if (program->has_main) {
+    program->main.module = program->count - 1;
+    program->main.entry = entry->code.code + function->entry;
+    program->main.params_size = 0;
+    program->main.frame_size = function->frame_size;
+    program->has_calls = true;
+  }
+}
+
+void free_build(Build* build) {
+  for (int i = 0; i < build->count; i++) {
+    BuildNode* node = build->nodes[i];
+
+    free(node->path);
+    free(node->source);
+
+    if (node->module != NULL) release_module(node->module);
+
+    FREE_ARRAY(BuildNode*, node->imports, node->import_count);
+    FREE_ARRAY(BuildNode*, node->dependents, node->dependent_capacity);
+    FREE_ARRAY(BuildNode, node, 1);
+  }
+
+  FREE_ARRAY(BuildNode*, build->nodes, build->capacity);
+  FREE_ARRAY(BuildNode*, build->order, build->order_capacity);
+}
+
+void init_build(Build* build) {
+  build->nodes = NULL;
+  build->count = 0;
+  build->capacity = 0;
+  build->order = NULL;
+  build->order_count = 0;
+  build->order_capacity = 0;
+  build->pool = NULL;
+}
+
+bool build_program(Program* program, const char* path, const char* source,
+                   bool rules) {
+  Build build;
+  init_build(&build);
+  init_program(program);
+  thread_read_failed = false;
+
+  BuildNode* entry = load_node(&build, path, source);
+  bool built = entry != NULL;
+
+  // A rule set compiles to other code than the same source as a program.
+  if (built && rules) {
+    entry->rules = true;
+    entry->key = hash_combine(entry->key, RULES_KEY);
+  }
+
+  if (built) built = compile_build(&build);
+  if (built) {
+    uint64_t start = metric_clock();
+    link_program(program, &build);
+    count_metric(METRIC_LINK_NS, metric_clock() - start);
+  }
+
+  free_build(&build);
+  return built;
+}
+
+bool load_program(Program* program, const char* path) {
+  if (!is_image(path)) return build_program(program, path, NULL, false);
+
+  thread_read_failed = false;
+  return load_image(program, path);
+}
+
+bool load_program_source(Program* program, const char* source) {
+  return build_program(program, NULL, source, false);
+}
+
+bool load_rules(Program* program, const char* path) {
+  return build_program(program, path, NULL, true);
+}
+
+int extend_program(Program* program, Scope* scope, const char* source) {
+  Build build;
+  init_build(&build);
+
+  BuildNode* entry = load_node(&build, NULL, source);
+  bool built = entry != NULL;
+
+  if (built) {
+    entry->scope = scope;
+    built = compile_build(&build);
+  }
+
+  int first = program->count;
+
+  if (built) {
+    uint64_t start = metric_clock();
+
+    for (int i = 0; i < build.order_count; i++) {
+      add_module(program, build.order[i]->module);
+    }
+
+    link_modules(program, first);
+    count_metric(METRIC_LINK_NS, metric_clock() - start);
+
+    // Later entries see what this one imported and declared, in that order
+    // so its own names win.
+    Module* module = entry->module;
+
+    for (int i = 0; i < module->import_count; i++) {
+      add_to_scope(scope, module->imports[i]);
+    }
+    add_to_scope(scope, module);
+  }
+
+  free_build(&build);
+  return built ? first : -1;
+}
+
+void free_program(Program* program) {
+  if (program->image != NULL) {
+    unmap_image(program);
+    return;
+  }
+
+  for (int i = 0; i < program->count; i++) {
+    FREE_ARRAY(int, program->links[i], program->modules[i]->ref_count);
+    FREE_ARRAY(Callee, program->callees[i], program->modules[i]->call_count);
+    release_module(program->modules[i]);
+  }
+
+  FREE_ARRAY(int*, program->links, program->capacity);
+  FREE_ARRAY(Callee*, program->callees, program->capacity);
+  FREE_ARRAY(Module*, program->modules, program->capacity);
+  FREE_ARRAY(int, program->bases, program->capacity);
+  FREE_ARRAY(HeapSlot, program->roots, program->root_capacity);
+
+  init_program(program);
+}
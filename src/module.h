@@ -0,0 +1,364 @@
+#ifndef nol_module_h
+#define nol_module_h
+
+#include <stdatomic.h>
+
+#include "bytecode.h"
+#include "common.h"
+#include "value.h"
+
+// Open addressing index from names to the position of their symbol or
+// function, kept at most half full. Only the first of equal names is found.
+typedef struct {
+  const char* name;
+  int length;
+  int index;
+} NameSlot;
+
+typedef struct {
+  NameSlot* slots;
+  int count;
+  int capacity;
+} NameIndex;
+
+typedef struct {
+  const char* name;
+  int length;
+  ValueType type;
+
+  // Byte offset inside the module's own global storage.
+  int offset;
+} Symbol;
+
+// A module level name a function uses, and what it stood for when the
+// function was compiled, see name_signature in the compiler.
+typedef struct {
+  const char* name;
+  int length;
+  uint64_t signature;
+} Dependency;
+
+#define MAX_PARAMS 16
+
+typedef struct {
+  const char* name;
+  int length;
+  ValueType return_type;
+
+  ValueType params[MAX_PARAMS];
+  int arity;
+  int params_size;
+
+  // Offset of the body in the module's code.
+  int entry;
+  // Bytes of parameters, locals and operands the body needs at most.
+  int frame_size;
+
+  // A body that is just `return expr;` with straight line code is copied
+  // into its callers instead of called. inline_start and inline_end bound
+  // the code of expr, inline_start is -1 for any other body.
+  int inline_start;
+  int inline_end;
+
+  // The declaration from its return type to the closing brace, and the
+  // code of the body from entry to code_end. Compiling the file again
+  // copies the code while the text and the dependencies are unchanged.
+  int source_start;
+  int source_length;
+  int source_lines;
+  int code_end;
+
+  // Index into the module's dependencies.
+  int first_dependency;
+  int dependency_count;
+
+  // What code calling the function depends on: the parameter and return
+  // types and, when the body is inlined, its text and dependencies.
+  uint64_t signature;
+
+  // Whether the body writes globals or array elements or prints, itself or
+  // through what it calls. A parallel for can't call such a function.
+  bool has_effects;
+  // Whether the body reads array elements, itself or through what it
+  // calls. A parallel for that writes elements can't call such a function.
+  bool reads_arrays;
+} Function;
+
+// A value the collector has to look at, offset bytes from the start of a
+// frame or of the globals.
+typedef struct {
+  int offset;
+  ValueType type;
+} HeapSlot;
+
+// The heap values a frame holds while it is stopped at a safepoint, which
+// is right after an OP_LOOP or an OP_CALL. code_offset is the end of that
+// instruction, slots index into the module's map_slots.
+typedef struct {
+  int code_offset;
+  int first_slot;
+  int slot_count;
+} StackMap;
+
+// A block of a loop compiled to record a profile, whose OP_PROFILE_BLOCK
+// counts its runs in the module's counter. node numbers its first
+// instruction as the optimizer decodes the loop, and it runs length nodes
+// from there.
+typedef struct {
+  int node;
+  int length;
+  int counter;
+} ProfileSite;
+
+// A loop compiled to record a profile. Later compiles find it again by the
+// module's key, where its `while` is in the source and what its nodes are.
+typedef struct {
+  int source_offset;
+  uint64_t signature;
+  int node_count;
+  // The opcodes of its nodes, which give the pairs its blocks run.
+  uint8_t* ops;
+  int first_site;
+  int site_count;
+} RecordedLoop;
+
+typedef struct Module Module;
+
+// Names a module sees besides its own and its imports', in a REPL session
+// where every entry sees what the earlier ones declared and imported. A
+// later name hides an earlier one.
+typedef struct {
+  Module* owner;
+  int index;
+} ScopeName;
+
+typedef struct {
+  // Both map to positions in names.
+  NameIndex symbols;
+  NameIndex functions;
+
+  ScopeName* names;
+  int count;
+  int capacity;
+} Scope;
+
+// A global referenced by a module's code. OP_GET_GLOBAL and OP_SET_GLOBAL
+// carry an index into the module's refs, which the linker turns into an
+// absolute offset in the program's global storage.
+typedef struct {
+  Module* owner;
+  int symbol;
+  // Bytes into the symbol, for a field of a struct.
+  int offset;
+} GlobalRef;
+
+// A function called by a module's code, OP_CALL carries an index into the
+// module's calls.
+typedef struct {
+  Module* owner;
+  int function;
+} CallRef;
+
+// A call resolved by the linker.
+typedef struct {
+  int module;
+  uint8_t* entry;
+  int params_size;
+  int frame_size;
+} Callee;
+
+struct Module {
+  char* path;
+  char* source;
+
+  // Hash of the source combined with the keys of all imports, so an unchanged
+  // module with unchanged imports maps to the same compiled module.
+  uint64_t key;
+
+  Code code;
+
+  Module** imports;
+  int import_count;
+  // Looked in after the imports, NULL outside a REPL session. Outlives the
+  // module.
+  Scope* scope;
+
+  Symbol* symbols;
+  int symbol_count;
+  int symbol_capacity;
+  int globals_size;
+  NameIndex symbol_names;
+
+  GlobalRef* refs;
+  int ref_count;
+  int ref_capacity;
+
+  Function* functions;
+  int function_count;
+  int function_capacity;
+  NameIndex function_names;
+
+  CallRef* calls;
+  int call_count;
+  int call_capacity;
+
+  Dependency* dependencies;
+  int dependency_count;
+  int dependency_capacity;
+
+  // By code_offset. Safepoints without heap values have no map.
+  StackMap* maps;
+  int map_count;
+  int map_capacity;
+
+  HeapSlot* map_slots;
+  int map_slot_count;
+  int map_slot_capacity;
+
+  // Highest record field the code reads, 0 if it reads none.
+  int field_count;
+
+  // The loops compiled to record a profile, their sites and the counters
+  // the sites update, see profile.h. Empty unless recording.
+  RecordedLoop* recorded_loops;
+  int recorded_loop_count;
+  int recorded_loop_capacity;
+
+  ProfileSite* profile_sites;
+  int profile_site_count;
+  int profile_site_capacity;
+
+  atomic_uint_fast64_t* profile_counters;
+  int profile_counter_count;
+  int profile_counter_capacity;
+
+  // Held by the module cache, by the modules importing this one and by every
+  // build and program using it. The last one to let go frees the module.
+  atomic_int users;
+
+  // Neighbours in the cache's recency order.
+  Module* older;
+  Module* newer;
+};
+
+typedef struct {
+  // Modules in initialization order, every module comes after its imports.
+  // The last one is the entry module.
+  Module** modules;
+  int count;
+  int capacity;
+
+  // Where the globals of each module start.
+  int* bases;
+
+  // links[i][ref] is the global offset of module i's ref.
+  int** links;
+  // callees[i][call] is the function module i's call goes to.
+  Callee** callees;
+
+  // Size of the global storage each run of the program needs.
+  int globals_size;
+
+  // Deepest operand stack the top level code of any module needs. Programs
+  // with calls get CALL_STACK_SIZE bytes more and room for MAX_FRAMES
+  // nested calls.
+  int max_stack;
+  bool has_calls;
+
+  // Record fields a stream run has to split out for the program.
+  int field_count;
+
+  // Globals holding heap values.
+  HeapSlot* roots;
+  int root_count;
+  int root_capacity;
+
+  // A `void main()` in the entry module runs once every module is
+  // initialized.
+  bool has_main;
+  Callee main;
+
+  // Set for programs loaded from an image, whose top level code already ran.
+  // Every run starts at main with these globals. All of the program lives in
+  // the mapped image.
+  uint8_t* initial_globals;
+  void* image;
+  size_t image_size;
+} Program;
+
+int find_symbol(Module* module, const char* name, int length);
+int add_symbol(Module* module, const char* name, int length, ValueType type);
+int add_ref(Module* module, Module* owner, int symbol, int offset);
+int find_function(Module* module, const char* name, int length);
+int add_function(Module* module, const char* name, int length,
+                 ValueType return_type);
+int add_call(Module* module, Module* owner, int function);
+void add_dependency(Module* module, const char* name, int length,
+                    uint64_t signature);
+void add_stack_map(Module* module, int code_offset, HeapSlot* slots,
+                   int count);
+// Forgets the maps of safepoints past code_offset, for code that is
+// rewritten.
+void drop_stack_maps(Module* module, int code_offset);
+StackMap* find_stack_map(Module* module, int code_offset);
+
+// The whole of a regular file, NULL after reporting why it could not be read.
+char* read_file(const char* path);
+// Reports on the error stream why the file at path, the %s of message,
+// could not be read, which read_failed tells apart from compile errors.
+void report_read_error(const char* message, const char* path);
+
+// Where compile errors of the current thread go, stderr unless changed.
+FILE* error_stream();
+void set_error_stream(FILE* stream);
+
+// Threads used to compile the modules of one program, 0 for one per CPU.
+void set_compile_threads(int threads);
+
+// Loads the entry file and everything it imports, compiles the modules that
+// are not cached yet in parallel and links them into a program. An image
+// written by write_image is mapped instead.
+bool load_program(Program* program, const char* path);
+// Same as load_program, for a source string. Imports are resolved relative
+// to the working directory.
+bool load_program_source(Program* program, const char* source);
+// Same as load_program, for a rule set, see compile_rules.
+bool load_rules(Program* program, const char* path);
+// Whether the last load of the calling thread failed because a file could
+// not be read, rather than because the source did not compile.
+bool read_failed();
+void free_program(Program* program);
+
+void init_program(Program* program);
+// Compiles source as one more module of a program that grows entry by
+// entry, like a REPL session. The module sees what the earlier entries
+// declared and imported through scope. Imports the program does not have
+// yet are added before it. Returns the index of the first module added,
+// which is where running the entry starts, or -1 if it does not compile.
+int extend_program(Program* program, Scope* scope, const char* source);
+
+void init_scope(Scope* scope);
+void free_scope(Scope* scope);
+// The symbol or function a scope gives the name, -1 if none, with owner
+// set to the module it belongs to.
+int scope_symbol(Scope* scope, const char* name, int length, Module** owner);
+int scope_function(Scope* scope, const char* name, int length,
+                   Module** owner);
+
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+
+  int count;
+  int limit;
+} CacheStats;
+
+// Most compiled modules kept around for reuse. The least recently used ones
+// are evicted past that, unless a cached module still imports them or a
+// program is using them.
+void set_module_cache_limit(int limit);
+CacheStats module_cache_stats();
+void free_module_cache();
+
+#endif
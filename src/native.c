@@ -0,0 +1,35 @@
+#include "native.h"
+
+Native natives[MAX_NATIVES];
+int native_count = 0;
+
+int define_native(const char* name, ValueType return_type,
+                  const ValueType* params, int arity, NativeFn fn) {
+  if (native_count == MAX_NATIVES || arity > MAX_PARAMS) return -1;
+
+  Native* native = &natives[native_count];
+  native->name = name;
+  native->length = (int)strlen(name);
+  native->return_type = return_type;
+  native->arity = arity;
+  native->params_size = 0;
+  native->fn = fn;
+
+  for (int i = 0; i < arity; i++) {
+    native->params[i] = params[i];
+    native->params_size += value_size(params[i]);
+  }
+
+  return native_count++;
+}
+
+int find_native(const char* name, int length) {
+  for (int i = 0; i < native_count; i++) {
+    if (natives[i].length == length &&
+        memcmp(natives[i].name, name, length) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef nol_native_h
+#define nol_native_h
+
+#include "common.h"
+#include "module.h"
+#include "value.h"
+#include "vm.h"
+
+#define MAX_NATIVES 256
+
+// A host function. The arguments sit at args exactly as the caller pushed
+// them: packed in order, each taking value_size of its type, unaligned. The
+// function writes its result over them, at args. Nothing is copied or boxed
+// on the way in or out.
+typedef void (*NativeFn)(Fiber* fiber, uint8_t* args);
+
+typedef struct {
+  const char* name;
+  int length;
+  ValueType return_type;
+
+  ValueType params[MAX_PARAMS];
+  int arity;
+  int params_size;
+
+  NativeFn fn;
+} Native;
+
+// Indexed by the operand of OP_CALL_NATIVE.
+extern Native natives[MAX_NATIVES];
+
+// Makes fn callable from scripts as name, with a signature the compiler
+// checks calls against. Returns its index, or -1 if the table is full or the
+// signature takes too many parameters. Natives have to be defined before
+// any program using them is compiled, and are never removed. name is not
+// copied. Natives called in a parallel for run on several threads at once.
+int define_native(const char* name, ValueType return_type,
+                  const ValueType* params, int arity, NativeFn fn);
+int find_native(const char* name, int length);
+
+#endif
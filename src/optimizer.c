@@ -0,0 +1,1435 @@
+#include "optimizer.h"
+
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "hash.h"
+#include "native.h"
+#include "profile.h"
+#include "value.h"
+
+// Hidden locals one loop may get for hoisted and derived values.
+#define MAX_HIDDEN 16
+// Steps of one counter the strength reduction follows.
+#define MAX_STEPS 16
+// Largest step of a counter whose array accesses lose their bounds checks.
+// It keeps the counter from overflowing on its way past the length.
+#define MAX_STEP 16
+// Unrolled bodies stay within this many instructions.
+#define UNROLL_LIMIT 64
+#define UNROLL_FACTOR 4
+// Operands tracked on the stack of one block.
+#define MAX_TRACKED 64
+// Runs a node needs in the profile before what it saw is acted on.
+#define MIN_PROFILE_RUNS 64
+
+typedef struct {
+  uint8_t op;
+  uint8_t type;
+  int32_t operand;
+  int32_t immediate;
+  int32_t cost;
+
+  // Jumps: the node jumped to, the node count for the end of the loop.
+  int target;
+  // The heap slots of a safepoint, in the loop's slots.
+  int first_slot;
+  int slot_count;
+
+  // Reads or steps hidden local number operand. The operand becomes its
+  // offset once the loop's own locals have moved up to make room.
+  bool hidden;
+
+  // Times the node ran, from the profile.
+  uint64_t runs;
+} Node;
+
+typedef struct {
+  Node* nodes;
+  int count;
+  int capacity;
+} NodeList;
+
+// What is known about the value a node pushes and the ones it pops. Values
+// are followed within a block only.
+typedef struct {
+  // Nodes that pushed the values it pops, in push order, -1 if unknown.
+  int operands[3];
+  // The node popping its value, -1 if unknown.
+  int consumer;
+  // First node of the code computing its value, -1 if that code is not one
+  // straight run.
+  int first;
+  bool invariant;
+} ValueInfo;
+
+// A counter times a constant, kept in a hidden local stepped along with the
+// counter.
+typedef struct {
+  uint8_t get;
+  int32_t operand;
+  int32_t factor;
+  int hidden;
+} Derived;
+
+typedef struct {
+  LoopInfo* info;
+  Code* code;
+  NodeList list;
+
+  HeapSlot* slots;
+  int slot_count;
+  int slot_capacity;
+
+  // Code computing the hidden locals before the loop starts, in order.
+  NodeList preheader;
+  ValueType hidden_types[MAX_HIDDEN];
+  int hidden_offsets[MAX_HIDDEN];
+  int hidden_starts[MAX_HIDDEN];
+  int hidden_lengths[MAX_HIDDEN];
+  int hidden_count;
+  int hidden_size;
+
+  // Filled by analyze.
+  int analyzed_count;
+  bool* targets;
+  ValueInfo* values;
+  // By byte of the locals declared before the loop, and by global ref.
+  bool* locals_written;
+  bool* globals_written;
+  bool calls;
+
+  bool changed;
+} Loop;
+
+void add_node(NodeList* list, Node* node) {
+  if (list->capacity < list->count + 1) {
+    int old_capacity = list->capacity;
+
+    list->capacity = GROW_CAPACITY(old_capacity);
+    list->nodes = GROW_ARRAY(Node, list->nodes, old_capacity, list->capacity);
+  }
+
+  list->nodes[list->count++] = *node;
+}
+
+void free_nodes(NodeList* list) {
+  FREE_ARRAY(Node, list->nodes, list->capacity);
+  list->nodes = NULL;
+  list->count = 0;
+  list->capacity = 0;
+}
+
+Node new_node(uint8_t op, uint8_t type, int32_t operand) {
+  Node node = {op, type, operand, 0, 0, -1, -1, 0, false, 0};
+  return node;
+}
+
+Instruction node_instruction(Node* node) {
+  Instruction instruction = {node->op,        node->type, node->operand,
+                             node->immediate, node->cost, 0};
+  return instruction;
+}
+
+bool is_jump(uint8_t op) { return op_info[op].operand == OPERAND_JUMP; }
+
+// Instructions that close a block and carry its cost.
+bool ends_block(uint8_t op) {
+  switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_LOOP:
+    case OP_FUEL:
+    case OP_CALL_NATIVE:
+    case OP_TAIL_CALL:
+    case OP_RETURN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_variable(Node* node) {
+  return (node->op == OP_GET_LOCAL || node->op == OP_GET_GLOBAL) &&
+         !node->hidden;
+}
+
+bool same_variable(Node* a, Node* b) {
+  return is_variable(a) && is_variable(b) && a->op == b->op &&
+         a->operand == b->operand;
+}
+
+bool same_nodes(Node* a, Node* b, int count) {
+  for (int i = 0; i < count; i++) {
+    if (a[i].op != b[i].op || a[i].type != b[i].type ||
+        a[i].operand != b[i].operand || a[i].immediate != b[i].immediate ||
+        a[i].hidden != b[i].hidden) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void add_slot(Loop* loop, HeapSlot* slot) {
+  if (loop->slot_capacity < loop->slot_count + 1) {
+    int old_capacity = loop->slot_capacity;
+
+    loop->slot_capacity = GROW_CAPACITY(old_capacity);
+    loop->slots = GROW_ARRAY(HeapSlot, loop->slots, old_capacity,
+                             loop->slot_capacity);
+  }
+
+  loop->slots[loop->slot_count++] = *slot;
+}
+
+// Turns the loop's code into nodes, with jumps pointing at nodes and the
+// stack maps of safepoints copied out. Fails for jumps leaving the loop.
+bool decode_loop(Loop* loop) {
+  Module* module = loop->info->module;
+  Code* code = loop->code;
+  int start = loop->info->start;
+  int length = code->count - start;
+
+  int* node_at = ALLOCATE(int, length + 1);
+  for (int i = 0; i <= length; i++) node_at[i] = -1;
+
+  bool valid = true;
+
+  for (int offset = start; offset < code->count;) {
+    Instruction instruction;
+    decode_instruction(code->code, offset, &instruction);
+    int end = offset + instruction.length;
+
+    // Switch tables can't be encoded again, loops with a match are left
+    // as they are. So are loops around a parallel for, whose body other
+    // fibers run.
+    if (instruction.op == OP_TABLESWITCH || instruction.op == OP_LOOKUPSWITCH ||
+        instruction.op == OP_PARALLEL) {
+      valid = false;
+    }
+
+    Node node = new_node(instruction.op, instruction.type,
+                         instruction.operand);
+    node.immediate = instruction.immediate;
+    node.cost = instruction.cost;
+
+    if (instruction.op == OP_LOOP) {
+      node.target = end - instruction.operand - start;
+    } else if (is_jump(instruction.op)) {
+      node.target = end + instruction.operand - start;
+    }
+
+    if (instruction.op == OP_CALL || instruction.op == OP_LOOP) {
+      StackMap* map = find_stack_map(module, end);
+
+      if (map != NULL) {
+        node.first_slot = loop->slot_count;
+        node.slot_count = map->slot_count;
+
+        for (int i = 0; i < map->slot_count; i++) {
+          add_slot(loop, &module->map_slots[map->first_slot + i]);
+        }
+      }
+    }
+
+    node_at[offset - start] = loop->list.count;
+    add_node(&loop->list, &node);
+    offset = end;
+  }
+
+  node_at[length] = loop->list.count;
+
+  for (int i = 0; i < loop->list.count; i++) {
+    Node* node = &loop->list.nodes[i];
+    if (!is_jump(node->op)) continue;
+
+    if (node->target < 0 || node->target > length ||
+        node_at[node->target] == -1) {
+      valid = false;
+    } else {
+      node->target = node_at[node->target];
+    }
+  }
+
+  FREE_ARRAY(int, node_at, length + 1);
+  return valid;
+}
+
+// Makes list the loop's code. remap holds the new index of every old node
+// and of the end.
+void replace_nodes(Loop* loop, NodeList* list, int* remap) {
+  for (int i = 0; i < list->count; i++) {
+    Node* node = &list->nodes[i];
+    if (is_jump(node->op)) node->target = remap[node->target];
+  }
+
+  free_nodes(&loop->list);
+  loop->list = *list;
+}
+
+void mark_local_write(Loop* loop, int offset, int size) {
+  for (int i = offset; i < offset + size && i < loop->info->locals_size;
+       i++) {
+    loop->locals_written[i] = true;
+  }
+}
+
+bool is_local_invariant(Loop* loop, int offset, int size) {
+  if (offset + size > loop->info->locals_size) return false;
+
+  for (int i = offset; i < offset + size; i++) {
+    if (loop->locals_written[i]) return false;
+  }
+
+  return true;
+}
+
+// Refs to one global, which may be to the whole of it or to a field.
+bool same_global(Loop* loop, int a, int b) {
+  GlobalRef* refs = loop->info->module->refs;
+  return refs[a].owner == refs[b].owner && refs[a].symbol == refs[b].symbol;
+}
+
+void mark_global_write(Loop* loop, int ref) {
+  for (int i = 0; i < loop->info->module->ref_count; i++) {
+    if (same_global(loop, i, ref)) loop->globals_written[i] = true;
+  }
+}
+
+bool is_global_invariant(Loop* loop, int ref) {
+  return !loop->calls && !loop->globals_written[ref];
+}
+
+// How many values a node pops and pushes. False for the instructions that
+// reshape the stack in other ways.
+bool stack_effect(Loop* loop, Node* node, int* pops, int* pushes) {
+  Module* module = loop->info->module;
+
+  *pops = 0;
+  *pushes = 0;
+
+  switch (node->op) {
+    case OP_CONSTANT:
+    case OP_CONST_SMALL:
+    case OP_ZERO:
+    case OP_ONE:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_FIELD:
+    case OP_STRING:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+      *pushes = 1;
+      return true;
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_LENGTH:
+    case OP_ARRAY_NEGATE:
+    case OP_ARRAY_NOT:
+    case OP_RANGE:
+    case OP_SUM:
+    case OP_MIN:
+    case OP_MAX:
+    case OP_ABS:
+    case OP_SQRT:
+    case OP_BIT_NOT:
+    case OP_DIVIDE_POW2:
+    case OP_MODULO_POW2:
+    case OP_DIVIDE_MAGIC:
+    case OP_MODULO_MAGIC:
+    case OP_COPY_COLUMN:
+      *pops = 1;
+      *pushes = 1;
+      return true;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_SHIFT_RIGHT_UNSIGNED:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_AND:
+    case OP_OR:
+    case OP_CONCAT:
+    case OP_GET_ELEMENT:
+    case OP_GET_ELEMENT_UNCHECKED:
+    case OP_ARRAY_ADD:
+    case OP_ARRAY_SUBTRACT:
+    case OP_ARRAY_MULTIPLY:
+    case OP_ARRAY_EQUAL:
+    case OP_ARRAY_LESS:
+    case OP_ARRAY_GREATER:
+    case OP_FILL:
+    case OP_FILL_COLUMNS:
+    case OP_FILTER:
+    case OP_MIN_INT:
+    case OP_MAX_INT:
+    case OP_GET_MEMBER:
+    case OP_GET_COLUMN:
+      *pops = 2;
+      *pushes = 1;
+      return true;
+    case OP_CLAMP:
+      *pops = 3;
+      *pushes = 1;
+      return true;
+    case OP_SET_ELEMENT:
+    case OP_SET_ELEMENT_UNCHECKED:
+    case OP_SET_MEMBER:
+    case OP_SET_COLUMN:
+      *pops = 3;
+      return true;
+    case OP_POP:
+    case OP_PRINT:
+    case OP_RESULT:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_JUMP_IF_FALSE:
+      *pops = 1;
+      return true;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+      *pops = 2;
+      return true;
+    case OP_ARRAY:
+      *pops = node->operand;
+      *pushes = 1;
+      return true;
+    case OP_INCREMENT_GLOBAL:
+    case OP_INCREMENT_LOCAL:
+    case OP_JUMP:
+    case OP_LOOP:
+    case OP_FUEL:
+    case OP_PROFILE_BLOCK:
+      return true;
+    case OP_CALL: {
+      CallRef* call = &module->calls[node->operand];
+      Function* function = &call->owner->functions[call->function];
+
+      *pops = function->arity;
+      *pushes = function->return_type != VAL_VOID;
+      return true;
+    }
+    case OP_CALL_NATIVE: {
+      Native* native = &natives[node->operand];
+
+      *pops = native->arity;
+      *pushes = native->return_type != VAL_VOID;
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+bool are_operands_invariant(Loop* loop, ValueInfo* value, int count) {
+  for (int i = 0; i < count; i++) {
+    int operand = value->operands[i];
+    if (operand == -1 || !loop->values[operand].invariant) return false;
+  }
+
+  return true;
+}
+
+// Whether the node computes the same value on every iteration, without side
+// effects and without failing.
+bool is_invariant(Loop* loop, int index) {
+  Node* node = &loop->list.nodes[index];
+  ValueInfo* value = &loop->values[index];
+
+  if (node->hidden) return false;
+
+  switch (node->op) {
+    case OP_CONSTANT:
+    case OP_CONST_SMALL:
+    case OP_ZERO:
+    case OP_ONE:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_FIELD:
+    case OP_STRING:
+      return true;
+    case OP_GET_LOCAL:
+      return is_local_invariant(loop, node->operand, value_size(node->type));
+    case OP_GET_GLOBAL:
+      return is_global_invariant(loop, node->operand);
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_LENGTH:
+    case OP_ABS:
+    case OP_BIT_NOT:
+    case OP_DIVIDE_POW2:
+    case OP_MODULO_POW2:
+    case OP_DIVIDE_MAGIC:
+    case OP_MODULO_MAGIC:
+      return are_operands_invariant(loop, value, 1);
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_AND:
+    case OP_OR:
+    case OP_MIN_INT:
+    case OP_MAX_INT:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_SHIFT_RIGHT_UNSIGNED:
+      return are_operands_invariant(loop, value, 2);
+    case OP_CLAMP:
+      return are_operands_invariant(loop, value, 3);
+    default:
+      return false;
+  }
+}
+
+ValueType result_type(Node* node) {
+  switch (node->op) {
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+      return node->type;
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_AND:
+    case OP_OR:
+      return VAL_BOOL;
+    case OP_STRING:
+      return VAL_STRING;
+    default:
+      return VAL_INT;
+  }
+}
+
+// Finds the jump targets, the variables the loop writes and where the
+// values of its expressions come from and go.
+void analyze(Loop* loop) {
+  FREE_ARRAY(bool, loop->targets, loop->analyzed_count + 1);
+  FREE_ARRAY(ValueInfo, loop->values, loop->analyzed_count);
+
+  int count = loop->list.count;
+  Node* nodes = loop->list.nodes;
+
+  loop->analyzed_count = count;
+  loop->targets = ALLOCATE(bool, count + 1);
+  loop->values = ALLOCATE(ValueInfo, count);
+  memset(loop->targets, 0, sizeof(bool) * (count + 1));
+  for (int i = 0; i < loop->info->locals_size; i++) {
+    loop->locals_written[i] = false;
+  }
+  for (int i = 0; i < loop->info->module->ref_count; i++) {
+    loop->globals_written[i] = false;
+  }
+  loop->calls = false;
+
+  for (int i = 0; i < count; i++) {
+    Node* node = &nodes[i];
+
+    if (is_jump(node->op)) loop->targets[node->target] = true;
+    if (node->hidden) continue;
+
+    switch (node->op) {
+      case OP_SET_LOCAL:
+        mark_local_write(loop, node->operand, value_size(node->type));
+        break;
+      case OP_INCREMENT_LOCAL:
+        mark_local_write(loop, node->operand, sizeof(int32_t));
+        break;
+      case OP_SET_GLOBAL:
+      case OP_INCREMENT_GLOBAL:
+        mark_global_write(loop, node->operand);
+        break;
+      case OP_CALL:
+      case OP_CALL_NATIVE:
+      case OP_TAIL_CALL:
+        loop->calls = true;
+        break;
+      default:
+        break;
+    }
+  }
+
+  int stack[MAX_TRACKED];
+  int depth = 0;
+
+  for (int i = 0; i < count; i++) {
+    ValueInfo* value = &loop->values[i];
+
+    for (int j = 0; j < 3; j++) value->operands[j] = -1;
+    value->consumer = -1;
+    value->first = -1;
+    value->invariant = false;
+
+    if (loop->targets[i] || (i > 0 && ends_block(nodes[i - 1].op))) {
+      depth = 0;
+    }
+
+    int pops;
+    int pushes;
+
+    if (!stack_effect(loop, &nodes[i], &pops, &pushes)) {
+      depth = 0;
+      continue;
+    }
+
+    if (pops > 3 || pops > depth) {
+      depth = 0;
+    } else {
+      for (int j = pops - 1; j >= 0; j--) {
+        int operand = stack[--depth];
+
+        value->operands[j] = operand;
+        loop->values[operand].consumer = i;
+      }
+
+      // The operands have to be computed right before the node, one after
+      // the other.
+      int expected = i - 1;
+      value->first = i;
+
+      for (int j = pops - 1; j >= 0; j--) {
+        int operand = value->operands[j];
+
+        if (operand != expected || loop->values[operand].first == -1) {
+          value->first = -1;
+          break;
+        }
+
+        value->first = loop->values[operand].first;
+        expected = value->first - 1;
+      }
+
+      value->invariant = is_invariant(loop, i);
+    }
+
+    if (pushes > 0) {
+      if (depth == MAX_TRACKED) depth = 0;
+      stack[depth++] = i;
+    }
+  }
+}
+
+// The start value of a counter, if the code before the loop set it.
+bool entry_value(Loop* loop, Node* counter, int32_t* value) {
+  OP set = counter->op == OP_GET_LOCAL ? OP_SET_LOCAL : OP_SET_GLOBAL;
+
+  for (int i = 0; i < loop->info->entry_count; i++) {
+    LoopEntry* entry = &loop->info->entries[i];
+
+    if (entry->set == set && entry->operand == counter->operand) {
+      *value = entry->value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Finds where a counter steps, a variable the loop only changes by adding
+// constants to it, filling steps, which has room for MAX_STEPS. Returns how
+// often it does, or -1 if the variable changes in other ways.
+int counter_steps(Loop* loop, Node* counter, int* steps) {
+  bool local = counter->op == OP_GET_LOCAL;
+
+  if (local && counter->operand + 4 > loop->info->locals_size) return -1;
+  if (!local && loop->calls) return -1;
+
+  int count = 0;
+
+  for (int i = 0; i < loop->list.count; i++) {
+    Node* node = &loop->list.nodes[i];
+    if (node->hidden) continue;
+
+    bool step = false;
+    bool write = false;
+
+    if (local && (node->op == OP_SET_LOCAL ||
+                  node->op == OP_INCREMENT_LOCAL)) {
+      int size = node->op == OP_SET_LOCAL ? value_size(node->type) : 4;
+
+      write = node->operand < counter->operand + 4 &&
+              counter->operand < node->operand + size;
+      step = node->op == OP_INCREMENT_LOCAL &&
+             node->operand == counter->operand;
+    } else if (!local && (node->op == OP_SET_GLOBAL ||
+                          node->op == OP_INCREMENT_GLOBAL)) {
+      write = same_global(loop, node->operand, counter->operand);
+      step = node->op == OP_INCREMENT_GLOBAL &&
+             node->operand == counter->operand;
+    }
+
+    if (!write) continue;
+    if (!step || count == MAX_STEPS) return -1;
+
+    steps[count++] = i;
+  }
+
+  return count;
+}
+
+// [GET x, constant, ADD or SUBTRACT, SET x] on an int variable.
+bool is_increment(Loop* loop, int index, int32_t* amount) {
+  Node* nodes = &loop->list.nodes[index];
+
+  if (!is_variable(&nodes[0]) || nodes[0].type != VAL_INT) return false;
+
+  OP set = nodes[0].op == OP_GET_LOCAL ? OP_SET_LOCAL : OP_SET_GLOBAL;
+  if (nodes[3].op != set || nodes[3].operand != nodes[0].operand) {
+    return false;
+  }
+
+  for (int i = 1; i <= 3; i++) {
+    if (loop->targets[index + i]) return false;
+  }
+
+  int32_t value;
+  if (!read_int_constant(loop->code, nodes[1].op, nodes[1].operand, &value)) {
+    return false;
+  }
+
+  int64_t step = value;
+  if (nodes[2].op == OP_SUBTRACT) {
+    step = -step;
+  } else if (nodes[2].op != OP_ADD) {
+    return false;
+  }
+
+  if (step < INT8_MIN || step > INT8_MAX) return false;
+
+  *amount = (int32_t)step;
+  return true;
+}
+
+// Turns `x = x + k` into a single instruction.
+void combine_increments(Loop* loop) {
+  analyze(loop);
+
+  int count = loop->list.count;
+  int* remap = ALLOCATE(int, count + 1);
+  NodeList list = {NULL, 0, 0};
+
+  for (int i = 0; i < count;) {
+    remap[i] = list.count;
+
+    int32_t amount;
+
+    if (i + 3 < count && is_increment(loop, i, &amount)) {
+      Node* get = &loop->list.nodes[i];
+      Node step = new_node(get->op == OP_GET_LOCAL ? OP_INCREMENT_LOCAL
+                                                   : OP_INCREMENT_GLOBAL,
+                           VAL_VOID, get->operand);
+      step.immediate = amount;
+
+      add_node(&list, &step);
+      for (int j = 1; j <= 3; j++) remap[i + j] = list.count - 1;
+
+      i += 4;
+      loop->changed = true;
+      continue;
+    }
+
+    add_node(&list, &loop->list.nodes[i]);
+    i++;
+  }
+
+  remap[count] = list.count;
+  replace_nodes(loop, &list, remap);
+  FREE_ARRAY(int, remap, count + 1);
+}
+
+// A loop of the form `while (i < a.length) { ...; i = i + k; }`, with i
+// starting at 0 or more, a not changing and k small and positive, has i in
+// bounds of a everywhere in its body. a[i] is not checked there.
+void remove_bounds_checks(Loop* loop) {
+  analyze(loop);
+
+  Node* nodes = loop->list.nodes;
+  int count = loop->list.count;
+
+  if (count < 7) return;
+
+  Node* counter = &nodes[0];
+  Node* array = &nodes[1];
+
+  if (!is_variable(counter) || counter->type != VAL_INT) return;
+  if (!is_variable(array) ||
+      (array->type != VAL_INT_ARRAY && array->type != VAL_BOOL_ARRAY)) {
+    return;
+  }
+
+  if (nodes[2].op != OP_LENGTH || nodes[3].op != OP_LESS ||
+      nodes[4].op != OP_JUMP_IF_FALSE || nodes[4].target != count ||
+      !loop->values[1].invariant) {
+    return;
+  }
+
+  int steps[MAX_STEPS];
+  if (counter_steps(loop, counter, steps) != 1) return;
+
+  int step = steps[0];
+  if (step != count - 2 || nodes[step].immediate <= 0 ||
+      nodes[step].immediate > MAX_STEP) {
+    return;
+  }
+
+  int32_t start;
+  if (!entry_value(loop, counter, &start) || start < 0) return;
+
+  for (int i = 5; i < count; i++) {
+    Node* node = &nodes[i];
+    ValueInfo* value = &loop->values[i];
+
+    if (node->op != OP_GET_ELEMENT && node->op != OP_SET_ELEMENT) continue;
+    if (value->operands[0] == -1 || value->operands[1] == -1) continue;
+
+    if (same_variable(&nodes[value->operands[0]], array) &&
+        same_variable(&nodes[value->operands[1]], counter)) {
+      node->op = node->op == OP_GET_ELEMENT ? OP_GET_ELEMENT_UNCHECKED
+                                            : OP_SET_ELEMENT_UNCHECKED;
+      loop->changed = true;
+    }
+  }
+}
+
+// Gives the loop a hidden local holding the value of code, which is
+// computed once before the loop. Locals for the same code are shared.
+// Returns the local's number, -1 if the loop has no room for more.
+int add_hidden(Loop* loop, Node* code, int length, ValueType type) {
+  for (int i = 0; i < loop->hidden_count; i++) {
+    if (loop->hidden_lengths[i] == length &&
+        same_nodes(&loop->preheader.nodes[loop->hidden_starts[i]], code,
+                   length)) {
+      return i;
+    }
+  }
+
+  if (loop->hidden_count == MAX_HIDDEN) return -1;
+
+  int hidden = loop->hidden_count++;
+
+  loop->hidden_types[hidden] = type;
+  loop->hidden_offsets[hidden] = loop->hidden_size;
+  loop->hidden_starts[hidden] = loop->preheader.count;
+  loop->hidden_lengths[hidden] = length;
+  loop->hidden_size += value_size(type);
+
+  for (int i = 0; i < length; i++) {
+    Node node = code[i];
+    node.first_slot = -1;
+    node.slot_count = 0;
+
+    add_node(&loop->preheader, &node);
+  }
+
+  loop->changed = true;
+  return hidden;
+}
+
+Node hidden_node(uint8_t op, ValueType type, int hidden) {
+  Node node = new_node(op, type, hidden);
+  node.hidden = true;
+  return node;
+}
+
+// Replaces each product of a counter and a constant with a hidden local
+// that starts at that product and steps along with the counter, each step
+// times the constant.
+void reduce_strength(Loop* loop) {
+  analyze(loop);
+
+  Node* nodes = loop->list.nodes;
+  int count = loop->list.count;
+
+  Derived derived[MAX_HIDDEN];
+  int derived_count = 0;
+
+  int* reduced = ALLOCATE(int, count);
+  for (int i = 0; i < count; i++) reduced[i] = -1;
+
+  for (int i = 2; i < count; i++) {
+    ValueInfo* value = &loop->values[i];
+
+    if (nodes[i].op != OP_MULTIPLY || value->operands[0] != i - 2 ||
+        value->operands[1] != i - 1) {
+      continue;
+    }
+
+    Node* counter = &nodes[i - 2];
+    Node* constant = &nodes[i - 1];
+
+    if (!is_variable(counter)) {
+      counter = &nodes[i - 1];
+      constant = &nodes[i - 2];
+    }
+
+    int32_t factor;
+
+    if (!is_variable(counter) || counter->type != VAL_INT ||
+        !read_int_constant(loop->code, constant->op, constant->operand,
+                           &factor)) {
+      continue;
+    }
+
+    int steps[MAX_STEPS];
+    int step_count = counter_steps(loop, counter, steps);
+    if (step_count <= 0) continue;
+
+    bool fits = true;
+
+    for (int j = 0; j < step_count; j++) {
+      int64_t step = (int64_t)nodes[steps[j]].immediate * factor;
+      if (step < INT8_MIN || step > INT8_MAX) fits = false;
+    }
+
+    if (!fits) continue;
+
+    int hidden = add_hidden(loop, &nodes[i - 2], 3, VAL_INT);
+    if (hidden == -1) break;
+
+    reduced[i - 2] = hidden;
+
+    bool known = false;
+    for (int j = 0; j < derived_count; j++) {
+      if (derived[j].hidden == hidden) known = true;
+    }
+
+    if (!known) {
+      Derived* product = &derived[derived_count++];
+      product->get = counter->op;
+      product->operand = counter->operand;
+      product->factor = factor;
+      product->hidden = hidden;
+    }
+  }
+
+  if (derived_count == 0) {
+    FREE_ARRAY(int, reduced, count);
+    return;
+  }
+
+  int* remap = ALLOCATE(int, count + 1);
+  NodeList list = {NULL, 0, 0};
+
+  for (int i = 0; i < count;) {
+    remap[i] = list.count;
+
+    if (reduced[i] != -1) {
+      Node read = hidden_node(OP_GET_LOCAL, VAL_INT, reduced[i]);
+      add_node(&list, &read);
+
+      remap[i + 1] = list.count - 1;
+      remap[i + 2] = list.count - 1;
+      i += 3;
+      continue;
+    }
+
+    Node* node = &nodes[i];
+    add_node(&list, node);
+
+    for (int j = 0; j < derived_count && !node->hidden; j++) {
+      Derived* product = &derived[j];
+      OP step_op = product->get == OP_GET_LOCAL ? OP_INCREMENT_LOCAL
+                                                : OP_INCREMENT_GLOBAL;
+
+      if (node->op == step_op && node->operand == product->operand) {
+        Node step = hidden_node(OP_INCREMENT_LOCAL, VAL_VOID,
+                                product->hidden);
+        step.immediate = node->immediate * product->factor;
+        add_node(&list, &step);
+      }
+    }
+
+    i++;
+  }
+
+  remap[count] = list.count;
+  replace_nodes(loop, &list, remap);
+
+  FREE_ARRAY(int, remap, count + 1);
+  FREE_ARRAY(int, reduced, count);
+}
+
+bool is_hoistable(Loop* loop, int index) {
+  ValueInfo* value = &loop->values[index];
+
+  if (!value->invariant || value->first == -1 || value->first == index) {
+    return false;
+  }
+
+  ValueType type = result_type(&loop->list.nodes[index]);
+  return type == VAL_INT || type == VAL_BOOL;
+}
+
+// Moves the largest invariant expressions out of the loop. Each is
+// computed once into a hidden local the loop reads instead.
+void hoist_invariants(Loop* loop) {
+  analyze(loop);
+
+  Node* nodes = loop->list.nodes;
+  int count = loop->list.count;
+
+  int* hoisted = ALLOCATE(int, count);
+  int* ends = ALLOCATE(int, count);
+  for (int i = 0; i < count; i++) hoisted[i] = -1;
+
+  bool any = false;
+
+  for (int i = 0; i < count; i++) {
+    if (!is_hoistable(loop, i)) continue;
+
+    int consumer = loop->values[i].consumer;
+    if (consumer != -1 && is_hoistable(loop, consumer)) continue;
+
+    int first = loop->values[i].first;
+    int hidden = add_hidden(loop, &nodes[first], i - first + 1,
+                            result_type(&nodes[i]));
+    if (hidden == -1) break;
+
+    hoisted[first] = hidden;
+    ends[first] = i;
+    any = true;
+  }
+
+  if (any) {
+    int* remap = ALLOCATE(int, count + 1);
+    NodeList list = {NULL, 0, 0};
+
+    for (int i = 0; i < count;) {
+      remap[i] = list.count;
+
+      if (hoisted[i] == -1) {
+        add_node(&list, &nodes[i]);
+        i++;
+        continue;
+      }
+
+      int hidden = hoisted[i];
+      Node read = hidden_node(OP_GET_LOCAL, loop->hidden_types[hidden],
+                              hidden);
+      add_node(&list, &read);
+
+      for (int j = i + 1; j <= ends[i]; j++) remap[j] = list.count - 1;
+      i = ends[i] + 1;
+    }
+
+    remap[count] = list.count;
+    replace_nodes(loop, &list, remap);
+    FREE_ARRAY(int, remap, count + 1);
+  }
+
+  FREE_ARRAY(int, ends, count);
+  FREE_ARRAY(int, hoisted, count);
+}
+
+// The hidden locals go right above the locals declared before the loop.
+// The loop's own locals move up by their size.
+void place_hidden(Loop* loop) {
+  int base = loop->info->locals_size;
+
+  for (int i = 0; i < loop->list.count; i++) {
+    Node* node = &loop->list.nodes[i];
+
+    if (node->hidden) {
+      node->operand = base + loop->hidden_offsets[node->operand];
+    } else if ((node->op == OP_GET_LOCAL || node->op == OP_SET_LOCAL ||
+                node->op == OP_INCREMENT_LOCAL) &&
+               node->operand >= base) {
+      node->operand += loop->hidden_size;
+    }
+  }
+
+  for (int i = 0; i < loop->slot_count; i++) {
+    if (loop->slots[i].offset >= base) {
+      loop->slots[i].offset += loop->hidden_size;
+    }
+  }
+}
+
+// Repeats the body of `while (i < N) { ...; i = i + k; }` when the body runs
+// straight through and the number of iterations, known from the start value
+// of i, is a multiple of the copies. Only every few iterations check the
+// condition and jump back then.
+void unroll_loop(Loop* loop) {
+  analyze(loop);
+
+  Node* nodes = loop->list.nodes;
+  int count = loop->list.count;
+
+  if (count < 6) return;
+
+  Node* counter = &nodes[0];
+  int32_t limit;
+
+  if (!is_variable(counter) || counter->type != VAL_INT ||
+      !read_int_constant(loop->code, nodes[1].op, nodes[1].operand, &limit) ||
+      nodes[2].op != OP_LESS || nodes[3].op != OP_JUMP_IF_FALSE ||
+      nodes[3].target != count) {
+    return;
+  }
+
+  for (int i = 4; i < count - 1; i++) {
+    if (ends_block(nodes[i].op) || nodes[i].op == OP_CALL) return;
+  }
+
+  int steps[MAX_STEPS];
+  if (counter_steps(loop, counter, steps) != 1) return;
+
+  int step = steps[0];
+  if (nodes[step].immediate <= 0) return;
+
+  int32_t start;
+  if (!entry_value(loop, counter, &start) || start >= limit) return;
+
+  int64_t amount = nodes[step].immediate;
+  int64_t trips = ((int64_t)limit - start + amount - 1) / amount;
+
+  // The counter must not wrap around on the last step.
+  if (start + trips * amount > INT32_MAX) return;
+
+  int body_length = count - 5;
+  int factor = 0;
+
+  for (int copies = UNROLL_FACTOR; copies >= 2; copies /= 2) {
+    if (trips % copies == 0 && body_length * copies <= UNROLL_LIMIT) {
+      factor = copies;
+      break;
+    }
+  }
+
+  if (factor == 0) return;
+
+  NodeList list = {NULL, 0, 0};
+
+  for (int i = 0; i < 4; i++) add_node(&list, &nodes[i]);
+
+  for (int copy = 0; copy < factor; copy++) {
+    for (int i = 4; i < count - 1; i++) add_node(&list, &nodes[i]);
+  }
+
+  add_node(&list, &nodes[count - 1]);
+  list.nodes[3].target = list.count;
+
+  free_nodes(&loop->list);
+  loop->list = list;
+  loop->changed = true;
+}
+
+// Whether the loop has no loop inside, which makes it the one a profile
+// follows.
+bool is_innermost(Loop* loop) {
+  for (int i = 0; i < loop->list.count - 1; i++) {
+    if (loop->list.nodes[i].op == OP_LOOP) return false;
+  }
+
+  return true;
+}
+
+// What the loop's code is, before any pass changes it. Operands are left
+// out, constant indices move when earlier code gets new constants.
+uint64_t loop_signature(Loop* loop) {
+  int count = loop->list.count;
+  uint8_t* bytes = ALLOCATE(uint8_t, count * 2);
+
+  for (int i = 0; i < count; i++) {
+    bytes[i * 2] = loop->list.nodes[i].op;
+    bytes[i * 2 + 1] = loop->list.nodes[i].type;
+  }
+
+  uint64_t signature = hash_bytes(bytes, count * 2);
+  FREE_ARRAY(uint8_t, bytes, count * 2);
+  return signature;
+}
+
+// Puts a counter into the loop at the start of every block for the
+// profile. Jumps to a block go to its counter.
+void instrument_loop(Loop* loop) {
+  Module* module = loop->info->module;
+  Node* nodes = loop->list.nodes;
+  int count = loop->list.count;
+
+  bool* starts = ALLOCATE(bool, count + 1);
+  uint8_t* ops = ALLOCATE(uint8_t, count);
+  memset(starts, 0, sizeof(bool) * (count + 1));
+  starts[0] = true;
+
+  for (int i = 0; i < count; i++) {
+    ops[i] = nodes[i].op;
+    if (is_jump(nodes[i].op)) starts[nodes[i].target] = true;
+    if (ends_block(nodes[i].op)) starts[i + 1] = true;
+  }
+
+  add_recorded_loop(module, loop->info->source_offset, loop_signature(loop),
+                    ops, count);
+
+  NodeList list = {NULL, 0, 0};
+  int* remap = ALLOCATE(int, count + 1);
+
+  for (int i = 0; i < count; i++) {
+    remap[i] = list.count;
+
+    if (starts[i]) {
+      int end = i + 1;
+      while (end < count && !starts[end]) end++;
+
+      Node counter = new_node(OP_PROFILE_BLOCK, VAL_VOID,
+                              add_profile_site(module, i, end - i));
+      add_node(&list, &counter);
+    }
+
+    add_node(&list, &nodes[i]);
+  }
+
+  remap[count] = list.count;
+  replace_nodes(loop, &list, remap);
+  loop->changed = true;
+
+  FREE_ARRAY(int, remap, count + 1);
+  FREE_ARRAY(uint8_t, ops, count);
+  FREE_ARRAY(bool, starts, count + 1);
+}
+
+// Gives the nodes what the profile saw them do, if it has the loop as it is
+// now.
+bool apply_profile(Loop* loop) {
+  LoopProfile* profile = find_loop_profile(loop->info->module->key,
+                                           loop->info->source_offset);
+
+  if (profile == NULL || profile->node_count != loop->list.count ||
+      profile->signature != loop_signature(loop)) {
+    return false;
+  }
+
+  for (int i = 0; i < loop->list.count; i++) {
+    loop->list.nodes[i].runs = profile->nodes[i].runs;
+  }
+
+  return true;
+}
+
+// The branch that stands for a comparison followed by OP_JUMP_IF_FALSE, or
+// OP_END if there is none.
+uint8_t fused_branch(Node* comparison) {
+  switch (comparison->op) {
+    case OP_LESS:
+      return OP_JUMP_IF_NOT_LESS;
+    case OP_GREATER:
+      return OP_JUMP_IF_NOT_GREATER;
+    case OP_EQUAL:
+      return comparison->type == VAL_INT ? OP_JUMP_IF_NOT_EQUAL : OP_END;
+    default:
+      return OP_END;
+  }
+}
+
+// Comparisons of ints branched on right away become one instruction, where
+// the profile saw the pair among the hot ones.
+void fuse_branches(Loop* loop) {
+  analyze(loop);
+
+  Node* nodes = loop->list.nodes;
+  int count = loop->list.count;
+
+  NodeList list = {NULL, 0, 0};
+  int* remap = ALLOCATE(int, count + 1);
+  bool fused = false;
+
+  for (int i = 0; i < count; i++) {
+    remap[i] = list.count;
+    add_node(&list, &nodes[i]);
+
+    if (i + 1 == count) break;
+
+    Node* branch = &nodes[i + 1];
+    uint8_t op = fused_branch(&nodes[i]);
+
+    if (op == OP_END || branch->op != OP_JUMP_IF_FALSE ||
+        loop->targets[i + 1] || nodes[i].runs < MIN_PROFILE_RUNS ||
+        !is_hot_pair(nodes[i].op, OP_JUMP_IF_FALSE)) {
+      continue;
+    }
+
+    Node* node = &list.nodes[list.count - 1];
+    node->op = op;
+    node->type = VAL_VOID;
+    node->operand = 0;
+    node->cost = branch->cost;
+    node->target = branch->target;
+
+    remap[++i] = list.count - 1;
+    fused = true;
+  }
+
+  remap[count] = list.count;
+
+  if (fused) {
+    replace_nodes(loop, &list, remap);
+    loop->changed = true;
+  } else {
+    free_nodes(&list);
+  }
+
+  FREE_ARRAY(int, remap, count + 1);
+}
+
+// Writes the hidden locals' code, the loop and the drop of the hidden locals
+// after it over the original loop, with block costs and jump offsets worked
+// out anew. Fails if a jump got too long.
+bool encode_loop(Loop* loop) {
+  LoopInfo* info = loop->info;
+  NodeList all = {NULL, 0, 0};
+
+  for (int i = 0; i < loop->preheader.count; i++) {
+    add_node(&all, &loop->preheader.nodes[i]);
+  }
+
+  if (loop->preheader.count > 0) {
+    Node fuel = new_node(OP_FUEL, VAL_VOID, 0);
+    add_node(&all, &fuel);
+  }
+
+  int first = all.count;
+
+  for (int i = 0; i < loop->list.count; i++) {
+    Node node = loop->list.nodes[i];
+    if (is_jump(node.op)) node.target += first;
+
+    add_node(&all, &node);
+  }
+
+  int exit = all.count;
+
+  if (loop->hidden_size > 0) {
+    Node drop = new_node(OP_DROP, VAL_VOID, loop->hidden_size);
+    add_node(&all, &drop);
+  }
+
+  int since = 0;
+
+  for (int i = 0; i < all.count; i++) {
+    Node* node = &all.nodes[i];
+
+    if (!ends_block(node->op)) {
+      since++;
+      continue;
+    }
+
+    if (node->op == OP_FUEL) {
+      node->operand = since + 1;
+    } else {
+      node->cost = since + 1;
+    }
+
+    since = 0;
+  }
+
+  int* offsets = ALLOCATE(int, all.count + 1);
+  offsets[0] = info->start;
+
+  for (int i = 0; i < all.count; i++) {
+    Instruction instruction = node_instruction(&all.nodes[i]);
+    offsets[i + 1] = offsets[i] + instruction_length(&instruction);
+  }
+
+  bool fits = true;
+
+  for (int i = 0; i < all.count; i++) {
+    Node* node = &all.nodes[i];
+    if (!is_jump(node->op)) continue;
+
+    int end = offsets[i + 1];
+    int target = offsets[node->target];
+    int jump = node->op == OP_LOOP ? end - target : target - end;
+
+    if (jump < 0 || jump > UINT16_MAX) fits = false;
+    node->operand = jump;
+  }
+
+  if (fits) {
+    Code* code = loop->code;
+
+    code->count = info->start;
+    drop_stack_maps(info->module, info->start);
+
+    for (int i = 0; i < all.count; i++) {
+      Node* node = &all.nodes[i];
+      Instruction instruction = node_instruction(node);
+
+      write_instruction(code, &instruction);
+
+      if (node->first_slot != -1) {
+        add_stack_map(info->module, code->count,
+                      &loop->slots[node->first_slot], node->slot_count);
+      }
+    }
+
+    info->exit = offsets[exit];
+    info->hidden_size = loop->hidden_size;
+  }
+
+  FREE_ARRAY(int, offsets, all.count + 1);
+  free_nodes(&all);
+  return fits;
+}
+
+bool optimize_loop(LoopInfo* info) {
+  Loop loop;
+  memset(&loop, 0, sizeof(loop));
+
+  loop.info = info;
+  loop.code = &info->module->code;
+  loop.locals_written = ALLOCATE(bool, info->locals_size);
+  loop.globals_written = ALLOCATE(bool, info->module->ref_count);
+
+  bool optimized = false;
+
+  if (decode_loop(&loop)) {
+    bool innermost = is_innermost(&loop);
+
+    if (innermost && profile_recording()) {
+      instrument_loop(&loop);
+    } else {
+      bool profiled = innermost && apply_profile(&loop);
+
+      combine_increments(&loop);
+      remove_bounds_checks(&loop);
+      reduce_strength(&loop);
+      hoist_invariants(&loop);
+      if (loop.hidden_count > 0) place_hidden(&loop);
+      unroll_loop(&loop);
+
+      if (profiled) fuse_branches(&loop);
+    }
+
+    optimized = loop.changed && encode_loop(&loop);
+  }
+
+  FREE_ARRAY(bool, loop.targets, loop.analyzed_count + 1);
+  FREE_ARRAY(ValueInfo, loop.values, loop.analyzed_count);
+  FREE_ARRAY(bool, loop.locals_written, info->locals_size);
+  FREE_ARRAY(bool, loop.globals_written, info->module->ref_count);
+  FREE_ARRAY(HeapSlot, loop.slots, loop.slot_capacity);
+  free_nodes(&loop.preheader);
+  free_nodes(&loop.list);
+
+  return optimized;
+}
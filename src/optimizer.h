@@ -0,0 +1,46 @@
+#ifndef nol_optimizer_h
+#define nol_optimizer_h
+
+#include "common.h"
+#include "module.h"
+
+// Variables known to hold int constants when a loop starts.
+#define MAX_LOOP_ENTRIES 8
+
+// An int constant the code right before a loop leaves in a variable, which
+// gives counters their start values. set is OP_SET_LOCAL or OP_SET_GLOBAL.
+typedef struct {
+  OP set;
+  int operand;
+  int32_t value;
+} LoopEntry;
+
+typedef struct {
+  Module* module;
+  // Start of the loop's code, which runs to the end of the module's code.
+  // It must be a block start.
+  int start;
+  // Where the loop's `while` is in the module's source, which finds its
+  // profile.
+  int source_offset;
+  // Bytes of the frame taken by the locals declared before the loop.
+  int locals_size;
+  LoopEntry entries[MAX_LOOP_ENTRIES];
+  int entry_count;
+
+  // Set by optimize_loop: where the code after the loop starts, and the
+  // bytes of hidden locals the loop keeps on the stack while it runs.
+  int exit;
+  int hidden_size;
+} LoopInfo;
+
+// Rewrites a while loop that was just compiled. Loop invariant expressions
+// are computed once before it, multiplications of a counter become a second
+// counter, array accesses indexed by a counter checked against the array's
+// length skip their bounds checks, and short bodies of loops with a fixed
+// trip count are unrolled. Innermost loops with a profile then fuse hot
+// comparisons with their branches. While recording a profile, innermost
+// loops get counters instead. Returns false if the code was left as it was.
+bool optimize_loop(LoopInfo* info);
+
+#endif
@@ -0,0 +1,261 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "memory.h"
+
+typedef struct {
+  TaskFn fn;
+  void* arg;
+} Task;
+
+// A worker's own tasks. The owner pushes and pops at the bottom, idle
+// workers steal the oldest task from the top.
+typedef struct {
+  pthread_mutex_t lock;
+
+  Task* tasks;
+  int top;
+  int bottom;
+  int capacity;
+} Deque;
+
+typedef struct {
+  Pool* pool;
+  int index;
+} Worker;
+
+struct Pool {
+  pthread_t* threads;
+  Worker* workers;
+  Deque* deques;
+  int thread_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t has_work;
+  pthread_cond_t idle;
+
+  // Tasks sitting in the deques.
+  atomic_int queued;
+  // Submitted tasks that have not finished yet.
+  int pending;
+  bool stopping;
+
+  // Deque that gets the next task submitted from outside the pool.
+  atomic_int next;
+};
+
+_Thread_local Worker* current_worker;
+
+void deque_push(Deque* deque, Task task) {
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->bottom - deque->top == deque->capacity) {
+    int old_capacity = deque->capacity;
+    Task* tasks = ALLOCATE(Task, GROW_CAPACITY(old_capacity));
+
+    for (int i = deque->top; i < deque->bottom; i++) {
+      tasks[i - deque->top] = deque->tasks[i % old_capacity];
+    }
+
+    FREE_ARRAY(Task, deque->tasks, old_capacity);
+
+    deque->tasks = tasks;
+    deque->capacity = GROW_CAPACITY(old_capacity);
+    deque->bottom -= deque->top;
+    deque->top = 0;
+  }
+
+  deque->tasks[deque->bottom % deque->capacity] = task;
+  deque->bottom++;
+
+  pthread_mutex_unlock(&deque->lock);
+}
+
+bool deque_pop(Deque* deque, Task* out, bool steal) {
+  pthread_mutex_lock(&deque->lock);
+
+  bool found = deque->bottom > deque->top;
+
+  if (found && steal) {
+    *out = deque->tasks[deque->top % deque->capacity];
+    deque->top++;
+  } else if (found) {
+    deque->bottom--;
+    *out = deque->tasks[deque->bottom % deque->capacity];
+  }
+
+  if (deque->top == deque->bottom) {
+    deque->top = 0;
+    deque->bottom = 0;
+  }
+
+  pthread_mutex_unlock(&deque->lock);
+  return found;
+}
+
+bool take_task(Pool* pool, int index, Task* out) {
+  if (atomic_load(&pool->queued) == 0) return false;
+
+  bool found = deque_pop(&pool->deques[index], out, false);
+
+  for (int i = 1; !found && i < pool->thread_count; i++) {
+    found = deque_pop(&pool->deques[(index + i) % pool->thread_count], out,
+                      true);
+  }
+
+  if (found) atomic_fetch_sub(&pool->queued, 1);
+  return found;
+}
+
+void run_task(Pool* pool, Task task) {
+  task.fn(task.arg);
+
+  pthread_mutex_lock(&pool->lock);
+
+  pool->pending--;
+  if (pool->pending == 0) pthread_cond_broadcast(&pool->idle);
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void* worker(void* arg) {
+  Worker* self = (Worker*)arg;
+  Pool* pool = self->pool;
+
+  current_worker = self;
+
+  while (true) {
+    Task task;
+
+    if (!take_task(pool, self->index, &task)) {
+      pthread_mutex_lock(&pool->lock);
+
+      while (atomic_load(&pool->queued) == 0 && !pool->stopping) {
+        pthread_cond_wait(&pool->has_work, &pool->lock);
+      }
+
+      bool stop = atomic_load(&pool->queued) == 0;
+      pthread_mutex_unlock(&pool->lock);
+
+      if (stop) return NULL;
+      continue;
+    }
+
+    run_task(pool, task);
+  }
+}
+
+bool pool_run_next(Pool* pool) {
+  if (current_worker == NULL || current_worker->pool != pool) return false;
+
+  Task task;
+  if (!take_task(pool, current_worker->index, &task)) return false;
+
+  run_task(pool, task);
+  return true;
+}
+
+Pool* new_pool(int thread_count) {
+  Pool* pool = ALLOCATE(Pool, 1);
+
+  pool->threads = ALLOCATE(pthread_t, thread_count);
+  pool->workers = ALLOCATE(Worker, thread_count);
+  pool->deques = ALLOCATE(Deque, thread_count);
+  pool->thread_count = thread_count;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->has_work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  atomic_init(&pool->queued, 0);
+  pool->pending = 0;
+  pool->stopping = false;
+  atomic_init(&pool->next, 0);
+
+  for (int i = 0; i < thread_count; i++) {
+    Deque* deque = &pool->deques[i];
+
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->tasks = NULL;
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->capacity = 0;
+
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i;
+  }
+
+  for (int i = 0; i < thread_count; i++) {
+    pthread_create(&pool->threads[i], NULL, worker, &pool->workers[i]);
+  }
+
+  return pool;
+}
+
+void free_pool(Pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->has_work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->thread_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  for (int i = 0; i < pool->thread_count; i++) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    FREE_ARRAY(Task, pool->deques[i].tasks, pool->deques[i].capacity);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->has_work);
+  pthread_cond_destroy(&pool->idle);
+
+  FREE_ARRAY(Deque, pool->deques, pool->thread_count);
+  FREE_ARRAY(Worker, pool->workers, pool->thread_count);
+  FREE_ARRAY(pthread_t, pool->threads, pool->thread_count);
+  FREE_ARRAY(Pool, pool, 1);
+}
+
+// Tasks submitted by a worker go to its own deque, so related work stays on
+// one thread unless someone else runs out. Other submissions are spread
+// round robin.
+void pool_submit(Pool* pool, TaskFn fn, void* arg) {
+  Task task = {fn, arg};
+
+  int index;
+  if (current_worker != NULL && current_worker->pool == pool) {
+    index = current_worker->index;
+  } else {
+    index = atomic_fetch_add(&pool->next, 1) % pool->thread_count;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->pending++;
+  pthread_mutex_unlock(&pool->lock);
+
+  deque_push(&pool->deques[index], task);
+
+  pthread_mutex_lock(&pool->lock);
+  atomic_fetch_add(&pool->queued, 1);
+  pthread_cond_signal(&pool->has_work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(Pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+}
+
+int cpu_count() {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count < 1 ? 1 : (int)count;
+}
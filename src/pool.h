@@ -0,0 +1,23 @@
+#ifndef nol_pool_h
+#define nol_pool_h
+
+#include "common.h"
+
+typedef void (*TaskFn)(void* arg);
+
+typedef struct Pool Pool;
+
+Pool* new_pool(int thread_count);
+void free_pool(Pool* pool);
+
+// Tasks may submit further tasks, pool_wait returns once all of them are done.
+void pool_submit(Pool* pool, TaskFn fn, void* arg);
+void pool_wait(Pool* pool);
+// Runs a queued task on the calling worker of the pool, its own first, then
+// one stolen from the others. False if there is none or the caller is not
+// one of the pool's workers.
+bool pool_run_next(Pool* pool);
+
+int cpu_count();
+
+#endif
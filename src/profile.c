@@ -0,0 +1,259 @@
+#include "profile.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bytecode.h"
+#include "memory.h"
+
+#define PROFILE_HEADER "nol-profile 2"
+
+bool recording = false;
+
+// The loaded profile, read only once compiles start.
+LoopProfile* loop_profiles = NULL;
+int loop_profile_count = 0;
+int loop_profile_capacity = 0;
+
+// Times each pair of opcodes ran one after the other, by first * OP_COUNT +
+// second, and the sum of them all.
+uint64_t* pair_counts = NULL;
+uint64_t pair_total = 0;
+
+void set_profile_recording(bool enabled) { recording = enabled; }
+
+bool profile_recording() { return recording; }
+
+int add_recorded_loop(Module* module, int source_offset, uint64_t signature,
+                      uint8_t* ops, int node_count) {
+  if (module->recorded_loop_capacity < module->recorded_loop_count + 1) {
+    int old_capacity = module->recorded_loop_capacity;
+
+    module->recorded_loop_capacity = GROW_CAPACITY(old_capacity);
+    module->recorded_loops =
+        GROW_ARRAY(RecordedLoop, module->recorded_loops, old_capacity,
+                   module->recorded_loop_capacity);
+  }
+
+  RecordedLoop* loop = &module->recorded_loops[module->recorded_loop_count];
+  loop->source_offset = source_offset;
+  loop->signature = signature;
+  loop->node_count = node_count;
+  loop->ops = ALLOCATE(uint8_t, node_count);
+  memcpy(loop->ops, ops, node_count);
+  loop->first_site = module->profile_site_count;
+  loop->site_count = 0;
+
+  return module->recorded_loop_count++;
+}
+
+int add_profile_site(Module* module, int node, int length) {
+  if (module->profile_site_capacity < module->profile_site_count + 1) {
+    int old_capacity = module->profile_site_capacity;
+
+    module->profile_site_capacity = GROW_CAPACITY(old_capacity);
+    module->profile_sites =
+        GROW_ARRAY(ProfileSite, module->profile_sites, old_capacity,
+                   module->profile_site_capacity);
+  }
+
+  if (module->profile_counter_capacity < module->profile_counter_count + 1) {
+    int old_capacity = module->profile_counter_capacity;
+
+    module->profile_counter_capacity = GROW_CAPACITY(old_capacity);
+    module->profile_counters =
+        GROW_ARRAY(atomic_uint_fast64_t, module->profile_counters,
+                   old_capacity, module->profile_counter_capacity);
+  }
+
+  int counter = module->profile_counter_count++;
+  atomic_init(&module->profile_counters[counter], 0);
+
+  ProfileSite* site = &module->profile_sites[module->profile_site_count++];
+  site->node = node;
+  site->length = length;
+  site->counter = counter;
+
+  module->recorded_loops[module->recorded_loop_count - 1].site_count++;
+  return counter;
+}
+
+uint64_t read_counter(Module* module, int counter) {
+  return atomic_load_explicit(&module->profile_counters[counter],
+                              memory_order_relaxed);
+}
+
+// One line per loop and per site, then the opcode pairs the blocks ran,
+// summed over all loops.
+bool write_profile(Program* program, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) return false;
+
+  uint64_t* pairs = ALLOCATE(uint64_t, OP_COUNT * OP_COUNT);
+  memset(pairs, 0, sizeof(uint64_t) * OP_COUNT * OP_COUNT);
+
+  fprintf(file, "%s\n", PROFILE_HEADER);
+
+  for (int i = 0; i < program->count; i++) {
+    Module* module = program->modules[i];
+
+    for (int j = 0; j < module->recorded_loop_count; j++) {
+      RecordedLoop* loop = &module->recorded_loops[j];
+
+      fprintf(file, "loop %016" PRIx64 " %d %016" PRIx64 " %d\n", module->key,
+              loop->source_offset, loop->signature, loop->node_count);
+
+      for (int k = 0; k < loop->site_count; k++) {
+        ProfileSite* site = &module->profile_sites[loop->first_site + k];
+        uint64_t count = read_counter(module, site->counter);
+
+        fprintf(file, "block %d %d %" PRIu64 "\n", site->node, site->length,
+                count);
+
+        for (int n = site->node; n < site->node + site->length - 1; n++) {
+          pairs[loop->ops[n] * OP_COUNT + loop->ops[n + 1]] += count;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < OP_COUNT * OP_COUNT; i++) {
+    if (pairs[i] == 0) continue;
+
+    fprintf(file, "pair %s %s %" PRIu64 "\n", op_info[i / OP_COUNT].name,
+            op_info[i % OP_COUNT].name, pairs[i]);
+  }
+
+  FREE_ARRAY(uint64_t, pairs, OP_COUNT * OP_COUNT);
+  return fclose(file) == 0;
+}
+
+int find_op(const char* name) {
+  for (int i = 0; i < OP_COUNT; i++) {
+    if (strcmp(op_info[i].name, name) == 0) return i;
+  }
+
+  return -1;
+}
+
+LoopProfile* add_loop_profile() {
+  if (loop_profile_capacity < loop_profile_count + 1) {
+    int old_capacity = loop_profile_capacity;
+
+    loop_profile_capacity = GROW_CAPACITY(old_capacity);
+    loop_profiles = GROW_ARRAY(LoopProfile, loop_profiles, old_capacity,
+                               loop_profile_capacity);
+  }
+
+  return &loop_profiles[loop_profile_count++];
+}
+
+// Reads one line after the header. Sites refer to the last loop read.
+bool read_profile_line(const char* line) {
+  LoopProfile* loop =
+      loop_profile_count > 0 ? &loop_profiles[loop_profile_count - 1] : NULL;
+
+  uint64_t key;
+  uint64_t signature;
+  uint64_t count;
+  int offset;
+  int node;
+  int length;
+  char first[32];
+  char second[32];
+
+  if (sscanf(line, "loop %" SCNx64 " %d %" SCNx64 " %d", &key, &offset,
+             &signature, &length) == 4) {
+    if (length <= 0) return false;
+
+    loop = add_loop_profile();
+    loop->module_key = key;
+    loop->source_offset = offset;
+    loop->signature = signature;
+    loop->node_count = length;
+    loop->nodes = ALLOCATE(NodeProfile, length);
+    memset(loop->nodes, 0, sizeof(NodeProfile) * length);
+    return true;
+  }
+
+  if (sscanf(line, "block %d %d %" SCNu64, &node, &length, &count) == 3) {
+    if (loop == NULL || node < 0 || length < 1 ||
+        node + length > loop->node_count) {
+      return false;
+    }
+
+    for (int i = node; i < node + length; i++) loop->nodes[i].runs = count;
+    return true;
+  }
+
+  if (sscanf(line, "pair %31s %31s %" SCNu64, first, second, &count) == 3) {
+    int a = find_op(first);
+    int b = find_op(second);
+    if (a == -1 || b == -1) return false;
+
+    pair_counts[a * OP_COUNT + b] += count;
+    pair_total += count;
+    return true;
+  }
+
+  return false;
+}
+
+bool load_profile(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return false;
+
+  free_profile();
+  pair_counts = ALLOCATE(uint64_t, OP_COUNT * OP_COUNT);
+  memset(pair_counts, 0, sizeof(uint64_t) * OP_COUNT * OP_COUNT);
+
+  char line[256];
+  bool valid = fgets(line, sizeof(line), file) != NULL &&
+               strncmp(line, PROFILE_HEADER "\n", sizeof(line)) == 0;
+
+  while (valid && fgets(line, sizeof(line), file) != NULL) {
+    valid = read_profile_line(line);
+  }
+
+  fclose(file);
+
+  if (!valid) free_profile();
+  return valid;
+}
+
+void free_profile() {
+  for (int i = 0; i < loop_profile_count; i++) {
+    LoopProfile* loop = &loop_profiles[i];
+    FREE_ARRAY(NodeProfile, loop->nodes, loop->node_count);
+  }
+
+  FREE_ARRAY(LoopProfile, loop_profiles, loop_profile_capacity);
+  loop_profiles = NULL;
+  loop_profile_count = 0;
+  loop_profile_capacity = 0;
+
+  FREE_ARRAY(uint64_t, pair_counts, OP_COUNT * OP_COUNT);
+  pair_counts = NULL;
+  pair_total = 0;
+}
+
+LoopProfile* find_loop_profile(uint64_t module_key, int source_offset) {
+  for (int i = 0; i < loop_profile_count; i++) {
+    LoopProfile* loop = &loop_profiles[i];
+
+    if (loop->module_key == module_key &&
+        loop->source_offset == source_offset) {
+      return loop;
+    }
+  }
+
+  return NULL;
+}
+
+// A pair earns its instruction at one in 64 of all the pairs that ran.
+bool is_hot_pair(uint8_t first, uint8_t second) {
+  if (pair_counts == NULL || pair_total == 0) return false;
+
+  return pair_counts[first * OP_COUNT + second] * 64 >= pair_total;
+}
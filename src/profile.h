@@ -0,0 +1,63 @@
+#ifndef nol_profile_h
+#define nol_profile_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "module.h"
+
+// Counters a run keeps of its innermost loops, written to a file on exit
+// and read back by later runs to recompile those loops for what they saw.
+// A loop is known by the key of its module, where its `while` is in the
+// source and a signature of its code, so an edited loop loses its profile.
+
+// What the recording run saw a node of a loop do, numbered as the
+// optimizer decodes the loop before changing it.
+typedef struct {
+  // Times the block holding the node ran.
+  uint64_t runs;
+} NodeProfile;
+
+typedef struct {
+  uint64_t module_key;
+  int source_offset;
+  uint64_t signature;
+  int node_count;
+  NodeProfile* nodes;
+} LoopProfile;
+
+// Counters of one module are only updated by the fiber running its code,
+// apart from the chunks of a parallel for, which may lose a count now and
+// then. Both are fine for a profile, which only needs the proportions.
+static inline void count_profile(atomic_uint_fast64_t* counter,
+                                 uint64_t amount) {
+  atomic_store_explicit(
+      counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+      memory_order_relaxed);
+}
+
+// Loops compiled while recording get counters instead of being optimized.
+void set_profile_recording(bool enabled);
+bool profile_recording();
+
+// Records a loop with its node opcodes and returns its index. Sites added
+// after it belong to it.
+int add_recorded_loop(Module* module, int source_offset, uint64_t signature,
+                      uint8_t* ops, int node_count);
+// Adds a site with a zeroed counter and returns the counter.
+int add_profile_site(Module* module, int node, int length);
+// Writes the counters of every module of the program. False if the file
+// can't be written.
+bool write_profile(Program* program, const char* path);
+
+// Reads a profile for the compiles that follow. False if the file can't be
+// read or is not a profile.
+bool load_profile(const char* path);
+void free_profile();
+// The loaded profile of a loop, NULL if there is none.
+LoopProfile* find_loop_profile(uint64_t module_key, int source_offset);
+// Whether the profile saw first followed by second often enough in the
+// blocks that ran to give the pair its own instruction.
+bool is_hot_pair(uint8_t first, uint8_t second);
+
+#endif
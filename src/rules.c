@@ -0,0 +1,551 @@
+#include "rules.h"
+
+#include "bytecode.h"
+#include "hash.h"
+#include "memory.h"
+#include "native.h"
+
+// Values one rule may have on the stack at once while it is merged.
+#define MAX_RULE_STACK 256
+
+typedef struct {
+  uint8_t op;
+  uint8_t type;
+  int32_t operand;
+  int32_t immediate;
+  ValueType value_type;
+
+  // The nodes of its operands, in the rule set's children.
+  int first_child;
+  int child_count;
+
+  // Parents and rules using its value.
+  int uses;
+  // Whether computing it may fail or have side effects, which keeps it from
+  // being computed before it is needed.
+  bool may_fault;
+  // Stack offset of the temporary holding a shared value, -1 for none.
+  int slot;
+} RuleNode;
+
+typedef struct {
+  Module* module;
+  Code* code;
+
+  RuleNode* nodes;
+  int count;
+  int capacity;
+
+  int* children;
+  int child_count;
+  int child_capacity;
+
+  // Open addressing over the nodes for hash consing. Each slot holds a node
+  // index plus one, 0 means empty.
+  int* table;
+  int table_capacity;
+
+  // Instructions emitted since the current block started.
+  int block_size;
+  // Bytes on the stack at the current point of the emitted code.
+  int depth;
+  int max_depth;
+} RuleSet;
+
+void rule_error(int rule, const char* message) {
+  fprintf(error_stream(), "[rule %d] Error: %s\n", rule + 1, message);
+}
+
+// Stack effect, result type and whether an instruction can run ahead of
+// time. False for instructions rule sets do not support.
+bool rule_op(Instruction* instruction, int* pops, ValueType* result,
+             bool* safe) {
+  *pops = 0;
+  *safe = true;
+
+  switch (instruction->op) {
+    case OP_CONSTANT:
+    case OP_CONST_SMALL:
+    case OP_ZERO:
+    case OP_ONE:
+    case OP_FIELD:
+      *result = VAL_INT;
+      return true;
+    case OP_TRUE:
+    case OP_FALSE:
+      *result = VAL_BOOL;
+      return true;
+    case OP_STRING:
+      *result = VAL_STRING;
+      return true;
+    case OP_GET_GLOBAL:
+      *result = instruction->type;
+      return true;
+    case OP_NEGATE:
+    case OP_LENGTH:
+    case OP_SUM:
+    case OP_ABS:
+    case OP_BIT_NOT:
+    case OP_DIVIDE_POW2:
+    case OP_MODULO_POW2:
+    case OP_DIVIDE_MAGIC:
+    case OP_MODULO_MAGIC:
+      *pops = 1;
+      *result = VAL_INT;
+      return true;
+    case OP_NOT:
+      *pops = 1;
+      *result = VAL_BOOL;
+      return true;
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_MIN_INT:
+    case OP_MAX_INT:
+    case OP_BIT_AND:
+    case OP_BIT_OR:
+    case OP_BIT_XOR:
+    case OP_SHIFT_LEFT:
+    case OP_SHIFT_RIGHT:
+    case OP_SHIFT_RIGHT_UNSIGNED:
+      *pops = 2;
+      *result = VAL_INT;
+      return true;
+    case OP_CLAMP:
+      *pops = 3;
+      *result = VAL_INT;
+      return true;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_AND:
+    case OP_OR:
+      *pops = 2;
+      *result = VAL_BOOL;
+      return true;
+    case OP_CONCAT:
+      *pops = 2;
+      *result = VAL_STRING;
+      return true;
+    case OP_ARRAY:
+      *pops = instruction->operand;
+      *result = instruction->type == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+      return true;
+    default:
+      break;
+  }
+
+  *safe = false;
+
+  switch (instruction->op) {
+    case OP_DIVIDE:
+    case OP_MODULO:
+      *pops = 2;
+      *result = VAL_INT;
+      return true;
+    case OP_GET_ELEMENT:
+      *pops = 2;
+      *result = instruction->type;
+      return true;
+    case OP_ARRAY_ADD:
+    case OP_ARRAY_SUBTRACT:
+    case OP_ARRAY_MULTIPLY:
+      *pops = 2;
+      *result = VAL_INT_ARRAY;
+      return true;
+    case OP_ARRAY_EQUAL:
+    case OP_ARRAY_LESS:
+    case OP_ARRAY_GREATER:
+      *pops = 2;
+      *result = VAL_BOOL_ARRAY;
+      return true;
+    case OP_ARRAY_NEGATE:
+    case OP_RANGE:
+      *pops = 1;
+      *result = VAL_INT_ARRAY;
+      return true;
+    case OP_ARRAY_NOT:
+      *pops = 1;
+      *result = VAL_BOOL_ARRAY;
+      return true;
+    case OP_MIN:
+    case OP_MAX:
+    case OP_SQRT:
+      *pops = 1;
+      *result = VAL_INT;
+      return true;
+    case OP_FILL:
+    case OP_FILTER:
+      *pops = 2;
+      *result = instruction->type == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+      return true;
+    case OP_CALL_NATIVE: {
+      Native* native = &natives[instruction->operand];
+
+      *pops = native->arity;
+      *result = native->return_type;
+      return native->return_type != VAL_VOID;
+    }
+    default:
+      return false;
+  }
+}
+
+uint64_t hash_node(RuleNode* node, int* children) {
+  uint64_t hash = hash_combine(node->op, node->type);
+  hash = hash_combine(hash, (uint32_t)node->operand);
+  hash = hash_combine(hash, (uint32_t)node->immediate);
+
+  for (int i = 0; i < node->child_count; i++) {
+    hash = hash_combine(hash, children[i]);
+  }
+
+  return hash;
+}
+
+bool same_node(RuleSet* set, RuleNode* node, RuleNode* other,
+               int* children) {
+  if (node->op != other->op || node->type != other->type ||
+      node->operand != other->operand ||
+      node->immediate != other->immediate ||
+      node->child_count != other->child_count) {
+    return false;
+  }
+
+  for (int i = 0; i < node->child_count; i++) {
+    if (set->children[other->first_child + i] != children[i]) return false;
+  }
+
+  return true;
+}
+
+void insert_node(RuleSet* set, int index) {
+  RuleNode* node = &set->nodes[index];
+  int mask = set->table_capacity - 1;
+  int slot = hash_node(node, &set->children[node->first_child]) & mask;
+
+  while (set->table[slot] != 0) slot = (slot + 1) & mask;
+  set->table[slot] = index + 1;
+}
+
+void grow_table(RuleSet* set) {
+  int old_capacity = set->table_capacity;
+
+  FREE_ARRAY(int, set->table, old_capacity);
+  set->table_capacity = old_capacity < 64 ? 64 : old_capacity * 2;
+  set->table = ALLOCATE(int, set->table_capacity);
+
+  for (int i = 0; i < set->table_capacity; i++) set->table[i] = 0;
+
+  // Only nodes without side effects are in the table.
+  for (int i = 0; i < set->count; i++) {
+    if (set->nodes[i].op != OP_CALL_NATIVE) insert_node(set, i);
+  }
+}
+
+// Returns the node for the instruction applied to children, the existing
+// one if an equal node was made before. Natives may have side effects, so
+// each of their calls gets its own node.
+int intern_node(RuleSet* set, Instruction* instruction, int* children,
+                int child_count, ValueType type, bool safe) {
+  RuleNode key;
+  key.op = instruction->op;
+  key.type = instruction->type;
+  key.operand = instruction->operand;
+  key.immediate = instruction->immediate;
+  key.child_count = child_count;
+
+  bool shareable = instruction->op != OP_CALL_NATIVE;
+
+  if (shareable) {
+    if ((set->count + 1) * 4 > set->table_capacity * 3) grow_table(set);
+
+    int mask = set->table_capacity - 1;
+    int slot = hash_node(&key, children) & mask;
+
+    while (set->table[slot] != 0) {
+      int index = set->table[slot] - 1;
+      if (same_node(set, &key, &set->nodes[index], children)) return index;
+
+      slot = (slot + 1) & mask;
+    }
+  }
+
+  if (set->capacity < set->count + 1) {
+    int old_capacity = set->capacity;
+
+    set->capacity = GROW_CAPACITY(old_capacity);
+    set->nodes = GROW_ARRAY(RuleNode, set->nodes, old_capacity, set->capacity);
+  }
+
+  while (set->child_capacity < set->child_count + child_count) {
+    int old_capacity = set->child_capacity;
+
+    set->child_capacity = GROW_CAPACITY(old_capacity);
+    set->children = GROW_ARRAY(int, set->children, old_capacity,
+                               set->child_capacity);
+  }
+
+  int index = set->count++;
+  RuleNode* node = &set->nodes[index];
+
+  *node = key;
+  node->value_type = type;
+  node->first_child = set->child_count;
+  node->uses = 0;
+  node->may_fault = !safe;
+  node->slot = -1;
+
+  for (int i = 0; i < child_count; i++) {
+    set->children[set->child_count++] = children[i];
+    if (set->nodes[children[i]].may_fault) node->may_fault = true;
+  }
+
+  if (shareable) insert_node(set, index);
+
+  return index;
+}
+
+// Turns the straight line code of a rule into nodes and returns its root,
+// or -1 if the rule can't be merged.
+int build_rule(RuleSet* set, RuleCode* rule, int number) {
+  int stack[MAX_RULE_STACK];
+  int depth = 0;
+
+  for (int offset = rule->start; offset < rule->end;) {
+    Instruction instruction;
+    decode_instruction(set->code->code, offset, &instruction);
+    offset += instruction.length;
+
+    int pops;
+    ValueType type;
+    bool safe;
+
+    if (!rule_op(&instruction, &pops, &type, &safe)) {
+      rule_error(number, "Rules can only use operators, fields, globals "
+                         "and natives.");
+      return -1;
+    }
+
+    if (pops > depth || depth - pops == MAX_RULE_STACK) {
+      rule_error(number, "Rule too complex.");
+      return -1;
+    }
+
+    depth -= pops;
+    stack[depth] = intern_node(set, &instruction, &stack[depth], pops, type,
+                               safe);
+    depth++;
+  }
+
+  return depth == 1 ? stack[0] : -1;
+}
+
+void push_depth(RuleSet* set, ValueType type) {
+  set->depth += value_size(type);
+  if (set->depth > set->max_depth) set->max_depth = set->depth;
+}
+
+// Native calls end their block like jumps do.
+void emit_rule_op(RuleSet* set, uint8_t op, uint8_t type, int32_t operand,
+                  int32_t immediate) {
+  Instruction instruction = {op, type, operand, immediate, 0, 0};
+
+  if (op == OP_CALL_NATIVE) {
+    instruction.cost = set->block_size + 1;
+    set->block_size = 0;
+  } else {
+    set->block_size++;
+  }
+
+  write_instruction(set->code, &instruction);
+}
+
+// Ends the block with a jump and returns its offset for patching.
+int emit_rule_jump(RuleSet* set, OP op) {
+  int offset = set->code->count;
+  Instruction instruction = {op, VAL_VOID, 0xffff, 0, set->block_size + 1,
+                             0};
+
+  write_instruction(set->code, &instruction);
+  set->block_size = 0;
+
+  return offset;
+}
+
+// Starts a block, which jumps may target.
+void begin_rule_block(RuleSet* set) {
+  if (set->block_size == 0) return;
+
+  Instruction fuel = {OP_FUEL, VAL_VOID, set->block_size + 1, 0, 0, 0};
+  write_instruction(set->code, &fuel);
+  set->block_size = 0;
+}
+
+bool patch_rule_jump(RuleSet* set, int offset) {
+  Code* code = set->code;
+  begin_rule_block(set);
+
+  Instruction jump;
+  decode_instruction(code->code, offset, &jump);
+
+  int distance = code->count - (offset + jump.length);
+  if (distance > UINT16_MAX) return false;
+
+  code->code[offset + 1] = (distance >> 8) & 0xff;
+  code->code[offset + 2] = distance & 0xff;
+  return true;
+}
+
+bool emit_node(RuleSet* set, int index);
+
+// && and || whose right side may fail keep their short circuit, the right
+// side only runs when it decides the result.
+bool emit_short_circuit(RuleSet* set, RuleNode* node) {
+  int* children = &set->children[node->first_child];
+
+  if (!emit_node(set, children[0])) return false;
+
+  int else_jump = emit_rule_jump(set, OP_JUMP_IF_FALSE);
+  set->depth -= value_size(VAL_BOOL);
+
+  int end_jump;
+
+  if (node->op == OP_AND) {
+    if (!emit_node(set, children[1])) return false;
+    end_jump = emit_rule_jump(set, OP_JUMP);
+    set->depth -= value_size(VAL_BOOL);
+
+    if (!patch_rule_jump(set, else_jump)) return false;
+    emit_rule_op(set, OP_FALSE, VAL_VOID, 0, 0);
+    push_depth(set, VAL_BOOL);
+  } else {
+    emit_rule_op(set, OP_TRUE, VAL_VOID, 0, 0);
+    end_jump = emit_rule_jump(set, OP_JUMP);
+
+    if (!patch_rule_jump(set, else_jump)) return false;
+    if (!emit_node(set, children[1])) return false;
+  }
+
+  return patch_rule_jump(set, end_jump);
+}
+
+// Emits code leaving the node's value on the stack.
+bool emit_node(RuleSet* set, int index) {
+  RuleNode* node = &set->nodes[index];
+  int* children = &set->children[node->first_child];
+
+  if (node->slot != -1) {
+    emit_rule_op(set, OP_GET_LOCAL, node->value_type, node->slot, 0);
+    push_depth(set, node->value_type);
+    return true;
+  }
+
+  if ((node->op == OP_AND || node->op == OP_OR) &&
+      set->nodes[children[1]].may_fault) {
+    return emit_short_circuit(set, node);
+  }
+
+  for (int i = 0; i < node->child_count; i++) {
+    if (!emit_node(set, children[i])) return false;
+  }
+
+  emit_rule_op(set, node->op, node->type, node->operand, node->immediate);
+
+  for (int i = 0; i < node->child_count; i++) {
+    set->depth -= value_size(set->nodes[children[i]].value_type);
+  }
+  push_depth(set, node->value_type);
+
+  return true;
+}
+
+bool emit_rules(RuleSet* set, int* roots, int count, ValueType type) {
+  Module* module = set->module;
+
+  // Shared values are computed first, in an order where every node comes
+  // after its operands, and stay on the stack as temporaries.
+  for (int i = 0; i < set->count; i++) {
+    RuleNode* node = &set->nodes[i];
+    if (node->uses < 2 || node->child_count == 0 || node->may_fault) continue;
+
+    if (!emit_node(set, i)) return false;
+    node->slot = set->depth - value_size(node->value_type);
+  }
+
+  int temporaries = set->depth;
+
+  for (int i = 0; i < count; i++) {
+    if (!emit_node(set, roots[i])) return false;
+  }
+
+  ValueType array_type = type == VAL_INT ? VAL_INT_ARRAY : VAL_BOOL_ARRAY;
+  int symbol = add_symbol(module, "results", 7, array_type);
+  int ref = add_ref(module, module, symbol, 0);
+
+  emit_rule_op(set, OP_ARRAY, type, count, 0);
+  set->depth = temporaries;
+  push_depth(set, array_type);
+
+  emit_rule_op(set, OP_SET_GLOBAL, array_type, ref, 0);
+  emit_rule_op(set, OP_GET_GLOBAL, array_type, ref, 0);
+  emit_rule_op(set, OP_RESULT, array_type, 0, 0);
+
+  if (temporaries > 0) emit_rule_op(set, OP_DROP, VAL_VOID, temporaries, 0);
+
+  begin_rule_block(set);
+  emit_rule_op(set, OP_END, VAL_VOID, 0, 0);
+
+  return true;
+}
+
+bool merge_rules(Module* module, RuleCode* rules, int count, ValueType type) {
+  RuleSet set;
+  set.module = module;
+  set.code = &module->code;
+  set.nodes = NULL;
+  set.count = 0;
+  set.capacity = 0;
+  set.children = NULL;
+  set.child_count = 0;
+  set.child_capacity = 0;
+  set.table = NULL;
+  set.table_capacity = 0;
+  set.block_size = 0;
+  set.depth = 0;
+  set.max_depth = 0;
+
+  int* roots = ALLOCATE(int, count);
+  bool merged = true;
+
+  for (int i = 0; i < count && merged; i++) {
+    roots[i] = build_rule(&set, &rules[i], i);
+    if (roots[i] == -1) merged = false;
+  }
+
+  if (merged) {
+    for (int i = 0; i < set.count; i++) {
+      RuleNode* node = &set.nodes[i];
+
+      for (int j = 0; j < node->child_count; j++) {
+        set.nodes[set.children[node->first_child + j]].uses++;
+      }
+    }
+
+    for (int i = 0; i < count; i++) set.nodes[roots[i]].uses++;
+
+    // The rules are built again from their nodes.
+    module->code.count = rules[0].start;
+    merged = emit_rules(&set, roots, count, type);
+
+    if (!merged) rule_error(count - 1, "Too much code to jump over.");
+    module->code.max_stack = set.max_depth;
+  }
+
+  FREE_ARRAY(int, roots, count);
+  FREE_ARRAY(RuleNode, set.nodes, set.capacity);
+  FREE_ARRAY(int, set.children, set.child_capacity);
+  FREE_ARRAY(int, set.table, set.table_capacity);
+
+  return merged;
+}
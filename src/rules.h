@@ -0,0 +1,24 @@
+#ifndef nol_rules_h
+#define nol_rules_h
+
+#include "common.h"
+#include "module.h"
+#include "value.h"
+
+// The code of one rule of a rule set, compiled on its own.
+typedef struct {
+  int start;
+  int end;
+} RuleCode;
+
+// Replaces the separately compiled code of a rule set, which runs from the
+// first rule's start to the end of the module's code, with code computing
+// each distinct subexpression once. Equal subexpressions of all rules are
+// merged into one node, and nodes used more than once are computed up front
+// into temporaries, unless they may fail or have side effects. The results
+// go to an int[] or bool[] by rule order, stored in the global `results` and
+// returned as the module's result. Returns false if a rule uses something
+// rule sets do not support.
+bool merge_rules(Module* module, RuleCode* rules, int count, ValueType type);
+
+#endif
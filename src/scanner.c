@@ -3,9 +3,10 @@
 #include "common.h"
 #include "stdio.h"
 
-const char* start;
-const char* current;
-int line;
+// Modules are compiled concurrently, so each thread scans its own source.
+_Thread_local const char* start;
+_Thread_local const char* current;
+_Thread_local int line;
 
 void init_scanner(const char* source) {
   start = source;
@@ -17,8 +18,16 @@ int get_scanner_line() { return line; }
 const char* get_scanner_start() { return start; }
 const char* get_scanner_current() { return current; }
 
+void skip_scanner(const char* position, int position_line) {
+  start = position;
+  current = position;
+  line = position_line;
+}
+
 bool is_eof() { return *current == '\0'; }
 
+bool is_alpha(char c) { return isalpha(c) || c == '_'; }
+
 bool match(char expected) {
   if (is_eof()) return false;
   if (*current != expected) return false;
@@ -119,16 +128,38 @@ Token identifier_type() {
     case 'i':
       switch (start[1]) {
         case 'f':
-          return TOKEN_IF;
+          return check_keyword(2, 0, "", TOKEN_IF);
+        case 'm':
+          return check_keyword(2, 4, "port", TOKEN_IMPORT);
         case 'n':
           return check_keyword(2, 1, "t", TOKEN_INT);
       }
 
       break;
+    case 'm':
+      return check_keyword(1, 4, "atch", TOKEN_MATCH);
     case 'p':
-      return check_keyword(1, 4, "rint", TOKEN_PRINT);
+      switch (start[1]) {
+        case 'a':
+          return check_keyword(2, 6, "rallel", TOKEN_PARALLEL);
+        case 'r':
+          return check_keyword(2, 3, "int", TOKEN_PRINT);
+      }
+
+      break;
     case 'r':
       return check_keyword(1, 5, "eturn", TOKEN_RETURN);
+    case 's':
+      if (current - start > 3 && memcmp(start + 1, "tr", 2) == 0) {
+        switch (start[3]) {
+          case 'i':
+            return check_keyword(4, 2, "ng", TOKEN_STRING_TYPE);
+          case 'u':
+            return check_keyword(4, 2, "ct", TOKEN_STRUCT);
+        }
+      }
+
+      break;
     case 't':
       switch (start[1]) {
         case 'r':
@@ -136,6 +167,8 @@ Token identifier_type() {
       }
 
       break;
+    case 'v':
+      return check_keyword(1, 3, "oid", TOKEN_VOID);
     case 'w':
       return check_keyword(1, 4, "hile", TOKEN_WHILE);
   }
@@ -144,7 +177,7 @@ Token identifier_type() {
 }
 
 Token identifier_token() {
-  while (isalpha(*current) || isdigit(*current)) current++;
+  while (is_alpha(*current) || isdigit(*current)) current++;
   return identifier_type();
 }
 
@@ -158,7 +191,7 @@ Token scan_token() {
   char c = *current;
   current++;
 
-  if (isalpha(c)) return identifier_token();
+  if (is_alpha(c)) return identifier_token();
   if (isdigit(c)) return number_token();
 
   switch (c) {
@@ -170,6 +203,10 @@ Token scan_token() {
       return TOKEN_LEFT_BRACE;
     case '}':
       return TOKEN_RIGHT_BRACE;
+    case '[':
+      return TOKEN_LEFT_BRACKET;
+    case ']':
+      return TOKEN_RIGHT_BRACKET;
     case ';':
       return TOKEN_SEMICOLON;
     case ',':
@@ -186,14 +223,25 @@ Token scan_token() {
       return TOKEN_STAR;
     case '%':
       return TOKEN_PERCENT;
+    case '^':
+      return TOKEN_CARET;
+    case '~':
+      return TOKEN_TILDE;
 
     case '!':
       return match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG;
     case '=':
+      if (match('>')) return TOKEN_ARROW;
       return match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL;
     case '<':
+      if (match('<')) return TOKEN_LESS_LESS;
       return match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS;
     case '>':
+      // >> shifts in the sign bit, >>> shifts in zeros.
+      if (match('>')) {
+        return match('>') ? TOKEN_GREATER_GREATER_GREATER
+                          : TOKEN_GREATER_GREATER;
+      }
       return match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER;
     case '&':
       return match('&') ? TOKEN_AMP_AMP : TOKEN_AMP;
@@ -202,6 +250,12 @@ Token scan_token() {
 
     case '"':
       return string_token();
+
+    case '$':
+      // A record field, $1 is the first one.
+      if (!isdigit(*current)) return TOKEN_ERROR;
+      while (isdigit(*current)) current++;
+      return TOKEN_FIELD;
   }
 
   return TOKEN_ERROR;
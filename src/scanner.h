@@ -7,6 +7,8 @@ typedef enum {
   TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE,
   TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET,
+  TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA,
   TOKEN_DOT,
   TOKEN_MINUS,
@@ -15,16 +17,22 @@ typedef enum {
   TOKEN_SLASH,
   TOKEN_STAR,
   TOKEN_PERCENT,
+  TOKEN_CARET,
+  TOKEN_TILDE,
 
   // One or two character tokens.
   TOKEN_BANG,
   TOKEN_BANG_EQUAL,
   TOKEN_EQUAL,
   TOKEN_EQUAL_EQUAL,
+  TOKEN_ARROW,
   TOKEN_GREATER,
   TOKEN_GREATER_EQUAL,
+  TOKEN_GREATER_GREATER,
+  TOKEN_GREATER_GREATER_GREATER,
   TOKEN_LESS,
   TOKEN_LESS_EQUAL,
+  TOKEN_LESS_LESS,
   TOKEN_AMP,
   TOKEN_AMP_AMP,
   TOKEN_PIPE,
@@ -34,20 +42,27 @@ typedef enum {
   TOKEN_IDENTIFIER,
   TOKEN_STRING,
   TOKEN_NUMBER,
+  TOKEN_FIELD,
 
   // Keywords.
   TOKEN_ELSE,
   TOKEN_FALSE,
   TOKEN_FOR,
   TOKEN_IF,
+  TOKEN_IMPORT,
+  TOKEN_MATCH,
+  TOKEN_PARALLEL,
   TOKEN_PRINT,
   TOKEN_RETURN,
+  TOKEN_STRUCT,
   TOKEN_TRUE,
   TOKEN_WHILE,
   TOKEN_INT,
   TOKEN_FLOAT,
   TOKEN_BOOL,
   TOKEN_CHAR,
+  TOKEN_STRING_TYPE,
+  TOKEN_VOID,
 
   TOKEN_ERROR,
   TOKEN_EOF,
@@ -57,6 +72,9 @@ void init_scanner(const char* source);
 int get_scanner_line();
 const char* get_scanner_start();
 const char* get_scanner_current();
+// Goes on scanning at position, which is on the given line, without
+// scanning what lies before it.
+void skip_scanner(const char* position, int position_line);
 
 Token scan_token();
 
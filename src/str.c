@@ -0,0 +1,293 @@
+#include "str.h"
+
+#include <pthread.h>
+
+#include "hash.h"
+#include "memory.h"
+
+ObjString* new_object(Heap* heap, int length) {
+  ObjString* object =
+      (ObjString*)allocate_object(heap, OBJ_STRING, sizeof(ObjString));
+
+  object->length = length;
+  object->hash = 0;
+  object->chars = NULL;
+  object->left = NULL;
+  object->right = NULL;
+
+  return object;
+}
+
+char* new_chars(Heap* heap, int length) {
+  char* chars = (char*)heap_alloc(heap, length + 1);
+  account_bytes(heap, length + 1);
+
+  chars[length] = '\0';
+  return chars;
+}
+
+ObjString* flat_object(Heap* heap, const char* chars, int length) {
+  ObjString* object = new_object(heap, length);
+
+  object->chars = new_chars(heap, length);
+  memcpy(object->chars, chars, length);
+
+  return object;
+}
+
+String heap_string(ObjString* object) {
+  String string;
+
+  memset(string.bytes, 0, sizeof(string.bytes));
+  memcpy(string.bytes, &object, sizeof(object));
+  string.tag = HEAP_STRING;
+
+  return string;
+}
+
+static inline ObjString* as_object(String* string) {
+  ObjString* object;
+  memcpy(&object, string->bytes, sizeof(object));
+  return object;
+}
+
+ObjString* string_object(String* string) {
+  return string->tag == HEAP_STRING ? as_object(string) : NULL;
+}
+
+String make_string(Heap* heap, const char* chars, int length) {
+  if (length > SMALL_STRING_MAX) {
+    return heap_string(flat_object(heap, chars, length));
+  }
+
+  String string;
+
+  memset(string.bytes, 0, sizeof(string.bytes));
+  memcpy(string.bytes, chars, length);
+  string.tag = (uint8_t)length;
+
+  return string;
+}
+
+int string_length(String* string) {
+  if (string->tag != HEAP_STRING) return string->tag;
+  return as_object(string)->length;
+}
+
+// Heap object for one side of a rope node.
+ObjString* rope_side(Heap* heap, String* string) {
+  if (string->tag == HEAP_STRING) return as_object(string);
+  return flat_object(heap, string->bytes, string->tag);
+}
+
+// Short results are copied, which keeps them small or flat. Long ones become
+// a rope node holding both sides, so building a string piece by piece costs
+// one node per step and a single copy when it is finally read.
+String concat_strings(Heap* heap, String* a, String* b) {
+  int a_length = string_length(a);
+  int b_length = string_length(b);
+  int length = a_length + b_length;
+
+  if (b_length == 0) return *a;
+  if (a_length == 0) return *b;
+
+  if (length <= SMALL_STRING_MAX) {
+    String string = *a;
+
+    memcpy(&string.bytes[a_length], b->bytes, b_length);
+    string.tag = (uint8_t)length;
+
+    return string;
+  }
+
+  if (length < ROPE_MIN) {
+    const char* a_chars = string_chars(heap, a);
+    const char* b_chars = string_chars(heap, b);
+
+    ObjString* object = new_object(heap, length);
+
+    object->chars = new_chars(heap, length);
+    memcpy(object->chars, a_chars, a_length);
+    memcpy(&object->chars[a_length], b_chars, b_length);
+
+    return heap_string(object);
+  }
+
+  ObjString* object = new_object(heap, length);
+  object->left = rope_side(heap, a);
+  object->right = rope_side(heap, b);
+
+  return heap_string(object);
+}
+
+// Copies the leaves of a rope into one buffer, right to left, with an
+// explicit stack so deep ropes cannot overflow the C stack.
+void flatten(Heap* heap, ObjString* rope) {
+  char* chars = new_chars(heap, rope->length);
+
+  ObjString** pending = NULL;
+  int count = 0;
+  int capacity = 0;
+  int end = rope->length;
+
+  ObjString* node = rope;
+
+  while (node != NULL) {
+    if (node->chars != NULL) {
+      end -= node->length;
+      memcpy(&chars[end], node->chars, node->length);
+
+      node = count > 0 ? pending[--count] : NULL;
+      continue;
+    }
+
+    if (capacity < count + 1) {
+      int old_capacity = capacity;
+      capacity = GROW_CAPACITY(old_capacity);
+      pending = GROW_ARRAY(ObjString*, pending, old_capacity, capacity);
+    }
+
+    pending[count++] = node->left;
+    node = node->right;
+  }
+
+  FREE_ARRAY(ObjString*, pending, capacity);
+
+  rope->chars = chars;
+  rope->left = NULL;
+  rope->right = NULL;
+}
+
+const char* string_chars(Heap* heap, String* string) {
+  if (string->tag != HEAP_STRING) return string->bytes;
+
+  ObjString* object = as_object(string);
+  if (object->chars == NULL) flatten(heap, object);
+
+  return object->chars;
+}
+
+uint64_t object_hash(Heap* heap, ObjString* object) {
+  if (object->hash == 0) {
+    if (object->chars == NULL) flatten(heap, object);
+
+    uint64_t hash = hash_bytes(object->chars, object->length);
+    object->hash = hash == 0 ? 1 : hash;
+  }
+
+  return object->hash;
+}
+
+void settle_string(Heap* heap, String* string) {
+  if (string->tag == HEAP_STRING) object_hash(heap, as_object(string));
+}
+
+// Small strings are canonical, so they compare as 16 bytes. Heap strings
+// compare by identity first, which settles interned literals, then by
+// length and cached hash, and only equal hashes compare the bytes.
+bool strings_equal(Heap* heap, String* a, String* b) {
+  if (a->tag != HEAP_STRING || b->tag != HEAP_STRING) {
+    return memcmp(a, b, sizeof(String)) == 0;
+  }
+
+  ObjString* x = as_object(a);
+  ObjString* y = as_object(b);
+
+  if (x == y) return true;
+  if (x->length != y->length) return false;
+  if (object_hash(heap, x) != object_hash(heap, y)) return false;
+
+  return memcmp(x->chars, y->chars, x->length) == 0;
+}
+
+// Open addressing set of interned strings, shared by all compiling threads.
+// The objects live in a heap of their own that never collects, and are
+// pinned so the heaps of running fibers leave them alone.
+typedef struct {
+  ObjString** entries;
+  int count;
+  int capacity;
+  Heap heap;
+} InternTable;
+
+InternTable interned;
+pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+ObjString** find_interned(ObjString** entries, int capacity,
+                          const char* chars, int length, uint64_t hash) {
+  uint32_t mask = capacity - 1;
+  uint32_t index = (uint32_t)hash & mask;
+
+  while (true) {
+    ObjString** slot = &entries[index];
+    ObjString* entry = *slot;
+
+    if (entry == NULL) return slot;
+
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(entry->chars, chars, length) == 0) {
+      return slot;
+    }
+
+    index = (index + 1) & mask;
+  }
+}
+
+void grow_interned() {
+  int capacity = GROW_CAPACITY(interned.capacity);
+  ObjString** entries = ALLOCATE(ObjString*, capacity);
+
+  memset(entries, 0, sizeof(ObjString*) * capacity);
+
+  for (int i = 0; i < interned.capacity; i++) {
+    ObjString* entry = interned.entries[i];
+    if (entry == NULL) continue;
+
+    *find_interned(entries, capacity, entry->chars, entry->length,
+                   entry->hash) = entry;
+  }
+
+  FREE_ARRAY(ObjString*, interned.entries, interned.capacity);
+
+  interned.entries = entries;
+  interned.capacity = capacity;
+}
+
+ObjString* intern_string(const char* chars, int length) {
+  uint64_t hash = hash_bytes(chars, length);
+  if (hash == 0) hash = 1;
+
+  pthread_mutex_lock(&intern_lock);
+
+  if ((interned.count + 1) * 4 > interned.capacity * 3) grow_interned();
+
+  ObjString** slot = find_interned(interned.entries, interned.capacity, chars,
+                                   length, hash);
+
+  if (*slot == NULL) {
+    if (interned.count == 0) init_heap(&interned.heap);
+
+    *slot = flat_object(&interned.heap, chars, length);
+    (*slot)->obj.pinned = true;
+    (*slot)->hash = hash;
+    interned.count++;
+  }
+
+  ObjString* object = *slot;
+
+  pthread_mutex_unlock(&intern_lock);
+  return object;
+}
+
+void free_interned_strings() {
+  pthread_mutex_lock(&intern_lock);
+
+  if (interned.count > 0) free_heap(&interned.heap);
+  FREE_ARRAY(ObjString*, interned.entries, interned.capacity);
+
+  interned.entries = NULL;
+  interned.count = 0;
+  interned.capacity = 0;
+
+  pthread_mutex_unlock(&intern_lock);
+}
@@ -0,0 +1,60 @@
+#ifndef nol_str_h
+#define nol_str_h
+
+#include "common.h"
+#include "heap.h"
+
+// Strings this long or shorter are stored inline and never allocate.
+#define SMALL_STRING_MAX 15
+// Concatenations at least this long make a rope node instead of copying.
+#define ROPE_MIN 64
+
+// Tag of a string whose bytes start with an ObjString pointer.
+#define HEAP_STRING 0xff
+
+typedef struct ObjString ObjString;
+
+struct ObjString {
+  Obj obj;
+  int length;
+  // Computed the first time it is needed, 0 until then.
+  uint64_t hash;
+
+  // The bytes, NULL for a rope node that was not flattened yet.
+  char* chars;
+  ObjString* left;
+  ObjString* right;
+};
+
+// A string as it sits on the stack or in a global. A small string keeps its
+// bytes inline, zero padded, with its length in tag, so two small strings
+// are equal exactly when all 16 bytes are. Longer strings are always heap
+// strings.
+typedef struct {
+  char bytes[SMALL_STRING_MAX];
+  uint8_t tag;
+} String;
+
+String make_string(Heap* heap, const char* chars, int length);
+// Wraps an interned or heap object, which must be longer than
+// SMALL_STRING_MAX.
+String heap_string(ObjString* object);
+String concat_strings(Heap* heap, String* a, String* b);
+
+// The heap object of a long string, NULL for a small one.
+ObjString* string_object(String* string);
+
+int string_length(String* string);
+// Returns the bytes of the string, flattening it first if it is a rope.
+const char* string_chars(Heap* heap, String* string);
+bool strings_equal(Heap* heap, String* a, String* b);
+// Flattens a heap string and caches its hash, after which reading it writes
+// nothing. Strings other threads are about to read are settled first.
+void settle_string(Heap* heap, String* string);
+
+// Returns the one shared copy of the given bytes. Literals are interned
+// when compiled, so equal literals are the same object. Thread safe.
+ObjString* intern_string(const char* chars, int length);
+void free_interned_strings();
+
+#endif
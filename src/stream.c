@@ -0,0 +1,174 @@
+#include "stream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "metrics.h"
+
+// Input is read and output written in blocks of this size.
+#define STREAM_BLOCK (1 << 20)
+
+typedef struct {
+  Fiber* fiber;
+  char delimiter;
+
+  char* buffer;
+  size_t capacity;
+  // Bytes of a record still waiting for its newline.
+  size_t length;
+} Stream;
+
+// Points the first count fields at the record's bytes. memchr is vectorized
+// in libc, so a known delimiter is found a whole vector at a time.
+int split_fields(Field* fields, int count, const char* p, const char* end,
+                 char delimiter) {
+  int found = 0;
+
+  if (delimiter != '\0') {
+    while (found < count) {
+      const char* next = memchr(p, delimiter, end - p);
+      if (next == NULL) next = end;
+
+      fields[found].start = p;
+      fields[found].end = next;
+      found++;
+
+      if (next == end) break;
+      p = next + 1;
+    }
+
+    return found;
+  }
+
+  while (found < count) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end) break;
+
+    fields[found].start = p;
+    while (p < end && *p != ' ' && *p != '\t') p++;
+    fields[found].end = p;
+    found++;
+  }
+
+  return found;
+}
+
+bool run_record(Stream* stream, const char* start, const char* end) {
+  Fiber* fiber = stream->fiber;
+
+  if (end > start && end[-1] == '\r') end--;
+
+  fiber->record.start = start;
+  fiber->record.end = end;
+  fiber->field_count = split_fields(fiber->fields, fiber->program->field_count,
+                                    start, end, stream->delimiter);
+
+  reset_fiber(fiber);
+
+  while (resume_fiber(fiber, FIBER_SLICE) == FIBER_READY) {
+  }
+
+  return fiber->state == FIBER_DONE;
+}
+
+// Runs every complete record in the buffer and keeps the unfinished one at
+// its start.
+bool run_records(Stream* stream) {
+  const char* start = stream->buffer;
+  const char* end = stream->buffer + stream->length;
+  const char* newline;
+
+  while ((newline = memchr(start, '\n', end - start)) != NULL) {
+    if (!run_record(stream, start, newline)) return false;
+    start = newline + 1;
+  }
+
+  stream->length = end - start;
+  memmove(stream->buffer, start, stream->length);
+
+  return true;
+}
+
+bool run_input(Stream* stream, int fd) {
+  stream->length = 0;
+
+  while (true) {
+    // A record longer than the buffer makes it grow.
+    if (stream->capacity - stream->length < STREAM_BLOCK) {
+      size_t old_capacity = stream->capacity;
+
+      stream->capacity = old_capacity + STREAM_BLOCK;
+      stream->buffer = GROW_ARRAY(char, stream->buffer, old_capacity,
+                                  stream->capacity);
+    }
+
+    ssize_t bytes = read(fd, stream->buffer + stream->length,
+                         stream->capacity - stream->length);
+
+    if (bytes < 0) {
+      fprintf(error_stream(), "Could not read input.\n");
+      return false;
+    }
+
+    if (bytes == 0) break;
+
+    stream->length += bytes;
+    if (!run_records(stream)) return false;
+  }
+
+  // The last record may have no newline.
+  if (stream->length == 0) return true;
+
+  return run_record(stream, stream->buffer, stream->buffer + stream->length);
+}
+
+FiberState run_stream(Program* program, char** paths, int path_count,
+                      char delimiter) {
+  uint64_t start = metric_clock();
+
+  Stream stream;
+  stream.fiber = new_fiber(program);
+  stream.delimiter = delimiter;
+  stream.buffer = NULL;
+  stream.capacity = 0;
+  stream.length = 0;
+
+  Fiber* fiber = stream.fiber;
+  fiber->fields = ALLOCATE(Field, program->field_count);
+  apply_run_limits(fiber);
+
+  setvbuf(stdout, NULL, _IOFBF, STREAM_BLOCK);
+
+  bool ok = true;
+
+  if (path_count == 0) ok = run_input(&stream, STDIN_FILENO);
+
+  for (int i = 0; ok && i < path_count; i++) {
+    int fd = open(paths[i], O_RDONLY);
+
+    if (fd < 0) {
+      fprintf(error_stream(), "Could not open file \"%s\".\n", paths[i]);
+      ok = false;
+      break;
+    }
+
+    ok = run_input(&stream, fd);
+    close(fd);
+  }
+
+  fflush(stdout);
+
+  FiberState state = ok ? FIBER_DONE : fiber->state;
+  if (!ok && state == FIBER_DONE) state = FIBER_ERROR;
+
+  report_stop(state);
+  count_metric(METRIC_RUNS, 1);
+  count_metric(METRIC_RUN_NS, metric_clock() - start);
+
+  FREE_ARRAY(Field, fiber->fields, program->field_count);
+  FREE_ARRAY(char, stream.buffer, stream.capacity);
+  free_fiber(fiber);
+
+  return state;
+}
@@ -0,0 +1,15 @@
+#ifndef nol_stream_h
+#define nol_stream_h
+
+#include "common.h"
+#include "module.h"
+#include "vm.h"
+
+// Runs program once for every newline separated record of the files in
+// paths, or of stdin when there are none. Fields are split at delimiter, or
+// at runs of blanks when it is 0, and only as many as the program reads.
+// Returns FIBER_DONE, or the state of the run that stopped the stream.
+FiberState run_stream(Program* program, char** paths, int path_count,
+                      char delimiter);
+
+#endif
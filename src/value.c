@@ -1,13 +1,26 @@
 #include "value.h"
 
-// bool valuesEqual(Value a, Value b) {
-//   if (a.type != b.type) return false;
-//   switch (a.type) {
-//     case VAL_BOOL:
-//       return AS_BOOL(a) == AS_BOOL(b);
-//     case VAL_INT:
-//       return AS_INT(a) == AS_INT(b);
-//     default:
-//       return false;  // Unreachable.
-//   }
-// }
\ No newline at end of file
+const char* type_name(ValueType type) {
+  if (is_struct_type(type)) return "struct";
+
+  switch (type & 0xff) {
+    case VAL_CHAR:
+      return "char";
+    case VAL_INT:
+      return "int";
+    case VAL_FLOAT:
+      return "float";
+    case VAL_BOOL:
+      return "bool";
+    case VAL_STRING:
+      return "string";
+    case VAL_INT_ARRAY:
+      return "int[]";
+    case VAL_BOOL_ARRAY:
+      return "bool[]";
+    case VAL_STRUCT_ARRAY:
+      return "struct[]";
+    default:
+      return "void";
+  }
+}
@@ -1,8 +1,78 @@
 #ifndef nol_value_h
 #define nol_value_h
 
+#include "array.h"
 #include "common.h"
+#include "str.h"
 
-typedef enum { VAL_CHAR, VAL_INT, VAL_FLOAT, VAL_BOOL, VAL_VOID } ValueType;
+typedef enum {
+  VAL_CHAR,
+  VAL_INT,
+  VAL_FLOAT,
+  VAL_BOOL,
+  VAL_STRING,
+  VAL_INT_ARRAY,
+  VAL_BOOL_ARRAY,
+  VAL_VOID,
+  VAL_STRUCT_ARRAY,
+  // A struct is its int and bool fields back to back, with no header and no
+  // padding. Its type code is VAL_STRUCT plus its size, which is all the VM
+  // needs to move one. The compiler tells structs apart by the bits above
+  // the code byte, and an array of structs is VAL_STRUCT_ARRAY with the
+  // struct type above the code byte.
+  VAL_STRUCT = 0x80
+} ValueType;
 
-#endif
\ No newline at end of file
+#define MAX_STRUCT_SIZE 0x7f
+
+// Number of bytes a value of the given type takes on the stack. Inline, as
+// the VM asks for it on every typed stack access.
+static inline int value_size(ValueType type) {
+  switch (type & 0xff) {
+    case VAL_CHAR:
+      return sizeof(char);
+    case VAL_INT:
+      return sizeof(int32_t);
+    case VAL_FLOAT:
+      return sizeof(double);
+    case VAL_BOOL:
+      return sizeof(bool);
+    case VAL_STRING:
+      return sizeof(String);
+    case VAL_INT_ARRAY:
+    case VAL_BOOL_ARRAY:
+    case VAL_STRUCT_ARRAY:
+      return sizeof(ObjArray*);
+    default:
+      return type & VAL_STRUCT ? type & MAX_STRUCT_SIZE : 0;
+  }
+}
+
+static inline bool is_struct_type(ValueType type) {
+  return (type & VAL_STRUCT) != 0;
+}
+
+static inline bool is_struct_array_type(ValueType type) {
+  return (type & 0xff) == VAL_STRUCT_ARRAY;
+}
+
+// Arrays of ints and bools, which the array operators work on.
+static inline bool is_array_type(ValueType type) {
+  return type == VAL_INT_ARRAY || type == VAL_BOOL_ARRAY;
+}
+
+// Whether values of the type may refer to heap objects. Structs only hold
+// ints and bools.
+static inline bool is_heap_type(ValueType type) {
+  return type == VAL_STRING || is_array_type(type) ||
+         is_struct_array_type(type);
+}
+
+static inline ValueType element_type(ValueType type) {
+  if (is_struct_array_type(type)) return (ValueType)(type >> 8);
+  return type == VAL_INT_ARRAY ? VAL_INT : VAL_BOOL;
+}
+
+const char* type_name(ValueType type);
+
+#endif
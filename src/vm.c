@@ -1,17 +1,20 @@
 #include "vm.h"
 
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
 #include "bytecode.h"
 #include "common.h"
 #include "debug.h"
+#include "memory.h"
+#include "metrics.h"
+#include "native.h"
+#include "pool.h"
+#include "profile.h"
 #include "value.h"
 
-#define DEBUG_TRACE_EXECUTION
-
-uint8_t stack[STACK_MAX];
-uint8_t* top;
-
-void reset_stack() { top = stack; }
-
 #define push(value_type, value)              \
   do {                                       \
     memcpy(top, &value, sizeof(value_type)); \
@@ -24,14 +27,671 @@ void reset_stack() { top = stack; }
     memcpy(&out, top, sizeof(value_type)); \
   } while (false);
 
-void init_vm() { reset_stack(); }
-void free_vm() {}
+#define MOVE_FIXED(value_type)         \
+  do {                                 \
+    value_type v;                      \
+    memcpy(&v, from, sizeof(v));       \
+    memcpy(to, &v, sizeof(v));         \
+  } while (false)
+
+// Moves a value of size bytes, the two may overlap. Every type but structs
+// has one of the fixed sizes, which compile to a load and a store once the
+// size is known, instead of a call.
+static inline void move_value(uint8_t* to, const uint8_t* from, int size) {
+  switch (size) {
+    case sizeof(bool):
+      MOVE_FIXED(bool);
+      break;
+    case sizeof(int32_t):
+      MOVE_FIXED(int32_t);
+      break;
+    case sizeof(double):
+      MOVE_FIXED(double);
+      break;
+    case sizeof(String):
+      MOVE_FIXED(String);
+      break;
+    default:
+      memmove(to, from, size);
+      break;
+  }
+}
+
+// a / b or a % b for b != 0. The smallest int over -1 wraps around like the
+// other operators, its remainder is 0.
+static inline int32_t divide_ints(int32_t a, int32_t b, bool modulo) {
+  if (b == -1) return modulo ? 0 : (int32_t)(0u - (uint32_t)a);
+  return modulo ? a % b : a / b;
+}
+
+// The same by a constant d >= 2, with magic holding its multiplier and d
+// above it. Negative quotients are corrected by one.
+static inline int32_t divide_magic(int32_t a, uint64_t magic, int shift,
+                                   bool modulo) {
+  int64_t product = (int64_t)a * (int64_t)(uint32_t)magic;
+  int32_t q = (int32_t)(product >> shift) + (int32_t)((uint32_t)a >> 31);
+
+  if (!modulo) return q;
+  return (int32_t)((uint32_t)a - (uint32_t)q * (uint32_t)(magic >> 32));
+}
+
+int64_t run_fuel = FUEL_UNLIMITED;
+double run_timeout = 0;
+
+// Threads parallel for loops run on, 0 for one per core. The pool is
+// started by the first loop that needs it and shared by every fiber after.
+int parallel_threads;
+Pool* parallel_pool;
+pthread_mutex_t parallel_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_vm() {}
+
+void free_vm() {
+  if (parallel_pool != NULL) free_pool(parallel_pool);
+  parallel_pool = NULL;
+}
+
+void set_parallel_threads(int threads) { parallel_threads = threads; }
+
+double now_seconds() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void set_run_limits(int64_t fuel, double timeout) {
+  run_fuel = fuel;
+  run_timeout = timeout;
+}
+
+int frame_limit(Program* program) {
+  return program->has_calls ? MAX_FRAMES : 0;
+}
+
+int stack_size(Program* program) {
+  return program->max_stack + (program->has_calls ? CALL_STACK_SIZE : 0);
+}
+
+size_t fiber_size(Fiber* fiber) {
+  return sizeof(Fiber) + sizeof(CallFrame) * fiber->frame_limit +
+         (fiber->stack_end - fiber->stack) + fiber->globals_room;
+}
+
+// What main returns to. Running it ends the program.
+static uint8_t end_code[] = {OP_END};
+
+// A fiber starts at the first module. A program from an image is initialized
+// already, so its fibers start at the end of the entry module, where main is
+// called.
+void rewind_fiber(Fiber* fiber) {
+  Program* program = fiber->program;
+
+  if (program->initial_globals != NULL) {
+    Code* code = &program->modules[program->count - 1]->code;
+
+    fiber->module = program->count - 1;
+    fiber->ip = code->code + code->count - 1;
+  } else {
+    fiber->module = 0;
+    fiber->ip = program->count > 0 ? program->modules[0]->code.code : NULL;
+  }
+
+  fiber->top = fiber->stack;
+  fiber->frame = fiber->stack;
+  fiber->frame_count = 0;
+  fiber->state = program->count > 0 ? FIBER_READY : FIBER_DONE;
+}
+
+// The fiber, its call frames, its stack and its globals are a single
+// allocation sized from what the compiler worked out the program needs.
+Fiber* allocate_fiber(Program* program, int globals_room) {
+  int frames = frame_limit(program);
+  int stack = stack_size(program);
+
+  Fiber* fiber = (Fiber*)ALLOCATE(
+      uint8_t, sizeof(Fiber) + sizeof(CallFrame) * frames + stack +
+                   globals_room);
+
+  fiber->program = program;
+
+  fiber->frames = (CallFrame*)(fiber + 1);
+  fiber->frame_limit = frames;
+
+  fiber->stack = (uint8_t*)(fiber->frames + fiber->frame_limit);
+  fiber->stack_end = fiber->stack + stack;
+  fiber->globals = fiber->stack_end;
+  fiber->globals_room = globals_room;
+
+  return fiber;
+}
+
+Fiber* new_fiber(Program* program) {
+  Fiber* fiber = allocate_fiber(program, program->globals_size);
+
+  if (program->initial_globals != NULL) {
+    memcpy(fiber->globals, program->initial_globals, program->globals_size);
+  } else {
+    memset(fiber->globals, 0, program->globals_size);
+  }
+
+  rewind_fiber(fiber);
+
+  fiber->out = stdout;
+  fiber->record.start = NULL;
+  fiber->record.end = NULL;
+  fiber->fields = NULL;
+  fiber->field_count = 0;
+  init_heap(&fiber->heap);
+  fiber->initialize_only = false;
+  fiber->fault = NULL;
+  fiber->hold_fault = false;
+  fiber->owner = NULL;
+  fiber->instructions = 0;
+  fiber->fuel = FUEL_UNLIMITED;
+  fiber->deadline = 0;
+  fiber->waiting_since = 0;
+  fiber->next = NULL;
+
+  return fiber;
+}
+
+void mark_slot(Heap* heap, ValueType type, uint8_t* slot) {
+  if (type == VAL_STRING) {
+    String string;
+    memcpy(&string, slot, sizeof(String));
+
+    mark_object(heap, (Obj*)string_object(&string));
+  } else {
+    ObjArray* array;
+    memcpy(&array, slot, sizeof(array));
+
+    mark_object(heap, (Obj*)array);
+  }
+}
+
+// Marks what a frame stopped at ip holds, as its module's stack map says.
+void mark_frame(Heap* heap, Module* module, uint8_t* ip, uint8_t* frame) {
+  // The frame main returns to runs no code of the module.
+  if (ip == end_code) return;
+
+  StackMap* map = find_stack_map(module, ip - module->code.code);
+  if (map == NULL) return;
+
+  for (int i = 0; i < map->slot_count; i++) {
+    HeapSlot* slot = &module->map_slots[map->first_slot + i];
+    mark_slot(heap, slot->type, frame + slot->offset);
+  }
+}
+
+// The roots are the heap globals and, frame by frame, the locals and
+// operands the stack maps list. The fiber's saved ip, frame and module say
+// where the running frame stopped.
+void mark_fiber_roots(Heap* heap, void* arg) {
+  Fiber* fiber = (Fiber*)arg;
+  Program* program = fiber->program;
+
+  for (int i = 0; i < program->root_count; i++) {
+    HeapSlot* root = &program->roots[i];
+    mark_slot(heap, root->type, fiber->globals + root->offset);
+  }
+
+  if (program->count == 0) return;
+
+  mark_frame(heap, program->modules[fiber->module], fiber->ip, fiber->frame);
+
+  for (int i = 0; i < fiber->frame_count; i++) {
+    CallFrame* caller = &fiber->frames[i];
+    mark_frame(heap, program->modules[caller->module], caller->ip,
+               caller->frame);
+  }
+}
+
+void reset_fiber(Fiber* fiber) {
+  rewind_fiber(fiber);
+
+  // Between two runs only the globals are live.
+  if (fiber->heap.pending) {
+    collect_garbage(&fiber->heap, mark_fiber_roots, fiber);
+  }
+}
+
+void free_fiber(Fiber* fiber) {
+  count_metric(METRIC_INSTRUCTIONS, fiber->instructions);
+  add_gc_stats(&fiber->heap.stats);
+  free_heap(&fiber->heap);
+
+  FREE_ARRAY(uint8_t, fiber, fiber_size(fiber));
+}
+
+// Room for globals doubles, so a program growing a little at a time only
+// moves its fiber now and then.
+Fiber* grow_fiber(Fiber* fiber) {
+  Program* program = fiber->program;
+
+  if (frame_limit(program) <= fiber->frame_limit &&
+      stack_size(program) <= fiber->stack_end - fiber->stack &&
+      program->globals_size <= fiber->globals_room) {
+    return fiber;
+  }
+
+  int room = fiber->globals_room * 2;
+  if (room < program->globals_size) room = program->globals_size;
+
+  Fiber* grown = allocate_fiber(program, room);
+
+  memcpy(grown->globals, fiber->globals, fiber->globals_room);
+  memset(grown->globals + fiber->globals_room, 0, room - fiber->globals_room);
+
+  // The heap moves along, a sweep under way would keep a link into the old
+  // fiber.
+  finish_sweep(&fiber->heap);
+
+  grown->module = fiber->module;
+  grown->ip = fiber->ip;
+  grown->out = fiber->out;
+  grown->record = fiber->record;
+  grown->fields = fiber->fields;
+  grown->field_count = fiber->field_count;
+  grown->heap = fiber->heap;
+  grown->initialize_only = fiber->initialize_only;
+  grown->fault = fiber->fault;
+  grown->hold_fault = fiber->hold_fault;
+  grown->fuel = fiber->fuel;
+  grown->deadline = fiber->deadline;
+  grown->waiting_since = fiber->waiting_since;
+  grown->instructions = fiber->instructions;
+  grown->next = fiber->next;
+  grown->owner = fiber->owner;
+
+  grown->top = grown->stack;
+  grown->frame = grown->stack;
+  grown->frame_count = 0;
+  grown->state = fiber->state;
+
+  FREE_ARRAY(uint8_t, fiber, fiber_size(fiber));
+  return grown;
+}
+
+// Chunks a parallel for is split into per thread, so threads that finish
+// early take over what the others have not started.
+#define CHUNKS_PER_THREAD 8
+
+// A parallel for being run. Its chunks are handed out in order to whichever
+// runner asks next, the parent's thread being one of them.
+typedef struct {
+  Fiber* parent;
+  // Where the body starts, and the bytes of the parent's frame every runner
+  // gets a copy of. The loop variable is at offset slot of the frame,
+  // followed by the end and the accumulators of the reductions.
+  uint8_t* body;
+  int frame_size;
+  int slot;
+  int reduction_count;
+
+  int32_t low;
+  int32_t high;
+  int64_t chunk_size;
+  int chunk_count;
+  atomic_int next_chunk;
+  // The accumulators each chunk ended with, chunk after chunk.
+  int32_t* results;
+
+  // Set once a chunk fails, the others stop at their next slice.
+  atomic_bool stop;
+
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  // Runners not done yet, the instructions the done ones ran, and the
+  // first chunk that failed, with how.
+  int running;
+  uint64_t instructions;
+  int failed_chunk;
+  FiberState state;
+  const char* fault;
+} ParallelLoop;
+
+Pool* get_parallel_pool(int threads) {
+  pthread_mutex_lock(&parallel_pool_lock);
+
+  // The thread starting a loop runs chunks too.
+  if (parallel_pool == NULL) parallel_pool = new_pool(threads - 1);
+
+  pthread_mutex_unlock(&parallel_pool_lock);
+  return parallel_pool;
+}
+
+// Reading a string may flatten it or cache its hash. The chunks only read
+// the parent's strings, through its globals and its frame, and those are
+// settled before they start.
+void settle_strings(Fiber* fiber, uint8_t* body) {
+  Program* program = fiber->program;
+
+  for (int i = 0; i < program->root_count; i++) {
+    HeapSlot* root = &program->roots[i];
+    if (root->type != VAL_STRING) continue;
+
+    String string;
+    memcpy(&string, fiber->globals + root->offset, sizeof(String));
+    settle_string(&fiber->heap, &string);
+  }
+
+  Module* module = program->modules[fiber->module];
+  StackMap* map = find_stack_map(module, body - module->code.code);
+  if (map == NULL) return;
+
+  for (int i = 0; i < map->slot_count; i++) {
+    HeapSlot* slot = &module->map_slots[map->first_slot + i];
+    if (slot->type != VAL_STRING) continue;
+
+    String string;
+    memcpy(&string, fiber->frame + slot->offset, sizeof(String));
+    settle_string(&fiber->heap, &string);
+  }
+}
+
+// A fiber that runs chunks. The globals are the parent's, which the body
+// only reads, the heap is its own.
+Fiber* new_worker(ParallelLoop* loop) {
+  Fiber* parent = loop->parent;
+  Fiber* worker = allocate_fiber(parent->program, 0);
+
+  worker->globals = parent->globals;
+  worker->module = parent->module;
+  worker->out = parent->out;
+  worker->record = parent->record;
+  worker->fields = parent->fields;
+  worker->field_count = parent->field_count;
+  init_heap(&worker->heap);
+  worker->initialize_only = false;
+  worker->fault = NULL;
+  worker->hold_fault = true;
+  worker->instructions = 0;
+  worker->fuel = parent->fuel;
+  worker->deadline = parent->deadline;
+  worker->next = NULL;
+
+  // What an iteration allocates is dead by its end, where OP_PARALLEL_END
+  // frees it. The roots would lead into the parent's heap.
+  worker->heap.next_collection = SIZE_MAX;
+
+  memcpy(worker->stack, parent->frame, loop->frame_size);
+  return worker;
+}
+
+void run_chunk(ParallelLoop* loop, Fiber* worker, int chunk) {
+  int64_t first = loop->low + chunk * loop->chunk_size;
+  int64_t end = first + loop->chunk_size;
+  if (end > loop->high) end = loop->high;
+
+  int32_t index = (int32_t)first;
+  int32_t limit = (int32_t)end;
+  int size = sizeof(int32_t) * loop->reduction_count;
+  uint8_t* slots = worker->stack + loop->slot;
+
+  // The accumulators start over from the identities the parent holds.
+  memcpy(slots, &index, sizeof(index));
+  memcpy(slots + sizeof(int32_t), &limit, sizeof(limit));
+  memcpy(slots + 2 * sizeof(int32_t),
+         loop->parent->frame + loop->slot + 2 * sizeof(int32_t), size);
+
+  worker->ip = loop->body;
+  worker->frame = worker->stack;
+  worker->top = worker->stack + loop->frame_size;
+  worker->frame_count = 0;
+  worker->state = FIBER_READY;
+
+  while (resume_fiber(worker, FIBER_SLICE) == FIBER_READY &&
+         !atomic_load(&loop->stop)) {
+  }
+
+  // With no reductions there are no results.
+  if (worker->state == FIBER_DONE) {
+    if (size > 0) {
+      memcpy(&loop->results[chunk * loop->reduction_count],
+             slots + 2 * sizeof(int32_t), size);
+    }
+    return;
+  }
+
+  // Stopped because another chunk failed.
+  if (worker->state == FIBER_READY) return;
+
+  pthread_mutex_lock(&loop->lock);
+
+  if (loop->failed_chunk == -1 || chunk < loop->failed_chunk) {
+    loop->failed_chunk = chunk;
+    loop->state = worker->state;
+    loop->fault = worker->fault;
+  }
+
+  pthread_mutex_unlock(&loop->lock);
+  atomic_store(&loop->stop, true);
+}
+
+// Runs chunks until none are left, on the thread starting the loop or as a
+// task of the pool.
+void run_chunks(void* arg) {
+  ParallelLoop* loop = (ParallelLoop*)arg;
+  Fiber* worker = new_worker(loop);
+
+  while (!atomic_load(&loop->stop)) {
+    int chunk = atomic_fetch_add(&loop->next_chunk, 1);
+    if (chunk >= loop->chunk_count) break;
+
+    run_chunk(loop, worker, chunk);
+  }
+
+  pthread_mutex_lock(&loop->lock);
+
+  loop->instructions += worker->instructions;
+  loop->running--;
+  if (loop->running == 0) pthread_cond_signal(&loop->finished);
+
+  pthread_mutex_unlock(&loop->lock);
+
+  // Counted with the parent's instructions.
+  worker->instructions = 0;
+  free_fiber(worker);
+}
+
+int32_t reduce(Reduction kind, int32_t a, int32_t b) {
+  switch (kind) {
+    case REDUCE_SUM:
+      return (int32_t)((uint32_t)a + (uint32_t)b);
+    case REDUCE_MIN:
+      return a < b ? a : b;
+    default:
+      return a > b ? a : b;
+  }
+}
+
+// Runs a parallel for whose body starts at body. top is right above the
+// loop variable, the end and the accumulators, which get what the chunks
+// computed, combined in chunk order. The chunks' instructions count as the
+// fiber's.
+FiberState run_parallel(Fiber* fiber, uint8_t* body, uint8_t* top,
+                        uint32_t kinds) {
+  int count = 0;
+  while ((kinds >> (2 * count)) & 3) count++;
+
+  uint8_t* slots = top - sizeof(int32_t) * (2 + count);
+
+  ParallelLoop loop;
+  memcpy(&loop.low, slots, sizeof(int32_t));
+  memcpy(&loop.high, slots + sizeof(int32_t), sizeof(int32_t));
+  if (loop.low >= loop.high) return FIBER_DONE;
+
+  settle_strings(fiber, body);
+
+  int threads = parallel_threads > 0 ? parallel_threads : cpu_count();
+  int64_t range = (int64_t)loop.high - loop.low;
+
+  loop.parent = fiber;
+  loop.body = body;
+  loop.frame_size = top - fiber->frame;
+  loop.slot = slots - fiber->frame;
+  loop.reduction_count = count;
+  loop.chunk_size = range / ((int64_t)threads * CHUNKS_PER_THREAD);
+  if (loop.chunk_size < 1) loop.chunk_size = 1;
+  loop.chunk_count = (int)((range + loop.chunk_size - 1) / loop.chunk_size);
+  atomic_init(&loop.next_chunk, 0);
+  loop.results = ALLOCATE(int32_t, loop.chunk_count * count);
+  atomic_init(&loop.stop, false);
+
+  pthread_mutex_init(&loop.lock, NULL);
+  pthread_cond_init(&loop.finished, NULL);
+  int runners = threads < loop.chunk_count ? threads : loop.chunk_count;
+  loop.running = runners;
+  loop.instructions = 0;
+  loop.failed_chunk = -1;
+  loop.state = FIBER_DONE;
+  loop.fault = NULL;
+
+  if (runners > 1) {
+    Pool* pool = get_parallel_pool(threads);
+
+    for (int i = 1; i < runners; i++) {
+      pool_submit(pool, run_chunks, &loop);
+    }
+  }
+
+  run_chunks(&loop);
+
+  pthread_mutex_lock(&loop.lock);
+  while (loop.running > 0) pthread_cond_wait(&loop.finished, &loop.lock);
+  pthread_mutex_unlock(&loop.lock);
+
+  pthread_mutex_destroy(&loop.lock);
+  pthread_cond_destroy(&loop.finished);
+
+  if (loop.state == FIBER_DONE) {
+    for (int i = 0; i < count; i++) {
+      Reduction kind = (Reduction)((kinds >> (2 * i)) & 3);
+      uint8_t* accumulator = slots + sizeof(int32_t) * (2 + i);
+
+      int32_t value;
+      memcpy(&value, accumulator, sizeof(value));
 
-// Value peek(int distance) { return top[-1 - distance]; }
+      for (int chunk = 0; chunk < loop.chunk_count; chunk++) {
+        value = reduce(kind, value, loop.results[chunk * count + i]);
+      }
+
+      memcpy(accumulator, &value, sizeof(value));
+    }
+  }
+
+  if (loop.state == FIBER_ERROR) {
+    fiber->fault = loop.fault;
+    if (!fiber->hold_fault) fprintf(error_stream(), "%s\n", loop.fault);
+  }
+
+  FREE_ARRAY(int32_t, loop.results, loop.chunk_count * count);
+  count_metric(METRIC_PARALLEL_CHUNKS, loop.chunk_count);
+
+  fiber->instructions += loop.instructions;
+
+  if (fiber->fuel != FUEL_UNLIMITED) {
+    if (loop.instructions > (uint64_t)fiber->fuel) {
+      fiber->fuel = 0;
+      if (loop.state == FIBER_DONE) loop.state = FIBER_OUT_OF_FUEL;
+    } else {
+      fiber->fuel -= loop.instructions;
+    }
+  }
+
+  return loop.state;
+}
+
+// Collects with no roots at all, for a heap none of whose objects are live.
+void mark_no_roots(Heap* heap, void* arg) {
+  (void)heap;
+  (void)arg;
+}
+
+// Reads a field as an int in place, like atoi. Anything after the leading
+// digits is ignored and a missing field is 0.
+int32_t field_int(Fiber* fiber, uint32_t index) {
+  if (index >= (uint32_t)fiber->field_count) return 0;
+
+  const char* p = fiber->fields[index].start;
+  const char* end = fiber->fields[index].end;
+
+  bool negative = p < end && *p == '-';
+  if (p < end && (*p == '-' || *p == '+')) p++;
+
+  uint32_t value = 0;
+
+  while (p < end && (unsigned)(*p - '0') < 10) {
+    value = value * 10 + (uint32_t)(*p - '0');
+    p++;
+  }
+
+  return (int32_t)(negative ? 0u - value : value);
+}
+
+void print_value(Heap* heap, FILE* out, ValueType type, uint8_t* value) {
+  switch (type) {
+    case VAL_INT: {
+      int32_t integer;
+      memcpy(&integer, value, sizeof(int32_t));
+
+      fprintf(out, "%d", integer);
+      break;
+    }
+    case VAL_BOOL: {
+      bool boolean;
+      memcpy(&boolean, value, sizeof(bool));
+
+      fputs(boolean ? "true" : "false", out);
+      break;
+    }
+    case VAL_STRING: {
+      String string;
+      memcpy(&string, value, sizeof(String));
+
+      fwrite(string_chars(heap, &string), 1, string_length(&string), out);
+      break;
+    }
+    case VAL_INT_ARRAY:
+    case VAL_BOOL_ARRAY: {
+      ObjArray* array;
+      memcpy(&array, value, sizeof(array));
+
+      ValueType element = element_type(type);
+      int size = value_size(element);
+
+      fputc('[', out);
+      for (int i = 0; i < array->length; i++) {
+        if (i > 0) fputs(", ", out);
+        print_value(heap, out, element,
+                    (uint8_t*)array->data + (size_t)i * size);
+      }
+      fputc(']', out);
+      break;
+    }
+    default:
+      break;
+  }
+}
 
-// bool is_falsy(Value value) { return (IS_BOOL(value) && !AS_BOOL(value)); }
+// Instructions that may run before the VM has to look at the budget, the
+// fuel or the clock again.
+int64_t meter_window(Fiber* fiber, int64_t budget) {
+  int64_t window = budget;
 
-bool run_code(uint8_t* code) {
+  if (fiber->fuel != FUEL_UNLIMITED && fiber->fuel < window) {
+    window = fiber->fuel;
+  }
+
+  if (fiber->deadline > 0 && DEADLINE_CHECK_INTERVAL < window) {
+    window = DEADLINE_CHECK_INTERVAL;
+  }
+
+  return window;
+}
+
+FiberState resume_fiber(Fiber* fiber, int budget) {
 #define BINARY_OP(value_type, op) \
   do {                            \
     value_type b;                 \
@@ -42,20 +702,102 @@ bool run_code(uint8_t* code) {
     push(value_type, res);        \
   } while (false);
 
-  uint8_t* ip = code;
+// Elementwise kernel over an int[] and an int[] or int operand.
+#define ARRAY_MAP(kernel, result_type)                             \
+  do {                                                             \
+    bool scalar = *ip == VAL_INT;                                  \
+    ip++;                                                          \
+                                                                   \
+    ObjArray* b = NULL;                                            \
+    int32_t s = 0;                                                 \
+    if (scalar) {                                                  \
+      pop(int32_t, s);                                             \
+    } else {                                                       \
+      pop(ObjArray*, b);                                           \
+    }                                                              \
+    ObjArray* a;                                                   \
+    pop(ObjArray*, a);                                             \
+                                                                   \
+    if (b != NULL && b->length != a->length) {                     \
+      FAULT("Array lengths differ.");                              \
+    }                                                              \
+                                                                   \
+    ObjArray* r =                                                  \
+        new_array(&fiber->heap, sizeof(result_type), a->length); \
+    map_ints(kernel, r->data, (int32_t*)a->data,                   \
+             b != NULL ? (int32_t*)b->data : NULL, s, a->length);  \
+    push(ObjArray*, r);                                            \
+  } while (false)
+
+#define FAULT(message)  \
+  do {                  \
+    fault = message;    \
+    goto runtime_error; \
+  } while (false)
+
+// A comparison of ints and a jump taken when it is false.
+#define COMPARE_JUMP(op)               \
+  do {                                 \
+    uint16_t offset = read_u16(&ip);   \
+    meter -= read_leb128(&ip);         \
+                                       \
+    int32_t b;                         \
+    pop(int32_t, b);                   \
+    int32_t a;                         \
+    pop(int32_t, a);                   \
+                                       \
+    if (!(a op b)) ip += offset;       \
+                                       \
+    if (meter < 0) goto charge;        \
+  } while (false)
+
+#define LOAD_MODULE(index)                         \
+  do {                                             \
+    fiber->module = (index);                       \
+    code = &program->modules[fiber->module]->code; \
+    links = program->links[fiber->module];         \
+    callees = program->callees[fiber->module];     \
+  } while (false)
+
+  if (fiber->state != FIBER_READY) return fiber->state;
+
+  Program* program = fiber->program;
+  Code* code;
+  int* links;
+  Callee* callees;
+  LOAD_MODULE(fiber->module);
+
+  uint8_t* ip = fiber->ip;
+  uint8_t* top = fiber->top;
+  uint8_t* frame = fiber->frame;
+  uint8_t* globals = fiber->globals;
+
+  if (fiber->waiting_since > 0) {
+    fiber->deadline += now_seconds() - fiber->waiting_since;
+    fiber->waiting_since = 0;
+  }
+
+  // A single countdown stands for the budget, the fuel and the next deadline
+  // check, so charging a block is a subtraction and a branch in the common
+  // case.
+  int64_t remaining = budget;
+  int64_t window = meter_window(fiber, remaining);
+  int64_t meter = window;
+
+  const char* fault = NULL;
 
   while (true) {
 #ifdef DEBUG_TRACE_EXECUTION
     printf("          [");
-    for (uint8_t* slot = stack; slot < top; slot++) {
-      if (slot == stack)
+    for (uint8_t* slot = fiber->stack; slot < top; slot++) {
+      if (slot == fiber->stack)
         printf("%d", *slot);
       else
         printf(", %d", *slot);
     }
     printf("]\n");
 
-    int offset = ip - code;
+    int offset = ip - code->code;
     log_instruction(code, &offset);
 #endif
 
@@ -64,31 +806,130 @@ bool run_code(uint8_t* code) {
 
     switch (instruction) {
       case OP_CONSTANT: {
+        uint32_t index = read_leb128(&ip);
+
         int32_t integer;
-        memcpy(&integer, ip, sizeof(int32_t));
+        memcpy(&integer, &code->constants[index], sizeof(int32_t));
 
-        ip += sizeof(int32_t);
+        push(int32_t, integer);
+
+        break;
+      }
+      case OP_CONST_SMALL: {
+        int32_t integer = (int8_t)*ip;
+        ip++;
 
         push(int32_t, integer);
 
         break;
       }
+      case OP_ZERO: {
+        int32_t integer = 0;
+        push(int32_t, integer);
+        break;
+      }
+      case OP_ONE: {
+        int32_t integer = 1;
+        push(int32_t, integer);
+        break;
+      }
+      // Ints wrap around, so they are added and multiplied as unsigned.
       case OP_ADD:
-        BINARY_OP(int32_t, +);
+        BINARY_OP(uint32_t, +);
         break;
       case OP_SUBTRACT:
-        BINARY_OP(int32_t, -);
+        BINARY_OP(uint32_t, -);
         break;
       case OP_MULTIPLY:
-        BINARY_OP(int32_t, *);
+        BINARY_OP(uint32_t, *);
         break;
       case OP_DIVIDE:
-        BINARY_OP(int32_t, /);
+      case OP_MODULO: {
+        int32_t b;
+        pop(int32_t, b);
+        int32_t a;
+        pop(int32_t, a);
+
+        if (b == 0) FAULT("Division by zero.");
+
+        int32_t r = divide_ints(a, b, instruction == OP_MODULO);
+        push(int32_t, r);
+        break;
+      }
+      // Division by constants, rounding toward zero like OP_DIVIDE. A power
+      // of two adds 2^k - 1 to negative dividends before shifting, others
+      // multiply by a magic number and correct negative quotients by one.
+      case OP_DIVIDE_POW2:
+      case OP_MODULO_POW2: {
+        int k = (int8_t)*ip;
+        ip++;
+
+        int32_t a;
+        pop(int32_t, a);
+
+        int32_t mask = (int32_t)((1u << k) - 1);
+        int32_t bias = (a >> 31) & mask;
+        int32_t r = instruction == OP_DIVIDE_POW2 ? (a + bias) >> k
+                                                  : ((a + bias) & mask) - bias;
+        push(int32_t, r);
+        break;
+      }
+      case OP_DIVIDE_MAGIC:
+      case OP_MODULO_MAGIC: {
+        uint64_t magic;
+        memcpy(&magic, &code->constants[read_leb128(&ip)], sizeof(magic));
+        int shift = (int8_t)*ip;
+        ip++;
+
+        int32_t a;
+        pop(int32_t, a);
+
+        bool modulo = instruction == OP_MODULO_MAGIC;
+        int32_t r = divide_magic(a, magic, shift, modulo);
+        push(int32_t, r);
+        break;
+      }
+      case OP_BIT_AND:
+        BINARY_OP(int32_t, &);
+        break;
+      case OP_BIT_OR:
+        BINARY_OP(int32_t, |);
+        break;
+      case OP_BIT_XOR:
+        BINARY_OP(int32_t, ^);
+        break;
+      case OP_BIT_NOT: {
+        int32_t v;
+        pop(int32_t, v);
+        int32_t r = ~v;
+        push(int32_t, r);
+        break;
+      }
+      // Shift counts are taken modulo 32, as the hardware does.
+      case OP_SHIFT_LEFT:
+      case OP_SHIFT_RIGHT:
+      case OP_SHIFT_RIGHT_UNSIGNED: {
+        int32_t b;
+        pop(int32_t, b);
+        int32_t a;
+        pop(int32_t, a);
+
+        int count = b & 31;
+        int32_t r;
+        if (instruction == OP_SHIFT_LEFT) {
+          r = (int32_t)((uint32_t)a << count);
+        } else if (instruction == OP_SHIFT_RIGHT) {
+          r = a >> count;
+        } else {
+          r = (int32_t)((uint32_t)a >> count);
+        }
+        push(int32_t, r);
         break;
+      }
       case OP_NEGATE: {
         int32_t v;
         pop(int32_t, v);
-        int32_t r = -v;
+        int32_t r = (int32_t)(0u - (uint32_t)v);
         push(int32_t, r);
         break;
       }
@@ -134,8 +975,23 @@ bool run_code(uint8_t* code) {
             push(bool, r);
             break;
           }
-          default:
+          case VAL_STRING: {
+            String b;
+            pop(String, b);
+            String a;
+            pop(String, a);
+            bool r = strings_equal(&fiber->heap, &a, &b);
+            push(bool, r);
+            break;
+          }
+          default: {
+            // Structs have no padding, equal fields are equal bytes.
+            int size = value_size(operand_type);
+            top -= 2 * size;
+            bool r = memcmp(top, top + size, size) == 0;
+            push(bool, r);
             break;
+          }
         }
 
         break;
@@ -160,36 +1016,1023 @@ bool run_code(uint8_t* code) {
 
         break;
       }
-      case OP_RETURN: {
-        uint8_t return_type;
-        memcpy(&return_type, ip, 1);
+      // && and || of rule sets, which evaluate both sides.
+      case OP_AND:
+        BINARY_OP(bool, &&);
+        break;
+      case OP_OR:
+        BINARY_OP(bool, ||);
+        break;
+      case OP_POP: {
+        uint8_t type = *ip;
         ip++;
 
-        switch (return_type) {
-          case VAL_INT: {
-            int32_t value;
-            pop(int32_t, value);
+        top -= value_size(type);
+        break;
+      }
+      case OP_RESULT:
+        // In stream mode a bool result is a filter, records it holds for are
+        // copied to the output unchanged.
+        if (*ip == VAL_BOOL && fiber->record.start != NULL) {
+          ip++;
 
-            printf("%d", value);
-            break;
-          }
-          case VAL_BOOL: {
-            bool value;
-            pop(bool, value);
+          bool keep;
+          pop(bool, keep);
 
-            printf(value ? "true" : "false");
-            break;
+          if (keep) {
+            fwrite(fiber->record.start, 1,
+                   fiber->record.end - fiber->record.start, fiber->out);
+            fputc('\n', fiber->out);
           }
+          break;
         }
 
-        printf("\n");
+        // Any other result is printed.
+        // fall through
+      case OP_PRINT: {
+        uint8_t type = *ip;
+        ip++;
 
-        return true;
+        top -= value_size(type);
+        print_value(&fiber->heap, fiber->out, type, top);
+        fputc('\n', fiber->out);
+        break;
       }
-    }
-  }
+      case OP_DROP:
+        top -= read_leb128(&ip);
+        break;
+      case OP_SLIDE: {
+        // Moves the value on top down over the bytes below it.
+        int size = value_size(*ip);
+        ip++;
+        uint32_t count = read_leb128(&ip);
 
-  return true;
+        move_value(top - size - count, top - size, size);
+        top -= count;
+        break;
+      }
+      case OP_FIELD: {
+        int32_t integer = field_int(fiber, read_leb128(&ip));
+        push(int32_t, integer);
+        break;
+      }
+      case OP_STRING: {
+        ObjString* object;
+        memcpy(&object, &code->constants[read_leb128(&ip)], sizeof(object));
 
-#undef BINARY_OP
+        String string = object->length > SMALL_STRING_MAX
+                            ? heap_string(object)
+                            : make_string(NULL, object->chars, object->length);
+        push(String, string);
+        break;
+      }
+      case OP_CONCAT: {
+        String b;
+        pop(String, b);
+        String a;
+        pop(String, a);
+        String r = concat_strings(&fiber->heap, &a, &b);
+        push(String, r);
+        break;
+      }
+      case OP_LENGTH: {
+        int32_t length;
+
+        if (*ip == VAL_STRING) {
+          String string;
+          pop(String, string);
+          length = string_length(&string);
+        } else {
+          ObjArray* array;
+          pop(ObjArray*, array);
+          length = array->length;
+        }
+
+        ip++;
+        push(int32_t, length);
+        break;
+      }
+      case OP_ARRAY: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t count = read_leb128(&ip);
+
+        top -= size * count;
+
+        ObjArray* array = new_array(&fiber->heap, size, count);
+        memcpy(array->data, top, size * count);
+
+        push(ObjArray*, array);
+        break;
+      }
+      case OP_GET_ELEMENT: {
+        int size = value_size(*ip);
+        ip++;
+
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if ((uint32_t)index >= (uint32_t)array->length) {
+          FAULT("Array index out of bounds.");
+        }
+
+        move_value(top, (uint8_t*)array->data + (size_t)index * size, size);
+        top += size;
+        break;
+      }
+      case OP_SET_ELEMENT: {
+        int size = value_size(*ip);
+        ip++;
+
+        top -= size;
+        uint8_t* value = top;
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if ((uint32_t)index >= (uint32_t)array->length) {
+          FAULT("Array index out of bounds.");
+        }
+
+        move_value((uint8_t*)array->data + (size_t)index * size, value,
+                   size);
+        break;
+      }
+      // A field of a struct in an array, which stores the structs one after
+      // the other. The operand is the offset of the field in the struct.
+      case OP_GET_MEMBER: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if ((uint32_t)index >= (uint32_t)array->length) {
+          FAULT("Array index out of bounds.");
+        }
+
+        memcpy(top,
+               (uint8_t*)array->data + index * array->element_size + offset,
+               size);
+        top += size;
+        break;
+      }
+      case OP_SET_MEMBER: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        top -= size;
+        uint8_t* value = top;
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if ((uint32_t)index >= (uint32_t)array->length) {
+          FAULT("Array index out of bounds.");
+        }
+
+        memmove((uint8_t*)array->data + index * array->element_size + offset,
+                value, size);
+        break;
+      }
+      // The same for arrays of column structs, which store each field in a
+      // column of its own. The field offset bytes into the struct has its
+      // column offset * length bytes into the data.
+      case OP_GET_COLUMN: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if ((uint32_t)index >= (uint32_t)array->length) {
+          FAULT("Array index out of bounds.");
+        }
+
+        memcpy(top,
+               (uint8_t*)array->data + (size_t)offset * array->length +
+                   (size_t)index * size,
+               size);
+        top += size;
+        break;
+      }
+      case OP_SET_COLUMN: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        top -= size;
+        uint8_t* value = top;
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if ((uint32_t)index >= (uint32_t)array->length) {
+          FAULT("Array index out of bounds.");
+        }
+
+        memmove((uint8_t*)array->data + (size_t)offset * array->length +
+                    (size_t)index * size,
+                value, size);
+        break;
+      }
+      // A field of every element of an array of column structs, which is
+      // its column copied whole.
+      case OP_COPY_COLUMN: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        ObjArray* column = new_array(&fiber->heap, size, array->length);
+        memcpy(column->data,
+               (uint8_t*)array->data + (size_t)offset * array->length,
+               (size_t)size * array->length);
+
+        push(ObjArray*, column);
+        break;
+      }
+      // The loop optimizer proved the index in bounds.
+      case OP_GET_ELEMENT_UNCHECKED: {
+        int size = value_size(*ip);
+        ip++;
+
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        move_value(top, (uint8_t*)array->data + (size_t)index * size, size);
+        top += size;
+        break;
+      }
+      case OP_SET_ELEMENT_UNCHECKED: {
+        int size = value_size(*ip);
+        ip++;
+
+        top -= size;
+        uint8_t* value = top;
+        int32_t index;
+        pop(int32_t, index);
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        move_value((uint8_t*)array->data + (size_t)index * size, value,
+                   size);
+        break;
+      }
+      case OP_ARRAY_ADD:
+        ARRAY_MAP(KERNEL_ADD, int32_t);
+        break;
+      case OP_ARRAY_SUBTRACT:
+        ARRAY_MAP(KERNEL_SUBTRACT, int32_t);
+        break;
+      case OP_ARRAY_MULTIPLY:
+        ARRAY_MAP(KERNEL_MULTIPLY, int32_t);
+        break;
+      case OP_ARRAY_EQUAL:
+        ARRAY_MAP(KERNEL_EQUAL, bool);
+        break;
+      case OP_ARRAY_LESS:
+        ARRAY_MAP(KERNEL_LESS, bool);
+        break;
+      case OP_ARRAY_GREATER:
+        ARRAY_MAP(KERNEL_GREATER, bool);
+        break;
+      case OP_ARRAY_NEGATE: {
+        ObjArray* a;
+        pop(ObjArray*, a);
+
+        ObjArray* r = new_array(&fiber->heap, sizeof(int32_t), a->length);
+        negate_ints((int32_t*)r->data, (int32_t*)a->data, a->length);
+
+        push(ObjArray*, r);
+        break;
+      }
+      case OP_ARRAY_NOT: {
+        ObjArray* a;
+        pop(ObjArray*, a);
+
+        ObjArray* r = new_array(&fiber->heap, sizeof(bool), a->length);
+        not_bools((bool*)r->data, (bool*)a->data, a->length);
+
+        push(ObjArray*, r);
+        break;
+      }
+      case OP_RANGE: {
+        int32_t length;
+        pop(int32_t, length);
+
+        if (length < 0) FAULT("Array length can't be negative.");
+
+        ObjArray* array = new_array(&fiber->heap, sizeof(int32_t), length);
+        if (array == NULL) FAULT("Array too large.");
+
+        int32_t* ints = (int32_t*)array->data;
+        for (int32_t i = 0; i < length; i++) ints[i] = i;
+
+        push(ObjArray*, array);
+        break;
+      }
+      case OP_FILL: {
+        int size = value_size(*ip);
+        ip++;
+
+        top -= size;
+        uint8_t* value = top;
+        int32_t length;
+        pop(int32_t, length);
+
+        if (length < 0) FAULT("Array length can't be negative.");
+
+        // The pushed value sits right where the array goes, copy it first.
+        uint8_t element[MAX_STRUCT_SIZE];
+        memcpy(element, value, size);
+
+        ObjArray* array = new_array(&fiber->heap, size, length);
+        if (array == NULL) FAULT("Array too large.");
+
+        uint8_t* data = (uint8_t*)array->data;
+        for (int32_t i = 0; i < length; i++) {
+          memcpy(data + (size_t)i * size, element, size);
+        }
+
+        push(ObjArray*, array);
+        break;
+      }
+      case OP_FILL_COLUMNS: {
+        // The operand has the field count in its low 5 bits and a bit per
+        // field above them, set for bools, which lays out the columns.
+        uint32_t layout = read_leb128(&ip);
+        int field_count = layout & 0x1f;
+
+        int size = 0;
+        for (int i = 0; i < field_count; i++) {
+          size += layout >> (5 + i) & 1 ? sizeof(bool) : sizeof(int32_t);
+        }
+
+        top -= size;
+        uint8_t element[MAX_STRUCT_SIZE];
+        memcpy(element, top, size);
+        int32_t length;
+        pop(int32_t, length);
+
+        if (length < 0) FAULT("Array length can't be negative.");
+
+        ObjArray* array = new_array(&fiber->heap, size, length);
+        if (array == NULL) FAULT("Array too large.");
+
+        uint8_t* column = (uint8_t*)array->data;
+        int offset = 0;
+
+        for (int i = 0; i < field_count; i++) {
+          int field_size =
+              layout >> (5 + i) & 1 ? sizeof(bool) : sizeof(int32_t);
+
+          for (int32_t j = 0; j < length; j++) {
+            memcpy(column + (size_t)j * field_size, element + offset,
+                   field_size);
+          }
+
+          column += (size_t)field_size * length;
+          offset += field_size;
+        }
+
+        push(ObjArray*, array);
+        break;
+      }
+      case OP_SUM: {
+        bool ints = *ip == VAL_INT_ARRAY;
+        ip++;
+
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        int32_t sum = ints ? sum_ints((int32_t*)array->data, array->length)
+                           : count_bools((bool*)array->data, array->length);
+        push(int32_t, sum);
+        break;
+      }
+      case OP_MIN:
+      case OP_MAX: {
+        ObjArray* array;
+        pop(ObjArray*, array);
+
+        if (array->length == 0) FAULT("Array is empty.");
+
+        int32_t* ints = (int32_t*)array->data;
+        int32_t r = instruction == OP_MIN ? min_ints(ints, array->length)
+                                          : max_ints(ints, array->length);
+        push(int32_t, r);
+        break;
+      }
+      case OP_FILTER: {
+        int size = value_size(*ip);
+        ip++;
+
+        ObjArray* mask;
+        pop(ObjArray*, mask);
+        ObjArray* a;
+        pop(ObjArray*, a);
+
+        if (mask->length != a->length) FAULT("Array lengths differ.");
+
+        ObjArray* r = new_array(&fiber->heap, size, a->length);
+        r->length = filter_elements(r->data, a->data, (bool*)mask->data, size,
+                                    a->length);
+
+        push(ObjArray*, r);
+        break;
+      }
+      // The math built ins select instead of branching, which compilers
+      // turn into conditional moves.
+      case OP_ABS: {
+        int32_t v;
+        pop(int32_t, v);
+        // Wraps like negation, abs of the smallest int is itself.
+        uint32_t magnitude = v < 0 ? 0u - (uint32_t)v : (uint32_t)v;
+        int32_t r = (int32_t)magnitude;
+        push(int32_t, r);
+        break;
+      }
+      case OP_MIN_INT: {
+        int32_t b;
+        pop(int32_t, b);
+        int32_t a;
+        pop(int32_t, a);
+        int32_t r = a < b ? a : b;
+        push(int32_t, r);
+        break;
+      }
+      case OP_MAX_INT: {
+        int32_t b;
+        pop(int32_t, b);
+        int32_t a;
+        pop(int32_t, a);
+        int32_t r = a > b ? a : b;
+        push(int32_t, r);
+        break;
+      }
+      case OP_CLAMP: {
+        int32_t high;
+        pop(int32_t, high);
+        int32_t low;
+        pop(int32_t, low);
+        int32_t v;
+        pop(int32_t, v);
+        int32_t r = v < low ? low : v;
+        r = r > high ? high : r;
+        push(int32_t, r);
+        break;
+      }
+      case OP_SQRT: {
+        int32_t v;
+        pop(int32_t, v);
+
+        if (v < 0) FAULT("Can't take the square root of a negative number.");
+
+        // Exact: a double holds every int and its square root is rounded
+        // correctly, which never rounds up to the next int.
+        int32_t r = (int32_t)sqrt((double)v);
+        push(int32_t, r);
+        break;
+      }
+      case OP_GET_GLOBAL: {
+        uint8_t type = *ip;
+        ip++;
+        uint32_t ref = read_leb128(&ip);
+
+        int size = value_size(type);
+        move_value(top, globals + links[ref], size);
+        top += size;
+        break;
+      }
+      case OP_SET_GLOBAL: {
+        uint8_t type = *ip;
+        ip++;
+        uint32_t ref = read_leb128(&ip);
+
+        int size = value_size(type);
+        top -= size;
+        move_value(globals + links[ref], top, size);
+        break;
+      }
+      case OP_GET_LOCAL: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        move_value(top, frame + offset, size);
+        top += size;
+        break;
+      }
+      case OP_SET_LOCAL: {
+        int size = value_size(*ip);
+        ip++;
+        uint32_t offset = read_leb128(&ip);
+
+        top -= size;
+        move_value(frame + offset, top, size);
+        break;
+      }
+      // Ints wrap around like the arithmetic instructions do.
+      case OP_INCREMENT_GLOBAL: {
+        uint8_t* global = globals + links[read_leb128(&ip)];
+        int8_t amount = (int8_t)*ip;
+        ip++;
+
+        uint32_t value;
+        memcpy(&value, global, sizeof(value));
+        value += (uint32_t)(int32_t)amount;
+        memcpy(global, &value, sizeof(value));
+        break;
+      }
+      case OP_INCREMENT_LOCAL: {
+        uint8_t* local = frame + read_leb128(&ip);
+        int8_t amount = (int8_t)*ip;
+        ip++;
+
+        uint32_t value;
+        memcpy(&value, local, sizeof(value));
+        value += (uint32_t)(int32_t)amount;
+        memcpy(local, &value, sizeof(value));
+        break;
+      }
+      case OP_CALL: {
+        Callee* callee = &callees[read_leb128(&ip)];
+
+        // The arguments the caller pushed become the start of the frame.
+        uint8_t* base = top - callee->params_size;
+
+        if (fiber->frame_count == fiber->frame_limit ||
+            base + callee->frame_size > fiber->stack_end) {
+          FAULT("Stack overflow.");
+        }
+
+        CallFrame* caller = &fiber->frames[fiber->frame_count++];
+        caller->ip = ip;
+        caller->frame = frame;
+        caller->module = fiber->module;
+
+        frame = base;
+        if (callee->module != fiber->module) LOAD_MODULE(callee->module);
+        ip = callee->entry;
+        break;
+      }
+      case OP_CALL_NATIVE: {
+        Native* native = &natives[read_leb128(&ip)];
+        meter -= read_leb128(&ip);
+
+        // The host reads the arguments in place and leaves its result there.
+        top -= native->params_size;
+        native->fn(fiber, top);
+        top += value_size(native->return_type);
+
+        // Host calls are yield points, like back jumps.
+        if (meter < 0) goto charge;
+        break;
+      }
+      case OP_TAIL_CALL: {
+        Callee* callee = &callees[read_leb128(&ip)];
+        meter -= read_leb128(&ip);
+
+        // The callee takes over the frame of the function calling it.
+        if (frame + callee->frame_size > fiber->stack_end) {
+          FAULT("Stack overflow.");
+        }
+
+        memmove(frame, top - callee->params_size, callee->params_size);
+        top = frame + callee->params_size;
+
+        if (callee->module != fiber->module) LOAD_MODULE(callee->module);
+        ip = callee->entry;
+
+        if (meter < 0) goto charge;
+        break;
+      }
+      case OP_RETURN: {
+        int size = value_size(*ip);
+        ip++;
+        meter -= read_leb128(&ip);
+
+        // The result replaces the arguments the caller pushed.
+        move_value(frame, top - size, size);
+        top = frame + size;
+
+        CallFrame* caller = &fiber->frames[--fiber->frame_count];
+        ip = caller->ip;
+        frame = caller->frame;
+        if (caller->module != fiber->module) LOAD_MODULE(caller->module);
+
+        if (meter < 0) goto charge;
+        break;
+      }
+      case OP_JUMP: {
+        uint16_t offset = read_u16(&ip);
+        meter -= read_leb128(&ip);
+        ip += offset;
+
+        if (meter < 0) goto charge;
+        break;
+      }
+      case OP_JUMP_IF_FALSE: {
+        uint16_t offset = read_u16(&ip);
+        meter -= read_leb128(&ip);
+
+        bool condition;
+        pop(bool, condition);
+
+        if (!condition) ip += offset;
+
+        if (meter < 0) goto charge;
+        break;
+      }
+      case OP_JUMP_IF_NOT_LESS:
+        COMPARE_JUMP(<);
+        break;
+      case OP_JUMP_IF_NOT_GREATER:
+        COMPARE_JUMP(>);
+        break;
+      case OP_JUMP_IF_NOT_EQUAL:
+        COMPARE_JUMP(==);
+        break;
+      // A switch pops the value and jumps by the offset the table has for
+      // it, which is the default offset for values without an entry.
+      case OP_TABLESWITCH:
+      case OP_LOOKUPSWITCH: {
+        uint8_t type = *ip;
+        ip++;
+        meter -= read_leb128(&ip);
+
+        int32_t value;
+        if (type == VAL_BOOL) {
+          bool b;
+          pop(bool, b);
+          value = b;
+        } else {
+          pop(int32_t, value);
+        }
+
+        uint8_t* entry;
+
+        if (instruction == OP_TABLESWITCH) {
+          int32_t low;
+          memcpy(&low, ip, sizeof(low));
+          ip += sizeof(low);
+          uint32_t count = read_leb128(&ip);
+
+          uint32_t index = (uint32_t)value - (uint32_t)low;
+          entry = ip + 2 * (index < count ? index + 1 : 0);
+          ip += 2 * (count + 1);
+        } else {
+          uint32_t count = read_leb128(&ip);
+          uint8_t* keys = ip + 2;
+          entry = ip;
+          ip = keys + (sizeof(int32_t) + 2) * count;
+
+          // Binary search through the sorted values.
+          uint32_t low = 0;
+          uint32_t high = count;
+          while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            uint8_t* pair = keys + (sizeof(int32_t) + 2) * middle;
+
+            int32_t key;
+            memcpy(&key, pair, sizeof(key));
+
+            if (key == value) {
+              entry = pair + sizeof(int32_t);
+              break;
+            }
+
+            if (key < value) {
+              low = middle + 1;
+            } else {
+              high = middle;
+            }
+          }
+        }
+
+        ip += (int16_t)read_u16(&entry);
+
+        if (meter < 0) goto charge;
+        break;
+      }
+      case OP_LOOP: {
+        uint16_t offset = read_u16(&ip);
+        meter -= read_leb128(&ip);
+
+        // A back jump is a safepoint, the stack maps describe the frames.
+        if (fiber->heap.pending) {
+          fiber->ip = ip;
+          fiber->frame = frame;
+          collect_garbage(&fiber->heap, mark_fiber_roots, fiber);
+        }
+
+        ip -= offset;
+
+        if (meter < 0) goto charge;
+        break;
+      }
+      // Runs the body that follows in chunks, on this thread and the pool's,
+      // then goes on after it.
+      case OP_PARALLEL: {
+        uint16_t offset = read_u16(&ip);
+        meter -= read_leb128(&ip);
+        uint32_t kinds = read_leb128(&ip);
+
+        fiber->frame = frame;
+        FiberState state = run_parallel(fiber, ip, top, kinds);
+
+        if (state != FIBER_DONE) {
+          fiber->ip = ip;
+          fiber->top = top;
+
+          fiber->instructions += window - meter;
+          fiber->state = state;
+          return state;
+        }
+
+        ip += offset;
+
+        // The chunks used fuel the meter does not know about yet.
+        goto charge;
+      }
+      // Ends an iteration of a fiber running a chunk. The loop variable is
+      // followed by the end of the chunk, which finishes the fiber.
+      case OP_PARALLEL_END: {
+        uint16_t offset = read_u16(&ip);
+        meter -= read_leb128(&ip);
+        uint8_t* slot = frame + read_leb128(&ip);
+
+        int32_t index;
+        int32_t end;
+        memcpy(&index, slot, sizeof(index));
+        memcpy(&end, slot + sizeof(index), sizeof(end));
+
+        index++;
+        memcpy(slot, &index, sizeof(index));
+
+        // Nothing the iteration allocated outlives it.
+        if (fiber->heap.bytes > MIN_COLLECTION_BYTES) {
+          collect_garbage(&fiber->heap, mark_no_roots, NULL);
+          finish_sweep(&fiber->heap);
+          fiber->heap.next_collection = SIZE_MAX;
+        }
+
+        if (index < end) {
+          ip -= offset;
+
+          if (meter < 0) goto charge;
+          break;
+        }
+
+        fiber->ip = ip;
+        fiber->top = top;
+        fiber->frame = frame;
+
+        fiber->instructions += window - meter;
+        if (fiber->fuel != FUEL_UNLIMITED) fiber->fuel -= window - meter;
+        fiber->state = FIBER_DONE;
+        return FIBER_DONE;
+      }
+      case OP_FUEL:
+        meter -= read_leb128(&ip);
+
+        if (meter < 0) goto charge;
+        break;
+      // A counter of a loop compiled to record a profile, in the running
+      // module.
+      case OP_PROFILE_BLOCK: {
+        Module* module = program->modules[fiber->module];
+        count_profile(&module->profile_counters[read_leb128(&ip)], 1);
+        break;
+      }
+      case OP_END:
+        // Once the entry module is initialized main runs, returning to
+        // end_code.
+        if (fiber->module + 1 == program->count && program->has_main &&
+            !fiber->initialize_only && ip != end_code + 1) {
+          if (top + program->main.frame_size > fiber->stack_end) {
+            FAULT("Stack overflow.");
+          }
+
+          CallFrame* caller = &fiber->frames[fiber->frame_count++];
+          caller->ip = end_code;
+          caller->frame = frame;
+          caller->module = fiber->module;
+
+          frame = top;
+          ip = program->main.entry;
+          break;
+        }
+
+        // The module is initialized, continue with the next one.
+        if (fiber->module + 1 == program->count) {
+          fiber->ip = ip;
+          fiber->top = top;
+
+          fiber->instructions += window - meter;
+          if (fiber->fuel != FUEL_UNLIMITED) fiber->fuel -= window - meter;
+          fiber->state = FIBER_DONE;
+          return FIBER_DONE;
+        }
+
+        LOAD_MODULE(fiber->module + 1);
+        ip = code->code;
+        break;
+    }
+
+    continue;
+
+  runtime_error:
+    fiber->ip = ip;
+    fiber->top = top;
+    fiber->frame = frame;
+
+    fiber->instructions += window - meter;
+
+    fiber->fault = fault;
+    if (!fiber->hold_fault) fprintf(error_stream(), "%s\n", fault);
+
+    fiber->state = FIBER_ERROR;
+    return FIBER_ERROR;
+
+  // The block that just ended ran the meter out. Charge what was used since
+  // the last check against the fuel, look at the clock and either stop the
+  // fiber or open the next window.
+  charge: {
+    int64_t used = window - meter;
+    remaining -= used;
+    fiber->instructions += used;
+
+    fiber->ip = ip;
+    fiber->top = top;
+    fiber->frame = frame;
+
+    if (fiber->fuel != FUEL_UNLIMITED) {
+      if (used > fiber->fuel) {
+        fiber->fuel = 0;
+        fiber->state = FIBER_OUT_OF_FUEL;
+        return FIBER_OUT_OF_FUEL;
+      }
+
+      fiber->fuel -= used;
+    }
+
+    double now = fiber->deadline > 0 ? now_seconds() : 0;
+
+    if (fiber->deadline > 0 && now >= fiber->deadline) {
+      fiber->state = FIBER_DEADLINE;
+      return FIBER_DEADLINE;
+    }
+
+    if (remaining <= 0) {
+      fiber->waiting_since = now;
+      return FIBER_READY;
+    }
+
+    window = meter_window(fiber, remaining);
+    meter = window;
+  }
+  }
+
+#undef FAULT
+#undef ARRAY_MAP
+#undef LOAD_MODULE
+#undef COMPARE_JUMP
+#undef BINARY_OP
+}
+
+void init_scheduler(Scheduler* scheduler, int slice,
+                    void (*finished)(void* owner, FiberState state,
+                                     const char* fault)) {
+  scheduler->head = NULL;
+  scheduler->tail = NULL;
+  scheduler->slice = slice;
+  scheduler->finished = finished;
+}
+
+void spawn_fiber(Scheduler* scheduler, Fiber* fiber) {
+  fiber->next = NULL;
+
+  if (scheduler->tail == NULL) {
+    scheduler->head = fiber;
+  } else {
+    scheduler->tail->next = fiber;
+  }
+
+  scheduler->tail = fiber;
+}
+
+bool step_scheduler(Scheduler* scheduler) {
+  Fiber* fiber = scheduler->head;
+  if (fiber == NULL) return false;
+
+  scheduler->head = fiber->next;
+  if (scheduler->head == NULL) scheduler->tail = NULL;
+
+  if (resume_fiber(fiber, scheduler->slice) == FIBER_READY) {
+    spawn_fiber(scheduler, fiber);
+    return true;
+  }
+
+  void* owner = fiber->owner;
+  FiberState state = fiber->state;
+  const char* fault = fiber->fault;
+  free_fiber(fiber);
+
+  if (scheduler->finished != NULL) scheduler->finished(owner, state, fault);
+  return true;
+}
+
+void run_scheduler(Scheduler* scheduler) {
+  while (step_scheduler(scheduler)) {
+  }
+}
+
+void apply_run_limits(Fiber* fiber) {
+  fiber->fuel = run_fuel;
+  if (run_timeout > 0) {
+    double now = now_seconds();
+
+    // Waiting for the first turn does not count either.
+    fiber->deadline = now + run_timeout;
+    fiber->waiting_since = now;
+  }
+}
+
+void report_stop(FiberState state) {
+  if (state == FIBER_ERROR) count_metric(METRIC_RUNTIME_ERRORS, 1);
+
+  if (state == FIBER_OUT_OF_FUEL) {
+    count_metric(METRIC_OUT_OF_FUEL, 1);
+    fprintf(error_stream(), "Out of fuel.\n");
+  } else if (state == FIBER_DEADLINE) {
+    count_metric(METRIC_DEADLINES_EXCEEDED, 1);
+    fprintf(error_stream(), "Deadline exceeded.\n");
+  }
+}
+
+FiberState run_modules(Fiber* fiber, int first) {
+  Program* program = fiber->program;
+  uint64_t start = metric_clock();
+
+  // Between two runs only the globals are live.
+  if (fiber->heap.pending) {
+    fiber->ip = end_code;
+    fiber->frame_count = 0;
+    collect_garbage(&fiber->heap, mark_fiber_roots, fiber);
+  }
+
+  fiber->module = first;
+  fiber->ip = program->modules[first]->code.code;
+  fiber->top = fiber->stack;
+  fiber->frame = fiber->stack;
+  fiber->frame_count = 0;
+  fiber->state = FIBER_READY;
+  apply_run_limits(fiber);
+
+  while (resume_fiber(fiber, FIBER_SLICE) == FIBER_READY) {
+  }
+
+  count_metric(METRIC_RUNS, 1);
+  count_metric(METRIC_RUN_NS, metric_clock() - start);
+
+  report_stop(fiber->state);
+  return fiber->state;
+}
+
+FiberState run_program(Program* program, FILE* out) {
+  uint64_t start = metric_clock();
+  Fiber* fiber = new_fiber(program);
+
+  fiber->out = out;
+  apply_run_limits(fiber);
+
+  while (resume_fiber(fiber, FIBER_SLICE) == FIBER_READY) {
+  }
+
+  count_metric(METRIC_RUNS, 1);
+  count_metric(METRIC_RUN_NS, metric_clock() - start);
+
+  FiberState state = fiber->state;
+  free_fiber(fiber);
+
+  report_stop(state);
+  return state;
 }
\ No newline at end of file
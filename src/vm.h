@@ -1,12 +1,159 @@
 #ifndef nol_vm_h
 #define nol_vm_h
 
+#include "bytecode.h"
 #include "common.h"
+#include "heap.h"
+#include "module.h"
 
-#define STACK_MAX 4096
+// Instruction budget a fiber gets each time it is resumed by the scheduler.
+#define FIBER_SLICE 10000
+
+// Fuel value for fibers that may run forever.
+#define FUEL_UNLIMITED -1
+
+// Instructions a fiber with a deadline runs between two looks at the clock.
+#define DEADLINE_CHECK_INTERVAL 65536
+
+// Stack bytes and nesting depth available to the calls of a program.
+#define CALL_STACK_SIZE (256 * 1024)
+#define MAX_FRAMES 1024
+
+typedef enum {
+  FIBER_READY,
+  FIBER_DONE,
+  FIBER_ERROR,
+  FIBER_OUT_OF_FUEL,
+  FIBER_DEADLINE
+} FiberState;
+
+// A slice of the input. Records and fields point into the stream's read
+// buffer, nothing is copied.
+typedef struct {
+  const char* start;
+  const char* end;
+} Field;
+
+// Where a call returns to. Arguments, locals and operands live on the
+// fiber's stack, only this bookkeeping is kept apart.
+typedef struct {
+  uint8_t* ip;
+  uint8_t* frame;
+  int module;
+} CallFrame;
+
+// One run of a program. All execution state lives here, so any number of
+// fibers can be suspended at once and resumed in any order.
+typedef struct Fiber {
+  Program* program;
+
+  // Index of the running module and the saved instruction pointer into it.
+  int module;
+  uint8_t* ip;
+
+  uint8_t* stack;
+  uint8_t* stack_end;
+  uint8_t* top;
+  uint8_t* globals;
+  // Bytes of globals the fiber has room for, at least the program's.
+  int globals_room;
+
+  // Start of the running function's parameters and locals, which are
+  // addressed relative to it.
+  uint8_t* frame;
+  CallFrame* frames;
+  int frame_count;
+  int frame_limit;
+
+  // Where print statements write, stdout unless changed.
+  FILE* out;
+
+  // The record a stream run is on, start is NULL outside stream mode.
+  // fields holds its first field_count fields.
+  Field record;
+  Field* fields;
+  int field_count;
+
+  // Strings and arrays the run allocates.
+  Heap heap;
+
+  // Stops the run once every module is initialized, before main. Used to
+  // take snapshots.
+  bool initialize_only;
+
+  // Instructions the fiber may still run, or FUEL_UNLIMITED.
+  int64_t fuel;
+  // CLOCK_MONOTONIC time the fiber has to finish by, 0 for none.
+  double deadline;
+  // When a fiber with a deadline last waited for its turn, 0 if it is not
+  // waiting. The wait moves the deadline when it is resumed, so a deadline
+  // only counts the fiber's own running time.
+  double waiting_since;
+
+  FiberState state;
+  // The message of the runtime error the fiber stopped at, which is printed
+  // to the error stream unless hold_fault is set. The fibers running a
+  // parallel for hold theirs, and the loop reports the first.
+  const char* fault;
+  bool hold_fault;
+  // Instructions run so far, counted block by block and added to the
+  // metrics when the fiber is freed.
+  uint64_t instructions;
+
+  struct Fiber* next;
+  // Whatever spawned the fiber, for the scheduler's finished callback.
+  void* owner;
+} Fiber;
+
+typedef struct {
+  Fiber* head;
+  Fiber* tail;
+  int slice;
+  // Called with the owner of each fiber that finishes, how it stopped and
+  // its fault once the fiber is freed. May be NULL.
+  void (*finished)(void* owner, FiberState state, const char* fault);
+} Scheduler;
 
 void init_vm();
 void free_vm();
-bool run_code(uint8_t* code);
 
-#endif
\ No newline at end of file
+Fiber* new_fiber(Program* program);
+// Rewinds a finished fiber to run its program again. Globals, fuel and the
+// deadline carry over.
+void reset_fiber(Fiber* fiber);
+void free_fiber(Fiber* fiber);
+// Makes room in a fiber that is between runs for a program that grew since,
+// see extend_program. Returns the fiber, moved if it had to grow. Globals
+// and the heap carry over, new globals start out zeroed.
+Fiber* grow_fiber(Fiber* fiber);
+// Runs the top level code of the program's modules from first on, in a
+// fiber that already ran the ones before.
+FiberState run_modules(Fiber* fiber, int first);
+
+// Runs the fiber until it finishes, runs out of fuel, passes its deadline or
+// has used up its budget of instructions. Execution is metered per basic
+// block, so a fiber always stops between two blocks.
+FiberState resume_fiber(Fiber* fiber, int budget);
+
+void init_scheduler(Scheduler* scheduler, int slice,
+                    void (*finished)(void* owner, FiberState state,
+                                     const char* fault));
+void spawn_fiber(Scheduler* scheduler, Fiber* fiber);
+// Gives the first fiber in line a time slice, then puts it back in line or
+// frees it if it finished. False if there are no fibers.
+bool step_scheduler(Scheduler* scheduler);
+// Time slices the spawned fibers round robin until all of them finish.
+void run_scheduler(Scheduler* scheduler);
+
+// Fuel and timeout in seconds given to every fiber run_program starts.
+void set_run_limits(int64_t fuel, double timeout);
+// Threads a parallel for runs on, one per core unless set.
+void set_parallel_threads(int threads);
+void apply_run_limits(Fiber* fiber);
+// Tells the user why a run stopped early, if it did.
+void report_stop(FiberState state);
+FiberState run_program(Program* program, FILE* out);
+
+double now_seconds();
+
+#endif
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Records a profile of test/profile.nol, runs the script again with it and
+# checks both runs print what the script prints without loop optimizations.
+# Usage: test/profile.sh [path to nol]
+
+nol=${1:-./build/nol}
+dir=$(dirname "$0")
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+"$nol" --no-loop-opt "$dir/profile.nol" > "$work/expected" || exit 1
+"$nol" --record-profile "$work/profile" "$dir/profile.nol" > "$work/recorded" ||
+  exit 1
+"$nol" --use-profile "$work/profile" "$dir/profile.nol" > "$work/replayed" ||
+  exit 1
+
+cmp -s "$work/expected" "$work/recorded" || {
+  echo "Recording run differs:"
+  diff "$work/expected" "$work/recorded"
+  exit 1
+}
+
+cmp -s "$work/expected" "$work/replayed" || {
+  echo "Run with the profile differs:"
+  diff "$work/expected" "$work/replayed"
+  exit 1
+}
+
+echo "Profile runs match."